@@ -25,19 +25,26 @@
 #  endif
 #endif
 
+#include <chrono>
 #include <compare> // IWYU pragma: keep, we default `operator<=>` below.
 #include <concepts>
+#include <coroutine>
 #include <cstddef>
+#include <cstdint>
 #include <cstdio>
 #include <exception>
 #include <functional>
 #include <initializer_list>
 #include <map>
+#include <memory>
+#include <optional>
+#include <span>
 #include <string_view>
 #include <string>
 #include <type_traits>
 #include <typeinfo> // IWYU pragma: keep, we use `typeid()` below.
 #include <utility>
+#include <vector>
 
 namespace em::minitest
 {
@@ -47,9 +54,718 @@ namespace em::minitest
     struct InterruptTestException {};
     #endif
 
+    // Identifies a test.
+    struct TestDesc
+    {
+        std::string_view file; // Null-terminated.
+        int line = 0;
+        std::string_view name; // Null-terminated.
+
+        friend auto operator<=>(const TestDesc &, const TestDesc &) = default;
+    };
+
+    namespace detail
+    {
+        // For compatibility, this used to be here before it became a part of the listener API.
+        using TestDesc = em::minitest::TestDesc;
+    }
+
+    // Describes one element of a (possibly nested) exception.
+    struct ExceptionInfo
+    {
+        std::string_view type; // Empty for unknown exceptions.
+        std::string_view message; // Empty for unknown exceptions. If `what()` returns null, this has null `.data()`.
+    };
+
+    enum class FailureKind
+    {
+        assertion, // `EM_CHECK()` evaluated to false or threw.
+        unexpected_exception, // `EM_TRY()` threw.
+        missing_exception, // `EM_MUST_THROW()` didn't throw.
+        incorrect_exception, // `EM_MUST_THROW()` threw something else.
+        uncaught_exception, // The test itself threw.
+        crashed, // The test didn't finish in an interrupted run, e.g. it crashed the process (see `RunOptions::resume_path`).
+    };
+
+    // Describes a single failure in the current test. All pointers and views are only valid during the listener callback.
+    struct FailureInfo
+    {
+        FailureKind kind{};
+        const char *file = nullptr; // For `uncaught_exception` and `crashed` this is the test location.
+        int line = 0;
+        const char *expr = nullptr; // Null for `uncaught_exception`.
+        std::span<const ExceptionInfo> exceptions{}; // The caught exception, outermost first. Empty if nothing was thrown.
+        std::span<const ExceptionInfo> expected_exceptions{}; // Only for `incorrect_exception`.
+        // The return addresses at the point of failure, innermost first. Only if enabled with `--backtrace`, and not for `uncaught_exception`.
+        // The first few are inside minitest itself.
+        std::span<void *const> stack{};
+    };
+
+    // The result of a single test.
+    struct TestResult
+    {
+        bool failed = false;
+        std::chrono::nanoseconds duration{};
+        // The test failed, but will be retried (see `RunOptions::retries`). This doesn't count as a failure of the run.
+        bool will_retry = false;
+        // The test wasn't run, because it passed last time and its code didn't change (see `RunOptions::cache_path`). This counts as passing.
+        bool cached = false;
+        // The test wasn't run, because it already finished in an interrupted run (see `RunOptions::resume_path`). Its failures are replayed from there.
+        bool resumed = false;
+        // The test wasn't run, because a test it depends on failed or was skipped (see `EM_TEST()`). This counts neither as passing nor as failing.
+        bool skipped = false;
+
+        // The rest is only set if the test actually ran, i.e. not `cached`, `resumed` or `skipped`.
+        // When the test started, in the real time (unaffected by `RunOptions::virtual_time`). With `RunOptions::jobs`, this is earlier than `OnTestStart()`.
+        std::chrono::steady_clock::time_point start_time{};
+        // The CPU time spent by the thread that ran the test (or by the whole process, if the per-thread counters aren't available). Zero if not supported.
+        // For the async tests, this only counts the time when this test's coroutines were running.
+        std::chrono::nanoseconds cpu_user{};
+        std::chrono::nanoseconds cpu_system{};
+    };
+
+    // The result of the whole run.
+    struct RunSummary
+    {
+        // Those count each repetition of a test separately, but not the retries.
+        std::size_t num_tests = 0;
+        std::size_t num_failed = 0;
+        std::size_t num_repetitions = 1;
+        std::size_t num_cached = 0; // Included in `num_tests`.
+        std::size_t num_out_of_time = 0; // The tests that didn't start because of `RunOptions::max_run_time_ms`. Not included in `num_tests`.
+        std::size_t num_skipped = 0; // The tests that didn't run because of their dependencies, see `TestResult::skipped`. Not included in `num_tests`.
+    };
+
+    // Observes a test run. Override the functions you need, they do nothing by default.
+    // The events always come in this order: `OnRunStart()`, then for each test: [`OnFileStart()`], `OnTestStart()`, any number of `OnFailure()`, `OnTestEnd()`;
+    //   and then `OnRunEnd()`. `OnFileStart()` is only called when the file differs from that of the previous test.
+    // When repeating, each repetition starts with `OnRepetitionStart()` and then has its own test events. Each retry of a test has its own test events.
+    class Listener
+    {
+      public:
+        virtual ~Listener() = default;
+
+        // `num_tests` is per repetition.
+        virtual void OnRunStart(std::size_t num_tests) {(void)num_tests;}
+        // Only called when repeating (see `RunOptions::repeat`), before each repetition, counting from zero.
+        virtual void OnRepetitionStart(std::size_t repetition) {(void)repetition;}
+        virtual void OnFileStart(std::string_view file) {(void)file;}
+        virtual void OnTestStart(const TestDesc &test) {(void)test;}
+        // This is called for failed assertions and checks, and for exceptions escaping the test.
+        virtual void OnFailure(const FailureInfo &info) {(void)info;}
+        virtual void OnTestEnd(const TestDesc &test, const TestResult &result) {(void)test; (void)result;}
+        virtual void OnRunEnd(const RunSummary &summary) {(void)summary;}
+
+        // Called instead of all other events if the run can't start, e.g. because of invalid options or a file that can't be opened.
+        // Can be called several times before the run gives up, to report all problems at once.
+        // This is how the errors are reported when the console output is disabled. The message has no `minitest:` prefix and no trailing newline.
+        virtual void OnRunError(std::string_view message) {(void)message;}
+    };
+
+    enum class ListFormat
+    {
+        none, // Run the tests instead of listing them.
+        text, // One `file:line:name` per line.
+        json, // An array of objects, one per line, with the tags and the information from `RunOptions::state_path` if available.
+    };
+
+    struct RunOptions
+    {
+        // Print the progress to stderr. This is implemented as a listener too.
+        bool console_output = true;
+
+        // If not empty, also write a JUnit XML report to this file.
+        std::string junit_path;
+        // If not empty, also write a JSON Lines report to this file.
+        std::string jsonl_path;
+        // If not empty, also write a binary result log to this file. See `binlog` above for the format.
+        std::string binlog_path;
+        // If not empty, write a Chrome trace-event file (viewable in `chrome://tracing` or Perfetto) with the test timeline and the `EM_TRACE_SCOPE()`s.
+        // Only one runner at a time can trace, see `TestRunner`. The test spans only come from this runner,
+        //   but the `EM_TRACE_SCOPE()`s are recorded on all threads, including the ones of the other runners.
+        std::string trace_path;
+
+        // If not empty, remember the status of each test in this file, for `last_failed` and `failed_first`.
+        std::string state_path;
+        // Only run the tests that failed last time according to `state_path`. If there are none, run all tests.
+        bool last_failed = false;
+        // Run the tests that failed last time first, then the rest.
+        bool failed_first = false;
+
+        // If not empty, record each finished test in this journal. If the journal is from an interrupted run, skip the tests that already finished there,
+        //   and report them as they were, so the final summary is the same as for an uninterrupted run. The tests are identified by `file:line:name`.
+        // The tests that started but didn't finish there are reported as failed (see `FailureKind::crashed`) instead of running them again,
+        //   so that a test that crashes the process doesn't prevent the run from finishing. With `jobs`, this includes all tests that were running at the time.
+        std::string resume_path;
+
+        // If not empty, skip the tests that passed last time if their machine code didn't change, remembering the results in this file.
+        // The hash of a test includes the code of the functions it calls (transitively), and the build IDs of the shared libraries.
+        // The virtual calls and the changes to the global data are not detected, so this is opt-in.
+        // Only on ELF platforms on x86-64 and AArch64.
+        std::string cache_path;
+        // Run all tests even if `cache_path` says they can be skipped, and update the cache.
+        bool force = false;
+
+        // Print the selected tests to stdout instead of running them. All other selection options apply.
+        ListFormat list = ListFormat::none;
+        // If not empty, only run the tests with those IDs, in the `file:line:name` format that `list` prints.
+        std::vector<std::string> run_exact;
+
+        // If not empty, only run the tests that have at least one of those tags, from `EM_TEST(name, "tag", ...)`.
+        std::vector<std::string> include_tags;
+        // Don't run the tests that have any of those tags.
+        std::vector<std::string> exclude_tags;
+
+        // If not empty, the file with the source files that each test executed, for `record_impact` and `only_impacted`.
+        std::string impact_map_path;
+        // Record into `impact_map_path` which source files each test executes, replacing the old data for the tests that run.
+        // Only sees the code built with `-finstrument-functions` and `-g`. Only on ELF platforms with GCC or Clang,
+        //   and only if the implementation is built with `EM_MINITEST_INSTRUMENT_HOOKS=1`.
+        // The inlined functions are attributed to their own files, but the code running on other threads isn't seen.
+        bool record_impact = false;
+        // Only run the tests that executed any of `changed_files` according to `impact_map_path`, the tests defined in those files, and the tests missing from the map.
+        bool only_impacted = false;
+        // Matched against the recorded paths by the trailing components, so those can be relative to any parent directory, e.g. to the repository root.
+        std::vector<std::string> changed_files;
+
+        // If non-negative, only run the tests that fit into this many milliseconds according to their durations in `state_path`, and print the skipped ones.
+        // Prefers the tests that never ran, that failed recently, or whose source files were modified since the last run, and then the fast ones.
+        // This applies to one repetition.
+        int time_budget_ms = -1;
+        // If non-negative, a hard limit on the duration of the run. A test isn't started if the time is up, or if its last duration
+        //   (measured by the same `TestRunner`, or else from `state_path`) doesn't fit into the remaining time. The running tests aren't interrupted.
+        // The tests that don't start aren't failures, they're counted in `RunSummary::num_out_of_time`.
+        int max_run_time_ms = -1;
+
+        // Run the tests in a random order, determined by `seed`.
+        bool shuffle = false;
+        // Used for `shuffle` and to seed `Rng()`.
+        std::uint64_t seed = 0;
+
+        // Run all tests this many times.
+        std::size_t repeat = 1;
+        // Repeat until some test fails. Then `repeat` is the max number of repetitions, unlimited if it's 1.
+        bool repeat_until_fail = false;
+        // Rerun a failed test up to this many times. If it passes eventually, it's reported as flaky rather than failed.
+        std::size_t retries = 0;
+
+        // Run up to this many tests at once, on separate threads. The tests must be thread-safe then.
+        // A test doesn't start until the tests it depends on finish (see `EM_TEST()`), but the independent tests run in parallel.
+        // The listeners still get the events on the calling thread, one test at a time, as the tests finish.
+        // Doesn't work with `record_impact` and `profile_slow_ms`, which can only observe one test at a time.
+        std::size_t jobs = 1;
+        // If not empty, write the flaky tests to this file, one per line, as `file:line:name`.
+        // A test is flaky if it both passed and failed during the run, either because of `retries` or because of `repeat`.
+        std::string quarantine_path;
+
+        // Run the tests in the virtual time, where sleeping takes no real time and only moves the clock forward. The rest of the code takes as long as usual.
+        // This affects `Clock` and `SleepFor()` in the async tests. If the implementation is built with `EM_MINITEST_TIME_HOOKS=1` (only on Linux),
+        //   this also affects `nanosleep()`, `clock_nanosleep()` and `clock_gettime()` in the whole process during the run.
+        //   This is what `std::this_thread::sleep_for()` and the standard clocks use.
+        // The sleeps on different threads still finish in the order of their deadlines. The test durations in the reports are still in the real time.
+        // There's only one clock per process, so with `jobs`, a sleep in one test also moves the clock forward for the tests running in parallel with it.
+        // For the same reason, only one runner at a time can use this, see `TestRunner`.
+        bool virtual_time = false;
+
+        // Print the call stack for every failed check, to see which caller failed when the checks are in helper functions.
+        bool backtrace_on_failure = false;
+
+        // If non-negative, sample the call stacks of every test, and print a profile of the ones that take at least this many milliseconds.
+        // Each of them also gets a file with the folded stacks in `profile_dir`, for the flamegraph tools. Without `console_output`, only the files are written.
+        // This uses a process-wide timer signal, so only one runner at a time can use this, see `TestRunner`.
+        int profile_slow_ms = -1;
+        // Created if it doesn't exist.
+        std::string profile_dir = "minitest_profile";
+    };
+
+    // The format of the binary result log, written by `--binlog=<file>`. This is meant for huge runs, where the text reports get too large.
+    // `src/minitest_query.cpp` is a tool that reads those.
+    // The file is append-only, and consists of a `FileHeader`, followed by any number of entries. Each entry starts with an `EntryKind`:
+    //   `string` - `StringEntry`, followed by `.size` bytes of the string, followed by zero padding to a multiple of 8 bytes.
+    //              The strings are numbered sequentially from 0, and the results refer to them by those numbers.
+    //   `result` - `ResultEntry`.
+    // Every entry has a size that's a multiple of 8, so when the file is mmapped, all entries are properly aligned.
+    // The integers are in the native byte order. The readers should use `FileHeader::byte_order` to reject files from machines with a different one.
+    // If the writer crashes, the last entry can be incomplete. The readers should ignore it.
+    namespace binlog
+    {
+        inline constexpr char magic[8] = {'E', 'M', 'M', 'T', 'L', 'O', 'G', '\0'};
+        inline constexpr std::uint32_t current_version = 1;
+        inline constexpr std::uint32_t byte_order_mark = 0x01020304;
+
+        // Used instead of a string index when there's no string.
+        inline constexpr std::uint32_t no_string = 0xffffffff;
+
+        struct FileHeader
+        {
+            char magic[8]{};
+            std::uint32_t version = 0;
+            std::uint32_t byte_order = 0; // Must be equal to `byte_order_mark`.
+        };
+
+        enum class EntryKind : std::uint32_t
+        {
+            string = 1,
+            result = 2,
+        };
+
+        struct StringEntry
+        {
+            EntryKind kind = EntryKind::string;
+            std::uint32_t size = 0;
+        };
+
+        enum class Status : std::uint32_t
+        {
+            pass = 0,
+            fail = 1,
+            skip = 2, // See `TestResult::skipped`.
+            retry = 3, // A failed attempt that gets retried, see `TestResult::will_retry`. Not a test of its own, the last attempt has the final status.
+        };
+
+        struct ResultEntry
+        {
+            EntryKind kind = EntryKind::result;
+            Status status = Status::pass;
+            std::uint32_t file = no_string; // String index.
+            std::uint32_t name = no_string; // String index.
+            std::uint32_t line = 0;
+            std::uint32_t num_failures = 0;
+            std::uint32_t first_failure_file = no_string; // String index, the location of the first failure in this test.
+            std::uint32_t first_failure_line = 0;
+            std::uint64_t duration_ns = 0;
+            // The resource counters. Those are zero if not supported on this platform.
+            std::uint64_t cpu_user_ns = 0;
+            std::uint64_t cpu_system_ns = 0;
+            std::uint64_t max_rss_kb = 0; // The peak memory usage of the process so far, as reported by `getrusage()`.
+        };
+
+        static_assert(sizeof(FileHeader) % 8 == 0);
+        static_assert(sizeof(StringEntry) % 8 == 0);
+        static_assert(sizeof(ResultEntry) % 8 == 0);
+    }
+
     // Runs all tests. Returns the exit code, `0` if everything passes.
+    // Flags:
+    //   --junit=<file>      Also write a JUnit XML report to this file.
+    //   --jsonl=<file>      Also write a JSON Lines report to this file.
+    //   --binlog=<file>     Also write a binary result log to this file. This is more compact than the other reports.
+    //   --trace=<file>      Write a Chrome trace-event timeline of the run to this file.
+    //   --state=<file>      Remember the status of each test in this file. By default `<executable>.minitest-state`, if one of the next flags is used.
+    //   --last-failed       Only run the tests that failed last time. Or all tests if none failed.
+    //   --failed-first      Run the tests that failed last time first, then the rest.
+    //   --watch             After running, wait for the executable or the minitest library to be rebuilt, then rerun, failed tests first. Only on Linux.
+    //   --resume=<file>     Continue the run from this journal if it was interrupted, skipping the finished tests. Start a new journal otherwise.
+    //   --cache[=<file>]    Skip the tests that passed last time, if their machine code didn't change. By default `<executable>.minitest-cache`.
+    //   --force             Run all tests even with `--cache`, and update the cache.
+    //   --list[=json]       Print the tests, one per line, instead of running them. The other options still select which tests are printed.
+    //   --run-exact=<id>    Only run this test, `file:line:name` as printed by `--list`. Can be repeated.
+    //   --tags=<list>       Only run the tests that have any of those tags, comma-separated.
+    //   --skip-tags=<list>  Don't run the tests that have any of those tags, comma-separated.
+    //   --impact-map=<file> The source files that each test executes. By default `<executable>.minitest-impact`, if one of the next flags is used.
+    //   --record-impact     Record into the impact map which source files the tests execute. Build the code with `-finstrument-functions` and `-g`.
+    //   --changed=<file>    Only run the tests affected by the changes to the source files listed in this file, one per line, according to the impact map.
+    //   --time-budget=<t>   Only run the tests most likely to fail that fit into this time according to `--state`, like `30s`, `500ms` or `2m`.
+    //   --max-time=<t>      Stop starting the tests when this much time has passed. Unlike `--time-budget`, this is a hard limit that doesn't need `--state`.
+    //   --shuffle[=<seed>]  Run the tests in a random order. The seed is printed, to reproduce the order later. It also affects `Rng()`.
+    //   --repeat=<n>        Run all tests `n` times, then print the timing statistics for each test and the list of flaky tests.
+    //   --repeat-until-fail Repeat until some test fails, at most `--repeat` times if specified.
+    //   --retries=<k>       Rerun a failed test up to `k` times, and report it as flaky rather than failed if it passes.
+    //   --jobs=<n>          Run up to `n` tests at once, on separate threads. The dependencies between the tests are respected.
+    //   --quarantine=<file> Write the flaky tests to this file, one per line.
+    //   --virtual-time      Make the sleeps in the tests take no real time, only moving the clock forward. See `RunOptions::virtual_time`.
+    //   --backtrace         Print the call stack for every failed check. Only on POSIX systems.
+    //   --profile-slow=<ms> Profile the tests, and report the ones that take at least this long. Only on POSIX systems.
+    //   --profile-dir=<dir> Where to write the folded stacks of the slow tests, `minitest_profile` by default.
+    // The reports are written incrementally, and stay valid if we crash mid-run.
     [[nodiscard]] EM_MINITEST_API int RunTests(int argc, char **argv);
 
+    // Runs all tests with the specified options, notifying the `listeners` in addition to the built-in ones. Returns the exit code like the overload above.
+    // If there are no listeners at all (e.g. if you disable the console output), then the runner doesn't spend any time preparing the events.
+    // This is a shorthand for a single `TestRunner::Run()`.
+    [[nodiscard]] EM_MINITEST_API int RunTests(const RunOptions &options, std::span<Listener *const> listeners = {});
+
+    // Runs the tests with the specified options. Unlike `RunTests()`, this can be reused for many runs, e.g. for a periodic self-test.
+    // Remembers how long each test took, to tell in the later runs which tests fit into `RunOptions::max_run_time_ms`.
+    // Different runners can be used on different threads at the same time, if the tests themselves allow it.
+    // But `RunOptions::trace_path`, `virtual_time` and `profile_slow_ms` affect the whole process, so only one runner at a time can use them.
+    //   If another runner is already using one of them, `Run()` fails.
+    class TestRunner
+    {
+        RunOptions options;
+        std::map<TestDesc, std::chrono::nanoseconds> known_durations;
+
+      public:
+        TestRunner() {}
+        explicit TestRunner(RunOptions options) : options(std::move(options)) {}
+
+        [[nodiscard]]       RunOptions &GetOptions()       {return options;}
+        [[nodiscard]] const RunOptions &GetOptions() const {return options;}
+
+        // Runs the selected tests, notifying the `listeners` in addition to the built-in ones. Returns the exit code like `RunTests()`.
+        [[nodiscard]] EM_MINITEST_API int Run(std::span<Listener *const> listeners = {});
+    };
+
+    // A built-in self-test: a subset of the tests that are shipped in a production binary, e.g. to check the SIMD code paths on an unfamiliar CPU.
+    struct SelfTestOptions
+    {
+        // Only run the tests that have at least one of those tags. If empty, run all tests.
+        std::vector<std::string> tags;
+        // The limit on the duration of the self-test, see `RunOptions::max_run_time_ms`.
+        std::chrono::milliseconds max_run_time{100};
+    };
+
+    struct SelfTestResult
+    {
+        struct Test
+        {
+            TestDesc test;
+            // The test didn't fit into `SelfTestOptions::max_run_time`. If this is set, the other fields are empty.
+            bool out_of_time = false;
+            // A test it depends on failed or was skipped. If this is set, the other fields are empty.
+            bool skipped = false;
+            bool failed = false;
+            std::chrono::nanoseconds duration{};
+            // One per failure, in the same format as in the JUnit reports: the summary line, then the details.
+            std::vector<std::string> failures;
+        };
+        std::vector<Test> tests;
+
+        // Unknown tags in `SelfTestOptions::tags` and invalid test dependencies are errors, and nothing runs then.
+        bool invalid_options = false;
+        // The descriptions of those errors, if any.
+        std::vector<std::string> errors;
+
+        // True if no test failed. The tests that didn't start in time don't count as failures.
+        [[nodiscard]] bool Passed() const
+        {
+            if (invalid_options)
+                return false;
+            for (const Test &test : tests)
+            {
+                if (test.failed)
+                    return false;
+            }
+            return true;
+        }
+    };
+
+    // Runs the self-test, silently, and returns the results. Remembers how long the tests took in `runner`, so that the later calls skip
+    //   the tests that don't fit into the remaining time in advance. `runner.GetOptions()` is replaced by the ones built from `options`.
+    [[nodiscard]] EM_MINITEST_API SelfTestResult RunSelfTest(const SelfTestOptions &options, TestRunner &runner);
+    // Same, but without remembering the durations between the calls.
+    [[nodiscard]] EM_MINITEST_API SelfTestResult RunSelfTest(const SelfTestOptions &options);
+
+    // Runs the self-test periodically on a background thread, with the lowest priority, so it only uses the otherwise idle CPU time.
+    // Waits for the current run to finish and stops when destroyed.
+    // Since the tests run on a different thread, they must not touch the unprotected state that the rest of the program uses.
+    class BackgroundSelfTest
+    {
+        struct State;
+        std::unique_ptr<State> state;
+
+      public:
+        // The first run happens right away, and then every `period`, counting from the end of the previous run.
+        // `callback` is called on the background thread after each run.
+        EM_MINITEST_API BackgroundSelfTest(SelfTestOptions options, std::chrono::milliseconds period, std::function<void(const SelfTestResult &result)> callback);
+        BackgroundSelfTest(const BackgroundSelfTest &) = delete;
+        BackgroundSelfTest &operator=(const BackgroundSelfTest &) = delete;
+        EM_MINITEST_API ~BackgroundSelfTest();
+    };
+
+    // Records a span into the trace file, if enabled with `--trace=<file>`. Otherwise does nothing.
+    // Prefer the `EM_TRACE_SCOPE("name")` macro to using this directly.
+    class TraceScope
+    {
+        const char *name = nullptr;
+        std::int64_t start_ns = -1; // Negative if we're not tracing.
+
+      public:
+        // `name` must outlive the test run. Normally it's a string literal.
+        EM_MINITEST_API explicit TraceScope(const char *name);
+        TraceScope(const TraceScope &) = delete;
+        TraceScope &operator=(const TraceScope &) = delete;
+        EM_MINITEST_API ~TraceScope();
+    };
+
+    // A small and fast random number generator (SplitMix64).
+    // Satisfies `std::uniform_random_bit_generator`, so it can be used with the `<random>` distributions.
+    class RandomGenerator
+    {
+        std::uint64_t state = 0;
+
+      public:
+        using result_type = std::uint64_t;
+
+        constexpr RandomGenerator() {}
+        constexpr explicit RandomGenerator(std::uint64_t seed) : state(seed) {}
+
+        [[nodiscard]] static constexpr result_type min() {return 0;}
+        [[nodiscard]] static constexpr result_type max() {return result_type(-1);}
+
+        constexpr result_type operator()()
+        {
+            std::uint64_t z = (state += 0x9e3779b97f4a7c15);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+            return z ^ (z >> 31);
+        }
+    };
+
+    // Returns the random generator for the current test.
+    // It's reseeded before each test from the run seed (see `--shuffle`), the repetition number, and the test name and location.
+    // This way the tests get the same numbers regardless of the order they run in. Retries get the same numbers as the original attempt.
+    [[nodiscard]] EM_MINITEST_API RandomGenerator &Rng();
+
+    // Returns the tags of a test, from `EM_TEST(name, "tag", ...)`. Empty if there's no such test.
+    [[nodiscard]] EM_MINITEST_API std::vector<std::string_view> GetTestTags(const TestDesc &test);
+
+    // Returns a directory for the current test to write its files to, without a trailing slash. It's created on the first call in each test.
+    // Every test (and every repetition and retry of it) gets its own directory, so the tests don't see each other's files, even when running in parallel.
+    // It's placed on a memory-backed filesystem if there's one (`std::filesystem::temp_directory_path()`, `$XDG_RUNTIME_DIR` or `/dev/shm`, whichever
+    //   is `tmpfs`), otherwise in `std::filesystem::temp_directory_path()`.
+    // It's removed with everything in it after the test finishes, on a background thread, so the next tests don't wait for it.
+    // Can only be called on the thread running the test (or from the async tests).
+    [[nodiscard]] EM_MINITEST_API const std::string &TempDir();
+
+    // Returns a file descriptor of a new empty file that has no name and lives in memory (from `memfd_create()` on Linux), for the code that needs
+    //   a file but not a path. Elsewhere falls back to a file in `TempDir()`, unlinked right away. Close it when done.
+    // Returns -1 and sets `errno` on failure.
+    [[nodiscard]] EM_MINITEST_API int OpenTempFile();
+
+    // A steady clock for the code under test, that follows the virtual time (see `RunOptions::virtual_time`). Otherwise it's the same as `std::chrono::steady_clock`.
+    // Pass it to your code in the tests, e.g. as a template parameter. This works on all platforms, unlike making `std::chrono::steady_clock` virtual.
+    class Clock
+    {
+      public:
+        using rep = std::chrono::steady_clock::rep;
+        using period = std::chrono::steady_clock::period;
+        using duration = std::chrono::steady_clock::duration;
+        using time_point = std::chrono::time_point<Clock>;
+        static constexpr bool is_steady = true;
+
+        // The epoch is the same as of `std::chrono::steady_clock`.
+        [[nodiscard]] EM_MINITEST_API static time_point now();
+
+        // Waits until this time. In the virtual time this only waits for the other threads that sleep until earlier times.
+        EM_MINITEST_API static void SleepUntil(time_point time);
+        static void SleepFor(duration d)
+        {
+            SleepUntil(now() + d);
+        }
+    };
+
+    template <typename T = void>
+    class Task;
+
+    namespace detail
+    {
+        // The part of the promise of `Task<T>` that doesn't depend on `T`.
+        class TaskPromiseBase
+        {
+          public:
+            // Resumed when this task finishes. Null for the tests themselves, then the event loop notices that they're done.
+            std::coroutine_handle<> continuation;
+
+            #if EM_MINITEST_EXCEPTIONS
+            std::exception_ptr exception;
+            #endif
+
+            struct FinalAwaiter
+            {
+                [[nodiscard]] bool await_ready() const noexcept {return false;}
+                template <typename P>
+                [[nodiscard]] std::coroutine_handle<> await_suspend(std::coroutine_handle<P> handle) const noexcept
+                {
+                    std::coroutine_handle<> next = handle.promise().continuation;
+                    return next ? next : std::noop_coroutine();
+                }
+                void await_resume() const noexcept {}
+            };
+
+            // The tasks are lazy, they start when awaited.
+            [[nodiscard]] std::suspend_always initial_suspend() const noexcept {return {};}
+            [[nodiscard]] FinalAwaiter final_suspend() const noexcept {return {};}
+
+            void unhandled_exception()
+            {
+                #if EM_MINITEST_EXCEPTIONS
+                exception = std::current_exception();
+                #else
+                std::terminate();
+                #endif
+            }
+
+            // Rethrows the exception that escaped the coroutine, if any.
+            void RethrowException() const
+            {
+                #if EM_MINITEST_EXCEPTIONS
+                if (exception)
+                    std::rethrow_exception(exception);
+                #endif
+            }
+        };
+
+        template <typename T>
+        class TaskPromise : public TaskPromiseBase
+        {
+          public:
+            std::optional<T> value;
+
+            template <typename U = T>
+            void return_value(U &&new_value)
+            {
+                value.emplace(std::forward<U>(new_value));
+            }
+        };
+
+        template <>
+        class TaskPromise<void> : public TaskPromiseBase
+        {
+          public:
+            void return_void() const noexcept {}
+        };
+    }
+
+    // A coroutine for async tests: `EM_TEST_ASYNC(name) {co_await ...;}`. Can also be used for the helper functions that those tests await: `Task<int> Foo() {co_return 42;}`.
+    // A task doesn't start until it's awaited, and can only be awaited once. The exceptions, including `InterruptTestException` from the failed checks,
+    //   propagate to the awaiting coroutine, so `EM_CHECK()` stops the test as usual.
+    template <typename T>
+    class [[nodiscard]] Task
+    {
+      public:
+        struct promise_type : detail::TaskPromise<T>
+        {
+            [[nodiscard]] Task get_return_object() {return Task(std::coroutine_handle<promise_type>::from_promise(*this));}
+        };
+
+      private:
+        std::coroutine_handle<promise_type> handle;
+
+      public:
+        Task() {}
+        explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+        Task(Task &&other) noexcept : handle(std::exchange(other.handle, {})) {}
+        Task &operator=(Task other) noexcept
+        {
+            // Using the copy&swap idiom.
+            std::swap(handle, other.handle);
+            return *this;
+        }
+        ~Task()
+        {
+            if (handle)
+                handle.destroy();
+        }
+
+        [[nodiscard]] bool await_ready() const noexcept {return false;}
+        [[nodiscard]] std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) const noexcept
+        {
+            handle.promise().continuation = awaiting;
+            return handle; // Start the task.
+        }
+        T await_resume() const
+        {
+            handle.promise().RethrowException();
+            if constexpr (!std::is_void_v<T>)
+                return std::move(*handle.promise().value);
+        }
+
+        // For the test runner.
+        [[nodiscard]] std::coroutine_handle<promise_type> GetHandle() const {return handle;}
+    };
+
+    namespace detail
+    {
+        // Suspends the current async test until a timer expires or a file descriptor becomes ready. Returned by `SleepFor()`, `WaitReadable()`, `WaitWritable()`.
+        struct AsyncWait
+        {
+            enum Events
+            {
+                readable = 1,
+                writable = 2,
+            };
+
+            int fd = -1; // Negative if only waiting for the deadline.
+            int events = 0;
+            std::optional<Clock::time_point> deadline;
+            bool timed_out = false; // Set by the event loop.
+
+            [[nodiscard]] bool await_ready() const noexcept {return false;}
+            EM_MINITEST_API void await_suspend(std::coroutine_handle<> handle);
+            // Returns false if the file descriptor didn't become ready before the deadline. Always true when only sleeping.
+            bool await_resume() const noexcept {return !timed_out || fd < 0;}
+        };
+    }
+
+    // Those can only be awaited in the async tests (see `EM_TEST_ASYNC()`) and in the tasks they await. They let the other async tests run while waiting.
+    // Waits for this much time: `co_await SleepFor(10ms);`.
+    [[nodiscard]] inline detail::AsyncWait SleepFor(std::chrono::nanoseconds duration)
+    {
+        return {.deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(duration)};
+    }
+    // Waits until reading from `fd` won't block: `co_await WaitReadable(fd);`. Returns false if `timeout` passes first. Only on Linux.
+    [[nodiscard]] inline detail::AsyncWait WaitReadable(int fd, std::optional<std::chrono::nanoseconds> timeout = {})
+    {
+        detail::AsyncWait ret;
+        ret.fd = fd;
+        ret.events = detail::AsyncWait::readable;
+        if (timeout)
+            ret.deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(*timeout);
+        return ret;
+    }
+    // Waits until writing to `fd` won't block: `co_await WaitWritable(fd);`. Returns false if `timeout` passes first. Only on Linux.
+    [[nodiscard]] inline detail::AsyncWait WaitWritable(int fd, std::optional<std::chrono::nanoseconds> timeout = {})
+    {
+        detail::AsyncWait ret;
+        ret.fd = fd;
+        ret.events = detail::AsyncWait::writable;
+        if (timeout)
+            ret.deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(*timeout);
+        return ret;
+    }
+
+    // A shared library with tests, loaded at runtime. While it's loaded, its tests are registered along with the others, and `RunTests()` runs them as usual.
+    // It must link to the same `libminitest.so` as the executable, so that they share the test registry. Only on platforms with `dlopen()`.
+    // See `src/minitest_server.cpp`.
+    class TestModule
+    {
+        std::string path;
+        void *handle = nullptr;
+        std::vector<TestDesc> tests;
+
+      public:
+        TestModule() {}
+        TestModule(TestModule &&other) noexcept
+            : path(std::move(other.path)), handle(other.handle), tests(std::move(other.tests))
+        {
+            other.handle = nullptr;
+        }
+        TestModule &operator=(TestModule other) noexcept
+        {
+            // Using the copy&swap idiom.
+            std::swap(path, other.path);
+            std::swap(handle, other.handle);
+            std::swap(tests, other.tests);
+            return *this;
+        }
+        ~TestModule()
+        {
+            Unload();
+        }
+
+        // Unloads the current library if any, then loads this one and registers its tests.
+        // Returns false and prints the reason on failure, e.g. if it can't be loaded, or if some of its tests are already registered.
+        [[nodiscard]] EM_MINITEST_API bool Load(const std::string &new_path);
+        // Unregisters the tests and unloads the library. Does nothing if nothing is loaded.
+        // The library can stay in memory if it has the `STB_GNU_UNIQUE` symbols, which GCC emits for the static variables in inline functions.
+        EM_MINITEST_API void Unload();
+
+        [[nodiscard]] bool IsLoaded() const {return handle;}
+        [[nodiscard]] const std::string &GetPath() const {return path;}
+        [[nodiscard]] std::span<const TestDesc> GetTests() const {return tests;}
+    };
+
     namespace detail
     {
         // Terminates the program with an error.
@@ -90,25 +806,33 @@ namespace em::minitest
             [[nodiscard]] EM_MINITEST_API const char *operator()(const char *name);
         };
 
-        struct TestDesc
-        {
-            std::string_view file; // Null-terminated.
-            int line = 0;
-            std::string_view name; // Null-terminated.
+        // A set of tags, with a bit per tag. The bits are assigned by `InternTag()`.
+        using TagMask = std::uint64_t;
 
-            friend auto operator<=>(const TestDesc &, const TestDesc &) = default;
-        };
+        // Returns the bit of this tag, assigning a new one if this is a new tag. There can be at most 64 different tags.
+        [[nodiscard]] EM_MINITEST_API TagMask InternTag(std::string_view tag);
+        // Returns the name of each tag, indexed by the bit number.
+        [[nodiscard]] EM_MINITEST_API std::span<const std::string_view> GetTagNames();
 
         // Describes a known test.
         struct Test
         {
             void (*func)() = nullptr;
+            // Set instead of `func` for `EM_TEST_ASYNC()`.
+            Task<> (*async_func)() = nullptr;
+            TagMask tags = 0;
+            // The names of the tests this one depends on, from `"depends:name"` in `EM_TEST()`.
+            std::vector<std::string_view> dependencies;
         };
 
         // Using `std::map` to sort by filename.
         using TestMap = std::map<TestDesc, Test>;
         // This singleton stores all known tests.
         [[nodiscard]] EM_MINITEST_API TestMap &GetTestMap();
+        // Is called when registering a test that's already registered. Usually this is an error.
+        EM_MINITEST_API void OnDuplicateTest(const TestDesc &desc);
+        // Adds a tag or a `"depends:name"` from `EM_TEST()` to the test.
+        EM_MINITEST_API void AddTestAttribute(Test &test, std::string_view attribute);
 
         // A compile-time string.
         template <std::size_t N>
@@ -142,19 +866,31 @@ namespace em::minitest
         {
             // The function pointer is kept in separate template parameters, because we use the type of `ConstTestDesc` to detect
             //   multiple definitions of tests at link time, and the pointer would be always unique, and would prevent this.
-            template <void (*F)()>
-            inline static const ConstTestDesc register_test = []{
+            // The tags are also kept out of the type, so that a test with the same location and different tags is still a duplicate.
+            template <ConstString ...Tags>
+            [[nodiscard]] static ConstTestDesc Register(void (*func)(), Task<> (*async_func)())
+            {
                 TestMap &m = GetTestMap();
 
                 auto [iter, is_new] = m.try_emplace(TestDesc{.file = File.view(), .line = Line, .name = Name.view()});
-                // Here duplicates shouldn't be possible, since they should cause link errors.
+                // Here duplicates shouldn't be possible, since they should cause link errors. Unless they're in different `TestModule`s.
                 if (!is_new)
-                    detail::InternalError("A duplicate test was registered at `" + std::string(File.view()) + ":" + std::to_string(Line) + "`, named `" + std::string(Name.view()) + "`.");
+                {
+                    OnDuplicateTest(iter->first);
+                    return ConstTestDesc{};
+                }
 
-                iter->second.func = F;
+                iter->second.func = func;
+                iter->second.async_func = async_func;
+                (AddTestAttribute(iter->second, Tags.view()), ...);
 
                 return ConstTestDesc{};
-            }();
+            }
+
+            template <void (*F)(), ConstString ...Tags>
+            inline static const ConstTestDesc register_test = Register<Tags...>(F, nullptr);
+            template <Task<> (*F)(), ConstString ...Tags>
+            inline static const ConstTestDesc register_async_test = Register<Tags...>(nullptr, F);
         };
 
         // A simple imitation of `std::function_ref`.
@@ -258,7 +994,223 @@ namespace em::minitest
 }
 
 #ifdef EM_MINITEST_IMPLEMENTATION
-#include <chrono>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <limits>
+#include <list>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <set>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+// Resource usage for the binary log:
+#if __has_include(<sys/resource.h>)
+#include <sys/resource.h>
+#define DETAIL_EM_MINITEST_HAVE_RUSAGE 1
+#else
+#define DETAIL_EM_MINITEST_HAVE_RUSAGE 0
+#endif
+
+// Loading the `TestModule`s.
+#if __has_include(<dlfcn.h>)
+#include <dlfcn.h>
+#define DETAIL_EM_MINITEST_HAVE_DLOPEN 1
+#else
+#define DETAIL_EM_MINITEST_HAVE_DLOPEN 0
+#endif
+// Capturing and symbolizing the call stacks, for `--backtrace` and `--profile-slow=<ms>`:
+#if __has_include(<execinfo.h>) && __has_include(<dlfcn.h>)
+#include <dlfcn.h>
+#include <execinfo.h>
+#define DETAIL_EM_MINITEST_HAVE_BACKTRACE 1
+#else
+#define DETAIL_EM_MINITEST_HAVE_BACKTRACE 0
+#endif
+// The sampling profiler for `--profile-slow=<ms>`:
+#if DETAIL_EM_MINITEST_HAVE_BACKTRACE && __has_include(<signal.h>) && __has_include(<sys/time.h>)
+#include <signal.h>
+#include <sys/time.h>
+#define DETAIL_EM_MINITEST_HAVE_PROFILER 1
+#else
+#define DETAIL_EM_MINITEST_HAVE_PROFILER 0
+#endif
+// Reading the ELF symbol tables lets us symbolize the functions that aren't exported, which `dladdr()` can't see.
+#if DETAIL_EM_MINITEST_HAVE_BACKTRACE && __has_include(<elf.h>) && __has_include(<link.h>)
+#include <elf.h>
+#include <link.h>
+#define DETAIL_EM_MINITEST_HAVE_ELF 1
+#else
+#define DETAIL_EM_MINITEST_HAVE_ELF 0
+#endif
+// Hashing the test code for `--cache`. This needs the symbol sizes from ELF, and decoding the call instructions.
+#if DETAIL_EM_MINITEST_HAVE_ELF && (defined(__x86_64__) || defined(__aarch64__))
+#define DETAIL_EM_MINITEST_HAVE_CODE_HASH 1
+#else
+#define DETAIL_EM_MINITEST_HAVE_CODE_HASH 0
+#endif
+// The `-finstrument-functions` hooks and reading the DWARF line tables, for `--record-impact`.
+// Opt-in: define `EM_MINITEST_INSTRUMENT_HOOKS=1` when building the implementation. Otherwise we don't define `__cyg_profile_func_enter()` and `..._exit()`,
+//   so we don't clash with the profilers and the other programs that define them.
+#ifndef EM_MINITEST_INSTRUMENT_HOOKS
+#define EM_MINITEST_INSTRUMENT_HOOKS 0
+#endif
+#if DETAIL_EM_MINITEST_HAVE_ELF && EM_MINITEST_INSTRUMENT_HOOKS && (defined(__GNUC__) || defined(__clang__))
+#define DETAIL_EM_MINITEST_HAVE_IMPACT 1
+#else
+#define DETAIL_EM_MINITEST_HAVE_IMPACT 0
+#endif
+
+// Syncing the journal to disk for `--resume=<journal>`.
+#if __has_include(<unistd.h>)
+#include <unistd.h>
+#define DETAIL_EM_MINITEST_HAVE_FSYNC 1
+#else
+#define DETAIL_EM_MINITEST_HAVE_FSYNC 0
+#endif
+
+// Lowering the thread priority for `BackgroundSelfTest`.
+#if __has_include(<pthread.h>) && __has_include(<sched.h>) && __has_include(<sys/resource.h>)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#define DETAIL_EM_MINITEST_HAVE_THREAD_PRIORITY 1
+#else
+#define DETAIL_EM_MINITEST_HAVE_THREAD_PRIORITY 0
+#endif
+
+// Re-executing on rebuilds for `--watch`.
+#if defined(__linux__) && __has_include(<sys/inotify.h>) && __has_include(<poll.h>) && __has_include(<unistd.h>)
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#define DETAIL_EM_MINITEST_HAVE_WATCH 1
+#else
+#define DETAIL_EM_MINITEST_HAVE_WATCH 0
+#endif
+
+// Intercepting `nanosleep()`, `clock_gettime()` and friends for `--virtual-time`. They look up the real ones with `dlsym(RTLD_NEXT, ...)`.
+// Opt-in: define `EM_MINITEST_TIME_HOOKS=1` when building the implementation. This replaces those functions for the whole process, even without `--virtual-time`
+//   (then they only forward to the real ones), so only do this for the test builds. Otherwise only `em::minitest::Clock` follows the virtual time.
+// Not on 32-bit systems, where glibc can redirect those functions to their 64-bit time versions.
+#ifndef EM_MINITEST_TIME_HOOKS
+#define EM_MINITEST_TIME_HOOKS 0
+#endif
+#if defined(__linux__) && defined(__LP64__) && EM_MINITEST_TIME_HOOKS && DETAIL_EM_MINITEST_HAVE_DLOPEN && __has_include(<pthread.h>)
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#define DETAIL_EM_MINITEST_HAVE_TIME_HOOKS 1
+#else
+#define DETAIL_EM_MINITEST_HAVE_TIME_HOOKS 0
+#endif
+
+// Running the async tests at the same time, for `EM_TEST_ASYNC()`.
+#if defined(__linux__) && __has_include(<sys/epoll.h>) && __has_include(<sys/eventfd.h>) && __has_include(<sys/timerfd.h>)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#define DETAIL_EM_MINITEST_HAVE_EPOLL 1
+#else
+#define DETAIL_EM_MINITEST_HAVE_EPOLL 0
+#endif
+
+// Detecting the memory-backed filesystems for `TempDir()`, and the in-memory files for `OpenTempFile()`.
+#if defined(__linux__) && __has_include(<linux/magic.h>) && __has_include(<sys/mman.h>) && __has_include(<sys/vfs.h>) && __has_include(<unistd.h>)
+#include <linux/magic.h>
+#include <sys/mman.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+#define DETAIL_EM_MINITEST_HAVE_MEMFD 1
+#else
+#define DETAIL_EM_MINITEST_HAVE_MEMFD 0
+#endif
+// The fallback for `OpenTempFile()`.
+#if __has_include(<stdlib.h>) && __has_include(<unistd.h>)
+#include <stdlib.h>
+#include <unistd.h>
+#define DETAIL_EM_MINITEST_HAVE_MKSTEMP 1
+#else
+#define DETAIL_EM_MINITEST_HAVE_MKSTEMP 0
+#endif
+
+// Static tracepoints (USDT), for `perf`, `bpftrace` and similar tools. E.g. `bpftrace -e 'usdt:./libminitest.so:minitest:test_end { @[str(arg2)] = hist(arg4); }'`.
+// They compile to a single `nop` each, and cost nothing when not attached.
+// On x86-64 and AArch64 ELF we emit the `.note.stapsdt` notes ourselves, so we don't depend on SystemTap's `<sys/sdt.h>`.
+// Elsewhere we use `<sys/sdt.h>` if it's available, or disable the probes otherwise. Define `EM_MINITEST_PROBES=0` to disable them manually.
+// The probes (all in the `minitest` provider):
+//   test_start(const char *file, int line, const char *name)
+//   test_end(const char *file, int line, const char *name, int failed, int64 duration_ns)
+//   assertion_failure(const char *file, int line, const char *expr)
+//   unexpected_exception(const char *file, int line, const char *expr)
+//   exception(const char *type, size_t type_len, const char *message) - Once per element of an analyzed exception. `type` is not null-terminated.
+//   must_throw_start(const char *file, int line, const char *expr)
+//   must_throw_end(const char *file, int line, int passed)
+#ifndef EM_MINITEST_PROBES
+#  if defined(__ELF__) && (defined(__x86_64__) || defined(__aarch64__)) && (defined(__GNUC__) || defined(__clang__))
+#    define EM_MINITEST_PROBES 1
+#  elif __has_include(<sys/sdt.h>)
+#    define EM_MINITEST_PROBES 1
+#  else
+#    define EM_MINITEST_PROBES 0
+#  endif
+#endif
+
+#if !EM_MINITEST_PROBES
+#define DETAIL_EM_MINITEST_PROBE3(name_, a_, b_, c_) do {} while (false)
+#define DETAIL_EM_MINITEST_PROBE5(name_, a_, b_, c_, d_, e_) do {} while (false)
+#elif defined(__ELF__) && (defined(__x86_64__) || defined(__aarch64__)) && (defined(__GNUC__) || defined(__clang__))
+// This mimics what `<sys/sdt.h>` does: a `nop` and an ELF note describing its address and where to find the arguments.
+// The argument format is `size@operand`, where a negative size means a signed value. We mark everything as signed for simplicity.
+#define DETAIL_EM_MINITEST_PROBE3(name_, a_, b_, c_) \
+    DETAIL_EM_MINITEST_SDT(name_, DETAIL_EM_MINITEST_SDT_FMT(1) " " DETAIL_EM_MINITEST_SDT_FMT(2) " " DETAIL_EM_MINITEST_SDT_FMT(3), \
+        DETAIL_EM_MINITEST_SDT_ARG(1, a_), DETAIL_EM_MINITEST_SDT_ARG(2, b_), DETAIL_EM_MINITEST_SDT_ARG(3, c_))
+#define DETAIL_EM_MINITEST_PROBE5(name_, a_, b_, c_, d_, e_) \
+    DETAIL_EM_MINITEST_SDT(name_, DETAIL_EM_MINITEST_SDT_FMT(1) " " DETAIL_EM_MINITEST_SDT_FMT(2) " " DETAIL_EM_MINITEST_SDT_FMT(3) " " DETAIL_EM_MINITEST_SDT_FMT(4) " " DETAIL_EM_MINITEST_SDT_FMT(5), \
+        DETAIL_EM_MINITEST_SDT_ARG(1, a_), DETAIL_EM_MINITEST_SDT_ARG(2, b_), DETAIL_EM_MINITEST_SDT_ARG(3, c_), DETAIL_EM_MINITEST_SDT_ARG(4, d_), DETAIL_EM_MINITEST_SDT_ARG(5, e_))
+#define DETAIL_EM_MINITEST_SDT_FMT(i_) "%n[__em_sdt_size" #i_ "]@%[__em_sdt_arg" #i_ "]"
+#define DETAIL_EM_MINITEST_SDT_ARG(i_, x_) [__em_sdt_size##i_] "n" ((int)sizeof(x_)), [__em_sdt_arg##i_] "nor" (x_)
+#define DETAIL_EM_MINITEST_SDT(name_, format_, ...) \
+    __asm__ __volatile__( \
+        "990: nop\n" \
+        ".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+        ".balign 4\n" \
+        ".4byte 992f-991f, 994f-993f, 3\n" \
+        "991: .asciz \"stapsdt\"\n" \
+        "992: .balign 4\n" \
+        "993: .8byte 990b\n" \
+        ".8byte _.stapsdt.base\n" \
+        ".8byte 0\n" /* No semaphore. */ \
+        ".asciz \"minitest\"\n" \
+        ".asciz \"" #name_ "\"\n" \
+        ".asciz \"" format_ "\"\n" \
+        "994: .balign 4\n" \
+        ".popsection\n" \
+        ".ifndef _.stapsdt.base\n" \
+        ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+        ".weak _.stapsdt.base\n" \
+        ".hidden _.stapsdt.base\n" \
+        "_.stapsdt.base: .space 1\n" \
+        ".size _.stapsdt.base, 1\n" \
+        ".popsection\n" \
+        ".endif\n" \
+        :: __VA_ARGS__ \
+    )
+#else
+#include <sys/sdt.h>
+#define DETAIL_EM_MINITEST_PROBE3(name_, a_, b_, c_) DTRACE_PROBE3(minitest, name_, a_, b_, c_)
+#define DETAIL_EM_MINITEST_PROBE5(name_, a_, b_, c_, d_, e_) DTRACE_PROBE5(minitest, name_, a_, b_, c_, d_, e_)
+#endif
 
 // Demangler dependencies:
 #ifndef _MSC_VER
@@ -277,707 +1229,6527 @@ namespace em::minitest
 
         static thread_local std::size_t test_counters_width = 0;
 
-        // Splits `input` by `sep`, calling `func` for each part, which is `(std::string_view part) -> bool`.
-        // Stops immediately if `func` returns true, and then also returns true. Otherwise runs to completion and returns false.
-        static bool SplitString(std::string_view input, std::string_view sep, auto &&func)
-        {
-            while (true)
-            {
-                auto pos = input.find(sep);
+        static thread_local RandomGenerator cur_rng;
 
-                if (pos == std::string_view::npos)
-                    return func(auto(input));
+        class TempDirs;
 
-                if (func(input.substr(0, pos)))
-                    return true;
-                input.remove_prefix(pos + sep.size());
-            }
-        }
+        // The directory of `TempDir()` for one test.
+        struct TestTempDir
+        {
+            TempDirs *dirs = nullptr; // Of the current run.
+            const TestDesc *desc = nullptr;
+            std::string path; // Empty until `TempDir()` is called.
+        };
+        static thread_local TestTempDir *cur_temp_dir = nullptr;
 
-        // Splits two strings synchronously.
-        // `func` is `(std::string_view part1, std::string_view part2) -> bool`. If it returns true, the entire function stops and also returns true.
-        // Runs until both strings are finished. If one has more parts than the other, one of the parameters of `func` will be empty,
-        //   with `.data() == nullptr` (which is how you detect this condition, since otherwise it can be empty but not null).
-        static bool SplitString2(std::string_view input1, std::string_view input2, std::string_view sep, auto &&func)
+        // Mixes `value` into `seed`, for deriving the seeds.
+        [[nodiscard]] static std::uint64_t MixSeed(std::uint64_t seed, std::uint64_t value)
         {
-            bool done1 = false;
-            bool done2 = false;
+            return RandomGenerator(seed ^ (value * 0x9e3779b97f4a7c15))();
+        }
 
-            while (true)
+        // Computes the seed of `Rng()` for a specific test.
+        [[nodiscard]] static std::uint64_t TestSeed(std::uint64_t run_seed, std::size_t repetition, const TestDesc &desc)
+        {
+            // FNV-1a, to not depend on the standard library implementation of `std::hash`.
+            std::uint64_t hash = 0xcbf29ce484222325;
+            auto Add = [&](std::string_view str)
             {
-                auto pos1 = done1 ? std::string_view::npos : input1.find(sep);
-                auto pos2 = done2 ? std::string_view::npos : input2.find(sep);
-
-                bool found1 = pos1 != std::string_view::npos;
-                bool found2 = pos2 != std::string_view::npos;
-
-                if (func(done1 ? std::string_view{} : input1.substr(0, pos1), done2 ? std::string_view{} : input2.substr(0, pos2)))
-                    return true;
-
-                if (!found1 && !found2)
-                    return false;
-
-                done1 = !found1;
-                done2 = !found2;
-
-                if (found1)
-                    input1.remove_prefix(pos1 + sep.size());
-                if (found2)
-                    input2.remove_prefix(pos2 + sep.size());
-            }
+                for (char ch : str)
+                    hash = (hash ^ (unsigned char)ch) * 0x100000001b3;
+            };
+            Add(desc.file);
+            Add(std::to_string(desc.line));
+            Add(desc.name);
+            return MixSeed(MixSeed(run_seed, repetition), hash);
         }
 
-        void InternalError(std::string_view message)
+        #if DETAIL_EM_MINITEST_HAVE_TIME_HOOKS
+        [[nodiscard]] static std::chrono::nanoseconds TimespecToDuration(const timespec &time)
         {
-            std::fprintf(stderr, "minitest: Internal error: %.*s\n", (int)message.size(), message.data());
-            std::exit(2); // Because `1` is for failed tests.
+            return std::chrono::seconds(time.tv_sec) + std::chrono::nanoseconds(time.tv_nsec);
         }
+        #endif
 
-        #ifndef _MSC_VER
-        Demangler::~Demangler()
+        #if DETAIL_EM_MINITEST_HAVE_TIME_HOOKS || DETAIL_EM_MINITEST_HAVE_EPOLL
+        [[nodiscard]] static timespec DurationToTimespec(std::chrono::nanoseconds duration)
         {
-            std::free(buf_ptr); // Does nothing if `buf_ptr` is null.
+            auto sec = std::chrono::floor<std::chrono::seconds>(duration);
+            return {.tv_sec = time_t(sec.count()), .tv_nsec = long((duration - sec).count())};
         }
         #endif
 
-        const char *Demangler::operator()(const char *name)
+        #if DETAIL_EM_MINITEST_HAVE_TIME_HOOKS
+        // The functions we intercept for `RunOptions::virtual_time`, from the next library in the search order (normally libc).
+        struct RealTimeFunctions
         {
-            #ifdef _MSC_VER
-            return name;
-            #else
-            int status = -4; // Some custom error code, in case `abi::__cxa_demangle()` doesn't modify it at all for some reason.
-            buf_ptr = abi::__cxa_demangle(name, buf_ptr, &buf_size, &status);
-            if (status != 0) // -1 = out of memory, -2 = invalid string, -3 = invalid usage
-                return nullptr; // Unable to demangle.
-            return buf_ptr;
-            #endif
-        }
+            int (*clock_gettime)(clockid_t clock, timespec *time) = nullptr;
+            int (*nanosleep)(const timespec *duration, timespec *remaining) = nullptr;
+            int (*clock_nanosleep)(clockid_t clock, int flags, const timespec *time, timespec *remaining) = nullptr;
+            int (*usleep)(useconds_t duration) = nullptr;
+            unsigned int (*sleep)(unsigned int seconds) = nullptr;
+            int (*pthread_cond_timedwait)(pthread_cond_t *cond, pthread_mutex_t *mutex, const timespec *time) = nullptr;
+            int (*pthread_cond_clockwait)(pthread_cond_t *cond, pthread_mutex_t *mutex, clockid_t clock, const timespec *time) = nullptr; // Null before glibc 2.30.
+
+            RealTimeFunctions()
+            {
+                auto Load = [](auto &func, const char *name)
+                {
+                    func = reinterpret_cast<std::remove_reference_t<decltype(func)>>(dlsym(RTLD_NEXT, name));
+                };
+                Load(clock_gettime, "clock_gettime");
+                Load(nanosleep, "nanosleep");
+                Load(clock_nanosleep, "clock_nanosleep");
+                Load(usleep, "usleep");
+                Load(sleep, "sleep");
+                Load(pthread_cond_timedwait, "pthread_cond_timedwait");
+                Load(pthread_cond_clockwait, "pthread_cond_clockwait");
+                if (!clock_gettime || !nanosleep || !clock_nanosleep || !usleep || !sleep || !pthread_cond_timedwait)
+                    InternalError("Unable to find the real time functions in libc.");
+            }
+        };
 
-        TestMap &GetTestMap()
+        [[nodiscard]] static const RealTimeFunctions &GetRealTimeFunctions()
         {
-            static TestMap ret;
+            static const RealTimeFunctions ret;
             return ret;
         }
 
-        #if EM_MINITEST_EXCEPTIONS
-        // Calls `on_element` for the current exception and each nested exception. Always calls it at least once.
-        // If the callback returns true, stops the function and also returns true.
-        // The last call can receive an unknown exception, then you'll receive `type_name == ""` and `message == nullptr`.
-        // The type is passed as a string because we can't get the current `std::type_index` for nested exception (the current type, not the nested one).
-        // The demangler is passed in case you want to move it somewhere to prevent `type_name` from getting invalidated in the future.
-        static bool AnalyzeCurrentException(FuncRef<bool(Demangler &&demangler, std::string_view type_name, const char *message)> on_element)
+        // Whether the virtual time applies to this clock. Not to the CPU time clocks.
+        [[nodiscard]] static bool IsVirtualClock(clockid_t clock)
         {
-            try
-            {
-                throw;
-            }
-            catch (std::exception &e)
-            {
-                Demangler d;
-                std::string_view type_name = d(typeid(e).name());
+            return clock == CLOCK_REALTIME || clock == CLOCK_REALTIME_COARSE || clock == CLOCK_MONOTONIC || clock == CLOCK_MONOTONIC_COARSE ||
+                clock == CLOCK_MONOTONIC_RAW || clock == CLOCK_BOOTTIME;
+        }
+        #endif
 
-                #define DETAIL_EM_MINITEST_EAT_PREFIX(prefix) \
-                    if (type_name.starts_with(prefix)) \
-                    { \
-                        type_name.remove_prefix(sizeof(prefix) - 1); /* Minus the null terminator. Here we also trim the `<` which is included in the `prefix`. */ \
-                        type_name.remove_suffix(1); /* Remove the `>`. */ \
-                    }
+        // The current time of `std::chrono::steady_clock`, but always the real one, even if we make `clock_gettime()` return the virtual time.
+        // The runner uses this to measure the tests.
+        [[nodiscard]] static std::chrono::steady_clock::time_point RealNow()
+        {
+            #if DETAIL_EM_MINITEST_HAVE_TIME_HOOKS
+            // Both libstdc++ and libc++ use `CLOCK_MONOTONIC` for `steady_clock` on Linux.
+            timespec time{};
+            GetRealTimeFunctions().clock_gettime(CLOCK_MONOTONIC, &time);
+            return std::chrono::steady_clock::time_point(std::chrono::duration_cast<std::chrono::steady_clock::duration>(TimespecToDuration(time)));
+            #else
+            return std::chrono::steady_clock::now();
+            #endif
+        }
 
-                #ifdef _MSC_VER // MSVC or Clang in MSVC-compatible mode.
-                #define DETAIL_EM_MINITEST_STRUCT_PREFIX "struct "
-                #else
-                #define DETAIL_EM_MINITEST_STRUCT_PREFIX
-                #endif
+        // The virtual time for `RunOptions::virtual_time`. It's the real time plus an offset, which grows when something sleeps, instead of actually sleeping.
+        class VirtualTime
+        {
+            std::atomic<bool> enabled = false;
+            std::atomic<std::int64_t> offset_ns = 0;
 
-                #if defined(_GLIBCXX_RELEASE)
-                DETAIL_EM_MINITEST_EAT_PREFIX("std::_Nested_exception<") // This never gets used in MSVC-compatible mode anyway.
-                #elif defined(_LIBCPP_VERSION)
-                DETAIL_EM_MINITEST_EAT_PREFIX(DETAIL_EM_MINITEST_STRUCT_PREFIX "std::__nested<")
-                #elif defined(_MSVC_STL_VERSION)
-                DETAIL_EM_MINITEST_EAT_PREFIX(DETAIL_EM_MINITEST_STRUCT_PREFIX "std::_With_nested_v2<")
-                #endif
-                #undef DETAIL_EM_MINITEST_EAT_PREFIX
-                #undef DETAIL_EM_MINITEST_STRUCT_PREFIX
+            std::mutex mutex;
+            std::condition_variable sleeper_finished;
+            std::multiset<std::int64_t> sleepers; // The deadlines of the current sleeps, in nanoseconds since the epoch of `std::chrono::steady_clock`.
+            std::uint64_t num_sleeps_started = 0; // Lets the sleepers notice that another thread has started sleeping.
 
-                if (on_element(std::move(d), type_name, e.what()))
-                    return true;
+          public:
+            [[nodiscard]] bool IsEnabled() const
+            {
+                return enabled.load(std::memory_order_relaxed);
+            }
 
-                try
-                {
-                    std::rethrow_if_nested(e);
-                }
-                catch (...)
-                {
-                    AnalyzeCurrentException(on_element);
-                }
+            // The clocks return to the real time when this is disabled.
+            void SetEnabled(bool new_enabled)
+            {
+                offset_ns = 0;
+                enabled = new_enabled;
             }
-            catch (...)
+
+            // How far the virtual time is ahead of the real time. Zero if disabled.
+            [[nodiscard]] std::chrono::nanoseconds Offset() const
             {
-                return on_element(Demangler{}, {}, nullptr);
+                return IsEnabled() ? std::chrono::nanoseconds(offset_ns.load(std::memory_order_relaxed)) : std::chrono::nanoseconds{};
             }
 
-            return false;
-        }
+            [[nodiscard]] std::chrono::steady_clock::time_point Now() const
+            {
+                return RealNow() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(Offset());
+            }
 
-        // Uses `AnalyzeCurrentException()` to print the current exception.
-        static void PrintCurrentException(const char *indent)
-        {
-            AnalyzeCurrentException([&](Demangler &&, std::string_view type_name, const char *message)
+            // Moves the virtual time to `deadline`, unless it's already later. Before that, waits for the other threads that sleep until earlier times,
+            //   so that they wake up in the order of their deadlines.
+            // Also waits for a short real time before jumping, in case another thread is just about to start an earlier sleep (e.g. it was just spawned).
+            void SleepUntil(std::chrono::steady_clock::time_point deadline)
             {
-                if (type_name.empty())
-                {
-                    // Unknown type.
-                    std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "%sUnknown exception.\n", DETAIL_EM_MINITEST_LOG_PARAMS, indent);
-                }
-                else
+                std::int64_t deadline_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch()).count();
+
+                std::unique_lock lock(mutex);
+                auto iter = sleepers.insert(deadline_ns);
+                num_sleeps_started++;
+                lock.unlock();
+                sleeper_finished.notify_all();
+                lock.lock();
+
+                while (true)
                 {
-                    // Print the known type.
-                    // Here we don't print any special indication to distinguish from `Unknown exception.`, because that's clearly not a valid type anyway.
-                    std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "%s%.*s\n", DETAIL_EM_MINITEST_LOG_PARAMS, indent, (int)type_name.size(), type_name.data());
+                    sleeper_finished.wait(lock, [&]{return *sleepers.begin() == deadline_ns;});
 
-                    // Print message.
-                    if (message)
-                    {
-                        SplitString(message, "\n", [&](std::string_view line)
-                        {
-                            std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "%s    %.*s\n", DETAIL_EM_MINITEST_LOG_PARAMS, indent, (int)line.size(), line.data());
-                            return false;
-                        });
-                    }
-                    else
-                    {
-                        // Not indentend to distinguish from a valid message.
-                        std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "%s(null)\n", DETAIL_EM_MINITEST_LOG_PARAMS, indent);
-                    }
+                    // This goes through the interposed `pthread_cond_clockwait()`, which makes this wait take the real time.
+                    std::uint64_t old_num_sleeps_started = num_sleeps_started;
+                    bool interrupted = sleeper_finished.wait_for(lock, std::chrono::microseconds(200), [&]{return num_sleeps_started != old_num_sleeps_started;});
+                    if (!interrupted && *sleepers.begin() == deadline_ns)
+                        break;
                 }
 
-                return false;
-            });
-        }
+                std::int64_t new_offset_ns = deadline_ns - std::chrono::duration_cast<std::chrono::nanoseconds>(RealNow().time_since_epoch()).count();
+                if (new_offset_ns > offset_ns)
+                    offset_ns = new_offset_ns;
 
-        // Don't call this directly, use `DETAIL_EM_MINITEST_RUN_WITH_CATCH()`.
-        // Runs the lambda once. If it doesn't throw, returns its return value.
-        // If the lambda throws `InterruptTestException`, either rethrows it if `rethrow_interrupt`, or returns false otherwise.
-        // If the lambda throws something else, calls `on_failure()` and returns false.
-        // You must manually fail the test in `on_failure`, manually print the exception if needed, and manually throw `InterruptTestException` if needed.
-        static bool RunWithCatchImpl(bool rethrow_interrupt, FuncRef<bool()> func, FuncRef<void()> on_failure)
-        {
-            // Run the test with exception catching.
-            try
-            {
-                return func();
-            }
-            catch (InterruptTestException)
-            {
-                if (rethrow_interrupt)
-                    throw;
-                else
-                    return false;
-            }
-            catch (...)
-            {
-                on_failure();
-                return false;
+                sleepers.erase(iter);
+                lock.unlock();
+                sleeper_finished.notify_all();
             }
+        };
+
+        [[nodiscard]] static VirtualTime &GetVirtualTime()
+        {
+            static VirtualTime ret;
+            return ret;
         }
-        #define DETAIL_EM_MINITEST_RUN_WITH_CATCH detail::RunWithCatchImpl // No `(...)` allow debug info in the lambda.
-        #else
-        #define DETAIL_EM_MINITEST_RUN_WITH_CATCH(rethrow_interrupt_, func_, .../*on_failure*/) (func_)()
-        #endif
 
-        bool Assert(bool stop_on_failure, const char *file, int line, const char *expr_str, FuncRef<bool()> func)
+        // The resource counters of the current thread (or the whole process, if per-thread counters aren't available).
+        struct ResourceUsage
         {
-            #if EM_MINITEST_EXCEPTIONS
-            bool got_exception = false;
-            #endif
+            std::uint64_t cpu_user_ns = 0;
+            std::uint64_t cpu_system_ns = 0;
+            std::uint64_t max_rss_kb = 0;
 
-            auto FailAssert = [&]
+            // Returns zeros if this isn't supported on this platform.
+            [[nodiscard]] static ResourceUsage Now()
             {
-                // Flush the user output.
-                std::fflush(stdout);
-                std::fflush(stderr);
-
-                *fail_test_ptr = true;
-                // It should be impossible for this to be called twice, so there is no guard.
-                std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "    Assertion failed at:  %s:%d\n", DETAIL_EM_MINITEST_LOG_PARAMS, file, line);
-                std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "        Expression:  %s\n", DETAIL_EM_MINITEST_LOG_PARAMS, expr_str);
-
-                #if EM_MINITEST_EXCEPTIONS
-                if (got_exception)
-                {
-                    std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "        Threw an uncaught exception:\n", DETAIL_EM_MINITEST_LOG_PARAMS);
-                    detail::PrintCurrentException("            ");
-                }
-                else
+                ResourceUsage ret;
+                #if DETAIL_EM_MINITEST_HAVE_RUSAGE
+                rusage usage{};
+                #ifdef RUSAGE_THREAD
+                int who = RUSAGE_THREAD;
+                #else
+                int who = RUSAGE_SELF;
                 #endif
+                if (getrusage(who, &usage) == 0)
                 {
-                    std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "        Evaluated to false.\n", DETAIL_EM_MINITEST_LOG_PARAMS);
+                    ret.cpu_user_ns = std::uint64_t(usage.ru_utime.tv_sec) * 1'000'000'000 + std::uint64_t(usage.ru_utime.tv_usec) * 1000;
+                    ret.cpu_system_ns = std::uint64_t(usage.ru_stime.tv_sec) * 1'000'000'000 + std::uint64_t(usage.ru_stime.tv_usec) * 1000;
+                    ret.max_rss_kb = std::uint64_t(usage.ru_maxrss);
                 }
-
-                #if EM_MINITEST_EXCEPTIONS
-                if (stop_on_failure)
-                    throw InterruptTestException{};
-                #else
-                (void)stop_on_failure;
                 #endif
-            };
+                return ret;
+            }
+        };
 
-            bool ret = DETAIL_EM_MINITEST_RUN_WITH_CATCH(true, func, [&]
+        [[nodiscard]] static const char *FailureKindToString(FailureKind kind)
+        {
+            switch (kind)
             {
-                got_exception = true;
-                FailAssert(); // This can't be deduplicated with the one below, because this one is in a `catch`, and rethrows the current exception to print it.
-            });
+                case FailureKind::assertion:            return "assertion";
+                case FailureKind::unexpected_exception: return "unexpected_exception";
+                case FailureKind::missing_exception:    return "missing_exception";
+                case FailureKind::incorrect_exception:  return "incorrect_exception";
+                case FailureKind::uncaught_exception:   return "uncaught_exception";
+                case FailureKind::crashed:              return "crashed";
+            }
+            return "unknown";
+        }
 
-            if (!ret
-                #if EM_MINITEST_EXCEPTIONS
-                && !got_exception
-                #endif
-            )
+        // The listeners of the current run. This is empty when not running tests.
+        static thread_local std::span<Listener *const> cur_listeners;
+
+        [[nodiscard]] static bool HaveListeners()
+        {
+            return !cur_listeners.empty();
+        }
+
+        // Whether `ReportFailure()` should fill `FailureInfo::stack`.
+        static thread_local bool capture_backtraces = false;
+
+        // Whether the tests that run on this thread should record their spans in the trace (see `Tracer::AddTestSpan()`).
+        // This is per thread rather than a part of the tracer, so that the tests of the other runners (e.g. `BackgroundSelfTest`) don't end up in the trace.
+        static thread_local bool trace_test_spans = false;
+
+        // Whether some runner is using the process-wide features: the tracing, the virtual time, or the profiler. Only one runner at a time can use them.
+        static std::atomic<bool> exclusive_features_in_use = false;
+
+        static void ReportFailure(const FailureInfo &info)
+        {
+            #if DETAIL_EM_MINITEST_HAVE_BACKTRACE
+            // The uncaught exceptions are reported from the runner, where the stack isn't interesting.
+            if (capture_backtraces && info.kind != FailureKind::uncaught_exception)
             {
-                FailAssert();
+                // Only capturing the addresses here, the listeners symbolize them if they need to.
+                // `backtrace()` doesn't allocate, other than on the first call, which `RunTests()` makes in advance.
+                void *frames[64];
+                FailureInfo info_with_stack = info;
+                info_with_stack.stack = {frames, std::size_t(backtrace(frames, 64))};
+                for (Listener *l : cur_listeners)
+                    l->OnFailure(info_with_stack);
+                return;
             }
+            #endif
 
-            return ret;
+            for (Listener *l : cur_listeners)
+                l->OnFailure(info);
         }
 
-        #if EM_MINITEST_EXCEPTIONS
-        bool Try(bool stop_on_failure, const char *file, int line, const char *expr_str, FuncRef<void()> func)
+        // Splits `input` by `sep`, calling `func` for each part, which is `(std::string_view part) -> bool`.
+        // Stops immediately if `func` returns true, and then also returns true. Otherwise runs to completion and returns false.
+        static bool SplitString(std::string_view input, std::string_view sep, auto &&func)
         {
-            return DETAIL_EM_MINITEST_RUN_WITH_CATCH(true, [&]{func(); return false;/*The result is ignored here.*/}, [&]
+            while (true)
             {
-                // Flush the user output.
-                std::fflush(stdout);
-                std::fflush(stderr);
-
-                *fail_test_ptr = true;
-                // It should be impossible for this to be called twice, so there is no guard.
-                std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "    Unexpected exception at:  %s:%d\n", DETAIL_EM_MINITEST_LOG_PARAMS, file, line);
-                std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "        Expression:  %s\n", DETAIL_EM_MINITEST_LOG_PARAMS, expr_str);
+                auto pos = input.find(sep);
 
-                std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "        Threw an uncaught exception:\n", DETAIL_EM_MINITEST_LOG_PARAMS);
-                detail::PrintCurrentException("            ");
+                if (pos == std::string_view::npos)
+                    return func(auto(input));
 
-                if (stop_on_failure)
-                    throw InterruptTestException{};
-            });
+                if (func(input.substr(0, pos)))
+                    return true;
+                input.remove_prefix(pos + sep.size());
+            }
         }
 
-        void MustThrow::operator~()
+        // Splits two strings synchronously.
+        // `func` is `(std::string_view part1, std::string_view part2) -> bool`. If it returns true, the entire function stops and also returns true.
+        // Runs until both strings are finished. If one has more parts than the other, one of the parameters of `func` will be empty,
+        //   with `.data() == nullptr` (which is how you detect this condition, since otherwise it can be empty but not null).
+        static bool SplitString2(std::string_view input1, std::string_view input2, std::string_view sep, auto &&func)
         {
-            static constexpr std::size_t max_num_caught_exceptions = 128;
-            static constexpr std::size_t message_indent = 4; // How many characters the exception messages are indented by.
+            bool done1 = false;
+            bool done2 = false;
 
-            Arg caught_exceptions[max_num_caught_exceptions];
-            std::size_t num_caught_exceptions = 0;
+            while (true)
+            {
+                auto pos1 = done1 ? std::string_view::npos : input1.find(sep);
+                auto pos2 = done2 ? std::string_view::npos : input2.find(sep);
 
-            std::size_t max_string_len = 9; // Need this value to spell `(unknown)`.
+                bool found1 = pos1 != std::string_view::npos;
+                bool found2 = pos2 != std::string_view::npos;
 
-            // How many desired exceptions were provided by the user.
-            const std::size_t num_expected_exceptions = std::size_t(args.end() - args.begin());
+                if (func(done1 ? std::string_view{} : input1.substr(0, pos1), done2 ? std::string_view{} : input2.substr(0, pos2)))
+                    return true;
 
-            bool have_mismatch = false;
+                if (!found1 && !found2)
+                    return false;
 
-            bool ran_without_exceptions = DETAIL_EM_MINITEST_RUN_WITH_CATCH(
-                true,
-                [&]{body(); return true;},
-                [&]
-                {
-                    AnalyzeCurrentException([&](Demangler &&demangler, std::string_view type_name, const char *message)
-                    {
-                        if (num_caught_exceptions == max_num_caught_exceptions)
-                            InternalError("Too deeply nested exception caught in `EM_MUST_THROW()`.");
+                done1 = !found1;
+                done2 = !found2;
 
-                        Arg &this_ex = caught_exceptions[num_caught_exceptions];
-                        this_ex.demangler = std::move(demangler);
-                        this_ex.type = type_name;
-                        this_ex.message = message ? message : ""; // Need this for unknown exceptions.
+                if (found1)
+                    input1.remove_prefix(pos1 + sep.size());
+                if (found2)
+                    input2.remove_prefix(pos2 + sep.size());
+            }
+        }
 
-                        // Check against the user-provided types.
-                        if (num_expected_exceptions != 0)
-                        {
-                            // Only check if we don't have more caught exceptions than expected.
-                            // We don't set `have_mismatch = true;` in this case yet, because we compare the exception count
-                            //   after looping over all the exceptions anyway (to catch the opposite situation, when the code throws
-                            //   less exceptions than expected), so it makes no sense to check it here.
-                            if (num_caught_exceptions < num_expected_exceptions)
-                            {
-                                const Arg &expected_exception = args.begin()[num_caught_exceptions];
+        void InternalError(std::string_view message)
+        {
+            std::fprintf(stderr, "minitest: Internal error: %.*s\n", (int)message.size(), message.data());
+            std::exit(2); // Because `1` is for failed tests.
+        }
 
-                                if (
-                                    this_ex.type != expected_exception.type ||
-                                    this_ex.message != expected_exception.message
-                                )
-                                {
-                                    // Don't stop analyzing the exception to calculate `max_string_len` properly.
-                                    have_mismatch = true;
-                                }
-                            }
+        #ifndef _MSC_VER
+        Demangler::~Demangler()
+        {
+            std::free(buf_ptr); // Does nothing if `buf_ptr` is null.
+        }
+        #endif
+
+        const char *Demangler::operator()(const char *name)
+        {
+            #ifdef _MSC_VER
+            return name;
+            #else
+            int status = -4; // Some custom error code, in case `abi::__cxa_demangle()` doesn't modify it at all for some reason.
+            buf_ptr = abi::__cxa_demangle(name, buf_ptr, &buf_size, &status);
+            if (status != 0) // -1 = out of memory, -2 = invalid string, -3 = invalid usage
+                return nullptr; // Unable to demangle.
+            return buf_ptr;
+            #endif
+        }
 
+        TestMap &GetTestMap()
+        {
+            static TestMap ret;
+            return ret;
+        }
 
-                            // Update string lengths:
+        // The address of the test function, for the code hashes and the profiler. For the async tests, this only creates the coroutine,
+        //   but it refers to the coroutine body, so the hash still covers it.
+        [[nodiscard]] static std::uintptr_t TestFuncAddress(const Test &test)
+        {
+            return test.async_func ? reinterpret_cast<std::uintptr_t>(test.async_func) : reinterpret_cast<std::uintptr_t>(test.func);
+        }
 
-                            std::size_t type_len = this_ex.type.size();
-                            if (type_len > max_string_len)
-                                max_string_len = type_len;
+        // While loading a `TestModule`, this collects its tests that are already registered.
+        static std::vector<TestDesc> *module_duplicate_tests = nullptr;
 
-                            SplitString(this_ex.message, "\n", [&](std::string_view line)
-                            {
-                                std::size_t line_len = line.size() + 4; // `4` is the message indentation, it must match the printing below.
-                                if (line_len > max_string_len)
-                                    max_string_len = line_len;
-                                return false;
-                            });
-                        }
+        void OnDuplicateTest(const TestDesc &desc)
+        {
+            if (module_duplicate_tests)
+                module_duplicate_tests->push_back(desc);
+            else
+                InternalError("A duplicate test was registered at `" + std::string(desc.file) + ":" + std::to_string(desc.line) + "`, named `" + std::string(desc.name) + "`.");
+        }
 
-                        num_caught_exceptions++;
+        [[nodiscard]] static std::vector<std::string_view> &TagNames()
+        {
+            static std::vector<std::string_view> ret;
+            return ret;
+        }
 
-                        return false;
-                    });
+        TagMask InternTag(std::string_view tag)
+        {
+            std::vector<std::string_view> &names = TagNames();
+            auto iter = std::find(names.begin(), names.end(), tag);
+            if (iter != names.end())
+                return TagMask(1) << (iter - names.begin());
+            if (names.size() >= sizeof(TagMask) * 8)
+                InternalError("Too many different test tags, at most " + std::to_string(sizeof(TagMask) * 8) + " are supported.");
+            // Copying the name, because it can be in a `TestModule` that gets unloaded later.
+            static std::deque<std::string> storage;
+            names.push_back(storage.emplace_back(tag));
+            return TagMask(1) << (names.size() - 1);
+        }
+
+        std::span<const std::string_view> GetTagNames()
+        {
+            return TagNames();
+        }
+
+        void AddTestAttribute(Test &test, std::string_view attribute)
+        {
+            constexpr std::string_view depends_prefix = "depends:";
+            if (attribute.starts_with(depends_prefix))
+                test.dependencies.push_back(attribute.substr(depends_prefix.size()));
+            else
+                test.tags |= InternTag(attribute);
+        }
+
+        // Converts the tag names to a mask. Returns false and sets `error` if some tag is unknown.
+        [[nodiscard]] static bool TagNamesToMask(std::span<const std::string> tags, TagMask &mask, std::string &error)
+        {
+            std::span<const std::string_view> names = GetTagNames();
+            for (const std::string &tag : tags)
+            {
+                auto iter = std::find(names.begin(), names.end(), tag);
+                if (iter == names.end())
+                {
+                    error = "Unknown tag: `" + tag + "`.";
+                    return false;
                 }
-            );
+                mask |= TagMask(1) << (iter - names.begin());
+            }
+            return true;
+        }
+
+        #if DETAIL_EM_MINITEST_HAVE_ELF
+        // Reads the sections of an ELF file of our own class.
+        class ElfReader
+        {
+            std::FILE *file = nullptr;
+
+          public:
+            ElfW(Ehdr) header{};
+            std::vector<ElfW(Shdr)> sections; // Empty if this isn't an ELF file of the right class, or on read errors.
 
-            auto FailCheck = [&](const char *message)
+            ElfReader() {}
+            ElfReader(const ElfReader &) = delete;
+            ElfReader &operator=(const ElfReader &) = delete;
+            ~ElfReader()
             {
-                // Flush the user output.
-                std::fflush(stdout);
-                std::fflush(stderr);
+                if (file)
+                    std::fclose(file);
+            }
 
-                *fail_test_ptr = true;
-                std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "    %s at:  %s:%d\n", DETAIL_EM_MINITEST_LOG_PARAMS, message, file, line);
+            // Returns false if the file can't be opened.
+            [[nodiscard]] bool Open(const char *path)
+            {
+                file = std::fopen(path, "rb");
+                if (!file)
+                    return false;
+
+                if (!ReadAt(0, &header, sizeof header) || std::memcmp(header.e_ident, ELFMAG, SELFMAG) != 0 || header.e_ident[EI_CLASS] != (sizeof(void *) == 8 ? ELFCLASS64 : ELFCLASS32) || header.e_shentsize != sizeof(ElfW(Shdr)))
+                    return true;
+
+                sections.resize(header.e_shnum);
+                if (!ReadAt(header.e_shoff, sections.data(), sections.size() * sizeof(ElfW(Shdr))))
+                    sections.clear();
+                return true;
+            }
+
+            [[nodiscard]] bool ReadAt(std::uint64_t offset, void *dest, std::size_t size)
+            {
+                return std::fseek(file, long(offset), SEEK_SET) == 0 && std::fread(dest, 1, size, file) == size;
+            }
+
+            // Returns false on read errors, and for the compressed sections.
+            [[nodiscard]] bool ReadSection(const ElfW(Shdr) &section, std::string &out)
+            {
+                if (section.sh_type == SHT_NOBITS || section.sh_flags & SHF_COMPRESSED)
+                    return false;
+                out.assign(section.sh_size, '\0');
+                return ReadAt(section.sh_offset, out.data(), out.size());
+            }
+
+            // Returns null if there's no such section.
+            [[nodiscard]] const ElfW(Shdr) *FindSection(std::string_view name)
+            {
+                if (section_names.empty() && header.e_shstrndx < sections.size() && !ReadSection(sections[header.e_shstrndx], section_names))
+                    return nullptr;
+                for (const ElfW(Shdr) &section : sections)
+                {
+                    if (section.sh_name < section_names.size() && section_names.c_str() + section.sh_name == name)
+                        return &section;
+                }
+                return nullptr;
+            }
+
+          private:
+            std::string section_names; // Loaded lazily.
+        };
+        #endif
+
+        #if DETAIL_EM_MINITEST_HAVE_BACKTRACE
+        // Converts code addresses to function names. Caches everything it learns, so repeated lookups are cheap.
+        // Uses the ELF symbol tables where available, and `dladdr()` otherwise (which only sees the exported functions).
+        class Symbolizer
+        {
+          public:
+            struct Symbol
+            {
+                std::string name;
+                std::uintptr_t start = 0; // The function address, or 0 if unknown.
+                std::uintptr_t size = 0; // The function size in bytes, or 0 if unknown. Only known if we have the ELF symbol tables.
+            };
+
+          private:
+            struct Module
+            {
+                struct Entry
+                {
+                    std::uintptr_t addr = 0;
+                    std::uintptr_t size = 0;
+                    std::uint32_t name = 0; // An offset into `strings`.
+                };
 
-                // Only print the expression if it's short enough. `EM_MUST_THROW` needs this because it can accept multiple statements, unlike `EM_CHECK`.
-                if (std::string_view(expr_str).size() <= 150)
-                    std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "        Expression:  %s\n", DETAIL_EM_MINITEST_LOG_PARAMS, expr_str);
+                bool is_absolute = false; // The symbol addresses are absolute, rather than relative to the load address.
+                std::vector<Entry> entries; // Sorted by address.
+                std::string strings;
             };
 
-            // Fail if we didn't have any exceptions at all.
-            if (ran_without_exceptions)
+            std::map<std::string, Module, std::less<>> modules;
+            std::unordered_map<std::uintptr_t, Symbol> cache;
+            Demangler demangler;
+
+            #if DETAIL_EM_MINITEST_HAVE_ELF
+            // Reads the function symbols from `.symtab`, or from `.dynsym` if the file is stripped.
+            // Returns false if the file can't be opened. Leaves `module` empty if this isn't an ELF file of the right class, or on read errors.
+            static bool ReadElfSymbols(const char *path, Module &module)
             {
-                FailCheck("Missing exception");
-                #if EM_MINITEST_EXCEPTIONS
-                if (stop_on_failure)
-                    throw InterruptTestException{};
+                ElfReader elf;
+                if (!elf.Open(path))
+                    return false;
+                const auto &sections = elf.sections;
+
+                const ElfW(Shdr) *symtab = nullptr;
+                for (ElfW(Word) type : {ElfW(Word)(SHT_SYMTAB), ElfW(Word)(SHT_DYNSYM)})
+                {
+                    for (const ElfW(Shdr) &section : sections)
+                    {
+                        if (section.sh_type == type)
+                        {
+                            symtab = &section;
+                            break;
+                        }
+                    }
+                    if (symtab)
+                        break;
+                }
+                if (!symtab || symtab->sh_link >= sections.size() || symtab->sh_entsize != sizeof(ElfW(Sym)))
+                    return true;
+                const ElfW(Shdr) &strtab = sections[symtab->sh_link];
+
+                std::vector<ElfW(Sym)> symbols(symtab->sh_size / sizeof(ElfW(Sym)));
+                std::string strings(strtab.sh_size, '\0');
+                if (!elf.ReadAt(symtab->sh_offset, symbols.data(), symbols.size() * sizeof(ElfW(Sym))) || !elf.ReadAt(strtab.sh_offset, strings.data(), strings.size()))
+                    return true;
+
+                for (const ElfW(Sym) &sym : symbols)
+                {
+                    if ((sym.st_info & 0xf) != STT_FUNC /* `ELF64_ST_TYPE()` */ || sym.st_shndx == SHN_UNDEF || sym.st_value == 0 || sym.st_size == 0 || sym.st_name >= strings.size())
+                        continue;
+                    module.entries.push_back({.addr = std::uintptr_t(sym.st_value), .size = std::uintptr_t(sym.st_size), .name = std::uint32_t(sym.st_name)});
+                }
+                std::sort(module.entries.begin(), module.entries.end(), [](const Module::Entry &a, const Module::Entry &b){return a.addr < b.addr;});
+                module.is_absolute = elf.header.e_type == ET_EXEC;
+                module.strings = std::move(strings);
+                return true;
+            }
+            #endif
+
+            [[nodiscard]] const Module &GetModule(const char *path)
+            {
+                auto it = modules.find(std::string_view(path));
+                if (it != modules.end())
+                    return it->second;
+
+                Module &module = modules[path];
+                #if DETAIL_EM_MINITEST_HAVE_ELF
+                // `dladdr()` reports the executable under the name it was started with, which may be relative to a different directory.
+                if (!ReadElfSymbols(path, module))
+                    ReadElfSymbols("/proc/self/exe", module);
                 #endif
-                return;
+                return module;
             }
 
-            // If user didn't provide any exceptions to check against, stop now.
-            if (num_expected_exceptions == 0)
-                return;
+            void SetName(Symbol &symbol, const char *mangled_name)
+            {
+                const char *demangled = std::strncmp(mangled_name, "_Z", 2) == 0 ? demangler(mangled_name) : nullptr;
+                symbol.name = demangled ? demangled : mangled_name;
+            }
 
-            // Check that the number of exceptions matches our expectations.
-            if (num_caught_exceptions != num_expected_exceptions)
-                have_mismatch = true;
+          public:
+            // For the return addresses, pass `addr - 1`, otherwise the call in the last line of a function can be attributed to the next one.
+            [[nodiscard]] const Symbol &operator()(std::uintptr_t addr)
+            {
+                auto [it, is_new] = cache.try_emplace(addr);
+                Symbol &ret = it->second;
+                if (!is_new)
+                    return ret;
 
-            // On an exact match, do nothing.
-            if (!have_mismatch)
-                return;
+                Dl_info info{};
+                if (!dladdr(reinterpret_cast<void *>(addr), &info) || !info.dli_fname)
+                {
+                    ret.name = "[unknown]";
+                    return ret;
+                }
+
+                const Module &module = GetModule(info.dli_fname);
+                std::uintptr_t base = reinterpret_cast<std::uintptr_t>(info.dli_fbase);
+                std::uintptr_t module_addr = module.is_absolute ? addr : addr - base;
+                auto entry = std::upper_bound(module.entries.begin(), module.entries.end(), module_addr, [](std::uintptr_t a, const Module::Entry &b){return a < b.addr;});
+                if (entry != module.entries.begin() && module_addr < entry[-1].addr + entry[-1].size)
+                {
+                    --entry;
+                    SetName(ret, module.strings.c_str() + entry->name);
+                    ret.start = module.is_absolute ? entry->addr : base + entry->addr;
+                    ret.size = entry->size;
+                }
+                else if (info.dli_sname)
+                {
+                    SetName(ret, info.dli_sname);
+                    ret.start = reinterpret_cast<std::uintptr_t>(info.dli_saddr);
+                }
+                else
+                {
+                    // Unknown function, use the module name. Not adding the offset, to have all unknown functions of a module grouped together.
+                    const char *module_name = std::strrchr(info.dli_fname, '/');
+                    module_name = module_name ? module_name + 1 : info.dli_fname;
+                    ret.name = std::string("[") + module_name + "]";
+                }
+                return ret;
+            }
+        };
 
-            FailCheck("Incorrect exception");
+        // The symbolizer shared by everything, so its cache is reused.
+        [[nodiscard]] static Symbolizer &GetSymbolizer()
+        {
+            static Symbolizer ret;
+            return ret;
+        }
 
-            // Special-case a shorter printing format when there is no nesting, and only the message is different.
-            if (num_caught_exceptions == 1 && num_expected_exceptions == 1 && caught_exceptions[0].type == args.begin()->type)
+        // Calls `func(const std::string &name)` for each frame of a `FailureInfo::stack`, innermost first.
+        // Skips the minitest frames on top of the stack, and stops at the runner below the test.
+        static void ForEachStackFrame(std::span<void *const> stack, auto &&func)
+        {
+            constexpr std::string_view prefix = "em::minitest::";
+            bool in_user_code = false;
+            for (void *frame : stack)
             {
-                std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "        Exception:\n", DETAIL_EM_MINITEST_LOG_PARAMS);
-                bool first = true;
-                SplitString(caught_exceptions[0].message, "\n", [&](std::string_view line)
+                // Those are all return addresses, see the comment in `Symbolizer`.
+                const std::string &name = GetSymbolizer()(reinterpret_cast<std::uintptr_t>(frame) - 1).name;
+                if (name.starts_with(prefix))
+                {
+                    if (in_user_code)
+                        break;
+                    continue;
+                }
+                in_user_code = true;
+                func(name);
+            }
+        }
+        #endif
+
+        #if DETAIL_EM_MINITEST_HAVE_CODE_HASH
+        // Hashes the machine code of the test functions, for `--cache`.
+        // The hash of a function includes the hashes of all functions it calls or takes the address of (transitively), and the build IDs of all loaded modules
+        //   other than the one containing the function.
+        // This is conservative in one direction and not the other: moving unrelated code around can change the hash (because of the relative addressing),
+        //   but the virtual calls, the calls through the PLT to the same module, and the changes to global data aren't noticed.
+        class CodeHasher
+        {
+            using Segment = std::pair<std::uintptr_t, std::uintptr_t>; // Begin and end addresses.
+
+            struct LoadedModule
+            {
+                std::vector<Segment> segments; // Only the executable ones.
+                std::uint64_t build_id_hash = 0;
+            };
+            std::vector<LoadedModule> loaded_modules;
+            bool loaded_modules_ready = false;
+
+            std::unordered_map<std::uintptr_t, std::uint64_t> hashes; // The function address -> hash, or 0 if we couldn't hash it.
+
+            static void HashBytes(std::uint64_t &hash, const void *data, std::size_t size)
+            {
+                // FNV-1a.
+                const unsigned char *bytes = static_cast<const unsigned char *>(data);
+                for (std::size_t i = 0; i < size; i++)
+                    hash = (hash ^ bytes[i]) * 0x100000001b3;
+            }
+
+            void LoadModules()
+            {
+                loaded_modules_ready = true;
+                dl_iterate_phdr([](dl_phdr_info *info, std::size_t, void *userdata) -> int
                 {
-                    if (first)
+                    LoadedModule &module = static_cast<CodeHasher *>(userdata)->loaded_modules.emplace_back();
+                    std::uint64_t hash = 0xcbf29ce484222325;
+                    bool have_build_id = false;
+                    for (int i = 0; i < info->dlpi_phnum; i++)
                     {
-                        first = false;
-                        std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "            Caught:   %.*s\n", DETAIL_EM_MINITEST_LOG_PARAMS, (int)line.size(), line.data());
+                        const ElfW(Phdr) &phdr = info->dlpi_phdr[i];
+                        std::uintptr_t begin = info->dlpi_addr + phdr.p_vaddr;
+                        if (phdr.p_type == PT_LOAD && (phdr.p_flags & PF_X))
+                        {
+                            module.segments.emplace_back(begin, begin + phdr.p_memsz);
+                        }
+                        else if (phdr.p_type == PT_NOTE)
+                        {
+                            // Look for `NT_GNU_BUILD_ID`.
+                            std::uintptr_t cur = begin, end = begin + phdr.p_memsz;
+                            while (cur + sizeof(ElfW(Nhdr)) <= end)
+                            {
+                                const ElfW(Nhdr) *note = reinterpret_cast<const ElfW(Nhdr) *>(cur);
+                                std::uintptr_t name = cur + sizeof(ElfW(Nhdr));
+                                std::uintptr_t desc = name + ((note->n_namesz + 3) & ~std::uintptr_t(3));
+                                std::uintptr_t next = desc + ((note->n_descsz + 3) & ~std::uintptr_t(3));
+                                if (next > end)
+                                    break;
+                                if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 && std::memcmp(reinterpret_cast<const void *>(name), "GNU", 4) == 0)
+                                {
+                                    HashBytes(hash, reinterpret_cast<const void *>(desc), note->n_descsz);
+                                    have_build_id = true;
+                                }
+                                cur = next;
+                            }
+                        }
                     }
-                    else
+                    // Without a build ID, the file name is the best we can do.
+                    if (!have_build_id && info->dlpi_name)
+                        HashBytes(hash, info->dlpi_name, std::strlen(info->dlpi_name));
+                    module.build_id_hash = hash;
+                    return 0;
+                }, this);
+            }
+
+            // Returns the executable segment containing `addr`, or null if none.
+            [[nodiscard]] const Segment *FindSegment(std::uintptr_t addr)
+            {
+                if (!loaded_modules_ready)
+                    LoadModules();
+                for (const LoadedModule &module : loaded_modules)
+                {
+                    for (const Segment &seg : module.segments)
                     {
-                        std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "                      %.*s\n", DETAIL_EM_MINITEST_LOG_PARAMS, (int)line.size(), line.data());
+                        if (addr >= seg.first && addr < seg.second)
+                            return &seg;
                     }
-                    return false;
-                });
-                first = true;
-                SplitString(args.begin()->message, "\n", [&](std::string_view line)
+                }
+                return nullptr;
+            }
+
+            // The hash of the modules other than the one containing `addr`.
+            [[nodiscard]] std::uint64_t DependenciesHash(std::uintptr_t addr)
+            {
+                if (!loaded_modules_ready)
+                    LoadModules();
+
+                std::uint64_t hash = 0xcbf29ce484222325;
+                for (const LoadedModule &module : loaded_modules)
+                {
+                    bool contains_addr = std::any_of(module.segments.begin(), module.segments.end(), [&](const auto &seg){return addr >= seg.first && addr < seg.second;});
+                    if (!contains_addr)
+                        HashBytes(hash, &module.build_id_hash, sizeof module.build_id_hash);
+                }
+                return hash;
+            }
+
+            // How deep `FunctionHash()` follows the calls. The functions deeper than that can't be hashed, and so neither can their callers.
+            static constexpr std::size_t max_call_depth = 256;
+
+            // Returns 0 if the function can't be hashed. `depth` is the number of callers we came through.
+            [[nodiscard]] std::uint64_t FunctionHash(std::uintptr_t func, std::size_t depth = 0)
+            {
+                if (depth >= max_call_depth)
+                    return 0; // Not cached, the function could be reached in fewer steps from elsewhere.
+
+                auto [iter, is_new] = hashes.try_emplace(func, 1); // In case of recursion, the callers see this placeholder value.
+                if (!is_new)
+                    return iter->second;
+
+                const Symbolizer::Symbol &symbol = GetSymbolizer()(func);
+                const Segment *segment = FindSegment(func);
+                if (symbol.start != func || symbol.size == 0 || !segment)
+                    return hashes[func] = 0;
+
+                std::string code(reinterpret_cast<const char *>(func), symbol.size);
+                std::uint64_t hash = 0xcbf29ce484222325;
+                bool any_unhashable_callees = false;
+
+                // Find the references to other functions: the calls, and also the function addresses being loaded (e.g. the lambdas passed to `EM_CHECK()`).
+                // We replace the relative offsets in them with the hashes of those functions, so that our hash doesn't change when they move.
+                // Returns true if `target` is a function start.
+                auto VisitTarget = [&](std::uintptr_t target, std::size_t offset_pos, std::size_t offset_size) -> bool
+                {
+                    // Only the same module, the calls to other modules go through the PLT, and those are covered by `DependenciesHash()`.
+                    // This check is cheap, and filters out most of the garbage on x86 (see below).
+                    if (target < segment->first || target >= segment->second || (target >= func && target < func + symbol.size))
+                        return false;
+                    const Symbolizer::Symbol &callee = GetSymbolizer()(target);
+                    if (callee.start != target || callee.size == 0)
+                        return false;
+                    std::fill_n(code.begin() + std::ptrdiff_t(offset_pos), offset_size, '\0');
+                    std::uint64_t callee_hash = FunctionHash(target, depth + 1);
+                    if (callee_hash == 0)
+                        any_unhashable_callees = true;
+                    HashBytes(hash, &callee_hash, sizeof callee_hash);
+                    return true;
+                };
+
+                #if defined(__x86_64__)
+                // The calls, the jumps (tail calls), and the RIP-relative addressing (how the function addresses are loaded) all use a 32-bit displacement
+                //   relative to the end of the instruction, which is normally right after the displacement.
+                // We don't decode the instructions, and instead try every offset, then check if the target is a function start.
+                for (std::size_t i = 0; i + 4 <= code.size(); i++)
                 {
-                    if (first)
+                    std::int32_t rel = 0;
+                    std::memcpy(&rel, code.data() + i, sizeof rel);
+                    if (VisitTarget(func + i + 4 + std::uintptr_t(std::intptr_t(rel)), i, 4))
+                        i += 3;
+                }
+                #elif defined(__aarch64__)
+                // The instructions are fixed-size, so this is exact.
+                for (std::size_t i = 0; i + 4 <= code.size(); i += 4)
+                {
+                    std::uint32_t instr = 0;
+                    std::memcpy(&instr, code.data() + i, sizeof instr);
+                    if ((instr & 0x7c000000) == 0x14000000)
                     {
-                        first = false;
-                        std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "            Expected: %.*s\n", DETAIL_EM_MINITEST_LOG_PARAMS, (int)line.size(), line.data());
+                        // `bl imm26` and `b imm26` (tail calls). The offset is in units of 4 bytes.
+                        std::intptr_t rel = std::intptr_t(std::int32_t(instr << 6) >> 6) * 4;
+                        VisitTarget(func + i + std::uintptr_t(rel), i, 4);
                     }
-                    else
+                    else if ((instr & 0x9f000000) == 0x90000000 && i + 8 <= code.size())
                     {
-                        std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "                      %.*s\n", DETAIL_EM_MINITEST_LOG_PARAMS, (int)line.size(), line.data());
+                        // `adrp xN, page` followed by `add xN, xN, offset`, which is how the function addresses are loaded.
+                        std::uint32_t next = 0;
+                        std::memcpy(&next, code.data() + i + 4, sizeof next);
+                        std::uint32_t reg = instr & 31;
+                        if ((next & 0xffc00000) != 0x91000000 || (next & 31) != reg || ((next >> 5) & 31) != reg)
+                            continue;
+                        std::int64_t page_delta = std::int64_t(((instr >> 29) & 3) | ((instr >> 3) & 0x1ffffc)) << 43 >> 31; // Sign-extend the 21 bits, then multiply by 4096.
+                        std::uintptr_t page = ((func + i) & ~std::uintptr_t(0xfff)) + std::uintptr_t(page_delta);
+                        VisitTarget(page + ((next >> 10) & 0xfff), i, 8);
                     }
-                    return false;
-                });
+                }
+                #endif
+
+                if (any_unhashable_callees)
+                    return hashes[func] = 0;
+
+                HashBytes(hash, code.data(), code.size());
+                // Never return 0, it means an error.
+                if (hash == 0)
+                    hash = 1;
+                return hashes[func] = hash;
+            }
+
+          public:
+            // Returns 0 if the function can't be hashed, e.g. if there are no symbols.
+            [[nodiscard]] std::uint64_t TestHash(std::uintptr_t addr)
+            {
+                std::uint64_t hash = FunctionHash(addr);
+                if (hash == 0)
+                    return 0;
+                std::uint64_t deps_hash = DependenciesHash(addr);
+                HashBytes(hash, &deps_hash, sizeof deps_hash);
+                return hash ? hash : 1;
+            }
+        };
+        #endif
+
+        #if DETAIL_EM_MINITEST_HAVE_IMPACT
+        // Maps the functions to the source files their code came from, including the files of the functions inlined into them, for `--record-impact`.
+        // Uses the DWARF line tables (`.debug_line`), so needs `-g`. Doesn't support the compressed debug sections and the separate debug info files.
+        class SourceFileMapper
+        {
+            static constexpr std::uint32_t no_file = std::uint32_t(-1);
+
+            struct Row
+            {
+                std::uintptr_t addr = 0;
+                std::uint32_t file = no_file; // An index into `file_names`, or `no_file` at the end of a sequence.
+            };
+
+            struct Module
+            {
+                bool is_absolute = false; // The addresses are absolute, rather than relative to the load address.
+                std::vector<Row> rows; // Sorted by address. The file of an address is the file of the last row before it.
+            };
+
+            std::map<std::string, Module, std::less<>> modules;
+            std::map<std::string, std::uint32_t, std::less<>> file_ids;
+            std::vector<std::string_view> file_names; // Point to the keys of `file_ids`.
+            std::unordered_map<std::uintptr_t, std::vector<std::string_view>> cache;
+
+            // Reads the DWARF data.
+            struct Cursor
+            {
+                const unsigned char *cur = nullptr;
+                const unsigned char *end = nullptr;
+                bool ok = true; // Becomes false if we try to read past the end.
+
+                template <typename T>
+                [[nodiscard]] T Read()
+                {
+                    T ret{};
+                    if (std::size_t(end - cur) < sizeof(T))
+                    {
+                        ok = false;
+                        cur = end;
+                        return ret;
+                    }
+                    std::memcpy(&ret, cur, sizeof(T));
+                    cur += sizeof(T);
+                    return ret;
+                }
+
+                void Skip(std::uint64_t n)
+                {
+                    if (std::uint64_t(end - cur) < n)
+                    {
+                        ok = false;
+                        cur = end;
+                        return;
+                    }
+                    cur += n;
+                }
+
+                [[nodiscard]] std::uint64_t ReadUleb()
+                {
+                    std::uint64_t ret = 0;
+                    for (int shift = 0;; shift += 7)
+                    {
+                        auto byte = Read<unsigned char>();
+                        if (shift < 64)
+                            ret |= std::uint64_t(byte & 0x7f) << shift;
+                        if (!ok || !(byte & 0x80))
+                            return ret;
+                    }
+                }
+
+                [[nodiscard]] std::int64_t ReadSleb()
+                {
+                    std::uint64_t ret = 0;
+                    for (int shift = 0;; shift += 7)
+                    {
+                        auto byte = Read<unsigned char>();
+                        if (shift < 64)
+                            ret |= std::uint64_t(byte & 0x7f) << shift;
+                        if (!ok || !(byte & 0x80))
+                        {
+                            if (shift + 7 < 64 && byte & 0x40)
+                                ret |= std::uint64_t(-1) << (shift + 7); // Sign extension.
+                            return std::int64_t(ret);
+                        }
+                    }
+                }
+
+                // Reads a null-terminated string.
+                [[nodiscard]] std::string_view ReadString()
+                {
+                    const unsigned char *nul = static_cast<const unsigned char *>(std::memchr(cur, '\0', std::size_t(end - cur)));
+                    if (!nul)
+                    {
+                        ok = false;
+                        cur = end;
+                        return {};
+                    }
+                    std::string_view ret(reinterpret_cast<const char *>(cur), std::size_t(nul - cur));
+                    cur = nul + 1;
+                    return ret;
+                }
+            };
+
+            [[nodiscard]] std::uint32_t FileId(std::string_view dir, std::string_view name)
+            {
+                std::filesystem::path path(name);
+                if (!dir.empty() && path.is_relative())
+                    path = std::filesystem::path(dir) / path;
+                std::string str = path.lexically_normal().generic_string();
+
+                auto [iter, is_new] = file_ids.try_emplace(std::move(str), std::uint32_t(file_names.size()));
+                if (is_new)
+                    file_names.push_back(iter->first);
+                return iter->second;
+            }
+
+            // Parses `.debug_line`, versions 2 to 5. `line_strings` and `strings` are `.debug_line_str` and `.debug_str` respectively, which the version 5 can refer to.
+            void ParseLineTables(std::string_view data, std::string_view line_strings, std::string_view strings, Module &module)
+            {
+                Cursor units{reinterpret_cast<const unsigned char *>(data.data()), reinterpret_cast<const unsigned char *>(data.data() + data.size())};
+                while (units.ok && units.cur < units.end)
+                {
+                    Cursor c = units;
+                    std::uint64_t unit_length = c.Read<std::uint32_t>();
+                    bool is_64bit = unit_length == 0xffffffff;
+                    if (is_64bit)
+                        unit_length = c.Read<std::uint64_t>();
+                    if (!c.ok || unit_length > std::uint64_t(c.end - c.cur))
+                        return;
+                    c.end = c.cur + unit_length;
+                    units.cur = c.end;
+
+                    auto version = c.Read<std::uint16_t>();
+                    if (version < 2 || version > 5)
+                        continue;
+                    std::uint8_t address_size = sizeof(void *);
+                    if (version >= 5)
+                    {
+                        address_size = c.Read<std::uint8_t>();
+                        (void)c.Read<std::uint8_t>(); // Segment selector size.
+                    }
+                    std::uint64_t header_length = is_64bit ? c.Read<std::uint64_t>() : c.Read<std::uint32_t>();
+                    if (!c.ok || header_length > std::uint64_t(c.end - c.cur))
+                        continue;
+                    const unsigned char *program = c.cur + header_length;
+
+                    auto min_instruction_length = c.Read<std::uint8_t>();
+                    if (version >= 4)
+                        (void)c.Read<std::uint8_t>(); // Max operations per instruction, only matters for VLIW.
+                    (void)c.Read<std::uint8_t>(); // Default `is_stmt`.
+                    (void)c.Read<std::int8_t>(); // Line base.
+                    auto line_range = c.Read<std::uint8_t>();
+                    auto opcode_base = c.Read<std::uint8_t>();
+                    if (!c.ok || line_range == 0 || opcode_base == 0)
+                        continue;
+                    std::vector<std::uint8_t> opcode_lengths(opcode_base - 1);
+                    for (std::uint8_t &length : opcode_lengths)
+                        length = c.Read<std::uint8_t>();
+
+                    // The directories, and the global IDs of the files of this unit.
+                    std::vector<std::string_view> dirs;
+                    std::vector<std::uint32_t> files;
+                    if (version < 5)
+                    {
+                        // The directory 0 is the compilation directory, which is only known from `.debug_info`. Leaving the paths relative to it.
+                        dirs.push_back({});
+                        while (true)
+                        {
+                            std::string_view dir = c.ReadString();
+                            if (!c.ok || dir.empty())
+                                break;
+                            dirs.push_back(dir);
+                        }
+                        files.push_back(no_file); // The files are numbered from 1.
+                        while (true)
+                        {
+                            std::string_view name = c.ReadString();
+                            if (!c.ok || name.empty())
+                                break;
+                            std::uint64_t dir = c.ReadUleb();
+                            (void)c.ReadUleb(); // Modification time.
+                            (void)c.ReadUleb(); // Size.
+                            files.push_back(FileId(dir < dirs.size() ? dirs[dir] : std::string_view{}, name));
+                        }
+                    }
+                    else
+                    {
+                        // Calls `func(path, dir_index)` for each entry. Returns false on failure.
+                        auto ReadEntries = [&](auto &&func) -> bool
+                        {
+                            std::vector<std::pair<std::uint64_t, std::uint64_t>> formats; // Content type and form.
+                            formats.resize(c.Read<std::uint8_t>());
+                            for (auto &[type, form] : formats)
+                            {
+                                type = c.ReadUleb();
+                                form = c.ReadUleb();
+                            }
+                            std::uint64_t count = c.ReadUleb();
+                            for (std::uint64_t i = 0; i < count && c.ok; i++)
+                            {
+                                std::string_view path;
+                                std::uint64_t dir = 0;
+                                for (auto [type, form] : formats)
+                                {
+                                    std::string_view str;
+                                    std::uint64_t num = 0;
+                                    switch (form)
+                                    {
+                                      case 0x08: // DW_FORM_string
+                                        str = c.ReadString();
+                                        break;
+                                      case 0x1f: // DW_FORM_line_strp
+                                      case 0x0e: // DW_FORM_strp
+                                        {
+                                            std::string_view table = form == 0x1f ? line_strings : strings;
+                                            std::uint64_t offset = is_64bit ? c.Read<std::uint64_t>() : c.Read<std::uint32_t>();
+                                            if (offset < table.size())
+                                                str = table.substr(offset, table.find('\0', offset) - offset);
+                                        }
+                                        break;
+                                      case 0x0f: num = c.ReadUleb(); break; // DW_FORM_udata
+                                      case 0x0b: num = c.Read<std::uint8_t>(); break; // DW_FORM_data1
+                                      case 0x05: num = c.Read<std::uint16_t>(); break; // DW_FORM_data2
+                                      case 0x06: num = c.Read<std::uint32_t>(); break; // DW_FORM_data4
+                                      case 0x07: num = c.Read<std::uint64_t>(); break; // DW_FORM_data8
+                                      case 0x1e: c.Skip(16); break; // DW_FORM_data16
+                                      case 0x09: c.Skip(c.ReadUleb()); break; // DW_FORM_block
+                                      default:
+                                        return false;
+                                    }
+                                    if (type == 1) // DW_LNCT_path
+                                        path = str;
+                                    else if (type == 2) // DW_LNCT_directory_index
+                                        dir = num;
+                                }
+                                func(path, dir);
+                            }
+                            return c.ok;
+                        };
+
+                        if (!ReadEntries([&](std::string_view path, std::uint64_t dir){(void)dir; dirs.push_back(path);}))
+                            continue;
+                        if (!ReadEntries([&](std::string_view path, std::uint64_t dir){files.push_back(FileId(dir < dirs.size() ? dirs[dir] : std::string_view{}, path));}))
+                            continue;
+                    }
+                    if (!c.ok || program > c.end)
+                        continue;
+
+                    // Run the line number program. We only need the addresses and the files, so the rest of the state machine is ignored.
+                    c.cur = program;
+                    std::uintptr_t address = 0;
+                    std::uint64_t file = 1;
+                    bool skip_sequence = false; // The sequences at address 0 are from the functions that the linker discarded.
+                    std::uint32_t last_file = no_file; // The file of the last row in this sequence. We skip the rows that don't change it.
+                    auto AddRow = [&]
+                    {
+                        std::uint32_t id = file < files.size() ? files[file] : no_file;
+                        if (skip_sequence || id == last_file)
+                            return;
+                        module.rows.push_back({.addr = address, .file = id});
+                        last_file = id;
+                    };
+                    while (c.ok && c.cur < c.end)
+                    {
+                        auto opcode = c.Read<std::uint8_t>();
+                        if (opcode >= opcode_base)
+                        {
+                            // A special opcode.
+                            address += std::uintptr_t((opcode - opcode_base) / line_range * min_instruction_length);
+                            AddRow();
+                            continue;
+                        }
+                        switch (opcode)
+                        {
+                          case 0: // An extended opcode.
+                            {
+                                std::uint64_t length = c.ReadUleb();
+                                if (!c.ok || length == 0 || length > std::uint64_t(c.end - c.cur))
+                                {
+                                    c.ok = false;
+                                    break;
+                                }
+                                const unsigned char *next = c.cur + length;
+                                auto extended_opcode = c.Read<std::uint8_t>();
+                                if (extended_opcode == 1) // DW_LNE_end_sequence
+                                {
+                                    if (!skip_sequence)
+                                        module.rows.push_back({.addr = address, .file = no_file});
+                                    address = 0;
+                                    file = 1;
+                                    skip_sequence = false;
+                                    last_file = no_file;
+                                }
+                                else if (extended_opcode == 2) // DW_LNE_set_address
+                                {
+                                    address = address_size == 8 ? std::uintptr_t(c.Read<std::uint64_t>()) : std::uintptr_t(c.Read<std::uint32_t>());
+                                    skip_sequence = address == 0;
+                                }
+                                c.cur = next;
+                            }
+                            break;
+                          case 1: // DW_LNS_copy
+                            AddRow();
+                            break;
+                          case 2: // DW_LNS_advance_pc
+                            address += std::uintptr_t(c.ReadUleb() * min_instruction_length);
+                            break;
+                          case 3: // DW_LNS_advance_line
+                            (void)c.ReadSleb();
+                            break;
+                          case 4: // DW_LNS_set_file
+                            file = c.ReadUleb();
+                            break;
+                          case 8: // DW_LNS_const_add_pc
+                            address += std::uintptr_t((255 - opcode_base) / line_range * min_instruction_length);
+                            break;
+                          case 9: // DW_LNS_fixed_advance_pc
+                            address += c.Read<std::uint16_t>();
+                            break;
+                          default:
+                            // The rest only have ULEB arguments, and we can skip them without knowing what they are.
+                            for (std::uint8_t i = 0; i < opcode_lengths[opcode - 1]; i++)
+                                (void)c.ReadUleb();
+                            break;
+                        }
+                    }
+                }
+            }
+
+            // Returns false if the file can't be opened.
+            bool ReadModule(const char *path, Module &module)
+            {
+                ElfReader elf;
+                if (!elf.Open(path))
+                    return false;
+                module.is_absolute = elf.header.e_type == ET_EXEC;
+
+                std::string data, line_strings, strings;
+                const ElfW(Shdr) *section = elf.FindSection(".debug_line");
+                if (!section || !elf.ReadSection(*section, data))
+                    return true;
+                if (const ElfW(Shdr) *s = elf.FindSection(".debug_line_str"); s && !elf.ReadSection(*s, line_strings))
+                    line_strings.clear();
+                if (const ElfW(Shdr) *s = elf.FindSection(".debug_str"); s && !elf.ReadSection(*s, strings))
+                    strings.clear();
+
+                ParseLineTables(data, line_strings, strings, module);
+                // End markers go first, in case the next sequence starts at the same address.
+                std::sort(module.rows.begin(), module.rows.end(), [](const Row &a, const Row &b){return a.addr != b.addr ? a.addr < b.addr : (a.file != no_file) < (b.file != no_file);});
+                return true;
+            }
+
+            [[nodiscard]] Module &GetModule(const char *path)
+            {
+                auto it = modules.find(std::string_view(path));
+                if (it != modules.end())
+                    return it->second;
+
+                Module &module = modules[path];
+                // `dladdr()` reports the executable under the name it was started with, which may be relative to a different directory.
+                if (!ReadModule(path, module))
+                    ReadModule("/proc/self/exe", module);
+                return module;
+            }
+
+          public:
+            // Returns the source files of this function. Empty if unknown.
+            [[nodiscard]] const std::vector<std::string_view> &operator()(void *func)
+            {
+                auto [cache_iter, is_new] = cache.try_emplace(reinterpret_cast<std::uintptr_t>(func));
+                std::vector<std::string_view> &ret = cache_iter->second;
+                if (!is_new)
+                    return ret;
+
+                Dl_info info{};
+                if (!dladdr(func, &info) || !info.dli_fname)
+                    return ret;
+                const Module &module = GetModule(info.dli_fname);
+
+                // The symbol size tells us where the function ends. If it's unknown, only look at the first instruction.
+                const Symbolizer::Symbol &symbol = GetSymbolizer()(reinterpret_cast<std::uintptr_t>(func));
+                std::uintptr_t start = reinterpret_cast<std::uintptr_t>(func);
+                std::uintptr_t end = symbol.start == start && symbol.size > 0 ? start + symbol.size : start + 1;
+                if (!module.is_absolute)
+                {
+                    std::uintptr_t base = reinterpret_cast<std::uintptr_t>(info.dli_fbase);
+                    start -= base;
+                    end -= base;
+                }
+
+                // The row that covers the start of the function, followed by all rows inside of it.
+                auto iter = std::upper_bound(module.rows.begin(), module.rows.end(), start, [](std::uintptr_t a, const Row &b){return a < b.addr;});
+                if (iter != module.rows.begin())
+                    --iter;
+                std::vector<std::uint32_t> ids;
+                for (; iter != module.rows.end() && iter->addr < end; ++iter)
+                {
+                    if (iter->file != no_file)
+                        ids.push_back(iter->file);
+                }
+                std::sort(ids.begin(), ids.end());
+                ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+                for (std::uint32_t id : ids)
+                    ret.push_back(file_names[id]);
+                return ret;
+            }
+        };
+        #endif
+
+        // Stores the current exception as a list of `ExceptionInfo`s.
+        class ExceptionChain
+        {
+            std::vector<Demangler> demanglers; // This keeps the type names alive.
+            std::vector<ExceptionInfo> elems;
+
+          public:
+            ExceptionChain() {}
+
+            #if EM_MINITEST_EXCEPTIONS
+            // Call this in a `catch` block. The messages point into the exception object, so this must not outlive the `catch` block.
+            [[nodiscard]] static ExceptionChain FromCurrentException();
+            #endif
+
+            [[nodiscard]] std::span<const ExceptionInfo> view() const
+            {
+                return elems;
+            }
+        };
+
+        #if EM_MINITEST_EXCEPTIONS
+        // Calls `on_element` for the current exception and each nested exception. Always calls it at least once.
+        // If the callback returns true, stops the function and also returns true.
+        // The last call can receive an unknown exception, then you'll receive `type_name == ""` and `message == nullptr`.
+        // The type is passed as a string because we can't get the current `std::type_index` for nested exception (the current type, not the nested one).
+        // The demangler is passed in case you want to move it somewhere to prevent `type_name` from getting invalidated in the future.
+        static bool AnalyzeCurrentException(FuncRef<bool(Demangler &&demangler, std::string_view type_name, const char *message)> on_element)
+        {
+            try
+            {
+                throw;
+            }
+            catch (std::exception &e)
+            {
+                Demangler d;
+                std::string_view type_name = d(typeid(e).name());
+
+                #define DETAIL_EM_MINITEST_EAT_PREFIX(prefix) \
+                    if (type_name.starts_with(prefix)) \
+                    { \
+                        type_name.remove_prefix(sizeof(prefix) - 1); /* Minus the null terminator. Here we also trim the `<` which is included in the `prefix`. */ \
+                        type_name.remove_suffix(1); /* Remove the `>`. */ \
+                    }
+
+                #ifdef _MSC_VER // MSVC or Clang in MSVC-compatible mode.
+                #define DETAIL_EM_MINITEST_STRUCT_PREFIX "struct "
+                #else
+                #define DETAIL_EM_MINITEST_STRUCT_PREFIX
+                #endif
+
+                #if defined(_GLIBCXX_RELEASE)
+                DETAIL_EM_MINITEST_EAT_PREFIX("std::_Nested_exception<") // This never gets used in MSVC-compatible mode anyway.
+                #elif defined(_LIBCPP_VERSION)
+                DETAIL_EM_MINITEST_EAT_PREFIX(DETAIL_EM_MINITEST_STRUCT_PREFIX "std::__nested<")
+                #elif defined(_MSVC_STL_VERSION)
+                DETAIL_EM_MINITEST_EAT_PREFIX(DETAIL_EM_MINITEST_STRUCT_PREFIX "std::_With_nested_v2<")
+                #endif
+                #undef DETAIL_EM_MINITEST_EAT_PREFIX
+                #undef DETAIL_EM_MINITEST_STRUCT_PREFIX
+
+                DETAIL_EM_MINITEST_PROBE3(exception, type_name.data(), type_name.size(), e.what());
+
+                if (on_element(std::move(d), type_name, e.what()))
+                    return true;
+
+                try
+                {
+                    std::rethrow_if_nested(e);
+                }
+                catch (...)
+                {
+                    AnalyzeCurrentException(on_element);
+                }
+            }
+            catch (...)
+            {
+                DETAIL_EM_MINITEST_PROBE3(exception, (const char *)nullptr, std::size_t(0), (const char *)nullptr);
+                return on_element(Demangler{}, {}, nullptr);
+            }
+
+            return false;
+        }
+
+        ExceptionChain ExceptionChain::FromCurrentException()
+        {
+            ExceptionChain ret;
+            AnalyzeCurrentException([&](Demangler &&demangler, std::string_view type_name, const char *message)
+            {
+                // Moving a demangler doesn't move its buffer, so `type_name` stays valid.
+                ret.demanglers.push_back(std::move(demangler));
+                ret.elems.push_back({.type = type_name, .message = message ? std::string_view(message) : std::string_view{}});
+                return false;
+            });
+            return ret;
+        }
+
+        // Don't call this directly, use `DETAIL_EM_MINITEST_RUN_WITH_CATCH()`.
+        // Runs the lambda once. If it doesn't throw, returns its return value.
+        // If the lambda throws `InterruptTestException`, either rethrows it if `rethrow_interrupt`, or returns false otherwise.
+        // If the lambda throws something else, calls `on_failure()` and returns false.
+        // You must manually fail the test in `on_failure`, manually print the exception if needed, and manually throw `InterruptTestException` if needed.
+        static bool RunWithCatchImpl(bool rethrow_interrupt, FuncRef<bool()> func, FuncRef<void()> on_failure)
+        {
+            // Run the test with exception catching.
+            try
+            {
+                return func();
+            }
+            catch (InterruptTestException)
+            {
+                if (rethrow_interrupt)
+                    throw;
+                else
+                    return false;
+            }
+            catch (...)
+            {
+                on_failure();
+                return false;
+            }
+        }
+        #define DETAIL_EM_MINITEST_RUN_WITH_CATCH detail::RunWithCatchImpl // No `(...)` allow debug info in the lambda.
+        #else
+        #define DETAIL_EM_MINITEST_RUN_WITH_CATCH(rethrow_interrupt_, func_, .../*on_failure*/) (func_)()
+        #endif
+
+        bool Assert(bool stop_on_failure, const char *file, int line, const char *expr_str, FuncRef<bool()> func)
+        {
+            #if EM_MINITEST_EXCEPTIONS
+            bool got_exception = false;
+            #endif
+
+            auto FailAssert = [&]
+            {
+                *fail_test_ptr = true;
+                // It should be impossible for this to be called twice, so there is no guard.
+
+                DETAIL_EM_MINITEST_PROBE3(assertion_failure, file, line, expr_str);
+
+                if (HaveListeners())
+                {
+                    #if EM_MINITEST_EXCEPTIONS
+                    ExceptionChain chain = got_exception ? ExceptionChain::FromCurrentException() : ExceptionChain{};
+                    #else
+                    ExceptionChain chain;
+                    #endif
+                    ReportFailure({.kind = FailureKind::assertion, .file = file, .line = line, .expr = expr_str, .exceptions = chain.view()});
+                }
+
+                #if EM_MINITEST_EXCEPTIONS
+                if (stop_on_failure)
+                    throw InterruptTestException{};
+                #else
+                (void)stop_on_failure;
+                #endif
+            };
+
+            bool ret = DETAIL_EM_MINITEST_RUN_WITH_CATCH(true, func, [&]
+            {
+                got_exception = true;
+                FailAssert(); // This can't be deduplicated with the one below, because this one is in a `catch`, and rethrows the current exception to analyze it.
+            });
+
+            if (!ret
+                #if EM_MINITEST_EXCEPTIONS
+                && !got_exception
+                #endif
+            )
+            {
+                FailAssert();
+            }
+
+            return ret;
+        }
+
+        #if EM_MINITEST_EXCEPTIONS
+        bool Try(bool stop_on_failure, const char *file, int line, const char *expr_str, FuncRef<void()> func)
+        {
+            return DETAIL_EM_MINITEST_RUN_WITH_CATCH(true, [&]{func(); return false;/*The result is ignored here.*/}, [&]
+            {
+                *fail_test_ptr = true;
+                // It should be impossible for this to be called twice, so there is no guard.
+
+                DETAIL_EM_MINITEST_PROBE3(unexpected_exception, file, line, expr_str);
+
+                if (HaveListeners())
+                {
+                    ExceptionChain chain = ExceptionChain::FromCurrentException();
+                    ReportFailure({.kind = FailureKind::unexpected_exception, .file = file, .line = line, .expr = expr_str, .exceptions = chain.view()});
+                }
+
+                if (stop_on_failure)
+                    throw InterruptTestException{};
+            });
+        }
+
+        void MustThrow::operator~()
+        {
+            static constexpr std::size_t max_num_caught_exceptions = 128;
+
+            DETAIL_EM_MINITEST_PROBE3(must_throw_start, file, line, expr_str);
+            struct ProbeGuard
+            {
+                const MustThrow &self;
+                bool passed = true;
+
+                ~ProbeGuard()
+                {
+                    DETAIL_EM_MINITEST_PROBE3(must_throw_end, self.file, self.line, int(passed));
+                }
+            };
+            ProbeGuard probe_guard{*this};
+
+            Arg caught_exceptions[max_num_caught_exceptions];
+            std::size_t num_caught_exceptions = 0;
+
+            // How many desired exceptions were provided by the user.
+            const std::size_t num_expected_exceptions = std::size_t(args.end() - args.begin());
+
+            bool have_mismatch = false;
+
+            // The messages in `caught_exceptions` point into the exception object, so we must keep it alive after the `catch` block.
+            std::exception_ptr caught_exception;
+
+            bool ran_without_exceptions = DETAIL_EM_MINITEST_RUN_WITH_CATCH(
+                true,
+                [&]{body(); return true;},
+                [&]
+                {
+                    caught_exception = std::current_exception();
+                    AnalyzeCurrentException([&](Demangler &&demangler, std::string_view type_name, const char *message)
+                    {
+                        if (num_caught_exceptions == max_num_caught_exceptions)
+                            InternalError("Too deeply nested exception caught in `EM_MUST_THROW()`.");
+
+                        Arg &this_ex = caught_exceptions[num_caught_exceptions];
+                        this_ex.demangler = std::move(demangler);
+                        this_ex.type = type_name;
+                        this_ex.message = message ? message : ""; // Need this for unknown exceptions.
+
+                        // Check against the user-provided types.
+                        if (num_expected_exceptions != 0)
+                        {
+                            // Only check if we don't have more caught exceptions than expected.
+                            // We don't set `have_mismatch = true;` in this case yet, because we compare the exception count
+                            //   after looping over all the exceptions anyway (to catch the opposite situation, when the code throws
+                            //   less exceptions than expected), so it makes no sense to check it here.
+                            if (num_caught_exceptions < num_expected_exceptions)
+                            {
+                                const Arg &expected_exception = args.begin()[num_caught_exceptions];
+
+                                if (
+                                    this_ex.type != expected_exception.type ||
+                                    this_ex.message != expected_exception.message
+                                )
+                                {
+                                    // Don't stop analyzing the exception, the listeners want the whole chain.
+                                    have_mismatch = true;
+                                }
+                            }
+                        }
+
+                        num_caught_exceptions++;
+
+                        return false;
+                    });
+                }
+            );
+
+            auto FailCheck = [&](FailureKind kind)
+            {
+                *fail_test_ptr = true;
+                probe_guard.passed = false;
+
+                if (!HaveListeners())
+                    return;
+
+                std::vector<ExceptionInfo> caught_infos;
+                for (std::size_t i = 0; i < num_caught_exceptions; i++)
+                    caught_infos.push_back({.type = caught_exceptions[i].type, .message = caught_exceptions[i].message});
+                std::vector<ExceptionInfo> expected_infos;
+                for (const Arg &arg : args)
+                    expected_infos.push_back({.type = arg.type, .message = arg.message});
+
+                ReportFailure({.kind = kind, .file = file, .line = line, .expr = expr_str, .exceptions = caught_infos, .expected_exceptions = expected_infos});
+            };
+
+            // Fail if we didn't have any exceptions at all.
+            if (ran_without_exceptions)
+            {
+                FailCheck(FailureKind::missing_exception);
+                #if EM_MINITEST_EXCEPTIONS
+                if (stop_on_failure)
+                    throw InterruptTestException{};
+                #endif
+                return;
+            }
+
+            // If user didn't provide any exceptions to check against, stop now.
+            if (num_expected_exceptions == 0)
+                return;
+
+            // Check that the number of exceptions matches our expectations.
+            if (num_caught_exceptions != num_expected_exceptions)
+                have_mismatch = true;
+
+            // On an exact match, do nothing.
+            if (!have_mismatch)
+                return;
+
+            FailCheck(FailureKind::incorrect_exception);
+
+            #if EM_MINITEST_EXCEPTIONS
+            if (stop_on_failure)
+                throw InterruptTestException{};
+            #endif
+        }
+        #endif
+
+        // If `arg` is `name=value`, writes the `value` part to `value` and returns true. Otherwise returns false.
+        // If `arg` comes from `argv`, then `value` is null-terminated.
+        [[nodiscard]] static bool ParseFlagWithValue(std::string_view arg, std::string_view name, std::string_view &value)
+        {
+            if (!arg.starts_with(name) || arg.size() <= name.size() || arg[name.size()] != '=')
+                return false;
+            value = arg.substr(name.size() + 1);
+            return true;
+        }
+
+        // Parses a non-negative integer. Returns false if it's invalid or has junk after it.
+        template <std::integral T>
+        [[nodiscard]] static bool ParseNonNegative(std::string_view str, T &value)
+        {
+            T result{};
+            auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), result);
+            if (ec != std::errc{} || ptr != str.data() + str.size())
+                return false;
+            if constexpr (std::is_signed_v<T>)
+            {
+                if (result < 0)
+                    return false;
+            }
+            value = result;
+            return true;
+        }
+
+        // Parses a duration like `30s`, `500ms` or `2m` into milliseconds. A number without a suffix is in seconds. Returns false if it's invalid.
+        [[nodiscard]] static bool ParseDurationMs(std::string_view str, int &value)
+        {
+            int multiplier = 1000;
+            if (str.ends_with("ms"))
+            {
+                multiplier = 1;
+                str.remove_suffix(2);
+            }
+            else if (str.ends_with('s'))
+            {
+                str.remove_suffix(1);
+            }
+            else if (str.ends_with('m'))
+            {
+                multiplier = 60000;
+                str.remove_suffix(1);
+            }
+
+            int number = 0;
+            if (!ParseNonNegative(str, number) || number > std::numeric_limits<int>::max() / multiplier)
+                return false;
+            value = number * multiplier;
+            return true;
+        }
+
+        // Identifies a test in the files we write, as `file:line:name`.
+        [[nodiscard]] static std::string TestId(const TestDesc &desc)
+        {
+            std::string ret(desc.file);
+            ret += ':';
+            ret += std::to_string(desc.line);
+            ret += ':';
+            ret += desc.name;
+            return ret;
+        }
+
+        // Appends `str` to `out`, escaping it for use in XML text and attributes.
+        static void AppendXmlEscaped(std::string &out, std::string_view str)
+        {
+            for (char ch : str)
+            {
+                switch (ch)
+                {
+                    case '&':  out += "&amp;"; break;
+                    case '<':  out += "&lt;"; break;
+                    case '>':  out += "&gt;"; break;
+                    case '"':  out += "&quot;"; break;
+                    case '\'': out += "&apos;"; break;
+                    default:
+                        // XML 1.0 doesn't allow most control characters at all, even escaped.
+                        if ((unsigned char)ch < 0x20 && ch != '\t' && ch != '\n' && ch != '\r')
+                            out += '?';
+                        else
+                            out += ch;
+                        break;
+                }
+            }
+        }
+
+        // Appends `str` to `out` as a quoted JSON string.
+        static void AppendJsonString(std::string &out, std::string_view str)
+        {
+            out += '"';
+            for (char ch : str)
+            {
+                switch (ch)
+                {
+                    case '"':  out += "\\\""; break;
+                    case '\\': out += "\\\\"; break;
+                    case '\n': out += "\\n"; break;
+                    case '\r': out += "\\r"; break;
+                    case '\t': out += "\\t"; break;
+                    default:
+                        if ((unsigned char)ch < 0x20)
+                        {
+                            char buf[7];
+                            std::snprintf(buf, sizeof buf, "\\u%04x", (unsigned)ch);
+                            out += buf;
+                        }
+                        else
+                        {
+                            out += ch;
+                        }
+                        break;
+                }
+            }
+            out += '"';
+        }
+
+        // Appends a human-readable description of an exception chain to `out`, one line per type and per message line.
+        static void AppendExceptionChainText(std::string &out, std::span<const ExceptionInfo> chain, std::string_view indent)
+        {
+            for (const ExceptionInfo &ex : chain)
+            {
+                out += indent;
+                if (ex.type.empty())
+                {
+                    out += "Unknown exception.\n";
+                    continue;
+                }
+                out += ex.type;
+                out += '\n';
+                SplitString(ex.message, "\n", [&](std::string_view line)
+                {
+                    out += indent;
+                    out += "    ";
+                    out += line;
+                    out += '\n';
+                    return false;
+                });
+            }
+        }
+
+        // Appends a one-line summary of a failure to `out`.
+        static void AppendFailureSummary(std::string &out, const FailureInfo &info)
+        {
+            switch (info.kind)
+            {
+                case FailureKind::assertion:            out += "Assertion failed"; break;
+                case FailureKind::unexpected_exception: out += "Unexpected exception"; break;
+                case FailureKind::missing_exception:    out += "Missing exception"; break;
+                case FailureKind::incorrect_exception:  out += "Incorrect exception"; break;
+                case FailureKind::uncaught_exception:   out += "Uncaught exception"; break;
+                case FailureKind::crashed:              out += "Crashed"; break;
+            }
+            out += " at: ";
+            out += info.file;
+            out += ':';
+            out += std::to_string(info.line);
+        }
+
+        // Appends a multiline human-readable description of a failure to `out`. This roughly matches the console output.
+        static void AppendFailureText(std::string &out, const FailureInfo &info)
+        {
+            AppendFailureSummary(out, info);
+            out += '\n';
+
+            if (info.expr)
+            {
+                out += "    Expression: ";
+                out += info.expr;
+                out += '\n';
+            }
+
+            switch (info.kind)
+            {
+              case FailureKind::assertion:
+                if (info.exceptions.empty())
+                {
+                    out += "    Evaluated to false.\n";
+                    break;
+                }
+                [[fallthrough]];
+              case FailureKind::unexpected_exception:
+                out += "    Threw an uncaught exception:\n";
+                AppendExceptionChainText(out, info.exceptions, "        ");
+                break;
+              case FailureKind::missing_exception:
+                break;
+              case FailureKind::incorrect_exception:
+                out += "    Caught:\n";
+                AppendExceptionChainText(out, info.exceptions, "        ");
+                out += "    Expected:\n";
+                AppendExceptionChainText(out, info.expected_exceptions, "        ");
+                break;
+              case FailureKind::uncaught_exception:
+                AppendExceptionChainText(out, info.exceptions, "    ");
+                break;
+              case FailureKind::crashed:
+                out += "    Didn't finish in the interrupted run.\n";
+                break;
+            }
+
+            #if DETAIL_EM_MINITEST_HAVE_BACKTRACE
+            if (!info.stack.empty())
+            {
+                out += "    Stack:\n";
+                ForEachStackFrame(info.stack, [&](const std::string &name)
+                {
+                    out += "        ";
+                    out += name;
+                    out += '\n';
+                });
+            }
+            #endif
+        }
+
+        // Writes a JUnit XML report.
+        // To survive crashes, after every test we write the closing tags and flush, then seek back to overwrite them with the next test.
+        // The counters in `<testsuites>` and `<testsuite>` are rewritten the same way, in the space reserved for them in the opening tags.
+        // The retried attempts (see `RunOptions::retries`) aren't tests of their own. Their failures are written into the last attempt,
+        //   as `<flakyFailure>` if it passed or as `<rerunFailure>` if it failed, the same way Maven Surefire does it.
+        class JUnitReporter final : public Listener
+        {
+            std::FILE *file = nullptr;
+            std::string_view cur_file; // The test file of the currently open `<testsuite>`, if any.
+
+            struct Counters
+            {
+                std::size_t tests = 0;
+                std::size_t failures = 0;
+                std::size_t skipped = 0;
+                std::chrono::nanoseconds time{};
+                long pos = -1; // Where the attributes are in the file, or -1 if not written yet.
+            };
+            Counters run_counters;
+            Counters file_counters;
+
+            // How many bytes are reserved for the counter attributes. They are padded with spaces, which is allowed between the attributes.
+            static constexpr std::size_t counters_width = 112;
+
+            // The failures of the current test.
+            std::string failure_type;
+            std::string failure_summary;
+            std::string failure_text;
+
+            // The failures of the retried attempts of the current test.
+            struct RetryFailure
+            {
+                std::string type;
+                std::string summary;
+                std::string text;
+            };
+            std::vector<RetryFailure> retry_failures;
+
+            std::string buffer;
+
+            JUnitReporter() {}
+
+            void AppendFailureElement(std::string_view element, std::string_view type, std::string_view summary, std::string_view text)
+            {
+                buffer += "      <";
+                buffer += element;
+                buffer += " type=\"";
+                AppendXmlEscaped(buffer, type.empty() ? "failure" : type);
+                buffer += "\" message=\"";
+                AppendXmlEscaped(buffer, summary);
+                buffer += "\">";
+                AppendXmlEscaped(buffer, text);
+                buffer += "</";
+                buffer += element;
+                buffer += ">\n";
+            }
+
+            // Appends the placeholder for the counters to `buffer`, and remembers where it will be in the file.
+            void AppendCountersPlaceholder(Counters &counters)
+            {
+                counters.pos = std::ftell(file) + long(buffer.size());
+                buffer.append(counters_width, ' ');
+            }
+
+            // Overwrites the placeholder of the counters in the file. Then returns to where we were.
+            void WriteCounters(const Counters &counters)
+            {
+                if (counters.pos < 0)
+                    return;
+                char attrs[counters_width + 1];
+                int len = std::snprintf(attrs, sizeof attrs, " tests=\"%zu\" failures=\"%zu\" errors=\"0\" skipped=\"%zu\" time=\"%.6f\"",
+                    counters.tests, counters.failures, counters.skipped, std::chrono::duration<double>(counters.time).count()
+                );
+                std::size_t size = std::min(std::size_t(std::max(len, 0)), counters_width);
+                std::fill(attrs + size, attrs + counters_width, ' ');
+
+                long end = std::ftell(file);
+                std::fseek(file, counters.pos, SEEK_SET);
+                std::fwrite(attrs, 1, counters_width, file);
+                std::fseek(file, end, SEEK_SET);
+            }
+
+            // Writes `buffer`, then writes the closing tags, updates the counters and flushes. The next write then overwrites the closing tags.
+            // This relies on every write being at least as long as the closing tags, otherwise we would leave some garbage after them.
+            void Commit()
+            {
+                std::string_view tail = cur_file.empty() ? "</testsuites>\n" : "  </testsuite>\n</testsuites>\n";
+                buffer += tail;
+                std::fwrite(buffer.data(), 1, buffer.size(), file);
+                std::fseek(file, -(long)tail.size(), SEEK_CUR);
+                buffer.clear();
+                WriteCounters(run_counters);
+                WriteCounters(file_counters);
+                std::fflush(file);
+            }
+
+          public:
+            // Returns null if the file can't be opened.
+            [[nodiscard]] static std::unique_ptr<JUnitReporter> Open(const char *path)
+            {
+                std::unique_ptr<JUnitReporter> ret(new JUnitReporter);
+                ret->file = std::fopen(path, "wb");
+                if (!ret->file)
+                    return nullptr;
+                ret->buffer = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<testsuites name=\"minitest\"";
+                ret->AppendCountersPlaceholder(ret->run_counters);
+                ret->buffer += ">\n";
+                ret->Commit();
+                return ret;
+            }
+
+            JUnitReporter(const JUnitReporter &) = delete;
+            JUnitReporter &operator=(const JUnitReporter &) = delete;
+
+            ~JUnitReporter()
+            {
+                if (file)
+                    std::fclose(file);
+            }
+
+            void OnTestStart(const TestDesc &test) override
+            {
+                (void)test;
+                failure_type.clear();
+                failure_summary.clear();
+                failure_text.clear();
+            }
+
+            void OnFailure(const FailureInfo &info) override
+            {
+                // JUnit allows only one `<failure>` per test, so we take the type and summary from the first failure and join all the texts.
+                if (failure_type.empty())
+                {
+                    failure_type = FailureKindToString(info.kind);
+                    AppendFailureSummary(failure_summary, info);
+                }
+                AppendFailureText(failure_text, info);
+            }
+
+            void OnTestEnd(const TestDesc &test, const TestResult &result) override
+            {
+                if (result.will_retry)
+                {
+                    retry_failures.push_back({.type = std::move(failure_type), .summary = std::move(failure_summary), .text = std::move(failure_text)});
+                    return;
+                }
+
+                if (cur_file != test.file)
+                {
+                    if (!cur_file.empty())
+                        buffer += "  </testsuite>\n";
+                    cur_file = test.file;
+                    buffer += "  <testsuite name=\"";
+                    AppendXmlEscaped(buffer, test.file);
+                    buffer += '"';
+                    file_counters = {};
+                    AppendCountersPlaceholder(file_counters);
+                    buffer += ">\n";
+                }
+
+                for (Counters *counters : {&run_counters, &file_counters})
+                {
+                    counters->tests++;
+                    counters->failures += result.failed;
+                    counters->skipped += result.skipped;
+                    counters->time += result.duration;
+                }
+
+                buffer += "    <testcase classname=\"";
+                AppendXmlEscaped(buffer, test.file);
+                buffer += "\" name=\"";
+                AppendXmlEscaped(buffer, test.name);
+                buffer += "\" file=\"";
+                AppendXmlEscaped(buffer, test.file);
+                buffer += "\" line=\"";
+                buffer += std::to_string(test.line);
+                char time_buf[32];
+                std::snprintf(time_buf, sizeof time_buf, "%.6f", std::chrono::duration<double>(result.duration).count());
+                buffer += "\" time=\"";
+                buffer += time_buf;
+                buffer += '"';
+
+                std::vector<std::string_view> tags = GetTestTags(test);
+                if (!result.failed && !result.skipped && tags.empty() && retry_failures.empty())
+                {
+                    buffer += "/>\n";
+                }
+                else
+                {
+                    buffer += ">\n";
+                    if (!tags.empty())
+                    {
+                        // The same way pytest writes its properties.
+                        buffer += "      <properties>\n";
+                        for (std::string_view tag : tags)
+                        {
+                            buffer += "        <property name=\"tag\" value=\"";
+                            AppendXmlEscaped(buffer, tag);
+                            buffer += "\"/>\n";
+                        }
+                        buffer += "      </properties>\n";
+                    }
+                    if (result.failed)
+                        AppendFailureElement("failure", failure_type, failure_summary, failure_text);
+                    for (const RetryFailure &failure : retry_failures)
+                        AppendFailureElement(result.failed ? "rerunFailure" : "flakyFailure", failure.type, failure.summary, failure.text);
+                    if (result.skipped)
+                        buffer += "      <skipped message=\"A test it depends on failed or was skipped.\"/>\n";
+                    buffer += "    </testcase>\n";
+                }
+                retry_failures.clear();
+
+                Commit();
+            }
+
+            // No `OnRunEnd()`, the closing tags are already written by `Commit()`.
+        };
+
+        // Writes a JSON Lines report, one object per line: `run_start`, then one `test` per test, then `run_end`.
+        // Each line is flushed as soon as it's written, so the report stays usable if we crash.
+        // The retried attempts (see `RunOptions::retries`) get their own `test` lines with the `retry` status, which isn't a failure.
+        class JsonLinesReporter final : public Listener
+        {
+            std::FILE *file = nullptr;
+
+            std::string failures; // The JSON array elements for the failures of the current test, without the brackets.
+
+            std::string buffer;
+
+            JsonLinesReporter() {}
+
+            static void AppendExceptionChain(std::string &out, std::span<const ExceptionInfo> chain)
+            {
+                out += '[';
+                bool first = true;
+                for (const ExceptionInfo &ex : chain)
+                {
+                    if (!first)
+                        out += ',';
+                    first = false;
+
+                    // Unknown exceptions get nulls.
+                    out += "{\"type\":";
+                    if (ex.type.empty())
+                        out += "null";
+                    else
+                        AppendJsonString(out, ex.type);
+                    out += ",\"message\":";
+                    if (ex.type.empty())
+                        out += "null";
+                    else
+                        AppendJsonString(out, ex.message);
+                    out += '}';
+                }
+                out += ']';
+            }
+
+            void WriteLine()
+            {
+                buffer += '\n';
+                std::fwrite(buffer.data(), 1, buffer.size(), file);
+                std::fflush(file);
+                buffer.clear();
+            }
+
+          public:
+            // Returns null if the file can't be opened.
+            [[nodiscard]] static std::unique_ptr<JsonLinesReporter> Open(const char *path)
+            {
+                std::unique_ptr<JsonLinesReporter> ret(new JsonLinesReporter);
+                ret->file = std::fopen(path, "wb");
+                if (!ret->file)
+                    return nullptr;
+                return ret;
+            }
+
+            JsonLinesReporter(const JsonLinesReporter &) = delete;
+            JsonLinesReporter &operator=(const JsonLinesReporter &) = delete;
+
+            ~JsonLinesReporter()
+            {
+                if (file)
+                    std::fclose(file);
+            }
+
+            void OnRunStart(std::size_t num_tests) override
+            {
+                buffer += "{\"event\":\"run_start\",\"tests\":" + std::to_string(num_tests) + "}";
+                WriteLine();
+            }
+
+            void OnTestStart(const TestDesc &test) override
+            {
+                (void)test;
+                failures.clear();
+            }
+
+            void OnFailure(const FailureInfo &info) override
+            {
+                if (!failures.empty())
+                    failures += ',';
+                failures += "{\"kind\":\"";
+                failures += FailureKindToString(info.kind);
+                failures += "\",\"file\":";
+                AppendJsonString(failures, info.file);
+                failures += ",\"line\":";
+                failures += std::to_string(info.line);
+                if (info.expr)
+                {
+                    failures += ",\"expr\":";
+                    AppendJsonString(failures, info.expr);
+                }
+                if (!info.exceptions.empty())
+                {
+                    failures += ",\"exceptions\":";
+                    AppendExceptionChain(failures, info.exceptions);
+                }
+                if (!info.expected_exceptions.empty())
+                {
+                    failures += ",\"expected_exceptions\":";
+                    AppendExceptionChain(failures, info.expected_exceptions);
+                }
+                failures += '}';
+            }
+
+            void OnTestEnd(const TestDesc &test, const TestResult &result) override
+            {
+                buffer += "{\"event\":\"test\",\"file\":";
+                AppendJsonString(buffer, test.file);
+                buffer += ",\"line\":";
+                buffer += std::to_string(test.line);
+                buffer += ",\"name\":";
+                AppendJsonString(buffer, test.name);
+                buffer += ",\"tags\":[";
+                bool first_tag = true;
+                for (std::string_view tag : GetTestTags(test))
+                {
+                    if (!first_tag)
+                        buffer += ',';
+                    first_tag = false;
+                    AppendJsonString(buffer, tag);
+                }
+                buffer += "],\"status\":";
+                buffer += result.skipped ? "\"skip\"" : result.will_retry ? "\"retry\"" : result.failed ? "\"fail\"" : "\"pass\"";
+                char time_buf[32];
+                std::snprintf(time_buf, sizeof time_buf, "%.3f", std::chrono::duration<double, std::milli>(result.duration).count());
+                buffer += ",\"duration_ms\":";
+                buffer += time_buf;
+                buffer += ",\"failures\":[";
+                buffer += failures;
+                buffer += "]}";
+                WriteLine();
+            }
+
+            void OnRunEnd(const RunSummary &summary) override
+            {
+                buffer += "{\"event\":\"run_end\",\"tests\":" + std::to_string(summary.num_tests) + ",\"passed\":" + std::to_string(summary.num_tests - summary.num_failed) + ",\"failed\":" + std::to_string(summary.num_failed) + "}";
+                WriteLine();
+            }
+        };
+
+        // Writes the binary result log, see `binlog` for the format.
+        class BinaryLogWriter final : public Listener
+        {
+            std::FILE *file = nullptr;
+
+            // Maps the strings we've already written to their indices.
+            // We must own the strings, because the replayed failures (see `RunOptions::jobs` and `RunOptions::resume_path`) point into temporary storage.
+            std::map<std::string, std::uint32_t, std::less<>> string_indices;
+
+            binlog::ResultEntry cur_result;
+            std::uint32_t num_failures = 0;
+            std::string first_failure_file;
+            std::uint32_t first_failure_line = 0;
+
+            std::string buffer;
+
+            BinaryLogWriter() {}
+
+            void AppendBytes(const void *data, std::size_t size)
+            {
+                buffer.append(static_cast<const char *>(data), size);
+            }
+
+            // Returns the string index, writing the string to `buffer` if it's new.
+            std::uint32_t InternString(std::string_view str)
+            {
+                auto iter = string_indices.find(str);
+                if (iter == string_indices.end())
+                {
+                    iter = string_indices.emplace(std::string(str), std::uint32_t(string_indices.size())).first;
+                    binlog::StringEntry entry{.size = std::uint32_t(str.size())};
+                    AppendBytes(&entry, sizeof entry);
+                    AppendBytes(str.data(), str.size());
+                    buffer.append((8 - str.size() % 8) % 8, '\0');
+                }
+                return iter->second;
+            }
+
+          public:
+            // Returns null if the file can't be opened.
+            [[nodiscard]] static std::unique_ptr<BinaryLogWriter> Open(const char *path)
+            {
+                std::unique_ptr<BinaryLogWriter> ret(new BinaryLogWriter);
+                ret->file = std::fopen(path, "wb");
+                if (!ret->file)
+                    return nullptr;
+
+                binlog::FileHeader header{.version = binlog::current_version, .byte_order = binlog::byte_order_mark};
+                std::copy_n(binlog::magic, sizeof binlog::magic, header.magic);
+                std::fwrite(&header, sizeof header, 1, ret->file);
+                std::fflush(ret->file);
+                return ret;
+            }
+
+            BinaryLogWriter(const BinaryLogWriter &) = delete;
+            BinaryLogWriter &operator=(const BinaryLogWriter &) = delete;
+
+            ~BinaryLogWriter()
+            {
+                if (file)
+                    std::fclose(file);
+            }
+
+            void OnTestStart(const TestDesc &test) override
+            {
+                (void)test;
+                num_failures = 0;
+                first_failure_file.clear();
+                first_failure_line = 0;
+            }
+
+            void OnFailure(const FailureInfo &info) override
+            {
+                if (num_failures++ == 0)
+                {
+                    first_failure_file = info.file;
+                    first_failure_line = std::uint32_t(info.line);
+                }
+            }
+
+            void OnTestEnd(const TestDesc &test, const TestResult &result) override
+            {
+                binlog::ResultEntry entry{
+                    .status = result.skipped ? binlog::Status::skip : result.will_retry ? binlog::Status::retry : result.failed ? binlog::Status::fail : binlog::Status::pass,
+                    .file = InternString(test.file),
+                    .name = InternString(test.name),
+                    .line = std::uint32_t(test.line),
+                    .num_failures = num_failures,
+                    .first_failure_file = num_failures > 0 ? InternString(first_failure_file) : binlog::no_string,
+                    .first_failure_line = first_failure_line,
+                    .duration_ns = std::uint64_t(result.duration.count()),
+                    // Measured on the thread that ran the test, see `TestResult`. Zero for the tests that didn't run.
+                    .cpu_user_ns = std::uint64_t(result.cpu_user.count()),
+                    .cpu_system_ns = std::uint64_t(result.cpu_system.count()),
+                    .max_rss_kb = ResourceUsage::Now().max_rss_kb, // This is per process anyway.
+                };
+                AppendBytes(&entry, sizeof entry);
+
+                std::fwrite(buffer.data(), 1, buffer.size(), file);
+                std::fflush(file);
+                buffer.clear();
+            }
+        };
+
+        // One span in the trace.
+        struct TraceEvent
+        {
+            const char *name = nullptr; // Null-terminated, must live forever.
+            const char *category = nullptr;
+            const char *file = nullptr; // Optional.
+            int line = 0;
+            std::int64_t start_ns = 0; // Relative to `Tracer::origin`.
+            std::int64_t duration_ns = 0;
+            bool async = false; // This can overlap other spans on the same thread, so it's written as a pair of async events.
+        };
+
+        // Each thread appends to its own buffer without locking. We only lock to register a new thread.
+        struct TraceThreadBuffer
+        {
+            std::uint32_t thread_id = 0;
+            std::vector<TraceEvent> events;
+        };
+
+        class Tracer
+        {
+            std::mutex mutex; // Protects `buffers`.
+            // We never destroy those until the program exits, because the threads keep pointers to them in `cur_trace_buffer`.
+            std::vector<std::unique_ptr<TraceThreadBuffer>> buffers;
+
+          public:
+            std::atomic<bool> enabled = false;
+            std::chrono::steady_clock::time_point origin;
+
+            [[nodiscard]] std::int64_t Now() const
+            {
+                return std::chrono::duration_cast<std::chrono::nanoseconds>(RealNow() - origin).count();
+            }
+
+            // Returns the buffer for the current thread, creating it if needed.
+            [[nodiscard]] TraceThreadBuffer &ThisThreadBuffer()
+            {
+                static thread_local TraceThreadBuffer *cur_trace_buffer = nullptr;
+                if (!cur_trace_buffer)
+                {
+                    std::lock_guard lock(mutex);
+                    auto &buf = buffers.emplace_back(std::make_unique<TraceThreadBuffer>());
+                    buf->thread_id = std::uint32_t(buffers.size());
+                    buf->events.reserve(4096);
+                    cur_trace_buffer = buf.get();
+                }
+                return *cur_trace_buffer;
+            }
+
+            // Records the span of a test that ran on the current thread. Does nothing if not tracing, or if the runner of this thread doesn't trace.
+            // The spans of the async tests can overlap each other, so they're marked as such.
+            void AddTestSpan(const TestDesc &desc, bool failed, std::chrono::steady_clock::time_point start_time, std::chrono::steady_clock::time_point end_time, bool async)
+            {
+                if (!trace_test_spans || !enabled.load(std::memory_order_relaxed))
+                    return;
+                ThisThreadBuffer().events.push_back({
+                    .name = desc.name.data(),
+                    .category = failed ? "test,failed" : "test",
+                    .file = desc.file.data(),
+                    .line = desc.line,
+                    .start_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(start_time - origin).count(),
+                    .duration_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - start_time).count(),
+                    .async = async,
+                });
+            }
+
+            // Calls `func` for every thread buffer. Only call this while tracing is disabled.
+            void ForEachBuffer(auto &&func)
+            {
+                std::lock_guard lock(mutex);
+                for (const auto &buf : buffers)
+                    func(*buf);
+            }
+        };
+
+        [[nodiscard]] static Tracer &GetTracer()
+        {
+            static Tracer ret;
+            return ret;
+        }
+
+        // Enables `EM_TRACE_SCOPE()` and the test spans, and writes the trace to the file at the end of the run.
+        // The tests that actually run record their own spans on the threads that run them (see `Tracer::AddTestSpan()`), this only records the ones that didn't run.
+        class TraceWriter final : public Listener
+        {
+            std::FILE *file = nullptr;
+
+            std::string_view cur_file;
+            std::int64_t cur_file_start_ns = 0;
+            std::int64_t cur_test_start_ns = 0;
+
+            TraceWriter() {}
+
+            void FinishFileSpan()
+            {
+                if (cur_file.empty())
+                    return;
+                Tracer &tracer = GetTracer();
+                tracer.ThisThreadBuffer().events.push_back({.name = cur_file.data(), .category = "file", .start_ns = cur_file_start_ns, .duration_ns = tracer.Now() - cur_file_start_ns});
+            }
+
+          public:
+            // Returns null if the file can't be opened.
+            [[nodiscard]] static std::unique_ptr<TraceWriter> Open(const char *path)
+            {
+                std::unique_ptr<TraceWriter> ret(new TraceWriter);
+                ret->file = std::fopen(path, "wb");
+                if (!ret->file)
+                    return nullptr;
+                return ret;
+            }
+
+            TraceWriter(const TraceWriter &) = delete;
+            TraceWriter &operator=(const TraceWriter &) = delete;
+
+            ~TraceWriter()
+            {
+                GetTracer().enabled = false;
+                if (file)
+                    std::fclose(file);
+            }
+
+            void OnRunStart(std::size_t num_tests) override
+            {
+                (void)num_tests;
+                Tracer &tracer = GetTracer();
+                tracer.ForEachBuffer([](TraceThreadBuffer &buf){buf.events.clear();});
+                tracer.origin = RealNow();
+                tracer.enabled = true;
+            }
+
+            void OnFileStart(std::string_view new_file) override
+            {
+                FinishFileSpan();
+                cur_file = new_file;
+                cur_file_start_ns = GetTracer().Now();
+            }
+
+            void OnTestStart(const TestDesc &test) override
+            {
+                (void)test;
+                cur_test_start_ns = GetTracer().Now();
+            }
+
+            void OnTestEnd(const TestDesc &test, const TestResult &result) override
+            {
+                if (!result.skipped && !result.cached && !result.resumed)
+                    return; // This recorded its own span.
+
+                GetTracer().ThisThreadBuffer().events.push_back({
+                    .name = test.name.data(),
+                    .category = result.skipped ? "test,skipped" : result.failed ? "test,failed" : "test",
+                    .file = test.file.data(),
+                    .line = test.line,
+                    .start_ns = cur_test_start_ns,
+                    .duration_ns = result.duration.count(),
+                });
+            }
+
+            void OnRunEnd(const RunSummary &summary) override
+            {
+                (void)summary;
+                FinishFileSpan();
+
+                Tracer &tracer = GetTracer();
+                tracer.enabled = false;
+
+                std::string buffer = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+                bool first = true;
+                auto NextEvent = [&]
+                {
+                    if (!first)
+                        buffer += ",\n";
+                    first = false;
+                };
+                auto Flush = [&]
+                {
+                    std::fwrite(buffer.data(), 1, buffer.size(), file);
+                    buffer.clear();
+                };
+
+                std::size_t num_async_events = 0;
+                tracer.ForEachBuffer([&](const TraceThreadBuffer &buf)
+                {
+                    if (buf.events.empty())
+                        return;
+
+                    std::string tid = std::to_string(buf.thread_id);
+
+                    NextEvent();
+                    buffer += "{\"ph\":\"M\",\"pid\":1,\"tid\":" + tid + ",\"name\":\"thread_name\",\"args\":{\"name\":\"thread " + tid + "\"}}";
+
+                    for (const TraceEvent &e : buf.events)
+                    {
+                        char time_buf[64];
+                        std::snprintf(time_buf, sizeof time_buf, "\"ts\":%.3f,\"dur\":%.3f", double(e.start_ns) / 1000, double(e.duration_ns) / 1000);
+
+                        // The async spans are a begin event with the arguments, and an end event with the same ID.
+                        std::string async_id;
+                        if (e.async)
+                        {
+                            async_id = std::to_string(++num_async_events);
+                            std::snprintf(time_buf, sizeof time_buf, "\"ts\":%.3f", double(e.start_ns) / 1000);
+                        }
+
+                        NextEvent();
+                        buffer += e.async ? "{\"ph\":\"b\",\"id\":" + async_id + "," : std::string("{\"ph\":\"X\",");
+                        buffer += "\"pid\":1,\"tid\":" + tid + ",";
+                        buffer += time_buf;
+                        buffer += ",\"cat\":";
+                        AppendJsonString(buffer, e.category);
+                        buffer += ",\"name\":";
+                        AppendJsonString(buffer, e.name);
+                        if (e.file)
+                        {
+                            buffer += ",\"args\":{\"file\":";
+                            AppendJsonString(buffer, e.file);
+                            buffer += ",\"line\":" + std::to_string(e.line) + "}";
+                        }
+                        buffer += '}';
+
+                        if (e.async)
+                        {
+                            std::snprintf(time_buf, sizeof time_buf, "\"ts\":%.3f", double(e.start_ns + e.duration_ns) / 1000);
+                            NextEvent();
+                            buffer += "{\"ph\":\"e\",\"id\":" + async_id + ",\"pid\":1,\"tid\":" + tid + ",";
+                            buffer += time_buf;
+                            buffer += ",\"cat\":";
+                            AppendJsonString(buffer, e.category);
+                            buffer += ",\"name\":";
+                            AppendJsonString(buffer, e.name);
+                            buffer += '}';
+                        }
+
+                        if (buffer.size() > 1 << 16)
+                            Flush();
+                    }
+                });
+
+                buffer += "\n]}\n";
+                Flush();
+                std::fflush(file);
+            }
+        };
+
+        #if DETAIL_EM_MINITEST_HAVE_PROFILER
+        // The state shared between `SlowTestProfiler` and its signal handler.
+        struct ProfilerBuffer
+        {
+            static constexpr int max_depth = 64;
+
+            struct Sample
+            {
+                int depth = 0;
+                void *frames[max_depth]{};
+            };
+
+            std::vector<Sample> samples;
+            // The number of samples taken, can exceed `samples.size()` if we ran out of space.
+            std::atomic<std::size_t> num_samples = 0;
+        };
+        // The handler only writes to this while it's not null.
+        static std::atomic<ProfilerBuffer *> active_profiler_buffer = nullptr;
+        // How many signal handlers are currently running. They increment this before loading `active_profiler_buffer`,
+        //   so after resetting that pointer, waiting for this to reach zero guarantees that nobody writes to the old buffer anymore.
+        static std::atomic<int> num_profiler_writers = 0;
+
+        static void ProfilerSignalHandler(int)
+        {
+            int saved_errno = errno;
+            num_profiler_writers++;
+            if (ProfilerBuffer *buffer = active_profiler_buffer.load())
+            {
+                std::size_t i = buffer->num_samples++;
+                if (i < buffer->samples.size())
+                {
+                    ProfilerBuffer::Sample &sample = buffer->samples[i];
+                    sample.depth = backtrace(sample.frames, ProfilerBuffer::max_depth);
+                }
+            }
+            num_profiler_writers--;
+            errno = saved_errno;
+        }
+
+        // Stops the signal handlers from writing to the profiler buffer, and waits for the ones that are still running in other threads.
+        static void DeactivateProfilerBuffer()
+        {
+            active_profiler_buffer = nullptr;
+            while (num_profiler_writers.load() > 0)
+                std::this_thread::yield();
+        }
+
+        // Samples the call stacks with `SIGPROF` while each test runs, and reports the tests that took at least `threshold` time.
+        // Only the CPU time is sampled, so a test that just waits for something gets few samples.
+        class SlowTestProfiler final : public Listener
+        {
+            // The kernel can round this up to its tick length.
+            static constexpr int sampling_interval_us = 1000;
+            // The samples at the top of the stack, from the handler itself and the signal trampoline.
+            static constexpr int num_skipped_frames = 2;
+            static constexpr std::size_t num_top_functions = 10;
+
+            std::chrono::nanoseconds threshold{};
+            std::string dir;
+            bool print = false; // Otherwise only write the folded stacks.
+
+            ProfilerBuffer buffer;
+
+            struct sigaction old_action{};
+
+            SlowTestProfiler() {}
+
+            static void SetTimer(int interval_us)
+            {
+                itimerval timer{};
+                timer.it_interval.tv_usec = interval_us;
+                timer.it_value.tv_usec = interval_us;
+                setitimer(ITIMER_PROF, &timer, nullptr);
+            }
+
+            // Returns the file name for the folded stacks of this test.
+            [[nodiscard]] std::string FoldedStacksPath(const TestDesc &test) const
+            {
+                std::string name = std::string(test.file) + "_" + std::to_string(test.line) + "_" + std::string(test.name);
+                for (char &ch : name)
+                {
+                    if (!(ch >= 'a' && ch <= 'z') && !(ch >= 'A' && ch <= 'Z') && !(ch >= '0' && ch <= '9') && ch != '.' && ch != '-')
+                        ch = '_';
+                }
+                return dir + "/" + name + ".folded";
+            }
+
+            void Report(const TestDesc &test, std::size_t num_samples)
+            {
+                std::size_t num_dropped = 0;
+                if (num_samples > buffer.samples.size())
+                {
+                    num_dropped = num_samples - buffer.samples.size();
+                    num_samples = buffer.samples.size();
+                }
+
+                // Where the test function starts, to cut off the runner frames below it.
+                auto test_iter = GetTestMap().find(test);
+                std::uintptr_t test_func = test_iter != GetTestMap().end() ? TestFuncAddress(test_iter->second) : 0;
+
+                struct Counts
+                {
+                    std::size_t self = 0;
+                    std::size_t total = 0;
+                };
+                std::map<std::string_view, Counts> counts; // The keys point to the symbolizer cache.
+                std::map<std::string, std::size_t> folded_stacks;
+
+                std::vector<const Symbolizer::Symbol *> stack;
+                std::vector<std::string_view> seen_in_sample;
+                for (std::size_t i = 0; i < num_samples; i++)
+                {
+                    const ProfilerBuffer::Sample &sample = buffer.samples[i];
+
+                    // Leaf first.
+                    stack.clear();
+                    for (int j = num_skipped_frames; j < sample.depth; j++)
+                    {
+                        std::uintptr_t addr = reinterpret_cast<std::uintptr_t>(sample.frames[j]);
+                        const Symbolizer::Symbol &symbol = GetSymbolizer()(j == num_skipped_frames ? addr : addr - 1);
+                        stack.push_back(&symbol);
+                        if (test_func && symbol.start == test_func)
+                            break;
+                    }
+                    if (stack.empty())
+                        continue;
+
+                    counts[stack.front()->name].self++;
+                    seen_in_sample.clear();
+                    for (const Symbolizer::Symbol *symbol : stack)
+                    {
+                        // Count the recursive functions once per sample.
+                        if (std::find(seen_in_sample.begin(), seen_in_sample.end(), symbol->name) != seen_in_sample.end())
+                            continue;
+                        seen_in_sample.push_back(symbol->name);
+                        counts[symbol->name].total++;
+                    }
+
+                    std::string folded;
+                    for (auto it = stack.rbegin(); it != stack.rend(); ++it)
+                    {
+                        if (it != stack.rbegin())
+                            folded += ';';
+                        folded += (*it)->name;
+                    }
+                    folded_stacks[std::move(folded)]++;
+                }
+
+                std::string path = FoldedStacksPath(test);
+                bool path_ok = false;
+                if (std::FILE *file = std::fopen(path.c_str(), "wb"))
+                {
+                    for (const auto &[folded, count] : folded_stacks)
+                        std::fprintf(file, "%s %zu\n", folded.c_str(), count);
+                    path_ok = std::fclose(file) == 0;
+                }
+
+                if (!print)
+                    return;
+
+                std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "    Profile: %zu samples", DETAIL_EM_MINITEST_LOG_PARAMS, num_samples);
+                if (num_dropped > 0)
+                    std::fprintf(stderr, " (%zu more didn't fit)", num_dropped);
+                if (path_ok)
+                    std::fprintf(stderr, ", folded stacks in `%s`.\n", path.c_str());
+                else
+                    std::fprintf(stderr, ", unable to write the folded stacks to `%s`.\n", path.c_str());
+
+                if (num_samples == 0)
+                    return;
+
+                std::vector<std::pair<std::string_view, Counts>> top(counts.begin(), counts.end());
+                std::sort(top.begin(), top.end(), [](const auto &a, const auto &b){return a.second.self != b.second.self ? a.second.self > b.second.self : a.second.total > b.second.total;});
+                if (top.size() > num_top_functions)
+                    top.resize(num_top_functions);
+
+                std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "       Self   Total  Function\n", DETAIL_EM_MINITEST_LOG_PARAMS);
+                for (const auto &[name, c] : top)
+                {
+                    std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "     %5.1f%%  %5.1f%%  %.*s\n", DETAIL_EM_MINITEST_LOG_PARAMS,
+                        100.0 * double(c.self) / double(num_samples),
+                        100.0 * double(c.total) / double(num_samples),
+                        (int)name.size(), name.data()
+                    );
+                }
+            }
+
+          public:
+            // Returns null if the output directory can't be created.
+            [[nodiscard]] static std::unique_ptr<SlowTestProfiler> Open(std::chrono::nanoseconds threshold, std::string dir, bool print)
+            {
+                std::error_code ec;
+                std::filesystem::create_directories(dir, ec);
+                if (!std::filesystem::is_directory(dir, ec))
+                    return nullptr;
+
+                std::unique_ptr<SlowTestProfiler> ret(new SlowTestProfiler);
+                ret->threshold = threshold;
+                ret->dir = std::move(dir);
+                ret->print = print;
+                ret->buffer.samples.resize(10'000); // 10 seconds of CPU time.
+
+                // The first `backtrace()` call can allocate when loading the unwinder, so do it here rather than in the signal handler.
+                void *dummy[1];
+                (void)backtrace(dummy, 1);
+
+                struct sigaction action{};
+                action.sa_handler = ProfilerSignalHandler;
+                action.sa_flags = SA_RESTART;
+                sigemptyset(&action.sa_mask);
+                if (sigaction(SIGPROF, &action, &ret->old_action) != 0)
+                    InternalError("Unable to install the `SIGPROF` handler.");
+
+                return ret;
+            }
+
+            SlowTestProfiler(const SlowTestProfiler &) = delete;
+            SlowTestProfiler &operator=(const SlowTestProfiler &) = delete;
+
+            ~SlowTestProfiler()
+            {
+                SetTimer(0);
+                DeactivateProfilerBuffer();
+                sigaction(SIGPROF, &old_action, nullptr);
+            }
+
+            void OnTestStart(const TestDesc &test) override
+            {
+                (void)test;
+                buffer.num_samples = 0;
+                active_profiler_buffer = &buffer;
+                SetTimer(sampling_interval_us);
+            }
+
+            void OnTestEnd(const TestDesc &test, const TestResult &result) override
+            {
+                SetTimer(0);
+                DeactivateProfilerBuffer();
+
+                if (result.duration >= threshold && !result.resumed)
+                    Report(test, buffer.num_samples.load());
+            }
+        };
+        #endif
+
+        // Reads the whole file into `out`. Returns false if it can't be opened.
+        [[nodiscard]] static bool ReadFile(const char *path, std::string &out)
+        {
+            std::FILE *file = std::fopen(path, "rb");
+            if (!file)
+                return false;
+            char buf[4096];
+            while (std::size_t n = std::fread(buf, 1, sizeof buf, file))
+                out.append(buf, n);
+            std::fclose(file);
+            return true;
+        }
+
+        // Writes to a temporary file and then renames it, so a crash can't leave a half-written file. Returns false on failure.
+        [[nodiscard]] static bool WriteFileAtomically(const std::string &path, std::string_view contents)
+        {
+            std::string temp_path = path + ".tmp";
+            std::FILE *file = std::fopen(temp_path.c_str(), "wb");
+            if (!file)
+                return false;
+            bool ok = std::fwrite(contents.data(), 1, contents.size(), file) == contents.size();
+            ok = std::fclose(file) == 0 && ok;
+
+            std::error_code ec;
+            if (ok)
+                std::filesystem::rename(temp_path, path, ec);
+            if (!ok || ec)
+            {
+                std::filesystem::remove(temp_path, ec);
+                return false;
+            }
+            return true;
+        }
+
+        // The status of each test from the previous runs, for `--last-failed`, `--failed-first` and `--time-budget`.
+        // The file has one line per test: `<pass or fail> <duration in microseconds> <failure history in hex> file:line:name`.
+        // Bit N of the failure history is set if the test failed N runs ago, counting from the last one.
+        // The older format with only `pass file:line:name` or `fail file:line:name` is also accepted.
+        class RunState
+        {
+          public:
+            struct Entry
+            {
+                bool failed = false; // In the last run.
+                bool has_duration = false;
+                std::chrono::microseconds duration{}; // In the last run that actually ran the test.
+                std::uint32_t history = 0; // Bit N is set if the test failed N runs ago. This includes the last run as bit 0.
+            };
+
+          private:
+            std::map<std::string, Entry, std::less<>> entries; // The keys are from `TestId()`.
+
+          public:
+            // Returns an empty state if the file doesn't exist or can't be read.
+            [[nodiscard]] static RunState Load(const char *path)
+            {
+                RunState ret;
+                std::string contents;
+                if (!ReadFile(path, contents))
+                    return ret;
+
+                SplitString(contents, "\n", [&](std::string_view line)
+                {
+                    Entry entry;
+                    if (line.starts_with("pass "))
+                        entry.failed = false;
+                    else if (line.starts_with("fail "))
+                        entry.failed = true;
+                    else
+                        return false;
+                    line.remove_prefix(5);
+                    entry.history = entry.failed;
+
+                    // The duration and the history, unless this is the old format.
+                    std::uint64_t duration = 0;
+                    std::uint32_t history = 0;
+                    const char *end = line.data() + line.size();
+                    auto [duration_end, duration_ec] = std::from_chars(line.data(), end, duration);
+                    if (duration_ec == std::errc{} && duration_end < end && *duration_end == ' ')
+                    {
+                        auto [history_end, history_ec] = std::from_chars(duration_end + 1, end, history, 16);
+                        if (history_ec == std::errc{} && history_end < end && *history_end == ' ')
+                        {
+                            entry.has_duration = true;
+                            entry.duration = std::chrono::microseconds(duration);
+                            entry.history = history;
+                            line = std::string_view(history_end + 1, end);
+                        }
+                    }
+
+                    ret.entries.insert_or_assign(std::string(line), entry);
+                    return false;
+                });
+                return ret;
+            }
+
+            // Returns false on failure. Only keeps the tests that are in `GetTestMap()`.
+            [[nodiscard]] bool Save(const std::string &path) const
+            {
+                std::string contents;
+                for (const auto &elem : GetTestMap())
+                {
+                    std::string id = TestId(elem.first);
+                    auto it = entries.find(id);
+                    if (it == entries.end())
+                        continue;
+                    char buf[64];
+                    std::snprintf(buf, sizeof buf, "%s %llu %x ", it->second.failed ? "fail" : "pass", (unsigned long long)it->second.duration.count(), (unsigned int)it->second.history);
+                    contents += buf;
+                    contents += id;
+                    contents += '\n';
+                }
+                return WriteFileAtomically(path, contents);
+            }
+
+            // Returns null if this test never ran.
+            [[nodiscard]] const Entry *Find(const TestDesc &desc) const
+            {
+                auto it = entries.find(TestId(desc));
+                return it != entries.end() ? &it->second : nullptr;
+            }
+
+            [[nodiscard]] bool HasFailed(const TestDesc &desc) const
+            {
+                const Entry *entry = Find(desc);
+                return entry && entry->failed;
+            }
+
+            // Records the result of one run. `duration` is null if the test didn't actually run (e.g. was cached).
+            void AddResult(const TestDesc &desc, bool failed, const std::chrono::microseconds *duration)
+            {
+                Entry &entry = entries[TestId(desc)];
+                entry.failed = failed;
+                entry.history = entry.history << 1 | std::uint32_t(failed);
+                if (duration)
+                {
+                    entry.has_duration = true;
+                    entry.duration = *duration;
+                }
+            }
+        };
+
+        // Updates the `RunState` with the test results, and saves it at the end of the run.
+        class RunStateWriter final : public Listener
+        {
+            RunState state;
+            std::string path;
+            bool print = false; // Otherwise don't report the errors.
+
+            struct Result
+            {
+                bool failed = false; // In any of the repetitions.
+                bool has_duration = false;
+                std::chrono::microseconds duration{}; // The last one, if the test ran at all.
+            };
+            std::map<TestDesc, Result> results;
+
+          public:
+            RunStateWriter(RunState state, std::string path, bool print) : state(std::move(state)), path(std::move(path)), print(print) {}
+
+            void OnTestEnd(const TestDesc &test, const TestResult &result) override
+            {
+                if (result.will_retry || result.skipped)
+                    return;
+                Result &r = results[test];
+                r.failed = r.failed || result.failed;
+                if (!result.cached)
+                {
+                    r.has_duration = true;
+                    r.duration = std::chrono::duration_cast<std::chrono::microseconds>(result.duration);
+                }
+            }
+
+            void OnRunEnd(const RunSummary &summary) override
+            {
+                (void)summary;
+                for (const auto &[test, r] : results)
+                    state.AddResult(test, r.failed, r.has_duration ? &r.duration : nullptr);
+                if (!state.Save(path) && print)
+                    std::fprintf(stderr, "minitest: Unable to write the run state to `%s`.\n", path.c_str());
+            }
+        };
+
+        // The result of `ApplyTimeBudget()`.
+        struct TimeBudgetResult
+        {
+            std::chrono::microseconds selected_duration{}; // Estimated.
+            std::chrono::microseconds skipped_duration{}; // Estimated.
+            std::vector<std::pair<const TestMap::value_type *, std::chrono::microseconds>> skipped; // With the estimated durations, most important first.
+        };
+
+        // Picks the tests for `--time-budget` that are the most likely to fail per second of running time, and removes the rest from `tests`.
+        // A test is considered likely to fail if it never ran before, if it failed recently, or if its source file was modified after the last run.
+        [[nodiscard]] static TimeBudgetResult ApplyTimeBudget(std::vector<const TestMap::value_type *> &tests, std::chrono::milliseconds budget, const RunState &state, const std::string &state_path)
+        {
+            // The state is saved at the end of each run, so this is the time of the last run.
+            std::error_code ec;
+            std::filesystem::file_time_type last_run_time = std::filesystem::last_write_time(state_path, ec);
+            bool have_last_run_time = !ec;
+
+            // The tests that never ran are assumed to take the median time.
+            std::vector<std::chrono::microseconds> known_durations;
+            for (const TestMap::value_type *test : tests)
+            {
+                if (const RunState::Entry *entry = state.Find(test->first); entry && entry->has_duration)
+                    known_durations.push_back(entry->duration);
+            }
+            std::chrono::microseconds median_duration{};
+            if (!known_durations.empty())
+            {
+                std::nth_element(known_durations.begin(), known_durations.begin() + std::ptrdiff_t(known_durations.size() / 2), known_durations.end());
+                median_duration = known_durations[known_durations.size() / 2];
+            }
+
+            struct Candidate
+            {
+                const TestMap::value_type *test = nullptr;
+                double fail_chance = 0;
+                std::chrono::microseconds duration{};
+            };
+            std::vector<Candidate> candidates;
+            for (const TestMap::value_type *test : tests)
+            {
+                Candidate &c = candidates.emplace_back();
+                c.test = test;
+                c.duration = median_duration;
+                c.fail_chance = 0.01; // Anything can fail.
+
+                if (const RunState::Entry *entry = state.Find(test->first))
+                {
+                    // The recent failures count more.
+                    for (int i = 0; i < 32; i++)
+                    {
+                        if (entry->history >> i & 1)
+                            c.fail_chance += 0.5 / double(std::uint32_t(1) << i);
+                    }
+                    if (entry->has_duration)
+                        c.duration = entry->duration;
+                }
+                else
+                {
+                    c.fail_chance = 1;
+                }
+
+                if (have_last_run_time)
+                {
+                    std::filesystem::file_time_type modified = std::filesystem::last_write_time(std::filesystem::path(test->first.file), ec);
+                    if (!ec && modified > last_run_time)
+                        c.fail_chance += 0.5;
+                }
+
+                c.fail_chance = std::min(c.fail_chance, 1.0);
+            }
+
+            // Greedily fill the budget, ordering by the chance of failure per unit of time.
+            std::stable_sort(candidates.begin(), candidates.end(), [](const Candidate &a, const Candidate &b)
+            {
+                return a.fail_chance / double(std::max(a.duration.count(), std::int64_t(1))) > b.fail_chance / double(std::max(b.duration.count(), std::int64_t(1)));
+            });
+            TimeBudgetResult ret;
+            std::unordered_set<const TestMap::value_type *> selected;
+            for (const Candidate &c : candidates)
+            {
+                if (ret.selected_duration + c.duration <= budget)
+                {
+                    ret.selected_duration += c.duration;
+                    selected.insert(c.test);
+                }
+                else
+                {
+                    ret.skipped_duration += c.duration;
+                    ret.skipped.emplace_back(c.test, c.duration);
+                }
+            }
+
+            // Keep the original order.
+            std::erase_if(tests, [&](const TestMap::value_type *test){return !selected.contains(test);});
+            return ret;
+        }
+
+        // Prints the tests to stdout for `--list`.
+        static void PrintTestList(std::span<const TestMap::value_type *const> tests, ListFormat format, const RunState &state)
+        {
+            if (format == ListFormat::text)
+            {
+                for (const TestMap::value_type *test : tests)
+                    std::printf("%s\n", TestId(test->first).c_str());
+                return;
+            }
+
+            std::string buffer = "[\n";
+            for (std::size_t i = 0; i < tests.size(); i++)
+            {
+                const TestDesc &desc = tests[i]->first;
+                buffer += "{\"id\":";
+                AppendJsonString(buffer, TestId(desc));
+                buffer += ",\"file\":";
+                AppendJsonString(buffer, desc.file);
+                buffer += ",\"line\":";
+                buffer += std::to_string(desc.line);
+                buffer += ",\"name\":";
+                AppendJsonString(buffer, desc.name);
+                buffer += ",\"tags\":[";
+                bool first_tag = true;
+                for (std::string_view tag : GetTestTags(desc))
+                {
+                    if (!first_tag)
+                        buffer += ',';
+                    first_tag = false;
+                    AppendJsonString(buffer, tag);
+                }
+                buffer += ']';
+                if (const RunState::Entry *entry = state.Find(desc))
+                {
+                    buffer += ",\"last_status\":";
+                    buffer += entry->failed ? "\"fail\"" : "\"pass\"";
+                    if (entry->has_duration)
+                    {
+                        char time_buf[32];
+                        std::snprintf(time_buf, sizeof time_buf, "%.3f", std::chrono::duration<double, std::milli>(entry->duration).count());
+                        buffer += ",\"duration_ms\":";
+                        buffer += time_buf;
+                    }
+                }
+                buffer += i + 1 < tests.size() ? "},\n" : "}\n";
+            }
+            buffer += "]\n";
+            std::fwrite(buffer.data(), 1, buffer.size(), stdout);
+        }
+
+        #if DETAIL_EM_MINITEST_HAVE_CODE_HASH
+        // Remembers which tests passed, along with the hashes of their code, for `--cache`.
+        // The file has one line per test: `<hash in hex> file:line:name`.
+        class ResultCache final : public Listener
+        {
+            std::string path;
+            bool print = false; // Otherwise don't report the errors.
+            std::map<std::string, std::uint64_t, std::less<>> passed; // The keys are from `TestId()`.
+
+            CodeHasher hasher;
+            std::map<TestDesc, std::uint64_t> test_hashes; // Computed lazily.
+            std::map<TestDesc, bool> failed_now; // The tests that failed in this run, so that the later repetitions don't mark them as passing.
+
+            // Returns 0 if the test can't be hashed.
+            [[nodiscard]] std::uint64_t GetTestHash(const TestDesc &desc)
+            {
+                auto [iter, is_new] = test_hashes.try_emplace(desc);
+                if (is_new)
+                {
+                    auto test_iter = GetTestMap().find(desc);
+                    if (test_iter != GetTestMap().end())
+                        iter->second = hasher.TestHash(TestFuncAddress(test_iter->second));
+                }
+                return iter->second;
+            }
+
+          public:
+            ResultCache(std::string new_path, bool print)
+                : path(std::move(new_path)), print(print)
+            {
+                std::string contents;
+                if (!ReadFile(path.c_str(), contents))
+                    return;
+                SplitString(contents, "\n", [&](std::string_view line)
+                {
+                    std::uint64_t hash = 0;
+                    auto [ptr, ec] = std::from_chars(line.data(), line.data() + line.size(), hash, 16);
+                    if (ec == std::errc{} && ptr < line.data() + line.size() && *ptr == ' ')
+                        passed.insert_or_assign(std::string(ptr + 1, line.data() + line.size()), hash);
+                    return false;
+                });
+            }
+
+            // Returns true if this test passed last time, and its code didn't change since then.
+            [[nodiscard]] bool IsCachedPass(const TestDesc &desc)
+            {
+                auto iter = passed.find(TestId(desc));
+                if (iter == passed.end())
+                    return false;
+                std::uint64_t hash = GetTestHash(desc);
+                return hash != 0 && hash == iter->second;
+            }
+
+            void OnTestEnd(const TestDesc &test, const TestResult &result) override
+            {
+                if (result.will_retry || result.cached || result.skipped)
+                    return;
+
+                bool &failed = failed_now[test];
+                failed = failed || result.failed;
+
+                std::uint64_t hash = failed ? 0 : GetTestHash(test);
+                if (hash)
+                    passed.insert_or_assign(TestId(test), hash);
+                else
+                    passed.erase(TestId(test));
+            }
+
+            void OnRunEnd(const RunSummary &summary) override
+            {
+                (void)summary;
+
+                // Only keep the tests that still exist.
+                std::string contents;
+                for (const auto &elem : GetTestMap())
+                {
+                    std::string id = TestId(elem.first);
+                    auto iter = passed.find(id);
+                    if (iter == passed.end())
+                        continue;
+                    char buf[32];
+                    std::snprintf(buf, sizeof buf, "%016llx ", (unsigned long long)iter->second);
+                    contents += buf;
+                    contents += id;
+                    contents += '\n';
+                }
+
+                if (!WriteFileAtomically(path, contents) && print)
+                    std::fprintf(stderr, "minitest: Unable to write the result cache to `%s`.\n", path.c_str());
+            }
+        };
+        #endif
+
+        // Which source files each test executed, for `--record-impact` and `--changed`.
+        // The file has a line `file <path>` for each source file, numbered from 0, followed by a line `test <file numbers> file:line:name` for each test.
+        // The file numbers are comma-separated, or `-` if there are none.
+        class ImpactMap
+        {
+            std::vector<std::string> files;
+            std::map<std::string, std::uint32_t, std::less<>> file_ids;
+            std::map<std::string, std::vector<std::uint32_t>, std::less<>> tests; // The keys are from `TestId()`. The values are sorted.
+
+            // Returns true if one of the paths is a suffix of the other, starting after a `/`.
+            [[nodiscard]] static bool PathsMatch(std::string_view a, std::string_view b)
+            {
+                if (a.size() < b.size())
+                    std::swap(a, b);
+                return !b.empty() && a.ends_with(b) && (a.size() == b.size() || a[a.size() - b.size() - 1] == '/');
+            }
+
+          public:
+            // Returns false if the file can't be read or has the wrong format.
+            [[nodiscard]] bool Load(const char *path)
+            {
+                std::string contents;
+                if (!ReadFile(path, contents))
+                    return false;
+
+                bool ok = true;
+                SplitString(contents, "\n", [&](std::string_view line)
+                {
+                    if (line.starts_with("file "))
+                    {
+                        (void)AddFile(line.substr(5));
+                    }
+                    else if (line.starts_with("test "))
+                    {
+                        line.remove_prefix(5);
+                        std::size_t space = line.find(' ');
+                        if (space == std::string_view::npos)
+                        {
+                            ok = false;
+                            return true;
+                        }
+                        std::vector<std::uint32_t> &test_files = tests[std::string(line.substr(space + 1))];
+                        if (line.substr(0, space) != "-")
+                        {
+                            SplitString(line.substr(0, space), ",", [&](std::string_view number)
+                            {
+                                std::uint32_t id = 0;
+                                if (!ParseNonNegative(number, id) || id >= files.size())
+                                {
+                                    ok = false;
+                                    return true;
+                                }
+                                test_files.push_back(id);
+                                return false;
+                            });
+                        }
+                        std::sort(test_files.begin(), test_files.end());
+                    }
+                    else if (!line.empty())
+                    {
+                        ok = false;
+                    }
+                    return !ok;
+                });
+                return ok;
+            }
+
+            // Returns false on failure. Only keeps the tests that are in `GetTestMap()`, and the files that they use.
+            [[nodiscard]] bool Save(const std::string &path) const
+            {
+                std::vector<std::uint32_t> new_ids(files.size(), std::uint32_t(-1));
+                std::string file_lines, test_lines;
+                std::uint32_t num_new_ids = 0;
+                for (const auto &elem : GetTestMap())
+                {
+                    std::string id = TestId(elem.first);
+                    auto iter = tests.find(id);
+                    if (iter == tests.end())
+                        continue;
+
+                    test_lines += "test ";
+                    if (iter->second.empty())
+                        test_lines += '-';
+                    for (std::size_t i = 0; i < iter->second.size(); i++)
+                    {
+                        std::uint32_t &new_id = new_ids[iter->second[i]];
+                        if (new_id == std::uint32_t(-1))
+                        {
+                            new_id = num_new_ids++;
+                            file_lines += "file ";
+                            file_lines += files[iter->second[i]];
+                            file_lines += '\n';
+                        }
+                        if (i > 0)
+                            test_lines += ',';
+                        test_lines += std::to_string(new_id);
+                    }
+                    test_lines += ' ';
+                    test_lines += id;
+                    test_lines += '\n';
+                }
+                return WriteFileAtomically(path, file_lines + test_lines);
+            }
+
+            [[nodiscard]] std::uint32_t AddFile(std::string_view path)
+            {
+                auto [iter, is_new] = file_ids.try_emplace(std::string(path), std::uint32_t(files.size()));
+                if (is_new)
+                    files.push_back(iter->first);
+                return iter->second;
+            }
+
+            // Replaces the files of a test. `ids` must be sorted.
+            void SetTestFiles(const TestDesc &desc, std::vector<std::uint32_t> ids)
+            {
+                tests.insert_or_assign(TestId(desc), std::move(ids));
+            }
+
+            // Returns the flags for each file number, telling if the file is one of the `changed_files`.
+            [[nodiscard]] std::vector<bool> FindChangedFiles(std::span<const std::string> changed_files) const
+            {
+                std::vector<bool> ret(files.size());
+                for (std::size_t i = 0; i < files.size(); i++)
+                    ret[i] = std::any_of(changed_files.begin(), changed_files.end(), [&](const std::string &changed){return PathsMatch(files[i], changed);});
+                return ret;
+            }
+
+            // Returns true if the test must run after `changed_files` change: if it's not in the map, or it used one of them, or was defined in one of them.
+            // `changed_flags` is from `FindChangedFiles()`.
+            [[nodiscard]] bool IsAffected(const TestDesc &desc, std::span<const std::string> changed_files, const std::vector<bool> &changed_flags) const
+            {
+                std::string test_file = std::filesystem::path(desc.file).lexically_normal().generic_string();
+                if (std::any_of(changed_files.begin(), changed_files.end(), [&](const std::string &changed){return PathsMatch(test_file, changed);}))
+                    return true;
+                auto iter = tests.find(TestId(desc));
+                if (iter == tests.end())
+                    return true;
+                return std::any_of(iter->second.begin(), iter->second.end(), [&](std::uint32_t id){return changed_flags[id];});
+            }
+        };
+
+        #if DETAIL_EM_MINITEST_HAVE_IMPACT
+        // The functions called by the current test, for `--record-impact`. The `-finstrument-functions` hooks add to this when it's not null.
+        static thread_local std::unordered_set<void *> *impact_functions = nullptr;
+
+        // Records the source files executed by each test into an `ImpactMap`.
+        class ImpactRecorder final : public Listener
+        {
+            ImpactMap map;
+            std::string path;
+            bool print = false; // Otherwise don't report the problems.
+            SourceFileMapper mapper;
+
+            std::unordered_set<void *> functions;
+            std::map<TestDesc, std::vector<std::uint32_t>> test_files; // Merged over all repetitions and retries. Not sorted or deduplicated.
+            bool any_functions = false;
+            bool any_files = false;
+
+          public:
+            ImpactRecorder(ImpactMap map, std::string path, bool print) : map(std::move(map)), path(std::move(path)), print(print) {}
+
+            void OnTestStart(const TestDesc &test) override
+            {
+                (void)test;
+                functions.clear();
+                impact_functions = &functions;
+            }
+
+            void OnTestEnd(const TestDesc &test, const TestResult &result) override
+            {
+                impact_functions = nullptr;
+                if (result.cached || result.resumed || result.skipped)
+                    return; // Didn't run, so keep the old data.
+
+                std::vector<std::uint32_t> &ids = test_files[test];
+                for (void *func : functions)
+                {
+                    for (std::string_view file : mapper(func))
+                    {
+                        ids.push_back(map.AddFile(file));
+                        any_files = true;
+                    }
+                }
+                any_functions = any_functions || !functions.empty();
+            }
+
+            void OnRunEnd(const RunSummary &summary) override
+            {
+                (void)summary;
+
+                if (print)
+                {
+                    if (!any_functions)
+                        std::fprintf(stderr, "minitest: No function calls were recorded for `--record-impact`. Build the code with `-finstrument-functions`.\n");
+                    else if (!any_files)
+                        std::fprintf(stderr, "minitest: No line tables were found for `--record-impact`. Build the code with `-g`.\n");
+                }
+
+                for (auto &[test, ids] : test_files)
+                {
+                    std::sort(ids.begin(), ids.end());
+                    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+                    map.SetTestFiles(test, std::move(ids));
+                }
+                if (!map.Save(path) && print)
+                    std::fprintf(stderr, "minitest: Unable to write the impact map to `%s`.\n", path.c_str());
+            }
+        };
+        #endif
+
+        // An append-only journal of the finished tests for `--resume=<journal>`, so that an interrupted run can continue where it stopped.
+        // The file starts with `minitest-journal 1`, followed by the tab-separated records, one per line:
+        //   `F <kind> <file> <line> <expr> <N> <type> <message>... <M> <type> <message>...` - A failure of the next test, with N exceptions and M expected exceptions.
+        //                                                                                    The expression is empty if there is none.
+        //   `S <repetition> <file> <line> <file:line:name>` - A test started. If it has no `T` record, it crashed (or the run was interrupted while it ran).
+        //   `T <repetition> <pass or fail> <duration in nanoseconds> <file:line:name>` - A finished test, after its failures.
+        //   `done` - The run finished, so the next run starts over instead of resuming.
+        // In the fields, `\`, tab and newline are escaped as `\\`, `\t` and `\n`.
+        // Each test is written with a single write. The file is synced to disk after each failed test, and otherwise at most every 100 ms,
+        //   so a crash of the process loses nothing, and a crash of the machine loses at most the last 100 ms of passed tests.
+        class RunJournal final : public Listener
+        {
+          public:
+            struct Failure
+            {
+                FailureKind kind{};
+                std::string file;
+                int line = 0;
+                std::string expr; // Empty if none.
+                std::vector<std::pair<std::string, std::string>> exceptions; // Type and message.
+                std::vector<std::pair<std::string, std::string>> expected_exceptions;
+                std::vector<void *> stack; // Not saved to the journal, only used by `--jobs`.
+            };
+
+            struct Record
+            {
+                bool failed = false;
+                std::chrono::nanoseconds duration{};
+                std::vector<Failure> failures;
+            };
+
+          private:
+            std::FILE *file = nullptr;
+            std::map<std::pair<std::size_t, std::string>, Record, std::less<>> records; // The key is the repetition and `TestId()`.
+
+            std::size_t cur_repetition = 0;
+            std::string buffer; // The records for the current test.
+            std::chrono::steady_clock::time_point last_sync;
+
+            RunJournal() {}
+
+            static void AppendField(std::string &out, std::string_view str)
+            {
+                out += '\t';
+                for (char ch : str)
+                {
+                    switch (ch)
+                    {
+                        case '\\': out += "\\\\"; break;
+                        case '\t': out += "\\t"; break;
+                        case '\n': out += "\\n"; break;
+                        default: out += ch; break;
+                    }
+                }
+            }
+
+            [[nodiscard]] static std::string UnescapeField(std::string_view str)
+            {
+                std::string ret;
+                for (std::size_t i = 0; i < str.size(); i++)
+                {
+                    if (str[i] == '\\' && i + 1 < str.size())
+                    {
+                        i++;
+                        ret += str[i] == 't' ? '\t' : str[i] == 'n' ? '\n' : str[i];
+                    }
+                    else
+                    {
+                        ret += str[i];
+                    }
+                }
+                return ret;
+            }
+
+            // Returns false if the journal is from a finished run, or is invalid. Then we start over.
+            [[nodiscard]] bool Load(std::string_view contents)
+            {
+                if (!contents.starts_with("minitest-journal 1\n"))
+                    return false;
+
+                bool finished = false;
+                std::vector<Failure> failures;
+                std::map<std::pair<std::size_t, std::string>, Failure> unfinished; // The tests that started, but didn't finish yet.
+                SplitString(contents, "\n", [&](std::string_view line)
+                {
+                    // The last line is incomplete if we crashed while writing it.
+                    if (line.data() + line.size() == contents.data() + contents.size())
+                        return true;
+
+                    std::vector<std::string> fields;
+                    SplitString(line, "\t", [&](std::string_view field)
+                    {
+                        fields.push_back(UnescapeField(field));
+                        return false;
+                    });
+
+                    if (fields[0] == "done")
+                    {
+                        finished = true;
+                    }
+                    else if (fields[0] == "F" && fields.size() >= 7)
+                    {
+                        Failure &failure = failures.emplace_back();
+                        unsigned int kind = 0;
+                        std::size_t i = 5;
+                        auto ReadExceptions = [&](std::vector<std::pair<std::string, std::string>> &out)
+                        {
+                            std::size_t n = 0;
+                            if (i >= fields.size() || !ParseNonNegative(fields[i++], n) || n > (fields.size() - i) / 2)
+                                return false;
+                            for (std::size_t j = 0; j < n; j++, i += 2)
+                                out.emplace_back(fields[i], fields[i + 1]);
+                            return true;
+                        };
+                        if (!ParseNonNegative(fields[1], kind) || kind > unsigned(FailureKind::crashed) || !ParseNonNegative(fields[3], failure.line) ||
+                            !ReadExceptions(failure.exceptions) || !ReadExceptions(failure.expected_exceptions)
+                        )
+                        {
+                            failures.pop_back();
+                            return false;
+                        }
+                        failure.kind = FailureKind(kind);
+                        failure.file = std::move(fields[2]);
+                        failure.expr = std::move(fields[4]);
+                    }
+                    else if (fields[0] == "S" && fields.size() == 5)
+                    {
+                        std::size_t repetition = 0;
+                        Failure failure;
+                        failure.kind = FailureKind::crashed;
+                        failure.file = std::move(fields[2]);
+                        if (ParseNonNegative(fields[1], repetition) && ParseNonNegative(fields[3], failure.line))
+                            unfinished.insert_or_assign({repetition, std::move(fields[4])}, std::move(failure));
+                    }
+                    else if (fields[0] == "T" && fields.size() == 5)
+                    {
+                        std::size_t repetition = 0;
+                        std::uint64_t duration = 0;
+                        if (ParseNonNegative(fields[1], repetition) && ParseNonNegative(fields[3], duration))
+                        {
+                            unfinished.erase({repetition, fields[4]});
+                            Record &record = records[{repetition, std::move(fields[4])}];
+                            record.failed = fields[2] == "fail";
+                            record.duration = std::chrono::nanoseconds(duration);
+                            record.failures = std::move(failures);
+                        }
+                        failures.clear();
+                    }
+                    return false;
+                });
+
+                // Don't run those again, because they would likely crash again.
+                for (auto &[key, failure] : unfinished)
+                {
+                    Record &record = records[key];
+                    record.failed = true;
+                    record.duration = {};
+                    record.failures = {std::move(failure)};
+                }
+
+                return !finished;
+            }
+
+            void Sync()
+            {
+                std::fflush(file);
+                #if DETAIL_EM_MINITEST_HAVE_FSYNC
+                (void)fsync(fileno(file));
+                #endif
+                last_sync = RealNow();
+            }
+
+          public:
+            // Returns null if the file can't be opened.
+            [[nodiscard]] static std::unique_ptr<RunJournal> Open(const char *path)
+            {
+                std::unique_ptr<RunJournal> ret(new RunJournal);
+                std::string contents;
+                bool resume = ReadFile(path, contents) && ret->Load(contents);
+                if (!resume)
+                    ret->records.clear();
+                ret->file = std::fopen(path, resume ? "ab" : "wb");
+                if (!ret->file)
+                    return nullptr;
+                if (!resume)
+                {
+                    std::fputs("minitest-journal 1\n", ret->file);
+                    ret->Sync();
+                }
+                else if (!contents.ends_with('\n'))
+                {
+                    // Finish the incomplete line, if we crashed while writing it. `Load()` ignores it.
+                    std::fputc('\n', ret->file);
+                    std::fflush(ret->file);
+                }
+                return ret;
+            }
+
+            RunJournal(const RunJournal &) = delete;
+            RunJournal &operator=(const RunJournal &) = delete;
+
+            ~RunJournal()
+            {
+                if (file)
+                    std::fclose(file);
+            }
+
+            // Call this right before starting a test (but not its retries), so that if it crashes, the next run skips it.
+            void OnTestRun(std::size_t repetition, const TestDesc &test)
+            {
+                std::string line = "S";
+                AppendField(line, std::to_string(repetition));
+                AppendField(line, test.file);
+                AppendField(line, std::to_string(test.line));
+                AppendField(line, TestId(test));
+                line += '\n';
+                std::fwrite(line.data(), 1, line.size(), file);
+                std::fflush(file); // Enough to survive a crash of the process, we don't need to sync to disk.
+            }
+
+            // Returns null if this test didn't finish in the interrupted run.
+            [[nodiscard]] const Record *FindFinished(std::size_t repetition, const TestDesc &desc) const
+            {
+                auto iter = records.find(std::pair(repetition, TestId(desc)));
+                return iter != records.end() ? &iter->second : nullptr;
+            }
+
+            // Sends the failures from the interrupted run to the listeners.
+            // Copies the failure, so it can be replayed later.
+            [[nodiscard]] static Failure CopyFailure(const FailureInfo &info)
+            {
+                auto CopyExceptions = [](std::span<const ExceptionInfo> exceptions)
+                {
+                    std::vector<std::pair<std::string, std::string>> ret;
+                    for (const ExceptionInfo &ex : exceptions)
+                        ret.emplace_back(ex.type, ex.message);
+                    return ret;
+                };
+                return {
+                    .kind = info.kind,
+                    .file = info.file,
+                    .line = info.line,
+                    .expr = info.expr ? info.expr : "",
+                    .exceptions = CopyExceptions(info.exceptions),
+                    .expected_exceptions = CopyExceptions(info.expected_exceptions),
+                    .stack = std::vector<void *>(info.stack.begin(), info.stack.end()),
+                };
+            }
+
+            static void ReplayFailures(std::span<const Failure> failures, std::span<Listener *const> listeners)
+            {
+                for (const Failure &failure : failures)
+                {
+                    auto ToInfos = [](const std::vector<std::pair<std::string, std::string>> &exceptions)
+                    {
+                        std::vector<ExceptionInfo> ret;
+                        for (const auto &[type, message] : exceptions)
+                            ret.push_back({.type = type, .message = message});
+                        return ret;
+                    };
+                    std::vector<ExceptionInfo> exceptions = ToInfos(failure.exceptions);
+                    std::vector<ExceptionInfo> expected_exceptions = ToInfos(failure.expected_exceptions);
+
+                    FailureInfo info{
+                        .kind = failure.kind,
+                        .file = failure.file.c_str(),
+                        .line = failure.line,
+                        .expr = failure.expr.empty() ? nullptr : failure.expr.c_str(),
+                        .exceptions = exceptions,
+                        .expected_exceptions = expected_exceptions,
+                        .stack = failure.stack,
+                    };
+                    for (Listener *l : listeners)
+                        l->OnFailure(info);
+                }
+            }
+
+            void OnRepetitionStart(std::size_t repetition) override
+            {
+                cur_repetition = repetition;
+            }
+
+            void OnTestStart(const TestDesc &test) override
+            {
+                (void)test;
+                buffer.clear();
+            }
+
+            void OnFailure(const FailureInfo &info) override
+            {
+                buffer += 'F';
+                AppendField(buffer, std::to_string(int(info.kind)));
+                AppendField(buffer, info.file);
+                AppendField(buffer, std::to_string(info.line));
+                AppendField(buffer, info.expr ? info.expr : "");
+                for (std::span<const ExceptionInfo> exceptions : {info.exceptions, info.expected_exceptions})
+                {
+                    AppendField(buffer, std::to_string(exceptions.size()));
+                    for (const ExceptionInfo &ex : exceptions)
+                    {
+                        AppendField(buffer, ex.type);
+                        AppendField(buffer, ex.message);
+                    }
+                }
+                buffer += '\n';
+            }
+
+            void OnTestEnd(const TestDesc &test, const TestResult &result) override
+            {
+                if (result.will_retry || result.resumed || result.skipped)
+                    return; // Only the last attempt counts, and the resumed tests are already in the journal. The skipped ones will be skipped again.
+
+                buffer += 'T';
+                AppendField(buffer, std::to_string(cur_repetition));
+                AppendField(buffer, result.failed ? "fail" : "pass");
+                AppendField(buffer, std::to_string(result.duration.count()));
+                AppendField(buffer, TestId(test));
+                buffer += '\n';
+                std::fwrite(buffer.data(), 1, buffer.size(), file);
+                buffer.clear();
+
+                if (result.failed || RealNow() - last_sync >= std::chrono::milliseconds(100))
+                    Sync();
+                else
+                    std::fflush(file);
+            }
+
+            void OnRunEnd(const RunSummary &summary) override
+            {
+                (void)summary;
+                std::fputs("done\n", file);
+                Sync();
+            }
+        };
+
+        // Collects the results of the repeated and the retried tests. Prints the timing statistics and the flaky tests, and writes the quarantine list.
+        class RepeatStatsListener final : public Listener
+        {
+            struct Stats
+            {
+                std::vector<std::chrono::nanoseconds> durations;
+                std::size_t num_failed = 0;
+            };
+            std::map<TestDesc, Stats> stats;
+
+            bool print = false;
+            std::FILE *quarantine_file = nullptr;
+
+            RepeatStatsListener() {}
+
+            [[nodiscard]] static bool IsFlaky(const Stats &s)
+            {
+                return s.num_failed > 0 && s.num_failed < s.durations.size();
+            }
+
+          public:
+            // If `quarantine_path` is not empty, writes the flaky tests there. Returns null if it can't be opened.
+            [[nodiscard]] static std::unique_ptr<RepeatStatsListener> Open(bool print, const char *quarantine_path)
+            {
+                std::unique_ptr<RepeatStatsListener> ret(new RepeatStatsListener);
+                ret->print = print;
+                if (*quarantine_path)
+                {
+                    ret->quarantine_file = std::fopen(quarantine_path, "w");
+                    if (!ret->quarantine_file)
+                        return nullptr;
+                }
+                return ret;
+            }
+
+            RepeatStatsListener(const RepeatStatsListener &) = delete;
+            RepeatStatsListener &operator=(const RepeatStatsListener &) = delete;
+
+            ~RepeatStatsListener()
+            {
+                if (quarantine_file)
+                    std::fclose(quarantine_file);
+            }
+
+            void OnTestEnd(const TestDesc &test, const TestResult &result) override
+            {
+                if (result.skipped)
+                    return;
+                Stats &s = stats[test];
+                s.durations.push_back(result.duration);
+                if (result.failed)
+                    s.num_failed++;
+            }
+
+            void OnRunEnd(const RunSummary &summary) override
+            {
+                (void)summary;
+
+                std::size_t max_name_len = 0;
+                bool have_repeated_tests = false;
+                bool have_flaky_tests = false;
+                for (auto &[test, s] : stats)
+                {
+                    max_name_len = std::max(max_name_len, test.name.size());
+                    if (s.durations.size() > 1)
+                        have_repeated_tests = true;
+                    if (IsFlaky(s))
+                        have_flaky_tests = true;
+                    std::sort(s.durations.begin(), s.durations.end());
+                }
+
+                if (print && have_repeated_tests)
+                {
+                    auto Ms = [](std::chrono::nanoseconds d){return std::chrono::duration<double, std::milli>(d).count();};
+
+                    std::fprintf(stderr, "\nTimings (ms):\n");
+                    std::fprintf(stderr, "    %-*s  %9s  %9s  %9s  %9s  %5s\n", (int)max_name_len, "", "min", "median", "p95", "max", "runs");
+                    for (const auto &[test, s] : stats)
+                    {
+                        const auto &d = s.durations;
+                        std::size_t n = d.size();
+                        double median = n % 2 ? Ms(d[n / 2]) : (Ms(d[n / 2 - 1]) + Ms(d[n / 2])) / 2;
+                        // The nearest-rank method.
+                        std::size_t p95_index = (n * 95 + 99) / 100 - 1;
+                        std::fprintf(stderr, "    %-*s  %9.1f  %9.1f  %9.1f  %9.1f  %5zu\n", (int)max_name_len, test.name.data(), Ms(d.front()), median, Ms(d[p95_index]), Ms(d.back()), n);
+                    }
+                }
+
+                if (print && have_flaky_tests)
+                {
+                    std::fprintf(stderr, "\nFlaky tests:\n");
+                    for (const auto &[test, s] : stats)
+                    {
+                        if (IsFlaky(s))
+                            std::fprintf(stderr, "    %-*s   at:  %s:%d   (failed %zu of %zu runs)\n", (int)max_name_len, test.name.data(), test.file.data(), test.line, s.num_failed, s.durations.size());
+                    }
+                }
+
+                if (quarantine_file)
+                {
+                    for (const auto &[test, s] : stats)
+                    {
+                        if (IsFlaky(s))
+                            std::fprintf(quarantine_file, "%s\n", TestId(test).c_str());
+                    }
+                    std::fflush(quarantine_file);
+                }
+            }
+        };
+
+        // Prints the progress to stderr.
+        class ConsoleListener final : public Listener
+        {
+            std::size_t num_tests_total = 0;
+            std::size_t num_tests_started = 0;
+
+            std::string_view cur_file;
+            bool new_file = false; // Print the file name before the next test.
+            bool retrying = false; // The next test is a retry of the previous one.
+
+            std::string str_test_counters;
+            // We need this much whitespace: "  0 failed"
+            std::string str_failed_counter = "          ";
+
+            std::vector<const TestDesc *> failed_tests;
+            std::size_t failed_tests_max_name_len = 0;
+
+            std::string str_shuffle_seed; // Empty if not shuffling.
+
+            // Prints an exception, one line per type and per message line.
+            static void PrintException(std::span<const ExceptionInfo> chain, const char *indent)
+            {
+                for (const ExceptionInfo &ex : chain)
+                {
+                    if (ex.type.empty())
+                    {
+                        // Unknown type.
+                        std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "%sUnknown exception.\n", DETAIL_EM_MINITEST_LOG_PARAMS, indent);
+                        continue;
+                    }
+
+                    // Print the known type.
+                    // Here we don't print any special indication to distinguish from `Unknown exception.`, because that's clearly not a valid type anyway.
+                    std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "%s%.*s\n", DETAIL_EM_MINITEST_LOG_PARAMS, indent, (int)ex.type.size(), ex.type.data());
+
+                    // Print message.
+                    if (ex.message.data())
+                    {
+                        SplitString(ex.message, "\n", [&](std::string_view line)
+                        {
+                            std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "%s    %.*s\n", DETAIL_EM_MINITEST_LOG_PARAMS, indent, (int)line.size(), line.data());
+                            return false;
+                        });
+                    }
+                    else
+                    {
+                        // Not indentend to distinguish from a valid message.
+                        std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "%s(null)\n", DETAIL_EM_MINITEST_LOG_PARAMS, indent);
+                    }
+                }
+            }
+
+            // Prints the difference between the caught and the expected exception, for `FailureKind::incorrect_exception`.
+            static void PrintIncorrectException(std::span<const ExceptionInfo> caught, std::span<const ExceptionInfo> expected)
+            {
+                static constexpr std::size_t message_indent = 4; // How many characters the exception messages are indented by.
+
+                std::size_t max_string_len = 9; // Need this value to spell `(unknown)`.
+                for (const ExceptionInfo &ex : caught)
+                {
+                    if (ex.type.size() > max_string_len)
+                        max_string_len = ex.type.size();
+
+                    SplitString(ex.message, "\n", [&](std::string_view line)
+                    {
+                        std::size_t line_len = line.size() + message_indent;
+                        if (line_len > max_string_len)
+                            max_string_len = line_len;
+                        return false;
+                    });
+                }
+
+                // Special-case a shorter printing format when there is no nesting, and only the message is different.
+                if (caught.size() == 1 && expected.size() == 1 && caught[0].type == expected[0].type)
+                {
+                    std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "        Exception:\n", DETAIL_EM_MINITEST_LOG_PARAMS);
+                    bool first = true;
+                    SplitString(caught[0].message, "\n", [&](std::string_view line)
+                    {
+                        if (first)
+                        {
+                            first = false;
+                            std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "            Caught:   %.*s\n", DETAIL_EM_MINITEST_LOG_PARAMS, (int)line.size(), line.data());
+                        }
+                        else
+                        {
+                            std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "                      %.*s\n", DETAIL_EM_MINITEST_LOG_PARAMS, (int)line.size(), line.data());
+                        }
+                        return false;
+                    });
+                    first = true;
+                    SplitString(expected[0].message, "\n", [&](std::string_view line)
+                    {
+                        if (first)
+                        {
+                            first = false;
+                            std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "            Expected: %.*s\n", DETAIL_EM_MINITEST_LOG_PARAMS, (int)line.size(), line.data());
+                        }
+                        else
+                        {
+                            std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "                      %.*s\n", DETAIL_EM_MINITEST_LOG_PARAMS, (int)line.size(), line.data());
+                        }
+                        return false;
+                    });
+                }
+                else
+                {
+                    // The full printing format.
+
+                    // The table header
+                    std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "        Exception:\n", DETAIL_EM_MINITEST_LOG_PARAMS);
+                    std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "            %-*s | %s\n", DETAIL_EM_MINITEST_LOG_PARAMS,
+                        (int)max_string_len,
+                        "Caught",
+                        "Expected"
+                    );
+
+                    // How many exceptions to print. This is the max between the number of caught and expected exceptions.
+                    // Don't want to include `<algorithm>` for `std::max()`.
+                    std::size_t n = caught.size() > expected.size() ? caught.size() : expected.size();
+
+                    for (std::size_t i = 0; i < n; i++)
+                    {
+                        const ExceptionInfo *caught_ex = nullptr;
+                        if (i < caught.size())
+                            caught_ex = &caught[i];
+
+                        const ExceptionInfo *expected_ex = nullptr;
+                        if (i < expected.size())
+                            expected_ex = &expected[i];
+
+                        { // The type.
+                            // Caught.
+                            if (caught_ex && !caught_ex->type.empty())
+                            {
+                                std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "            %-*.*s", DETAIL_EM_MINITEST_LOG_PARAMS,
+                                    (int)max_string_len,
+                                    (int)caught_ex->type.size(),
+                                    caught_ex->type.data()
+                                );
+                            }
+                            else
+                            {
+                                std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "            %-*s", DETAIL_EM_MINITEST_LOG_PARAMS,
+                                    (int)max_string_len,
+                                    caught_ex ? "(unknown)" : "(none)"
+                                );
+                            }
+
+                            // Matches or not?
+                            if (caught_ex && expected_ex && caught_ex->type == expected_ex->type)
+                                std::fprintf(stderr, " | ");
+                            else
+                                std::fprintf(stderr, " # ");
+
+                            // Expected.
+                            if (expected_ex)
+                                std::fprintf(stderr, "%.*s\n", (int)expected_ex->type.size(), expected_ex->type.data());
+                            else
+                                std::fprintf(stderr, "(none)\n");
+                        }
+
+                        { // The message.
+                            SplitString2(
+                                caught_ex && !caught_ex->type.empty() ? caught_ex->message : std::string_view{}, // Not `""` to force a null `.data()`, which has a special meaning, see below.
+                                expected_ex && !expected_ex->type.empty() ? expected_ex->message : std::string_view{}, // Not `""` to force a null `.data()`, which has a special meaning, see below.
+                                "\n",
+                                [&](std::string_view caught_line, std::string_view expected_line)
+                                {
+                                    // Notice that `.data()` of the parameters can be `nullptr`, which has a special effect. It means we ran out of segments in that string.
+
+                                    std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "           %*s%c%-*.*s %c    %c%.*s\n", DETAIL_EM_MINITEST_LOG_PARAMS,
+                                        (int)message_indent, "",
+                                        caught_line.data() ? ' ' : '.', // Missing caught line indicator.
+                                        int(max_string_len - message_indent), (int)caught_line.size(), caught_line.data(),
+                                        caught_line.data() && expected_line.data() && caught_line == expected_line ? '|' : '#',
+                                        expected_line.data() ? ' ' : '.', // Missing expected line indicator.
+                                        (int)expected_line.size(), expected_line.data()
+                                    );
+                                    return false;
+                                }
+                            );
+                        }
+                    }
+                }
+
+            }
+
+            void LogPrePostRunTest(const TestDesc &test, bool post, const TestResult *result)
+            {
+                // This should be first.
+                // After the test, flush all the user streams.
+                // If we don't do this, then the output isn't interleaved correctly when mixing stdout and stderr (even on pure C streams),
+                //   when both streams are redirected to the same file.
+                if (post)
+                {
+                    std::fflush(stdout);
+                    std::fflush(stderr);
+                }
+
+                // Update test counters width.
+                detail::test_counters_width = std::max(str_test_counters.size(), str_failed_counter.size());
+
+                // Are we switching to a different file?
+                if (new_file)
+                {
+                    new_file = false;
+                    for (std::size_t i = 0; i < detail::test_counters_width; i++)
+                        std::fputc('#', stderr);
+                    std::fprintf(stderr, " [ file   ] --- %s\n", cur_file.data()); // This is guaranteed to be null-terminated.
+                }
+
+                // Test counters.
+                std::fprintf(stderr, "%-*s", (int)detail::test_counters_width, post ? str_failed_counter.c_str() : str_test_counters.c_str());
+
+                // Explain what we're doing with this test.
+                std::fprintf(stderr, " %s", !post ? "[ run    ]" : result->cached ? "[ CACHED ]" : result->skipped ? "[   SKIP ]" : result->resumed ? (result->failed ? "[ R FAIL ]" : "[ R   OK ]") : result->will_retry ? "[  RETRY ]" : result->failed ? "[   FAIL ]" : "[     OK ]");
+
+                // Test name.
+                std::fprintf(stderr, " %s", test.name.data()); // This is always null-terminated.
+
+                // Print the elapsed time.
+                if (post && !result->cached && !result->skipped)
+                {
+                    auto t = std::chrono::duration_cast<std::chrono::microseconds>(result->duration).count();
+                    std::fprintf(stderr, " (%.1f ms)", t / 1000.0);
+                }
+
+                // Print the source location of failed tests.
+                if (post && result->failed)
+                    std::fprintf(stderr, "   at:  %s:%d", test.file.data(), test.line); // `test.file` is always null-terminated.
+
+                std::fputc('\n', stderr);
+
+                // This should be last.
+                // Flush stderr before running the user test. Our framework doesn't write to `stdout` (only the user can), so that doesn't need to be flushed.
+                // See the beginning of this function for more details.
+                if (post)
+                    std::fflush(stderr);
+            }
+
+          public:
+            // `shuffle_seed` is null if we're not shuffling.
+            explicit ConsoleListener(const std::uint64_t *shuffle_seed)
+            {
+                if (shuffle_seed)
+                    str_shuffle_seed = std::to_string(*shuffle_seed);
+            }
+
+            void OnRunStart(std::size_t num_tests) override
+            {
+                num_tests_total = num_tests;
+
+                if (!str_shuffle_seed.empty())
+                    std::fprintf(stderr, "Shuffling with seed %s, rerun with `--shuffle=%s` to reproduce.\n\n", str_shuffle_seed.c_str(), str_shuffle_seed.c_str());
+            }
+
+            void OnRepetitionStart(std::size_t repetition) override
+            {
+                num_tests_started = 0;
+                if (repetition > 0)
+                    std::fputc('\n', stderr);
+                // Same as the width of the test counters, which we don't have yet for the first repetition.
+                std::size_t width = std::max(std::to_string(num_tests_total).size() * 2 + 1, str_failed_counter.size());
+                for (std::size_t i = 0; i < width; i++)
+                    std::fputc('#', stderr);
+                std::fprintf(stderr, " [ repeat ] --- %zu\n", repetition + 1);
+            }
+
+            void OnFileStart(std::string_view file) override
+            {
+                cur_file = file;
+                new_file = true;
+            }
+
+            void OnTestStart(const TestDesc &test) override
+            {
+                // The retries reuse the counter of the original attempt.
+                if (!retrying)
+                    num_tests_started++; // Increment this before logging.
+                str_test_counters = std::to_string(num_tests_started) + "/" + std::to_string(num_tests_total);
+
+                LogPrePostRunTest(test, false, nullptr);
+            }
+
+            void OnFailure(const FailureInfo &info) override
+            {
+                // Flush the user output.
+                std::fflush(stdout);
+                std::fflush(stderr);
+
+                switch (info.kind)
+                {
+                  case FailureKind::assertion:
+                    std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "    Assertion failed at:  %s:%d\n", DETAIL_EM_MINITEST_LOG_PARAMS, info.file, info.line);
+                    std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "        Expression:  %s\n", DETAIL_EM_MINITEST_LOG_PARAMS, info.expr);
+                    if (!info.exceptions.empty())
+                    {
+                        std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "        Threw an uncaught exception:\n", DETAIL_EM_MINITEST_LOG_PARAMS);
+                        PrintException(info.exceptions, "            ");
+                    }
+                    else
+                    {
+                        std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "        Evaluated to false.\n", DETAIL_EM_MINITEST_LOG_PARAMS);
+                    }
+                    break;
+
+                  case FailureKind::unexpected_exception:
+                    std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "    Unexpected exception at:  %s:%d\n", DETAIL_EM_MINITEST_LOG_PARAMS, info.file, info.line);
+                    std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "        Expression:  %s\n", DETAIL_EM_MINITEST_LOG_PARAMS, info.expr);
+                    std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "        Threw an uncaught exception:\n", DETAIL_EM_MINITEST_LOG_PARAMS);
+                    PrintException(info.exceptions, "            ");
+                    break;
+
+                  case FailureKind::missing_exception:
+                  case FailureKind::incorrect_exception:
+                    std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "    %s at:  %s:%d\n", DETAIL_EM_MINITEST_LOG_PARAMS,
+                        info.kind == FailureKind::missing_exception ? "Missing exception" : "Incorrect exception", info.file, info.line
+                    );
+
+                    // Only print the expression if it's short enough. `EM_MUST_THROW` needs this because it can accept multiple statements, unlike `EM_CHECK`.
+                    if (std::string_view(info.expr).size() <= 150)
+                        std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "        Expression:  %s\n", DETAIL_EM_MINITEST_LOG_PARAMS, info.expr);
+
+                    if (info.kind == FailureKind::incorrect_exception)
+                        PrintIncorrectException(info.exceptions, info.expected_exceptions);
+                    break;
+
+                  case FailureKind::uncaught_exception:
+                    std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "    Uncaught exception:\n", DETAIL_EM_MINITEST_LOG_PARAMS);
+                    PrintException(info.exceptions, "        ");
+                    break;
+
+                  case FailureKind::crashed:
+                    std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "    Crashed:\n", DETAIL_EM_MINITEST_LOG_PARAMS);
+                    std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "        Didn't finish in the interrupted run.\n", DETAIL_EM_MINITEST_LOG_PARAMS);
+                    break;
+                }
+
+                #if DETAIL_EM_MINITEST_HAVE_BACKTRACE
+                if (!info.stack.empty())
+                {
+                    std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "        Stack:\n", DETAIL_EM_MINITEST_LOG_PARAMS);
+                    ForEachStackFrame(info.stack, [&](const std::string &name)
+                    {
+                        std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "            %s\n", DETAIL_EM_MINITEST_LOG_PARAMS, name.c_str());
+                    });
+                }
+                #endif
+            }
+
+            void OnTestEnd(const TestDesc &test, const TestResult &result) override
+            {
+                retrying = result.will_retry;
+
+                // Update the failure count before logging.
+                // When repeating, count each failed test once.
+                if (result.failed && !result.will_retry && std::find(failed_tests.begin(), failed_tests.end(), &test) == failed_tests.end())
+                {
+                    failed_tests.push_back(&test);
+
+                    str_failed_counter.clear();
+                    if (failed_tests.size() < 100)
+                        str_failed_counter += ' ';
+                    if (failed_tests.size() < 10)
+                        str_failed_counter += ' ';
+                    str_failed_counter += std::to_string(failed_tests.size()) + " failed";
+
+                    if (test.name.size() > failed_tests_max_name_len)
+                        failed_tests_max_name_len = test.name.size();
+                }
+
+                LogPrePostRunTest(test, true, &result);
+            }
+
+            void OnRunEnd(const RunSummary &summary) override
+            {
+                std::string run_details;
+                if (summary.num_repetitions > 1)
+                    run_details = " in " + std::to_string(summary.num_repetitions) + " repetitions";
+                std::string notes;
+                if (summary.num_cached > 0)
+                    notes = std::to_string(summary.num_cached) + " cached";
+                if (summary.num_skipped > 0)
+                    notes += (notes.empty() ? "" : ", ") + (std::to_string(summary.num_skipped) + " skipped because of the dependencies");
+                if (summary.num_out_of_time > 0)
+                    notes += (notes.empty() ? "" : ", ") + (std::to_string(summary.num_out_of_time) + " didn't start in time");
+                if (!str_shuffle_seed.empty())
+                    notes += (notes.empty() ? "" : ", ") + ("shuffled with seed " + str_shuffle_seed);
+                if (!notes.empty())
+                    run_details += " (" + notes + ")";
+
+                if (failed_tests.empty())
+                {
+                    std::fprintf(stderr, "\nAll %zu test%s passed%s\n", summary.num_tests, summary.num_tests == 1 ? "" : "s", run_details.c_str());
+                }
+                else
+                {
+                    std::fprintf(stderr, "\nFailed tests:\n");
+                    for (const TestDesc *test : failed_tests)
+                    {
+                        std::fprintf(stderr, "    %-*s   at:  %s:%d\n", (int)failed_tests_max_name_len, test->name.data(), test->file.data(), test->line);
+                    }
+
+                    std::fprintf(stderr, "\nRan %zu test%s%s, %zu passed, %zu FAILED\n", summary.num_tests, summary.num_tests == 1 ? "" : "s", run_details.c_str(), summary.num_tests - summary.num_failed, summary.num_failed);
+                }
+            }
+        };
+
+        #if DETAIL_EM_MINITEST_HAVE_WATCH
+        // Watches the test executable and the minitest library for `--watch`, and re-executes the executable when they're rebuilt.
+        // Watches the directories rather than the files, because the linkers often write a new file and rename it over the old one.
+        class Watcher
+        {
+            int fd = -1;
+            std::filesystem::path exe_path;
+            std::vector<std::pair<int, std::filesystem::path>> watched; // The watch descriptor and the file.
+            bool changed = false;
+
+          public:
+            Watcher() {}
+            Watcher(const Watcher &) = delete;
+            Watcher &operator=(const Watcher &) = delete;
+            ~Watcher()
+            {
+                if (fd >= 0)
+                    close(fd);
+            }
+
+            // Returns false and prints an error on failure.
+            [[nodiscard]] bool Start()
+            {
+                std::error_code ec;
+                // This has to be done before the rebuild, because then it points to the deleted file.
+                exe_path = std::filesystem::read_symlink("/proc/self/exe", ec);
+                if (ec)
+                {
+                    std::fprintf(stderr, "minitest: Unable to determine the path of the executable for `--watch`.\n");
+                    return false;
+                }
+
+                std::vector<std::filesystem::path> files = {exe_path};
+                #if DETAIL_EM_MINITEST_HAVE_BACKTRACE
+                Dl_info info{};
+                if (dladdr(reinterpret_cast<void *>(&GetTestMap), &info) && info.dli_fname)
+                {
+                    std::filesystem::path lib = std::filesystem::canonical(info.dli_fname, ec);
+                    if (!ec && lib != exe_path)
+                        files.push_back(lib);
+                }
+                #endif
+
+                fd = inotify_init1(IN_CLOEXEC);
+                if (fd < 0)
+                {
+                    std::fprintf(stderr, "minitest: Unable to initialize inotify for `--watch`: %s\n", std::strerror(errno));
+                    return false;
+                }
+                for (const std::filesystem::path &file : files)
+                {
+                    int wd = inotify_add_watch(fd, file.parent_path().c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ATTRIB);
+                    if (wd < 0)
+                    {
+                        std::fprintf(stderr, "minitest: Unable to watch `%s`: %s\n", file.parent_path().c_str(), std::strerror(errno));
+                        return false;
+                    }
+                    watched.emplace_back(wd, file);
+                }
+                return true;
+            }
+
+            // Waits for a rebuild, then re-executes with the same arguments. Only returns on failure.
+            [[nodiscard]] int WaitAndReexec(char **argv)
+            {
+                std::fprintf(stderr, "\nminitest: Watching for changes in `%s`", exe_path.c_str());
+                for (std::size_t i = 1; i < watched.size(); i++)
+                    std::fprintf(stderr, " and `%s`", watched[i].second.c_str());
+                std::fprintf(stderr, ", press Ctrl+C to stop.\n");
+
+                alignas(inotify_event) char buf[4096];
+                while (true)
+                {
+                    // Once something changed, wait until the events stop for a while, because the linker writes the file in several steps.
+                    pollfd p{.fd = fd, .events = POLLIN, .revents = 0};
+                    int r = poll(&p, 1, changed ? 300 : -1);
+                    if (r < 0)
+                    {
+                        if (errno == EINTR)
+                            continue;
+                        std::fprintf(stderr, "minitest: `poll()` failed in `--watch`: %s\n", std::strerror(errno));
+                        return 2;
+                    }
+
+                    if (r == 0)
+                    {
+                        std::fprintf(stderr, "minitest: Rebuilt, rerunning.\n\n");
+                        std::fflush(stdout);
+                        std::fflush(stderr);
+                        execv(exe_path.c_str(), argv);
+                        // Most likely the file is still incomplete. Wait for the next change.
+                        std::fprintf(stderr, "minitest: Unable to run `%s`: %s\n", exe_path.c_str(), std::strerror(errno));
+                        changed = false;
+                        continue;
+                    }
+
+                    ssize_t size = read(fd, buf, sizeof buf);
+                    if (size <= 0)
+                        continue;
+                    for (char *ptr = buf; ptr < buf + size;)
+                    {
+                        const inotify_event *event = reinterpret_cast<const inotify_event *>(ptr);
+                        ptr += sizeof(inotify_event) + event->len;
+                        if (event->len == 0)
+                            continue;
+                        for (const auto &[wd, file] : watched)
+                        {
+                            if (wd == event->wd && file.filename() == event->name)
+                                changed = true;
+                        }
+                    }
+                }
+            }
+        };
+        #endif
+
+        #if EM_MINITEST_EXCEPTIONS
+        // Fails the current test because of an exception that escaped it. Must be called from a `catch` block.
+        static void ReportUncaughtException(const TestDesc &desc)
+        {
+            *fail_test_ptr = true;
+
+            if (HaveListeners())
+            {
+                ExceptionChain chain = ExceptionChain::FromCurrentException();
+                ReportFailure({.kind = FailureKind::uncaught_exception, .file = desc.file.data(), .line = desc.line, .exceptions = chain.view()});
+            }
+        }
+        #endif
+
+        // Returns true if this directory is on a memory-backed filesystem and we can write to it.
+        [[nodiscard]] static bool IsMemoryBackedDir([[maybe_unused]] const std::filesystem::path &path)
+        {
+            #if DETAIL_EM_MINITEST_HAVE_MEMFD
+            struct statfs info{};
+            if (path.empty() || statfs(path.c_str(), &info) != 0)
+                return false;
+            return (info.f_type == TMPFS_MAGIC || info.f_type == RAMFS_MAGIC) && access(path.c_str(), W_OK | X_OK) == 0;
+            #else
+            return false;
+            #endif
+        }
+
+        // Creates the directories for `TempDir()`, and removes them on a background thread.
+        // They are all in one parent directory per run, which is removed by `Finish()`. Each run has its own instance of this,
+        //   so the runs on different threads (e.g. `BackgroundSelfTest`) don't remove each other's directories.
+        class TempDirs
+        {
+            std::mutex mutex;
+            std::condition_variable has_work;
+            std::filesystem::path root; // Created on demand.
+            std::size_t num_created = 0;
+            std::deque<std::filesystem::path> to_remove;
+            bool stop = false;
+            std::thread thread; // Started on demand.
+
+            // Removes the directories from `to_remove` until `stop` is set and nothing is left.
+            void ThreadFunc()
+            {
+                std::unique_lock lock(mutex);
+                while (true)
+                {
+                    has_work.wait(lock, [&]{return stop || !to_remove.empty();});
+                    if (to_remove.empty())
+                        return;
+                    std::filesystem::path path = std::move(to_remove.front());
+                    to_remove.pop_front();
+                    lock.unlock();
+                    std::error_code ec;
+                    std::filesystem::remove_all(path, ec); // If this fails, `Finish()` tries again.
+                    lock.lock();
+                }
+            }
+
+            // Picks the filesystem and creates `root`. The mutex must be locked.
+            [[nodiscard]] std::error_code CreateRoot()
+            {
+                std::error_code ec;
+                std::filesystem::path base = std::filesystem::temp_directory_path(ec);
+                if (!IsMemoryBackedDir(base))
+                {
+                    std::vector<std::filesystem::path> candidates = {"/dev/shm"};
+                    if (const char *runtime_dir = std::getenv("XDG_RUNTIME_DIR"); runtime_dir && *runtime_dir)
+                        candidates.insert(candidates.begin(), runtime_dir);
+                    for (const std::filesystem::path &candidate : candidates)
+                    {
+                        if (IsMemoryBackedDir(candidate))
+                        {
+                            base = candidate;
+                            ec.clear();
+                            break;
+                        }
+                    }
+                }
+                if (ec)
+                    return ec;
+
+                // Several processes can run at the same time, so pick a random name.
+                std::uint64_t seed = std::uint64_t(RealNow().time_since_epoch().count());
+                for (std::uint64_t attempt = 0; attempt < 100; attempt++)
+                {
+                    char name[64];
+                    std::snprintf(name, sizeof name, "minitest-%016llx", (unsigned long long)MixSeed(seed, attempt));
+                    std::filesystem::path path = base / name;
+                    if (std::filesystem::create_directory(path, ec))
+                    {
+                        // The shared temporary directories are writable by everyone, so hide the files of the tests from the other users.
+                        std::filesystem::permissions(path, std::filesystem::perms::owner_all, ec);
+                        root = std::move(path);
+                        return ec;
+                    }
+                    if (ec)
+                        return ec;
+                }
+                return std::make_error_code(std::errc::file_exists);
+            }
+
+          public:
+            TempDirs() {}
+            TempDirs(const TempDirs &) = delete;
+            TempDirs &operator=(const TempDirs &) = delete;
+            ~TempDirs()
+            {
+                Finish();
+            }
+
+            // Creates a new directory for a test, and returns its path. Thread-safe.
+            [[nodiscard]] std::string Create(const TestDesc &desc, std::error_code &ec)
+            {
+                std::lock_guard lock(mutex);
+                ec.clear();
+                if (root.empty())
+                {
+                    ec = CreateRoot();
+                    if (ec)
+                        return "";
+                }
+
+                // The number makes it unique, and the test name makes it easier to find. Keep only the characters that are safe everywhere.
+                std::string name = std::to_string(num_created++) + '-';
+                for (char ch : desc.name.substr(0, 64))
+                    name += (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') || ch == '-' ? ch : '_';
+
+                std::filesystem::path path = root / name;
+                std::filesystem::create_directory(path, ec);
+                return ec ? "" : path.string();
+            }
+
+            // Removes a directory with everything in it, on the background thread. Thread-safe.
+            void Remove(std::string path)
+            {
+                {
+                    std::lock_guard lock(mutex);
+                    to_remove.push_back(std::move(path));
+                    if (!thread.joinable())
+                        thread = std::thread(&TempDirs::ThreadFunc, this);
+                }
+                has_work.notify_one();
+            }
+
+            // Waits for the pending removals, then removes the parent directory, along with anything that wasn't removed yet.
+            void Finish()
+            {
+                {
+                    std::lock_guard lock(mutex);
+                    stop = true;
+                }
+                has_work.notify_one();
+                if (thread.joinable())
+                    thread.join();
+
+                std::lock_guard lock(mutex);
+                stop = false;
+                if (!root.empty())
+                {
+                    std::error_code ec;
+                    std::filesystem::remove_all(root, ec);
+                    root.clear();
+                }
+            }
+        };
+
+        // Runs an async test to completion on its own event loop. Rethrows the exception that escaped it. Defined below.
+        static void RunAsyncTestAlone(Task<> (*func)());
+
+        // Runs a single test, and reports its failures to the listeners. `seed` is for `Rng()`. `temp_dirs` is for `TempDir()`.
+        [[nodiscard]] static TestResult RunOneTest(const TestDesc &desc, const Test &test, std::uint64_t seed, TempDirs &temp_dirs)
+        {
+            bool fail_test = false;
+            cur_rng = RandomGenerator(seed);
+
+            TestTempDir temp_dir;
+            temp_dir.dirs = &temp_dirs;
+            temp_dir.desc = &desc;
+
+            std::chrono::steady_clock::time_point test_start_time; // This gets set later, right before running the test.
+            std::chrono::steady_clock::time_point test_end_time; // This gets set later, right after running the test.
+            ResourceUsage usage_at_start;
+
+            { // Run the test. Here we need a scope for RAII purposes.
+                // Register the test pass flag into the thread-local singleton.
+                fail_test_ptr = &fail_test;
+                cur_temp_dir = &temp_dir;
+                struct Guard
+                {
+                    ~Guard()
+                    {
+                        fail_test_ptr = nullptr;
+                        cur_temp_dir = nullptr;
+                    }
+                };
+                Guard guard;
+
+                DETAIL_EM_MINITEST_PROBE3(test_start, desc.file.data(), desc.line, desc.name.data());
+
+                // Begin measuring time.
+                usage_at_start = ResourceUsage::Now();
+                test_start_time = RealNow();
+
+                // Run the test.
+                DETAIL_EM_MINITEST_RUN_WITH_CATCH(
+                    false,
+                    [&]
+                    {
+                        if (test.async_func)
+                            RunAsyncTestAlone(test.async_func);
+                        else
+                            test.func();
+                        return false; // The return value doesn't matter.
+                    },
+                    [&]
+                    {
+                        ReportUncaughtException(desc);
+                    }
+                );
+            }
+
+            // Finish measuring time.
+            test_end_time = RealNow();
+            ResourceUsage usage_at_end = ResourceUsage::Now();
+
+            if (!temp_dir.path.empty())
+                temp_dirs.Remove(std::move(temp_dir.path));
+
+            DETAIL_EM_MINITEST_PROBE5(test_end, desc.file.data(), desc.line, desc.name.data(), int(fail_test), std::int64_t((test_end_time - test_start_time).count()));
+
+            // On this thread, rather than in a listener, because with `RunOptions::jobs` the listeners only see the test after it finishes.
+            GetTracer().AddTestSpan(desc, fail_test, test_start_time, test_end_time, false);
+
+            TestResult ret{.failed = fail_test, .duration = test_end_time - test_start_time};
+            ret.start_time = test_start_time;
+            ret.cpu_user = std::chrono::nanoseconds(usage_at_end.cpu_user_ns - usage_at_start.cpu_user_ns);
+            ret.cpu_system = std::chrono::nanoseconds(usage_at_end.cpu_system_ns - usage_at_start.cpu_system_ns);
+            return ret;
+        }
+
+        // Finds the tests that each test depends on, from `"depends:name"` in `EM_TEST()`. The tests without dependencies are omitted.
+        // Returns false and adds to `errors` if some dependency doesn't exist or is ambiguous, or if there's a cycle.
+        // This checks all tests, not only the selected ones, so that the errors don't depend on the filters.
+        [[nodiscard]] static bool ResolveDependencies(const TestMap &test_map, std::map<const TestMap::value_type *, std::vector<const TestMap::value_type *>> &deps, std::vector<std::string> &errors)
+        {
+            std::unordered_multimap<std::string_view, const TestMap::value_type *> tests_by_name;
+            for (const auto &elem : test_map)
+                tests_by_name.emplace(elem.first.name, &elem);
+
+            bool ok = true;
+            for (const auto &elem : test_map)
+            {
+                for (std::string_view name : elem.second.dependencies)
+                {
+                    const TestMap::value_type *found = nullptr;
+                    std::size_t num_found = 0;
+                    auto [begin, end] = tests_by_name.equal_range(name);
+                    for (auto iter = begin; iter != end; iter++)
+                    {
+                        // Prefer the same file.
+                        if (iter->second->first.file == elem.first.file)
+                        {
+                            found = iter->second;
+                            num_found = 1;
+                            break;
+                        }
+                        found = iter->second;
+                        num_found++;
+                    }
+
+                    if (num_found != 1)
+                    {
+                        errors.push_back("`" + TestId(elem.first) + "` depends on `" + std::string(name) + "`, " +
+                            (num_found == 0 ? "but there's no such test." : "but there are several tests with this name in other files.")
+                        );
+                        ok = false;
+                        continue;
+                    }
+                    deps[&elem].push_back(found);
+                }
+            }
+            if (!ok)
+                return false;
+
+            // Look for cycles with a depth-first search.
+            enum class Mark {none, in_progress, done};
+            std::map<const TestMap::value_type *, Mark> marks;
+            std::vector<const TestMap::value_type *> path;
+            auto Visit = [&](auto &self, const TestMap::value_type *test) -> bool
+            {
+                Mark &mark = marks[test];
+                if (mark == Mark::done)
+                    return true;
+                if (mark == Mark::in_progress)
+                {
+                    std::string cycle;
+                    for (auto iter = std::find(path.begin(), path.end(), test); iter != path.end(); iter++)
+                        cycle += TestId((*iter)->first) + " -> ";
+                    cycle += TestId(test->first);
+                    errors.push_back("The test dependencies are circular: " + cycle);
+                    return false;
+                }
+
+                mark = Mark::in_progress;
+                path.push_back(test);
+                if (auto iter = deps.find(test); iter != deps.end())
+                {
+                    for (const TestMap::value_type *dep : iter->second)
+                    {
+                        if (!self(self, dep))
+                            return false;
+                    }
+                }
+                path.pop_back();
+                mark = Mark::done;
+                return true;
+            };
+            for (const auto &elem : deps)
+            {
+                if (!Visit(Visit, elem.first))
+                    return false;
+            }
+            return true;
+        }
+
+        // What happened to a test in the current repetition, for the dependencies.
+        enum class TestStatus
+        {
+            pending,
+            passed,
+            failed,
+            skipped,
+            out_of_time,
+        };
+
+        // Records the failures on a worker thread for `RunOptions::jobs`, to replay them to the listeners on the runner thread.
+        class FailureRecorder final : public Listener
+        {
+          public:
+            std::vector<RunJournal::Failure> failures;
+
+            void OnFailure(const FailureInfo &info) override
+            {
+                failures.push_back(RunJournal::CopyFailure(info));
+            }
+        };
+
+        // A test that runs on a different thread than the runner, see `TestThreadPool` and `AsyncTestLoop`.
+        struct TestJob
+        {
+            struct Attempt
+            {
+                TestResult result;
+                std::vector<RunJournal::Failure> failures;
+            };
+
+            std::size_t index = 0; // Not used by the thread that runs the test.
+            const TestMap::value_type *test = nullptr;
+            std::uint64_t seed = 0; // For `Rng()`.
+            std::vector<Attempt> attempts; // Filled by the thread that runs the test. There's more than one if the test is retried.
+        };
+
+        // The jobs finished by `TestThreadPool` and `AsyncTestLoop`, so that the runner can wait for both at once.
+        class FinishedJobQueue
+        {
+            std::mutex mutex;
+            std::condition_variable job_added;
+            std::deque<TestJob> jobs;
+
+          public:
+            void Push(TestJob job)
+            {
+                {
+                    std::lock_guard lock(mutex);
+                    jobs.push_back(std::move(job));
+                }
+                job_added.notify_one();
+            }
+
+            // Returns a finished job, or null if there's none right now.
+            [[nodiscard]] std::optional<TestJob> TryPop()
+            {
+                std::lock_guard lock(mutex);
+                if (jobs.empty())
+                    return {};
+                TestJob job = std::move(jobs.front());
+                jobs.pop_front();
+                return job;
+            }
+
+            // Blocks until some job finishes, and returns it.
+            [[nodiscard]] TestJob Pop()
+            {
+                std::unique_lock lock(mutex);
+                job_added.wait(lock, [&]{return !jobs.empty();});
+                TestJob job = std::move(jobs.front());
+                jobs.pop_front();
+                return job;
+            }
+        };
+
+        // The worker threads for `RunOptions::jobs`.
+        class TestThreadPool
+        {
+          public:
+            using Attempt = TestJob::Attempt;
+            using Job = TestJob;
+
+          private:
+            std::mutex mutex;
+            std::condition_variable jobs_added;
+            std::deque<Job> pending_jobs;
+            FinishedJobQueue &finished_jobs;
+            bool stop = false;
+
+            bool worker_backtraces = false;
+            bool worker_trace_test_spans = false;
+            TempDirs &temp_dirs;
+            // Decides if a failed test should be retried, given the result and the attempt number. Called on the worker threads.
+            std::function<bool(const TestResult &result, std::size_t attempt)> should_retry;
+
+            std::vector<std::thread> threads;
+
+            void WorkerLoop()
+            {
+                FailureRecorder recorder;
+                Listener *const recorder_ptr = &recorder;
+                cur_listeners = {&recorder_ptr, 1};
+                capture_backtraces = worker_backtraces;
+                trace_test_spans = worker_trace_test_spans;
+
+                std::unique_lock lock(mutex);
+                while (true)
+                {
+                    jobs_added.wait(lock, [&]{return stop || !pending_jobs.empty();});
+                    if (pending_jobs.empty())
+                        break;
+                    Job job = std::move(pending_jobs.front());
+                    pending_jobs.pop_front();
+                    lock.unlock();
+
+                    for (std::size_t attempt = 0;; attempt++)
+                    {
+                        Attempt &cur_attempt = job.attempts.emplace_back();
+                        cur_attempt.result = RunOneTest(job.test->first, job.test->second, job.seed, temp_dirs);
+                        cur_attempt.result.will_retry = should_retry(cur_attempt.result, attempt);
+                        cur_attempt.failures = std::move(recorder.failures);
+                        recorder.failures.clear();
+                        if (!cur_attempt.result.will_retry)
+                            break;
+                    }
+
+                    finished_jobs.Push(std::move(job));
+                    lock.lock();
+                }
+
+                cur_listeners = {};
+                capture_backtraces = false;
+                trace_test_spans = false;
+            }
+
+          public:
+            TestThreadPool(std::size_t num_threads, bool backtraces, bool trace, TempDirs &temp_dirs, FinishedJobQueue &finished_jobs, std::function<bool(const TestResult &result, std::size_t attempt)> should_retry)
+                : finished_jobs(finished_jobs), worker_backtraces(backtraces), worker_trace_test_spans(trace), temp_dirs(temp_dirs), should_retry(std::move(should_retry))
+            {
+                for (std::size_t i = 0; i < num_threads; i++)
+                    threads.emplace_back([this]{WorkerLoop();});
+            }
+
+            TestThreadPool(const TestThreadPool &) = delete;
+            TestThreadPool &operator=(const TestThreadPool &) = delete;
+
+            ~TestThreadPool()
+            {
+                {
+                    std::lock_guard lock(mutex);
+                    stop = true;
+                }
+                jobs_added.notify_all();
+                for (std::thread &thread : threads)
+                    thread.join();
+            }
+
+            // The job goes to `finished_jobs` when it's done.
+            void AddJob(Job job)
+            {
+                {
+                    std::lock_guard lock(mutex);
+                    pending_jobs.push_back(std::move(job));
+                }
+                jobs_added.notify_one();
+            }
+        };
+
+        class AsyncTestLoop;
+        // The loop that runs the current async test, for `AsyncWait`.
+        static thread_local AsyncTestLoop *cur_async_loop = nullptr;
+
+        // Runs the async tests (see `EM_TEST_ASYNC()`) on its own thread, all at once, switching between them when they wait for the timers or the file descriptors.
+        // It has its own thread so that the tests running on the runner thread don't delay the coroutines, which would inflate their durations.
+        // Like `TestThreadPool`, this records the failures of each test, for the runner to replay them to the listeners when the test finishes.
+        // Each test has its own failure flag, random generator and `TempDir()`, which are swapped into the thread-local variables whenever it's resumed.
+        class AsyncTestLoop
+        {
+          public:
+            using Attempt = TestJob::Attempt;
+            using Job = TestJob;
+
+          private:
+            struct RunningJob
+            {
+                Job job;
+                Task<> task; // The current attempt.
+                bool fail_test = false;
+                RandomGenerator rng;
+                TestTempDir temp_dir;
+                FailureRecorder recorder;
+                std::chrono::steady_clock::time_point start_time; // In the real time.
+                ResourceUsage usage; // The CPU time spent in the coroutines of the current attempt.
+                std::list<RunningJob>::iterator self;
+            };
+            std::list<RunningJob> running_jobs; // Only used by the loop thread.
+
+            std::mutex mutex;
+            std::condition_variable jobs_added;
+            std::deque<Job> pending_jobs;
+            bool stop = false;
+            std::thread thread; // Not used in `RunAlone()`.
+
+            // Those are null in `RunAlone()`, where `RunOneTest()` handles the rest.
+            FinishedJobQueue *finished_jobs = nullptr;
+            TempDirs *temp_dirs = nullptr;
+            bool backtraces = false;
+            bool trace = false;
+            // Decides if a failed test should be retried, given the result and the attempt number.
+            std::function<bool(const TestResult &result, std::size_t attempt)> should_retry;
+
+            // A suspended coroutine.
+            struct Waiter
+            {
+                std::coroutine_handle<> handle;
+                AsyncWait *wait = nullptr; // Lives in the coroutine frame.
+                RunningJob *job = nullptr; // Null in `RunAlone()`.
+            };
+            // The IDs are never reused, so the timers and the events can refer to the waiters that were already resumed, and we then ignore them.
+            std::unordered_map<std::uint64_t, Waiter> waiters;
+            std::uint64_t next_waiter_id = first_waiter_id;
+            // The waiters that can be resumed without waiting, e.g. for the regular files, which are always ready.
+            std::vector<std::uint64_t> ready_waiters;
+            std::size_t num_fd_waiters = 0;
+            RunningJob *cur_job = nullptr; // The one being resumed right now.
+
+            struct Timer
+            {
+                Clock::time_point deadline; // Possibly in the virtual time.
+                std::uint64_t waiter_id = 0;
+
+                friend auto operator<=>(const Timer &, const Timer &) = default;
+            };
+            std::priority_queue<Timer, std::vector<Timer>, std::greater<>> timers;
+
+            #if DETAIL_EM_MINITEST_HAVE_EPOLL
+            // The `epoll` data of our own file descriptors. The others have the waiter IDs.
+            static constexpr std::uint64_t wake_id = 0;
+            static constexpr std::uint64_t timer_id = 1;
+            static constexpr std::uint64_t first_waiter_id = 2;
+            int epoll_fd = -1;
+            int wake_fd = -1; // An `eventfd()` for `Wake()`.
+            int timer_fd = -1; // Armed for the earliest timer, so we don't have to round the `epoll_wait()` timeout to milliseconds.
+            #else
+            static constexpr std::uint64_t first_waiter_id = 0;
+            #endif
+
+            // Swaps the state of a test into the thread-local variables. Does nothing else for the null test.
+            class StateGuard
+            {
+                AsyncTestLoop &loop;
+                RunningJob *job = nullptr;
+                AsyncTestLoop *old_loop = nullptr;
+                bool *old_fail_test_ptr = nullptr;
+                TestTempDir *old_temp_dir = nullptr;
+                std::span<Listener *const> old_listeners;
+                Listener *recorder_ptr = nullptr;
+
+              public:
+                StateGuard(AsyncTestLoop &loop, RunningJob *job)
+                    : loop(loop), job(job), old_loop(cur_async_loop)
+                {
+                    cur_async_loop = &loop;
+                    loop.cur_job = job;
+                    if (!job)
+                        return;
+                    old_fail_test_ptr = fail_test_ptr;
+                    old_temp_dir = cur_temp_dir;
+                    old_listeners = cur_listeners;
+                    recorder_ptr = &job->recorder;
+                    fail_test_ptr = &job->fail_test;
+                    cur_temp_dir = &job->temp_dir;
+                    cur_listeners = {&recorder_ptr, 1};
+                    cur_rng = job->rng;
+                }
+                StateGuard(const StateGuard &) = delete;
+                StateGuard &operator=(const StateGuard &) = delete;
+                ~StateGuard()
+                {
+                    cur_async_loop = old_loop;
+                    loop.cur_job = nullptr;
+                    if (!job)
+                        return;
+                    job->rng = cur_rng;
+                    fail_test_ptr = old_fail_test_ptr;
+                    cur_temp_dir = old_temp_dir;
+                    cur_listeners = old_listeners;
+                }
+            };
+
+            void StartAttempt(RunningJob &job)
+            {
+                const TestDesc &desc = job.job.test->first;
+                job.fail_test = false;
+                job.rng = RandomGenerator(job.job.seed);
+                job.temp_dir = {};
+                job.temp_dir.dirs = temp_dirs;
+                job.temp_dir.desc = &desc;
+                job.task = job.job.test->second.async_func(); // This doesn't run the body yet.
+                DETAIL_EM_MINITEST_PROBE3(test_start, desc.file.data(), desc.line, desc.name.data());
+                job.start_time = RealNow();
+                job.usage = {};
+                Resume(&job, job.task.GetHandle());
+            }
+
+            void FinishAttempt(RunningJob &job)
+            {
+                std::chrono::steady_clock::time_point end_time = RealNow();
+                const TestDesc &desc = job.job.test->first;
+
+                {
+                    StateGuard guard(*this, &job);
+                    DETAIL_EM_MINITEST_RUN_WITH_CATCH(
+                        false,
+                        [&]
+                        {
+                            job.task.GetHandle().promise().RethrowException();
+                            return false; // The return value doesn't matter.
+                        },
+                        [&]
+                        {
+                            ReportUncaughtException(desc);
+                        }
+                    );
+                }
+
+                DETAIL_EM_MINITEST_PROBE5(test_end, desc.file.data(), desc.line, desc.name.data(), int(job.fail_test), std::int64_t((end_time - job.start_time).count()));
+
+                if (!job.temp_dir.path.empty())
+                    temp_dirs->Remove(std::move(job.temp_dir.path));
+
+                GetTracer().AddTestSpan(desc, job.fail_test, job.start_time, end_time, true);
+
+                Attempt &attempt = job.job.attempts.emplace_back();
+                attempt.result = {.failed = job.fail_test, .duration = end_time - job.start_time};
+                attempt.result.start_time = job.start_time;
+                attempt.result.cpu_user = std::chrono::nanoseconds(job.usage.cpu_user_ns);
+                attempt.result.cpu_system = std::chrono::nanoseconds(job.usage.cpu_system_ns);
+                attempt.result.will_retry = should_retry(attempt.result, job.job.attempts.size() - 1);
+                attempt.failures = std::move(job.recorder.failures);
+                job.recorder.failures.clear();
+                if (attempt.result.will_retry)
+                {
+                    StartAttempt(job);
+                    return;
+                }
+
+                finished_jobs->Push(std::move(job.job));
+                running_jobs.erase(job.self);
+            }
+
+            // Resumes a coroutine of this test. Finishes the test if it's done.
+            void Resume(RunningJob *job, std::coroutine_handle<> handle)
+            {
+                {
+                    StateGuard guard(*this, job);
+                    ResourceUsage usage_before = ResourceUsage::Now();
+                    handle.resume();
+                    ResourceUsage usage_after = ResourceUsage::Now();
+                    if (job)
+                    {
+                        job->usage.cpu_user_ns += usage_after.cpu_user_ns - usage_before.cpu_user_ns;
+                        job->usage.cpu_system_ns += usage_after.cpu_system_ns - usage_before.cpu_system_ns;
+                    }
+                }
+                if (job && job->task.GetHandle().done())
+                    FinishAttempt(*job);
+            }
+
+            // Resumes a waiter, unless it was already resumed.
+            void ResumeWaiter(std::uint64_t id, bool timed_out)
+            {
+                auto iter = waiters.find(id);
+                if (iter == waiters.end())
+                    return;
+                Waiter waiter = iter->second;
+                waiters.erase(iter);
+
+                waiter.wait->timed_out = timed_out;
+                if (waiter.wait->fd >= 0)
+                {
+                    num_fd_waiters--;
+                    #if DETAIL_EM_MINITEST_HAVE_EPOLL
+                    (void)epoll_ctl(epoll_fd, EPOLL_CTL_DEL, waiter.wait->fd, nullptr); // This fails for the regular files, that's fine.
+                    #endif
+                }
+                Resume(waiter.job, waiter.handle);
+            }
+
+            // Waits for the next events, and resumes the coroutines waiting for them.
+            void Step()
+            {
+                // Drop the timers of the waiters that were already resumed.
+                while (!timers.empty() && !waiters.contains(timers.top().waiter_id))
+                    timers.pop();
+
+                std::vector<std::uint64_t> ready = std::move(ready_waiters);
+                ready_waiters.clear();
+                bool dont_wait = !ready.empty();
+
+                // In the virtual time, if the tests only wait for the timers, jump to the earliest one instead of waiting.
+                // But not if something waits for a file descriptor, since that can take real time.
+                if (!dont_wait && !timers.empty() && num_fd_waiters == 0 && GetVirtualTime().IsEnabled())
+                {
+                    Clock::SleepUntil(timers.top().deadline);
+                    dont_wait = true;
+                }
+
+                #if DETAIL_EM_MINITEST_HAVE_EPOLL
+                itimerspec timer_spec{}; // Zero disarms the timer.
+                if (!timers.empty() && !dont_wait)
+                {
+                    // Relative to now, because the deadline can be in the virtual time.
+                    timer_spec.it_value = DurationToTimespec(std::max(std::chrono::nanoseconds(1), std::chrono::duration_cast<std::chrono::nanoseconds>(timers.top().deadline - Clock::now())));
+                }
+                if (timerfd_settime(timer_fd, 0, &timer_spec, nullptr) != 0)
+                    InternalError(std::string("Unable to set the timer for the async tests: ") + std::strerror(errno));
+
+                epoll_event events[64];
+                int num_events = epoll_wait(epoll_fd, events, 64, dont_wait ? 0 : -1);
+                if (num_events < 0 && errno != EINTR)
+                    InternalError(std::string("Unable to wait for the events in the async tests: ") + std::strerror(errno));
+                for (int i = 0; i < num_events; i++)
+                {
+                    std::uint64_t id = events[i].data.u64;
+                    if (id == wake_id || id == timer_id)
+                    {
+                        std::uint64_t value = 0;
+                        ssize_t size = read(id == wake_id ? wake_fd : timer_fd, &value, sizeof value);
+                        (void)size;
+                    }
+                    else
+                    {
+                        ready.push_back(id);
+                    }
+                }
+                #else
+                if (!dont_wait && !timers.empty())
+                    Clock::SleepUntil(timers.top().deadline);
+                #endif
+
+                // Collect the expired timers first, to not resume the waiters that add new expired timers in a loop.
+                Clock::time_point now = Clock::now();
+                std::vector<std::uint64_t> expired;
+                while (!timers.empty() && timers.top().deadline <= now)
+                {
+                    expired.push_back(timers.top().waiter_id);
+                    timers.pop();
+                }
+
+                for (std::uint64_t id : ready)
+                    ResumeWaiter(id, false);
+                for (std::uint64_t id : expired)
+                    ResumeWaiter(id, true);
+            }
+
+            // Makes `Step()` return early. Can be called from any thread.
+            void Wake()
+            {
+                #if DETAIL_EM_MINITEST_HAVE_EPOLL
+                std::uint64_t value = 1;
+                ssize_t size = write(wake_fd, &value, sizeof value);
+                (void)size;
+                #endif
+            }
+
+            void ThreadFunc()
+            {
+                capture_backtraces = backtraces;
+                trace_test_spans = trace;
+
+                std::unique_lock lock(mutex);
+                while (true)
+                {
+                    jobs_added.wait(lock, [&]{return stop || !pending_jobs.empty() || !running_jobs.empty();});
+                    if (stop)
+                        break;
+                    std::deque<Job> new_jobs = std::move(pending_jobs);
+                    pending_jobs.clear();
+                    lock.unlock();
+
+                    // Start the new tests, and run them until they first wait for something.
+                    for (Job &job : new_jobs)
+                    {
+                        RunningJob &running = running_jobs.emplace_back();
+                        running.self = std::prev(running_jobs.end());
+                        running.job = std::move(job);
+                        StartAttempt(running);
+                    }
+                    // `AddJob()` interrupts this.
+                    if (!running_jobs.empty())
+                        Step();
+
+                    lock.lock();
+                }
+
+                capture_backtraces = false;
+                trace_test_spans = false;
+            }
+
+          public:
+            // This one only supports `RunAlone()`.
+            AsyncTestLoop() : AsyncTestLoop(nullptr, nullptr, false, false, nullptr) {}
+            // Starts the thread for `AddJob()`. The finished jobs go to `finished_jobs`.
+            AsyncTestLoop(FinishedJobQueue *finished_jobs, TempDirs *temp_dirs, bool backtraces, bool trace, std::function<bool(const TestResult &result, std::size_t attempt)> should_retry)
+                : finished_jobs(finished_jobs), temp_dirs(temp_dirs), backtraces(backtraces), trace(trace), should_retry(std::move(should_retry))
+            {
+                #if DETAIL_EM_MINITEST_HAVE_EPOLL
+                epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+                wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+                timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+                if (epoll_fd < 0 || wake_fd < 0 || timer_fd < 0)
+                    InternalError(std::string("Unable to create the event loop for the async tests: ") + std::strerror(errno));
+                for (std::uint64_t id : {wake_id, timer_id})
+                {
+                    epoll_event event{};
+                    event.events = EPOLLIN;
+                    event.data.u64 = id;
+                    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, id == wake_id ? wake_fd : timer_fd, &event) != 0)
+                        InternalError(std::string("Unable to create the event loop for the async tests: ") + std::strerror(errno));
+                }
+                #endif
+
+                if (finished_jobs)
+                    thread = std::thread(&AsyncTestLoop::ThreadFunc, this);
+            }
+
+            AsyncTestLoop(const AsyncTestLoop &) = delete;
+            AsyncTestLoop &operator=(const AsyncTestLoop &) = delete;
+
+            ~AsyncTestLoop()
+            {
+                if (thread.joinable())
+                {
+                    {
+                        std::lock_guard lock(mutex);
+                        stop = true;
+                    }
+                    jobs_added.notify_one();
+                    Wake();
+                    thread.join();
+                }
+
+                // This destroys the coroutine frames, if the tests are still running.
+                running_jobs.clear();
+
+                #if DETAIL_EM_MINITEST_HAVE_EPOLL
+                close(timer_fd);
+                close(wake_fd);
+                close(epoll_fd);
+                #endif
+            }
+
+            // Starts the test on the loop thread. The job goes to `finished_jobs` when it's done.
+            void AddJob(Job job)
+            {
+                {
+                    std::lock_guard lock(mutex);
+                    pending_jobs.push_back(std::move(job));
+                }
+                jobs_added.notify_one();
+                Wake();
+            }
+
+            // Runs a single task to completion, using the thread-local test state as is. Rethrows the exception that escaped it.
+            void RunAlone(const Task<> &task)
+            {
+                Resume(nullptr, task.GetHandle());
+                while (!task.GetHandle().done())
+                    Step();
+                task.GetHandle().promise().RethrowException();
+            }
+
+            // Suspends a coroutine until the `wait` conditions are met. This is what `AsyncWait` calls.
+            void Suspend(AsyncWait &wait, std::coroutine_handle<> handle)
+            {
+                std::uint64_t id = next_waiter_id++;
+                waiters.try_emplace(id, Waiter{.handle = handle, .wait = &wait, .job = cur_job});
+                if (wait.deadline)
+                    timers.push({.deadline = *wait.deadline, .waiter_id = id});
+
+                if (wait.fd >= 0)
+                {
+                    num_fd_waiters++;
+                    #if DETAIL_EM_MINITEST_HAVE_EPOLL
+                    epoll_event event{};
+                    event.events = (wait.events & AsyncWait::readable ? std::uint32_t(EPOLLIN) : 0) | (wait.events & AsyncWait::writable ? std::uint32_t(EPOLLOUT) : 0);
+                    event.data.u64 = id;
+                    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wait.fd, &event) != 0)
+                    {
+                        if (errno == EPERM)
+                            ready_waiters.push_back(id); // `epoll` doesn't support the regular files, but they're always ready.
+                        else if (errno == EEXIST)
+                            InternalError("Two coroutines are waiting for the file descriptor " + std::to_string(wait.fd) + " at the same time.");
+                        else
+                            InternalError("Unable to wait for the file descriptor " + std::to_string(wait.fd) + ": " + std::strerror(errno));
+                    }
+                    #else
+                    InternalError("The async tests can only wait for the file descriptors on Linux.");
+                    #endif
+                }
+            }
+        };
+
+        void AsyncWait::await_suspend(std::coroutine_handle<> handle)
+        {
+            if (!cur_async_loop)
+                InternalError("`SleepFor()`, `WaitReadable()` and `WaitWritable()` can only be awaited in the async tests, see `EM_TEST_ASYNC()`.");
+            cur_async_loop->Suspend(*this, handle);
+        }
+
+        static void RunAsyncTestAlone(Task<> (*func)())
+        {
+            AsyncTestLoop loop;
+            Task<> task = func();
+            loop.RunAlone(task);
+        }
+    }
+
+    RandomGenerator &Rng()
+    {
+        return detail::cur_rng;
+    }
+
+    const std::string &TempDir()
+    {
+        detail::TestTempDir *temp_dir = detail::cur_temp_dir;
+        if (!temp_dir)
+            detail::InternalError("`TempDir()` can only be called on the thread running a test.");
+        if (temp_dir->path.empty())
+        {
+            std::error_code ec;
+            temp_dir->path = temp_dir->dirs->Create(*temp_dir->desc, ec);
+            if (ec)
+                detail::InternalError("Unable to create the temporary directory for the test: " + ec.message());
+        }
+        return temp_dir->path;
+    }
+
+    int OpenTempFile()
+    {
+        #if DETAIL_EM_MINITEST_HAVE_MEMFD
+        if (int fd = memfd_create("minitest", MFD_CLOEXEC); fd >= 0 || errno != ENOSYS)
+            return fd;
+        #endif
+
+        #if DETAIL_EM_MINITEST_HAVE_MKSTEMP
+        std::string path = TempDir() + "/file-XXXXXX";
+        int fd = mkstemp(path.data());
+        if (fd >= 0)
+            unlink(path.c_str());
+        return fd;
+        #else
+        errno = ENOSYS;
+        return -1;
+        #endif
+    }
+
+    Clock::time_point Clock::now()
+    {
+        detail::VirtualTime &virtual_time = detail::GetVirtualTime();
+        std::chrono::steady_clock::time_point ret = virtual_time.IsEnabled() ? virtual_time.Now() : std::chrono::steady_clock::now();
+        return time_point(ret.time_since_epoch());
+    }
+
+    void Clock::SleepUntil(time_point time)
+    {
+        std::chrono::steady_clock::time_point steady_time(time.time_since_epoch());
+        detail::VirtualTime &virtual_time = detail::GetVirtualTime();
+        if (virtual_time.IsEnabled())
+            virtual_time.SleepUntil(steady_time);
+        else
+            std::this_thread::sleep_until(steady_time);
+    }
+
+    std::vector<std::string_view> GetTestTags(const TestDesc &test)
+    {
+        std::vector<std::string_view> ret;
+        auto iter = detail::GetTestMap().find(test);
+        if (iter == detail::GetTestMap().end())
+            return ret;
+        std::span<const std::string_view> names = detail::GetTagNames();
+        for (std::size_t i = 0; i < names.size(); i++)
+        {
+            if (iter->second.tags >> i & 1)
+                ret.push_back(names[i]);
+        }
+        return ret;
+    }
+
+    bool TestModule::Load(const std::string &new_path)
+    {
+        Unload();
+
+        #if DETAIL_EM_MINITEST_HAVE_DLOPEN
+        detail::TestMap &test_map = detail::GetTestMap();
+        std::vector<TestDesc> old_tests; // Sorted, because the map is.
+        old_tests.reserve(test_map.size());
+        for (const auto &elem : test_map)
+            old_tests.push_back(elem.first);
+
+        // The tests register themselves when the library is loaded.
+        std::vector<TestDesc> duplicates;
+        detail::module_duplicate_tests = &duplicates;
+        void *new_handle = dlopen(new_path.c_str(), RTLD_NOW | RTLD_LOCAL);
+        detail::module_duplicate_tests = nullptr;
+        if (!new_handle)
+        {
+            const char *error = dlerror();
+            std::fprintf(stderr, "minitest: Unable to load `%s`: %s\n", new_path.c_str(), error ? error : "unknown error");
+            return false;
+        }
+
+        std::vector<TestDesc> new_tests;
+        for (const auto &elem : test_map)
+        {
+            if (!std::binary_search(old_tests.begin(), old_tests.end(), elem.first))
+                new_tests.push_back(elem.first);
+        }
+
+        if (!duplicates.empty())
+        {
+            for (const TestDesc &desc : duplicates)
+            {
+                // The registered description points into the library that registered it, which tells us where the other copy is.
+                const char *other_path = "the executable";
+                Dl_info info{};
+                if (auto iter = test_map.find(desc); iter != test_map.end() && dladdr(iter->first.name.data(), &info) && info.dli_fname && *info.dli_fname)
+                    other_path = info.dli_fname;
+                std::fprintf(stderr, "minitest: `%s` has a test that's already registered by `%s`: `%s:%d`, named `%s`.\n", new_path.c_str(), other_path, desc.file.data(), desc.line, desc.name.data());
+            }
+            for (const TestDesc &desc : new_tests)
+                test_map.erase(desc);
+            dlclose(new_handle);
+            return false;
+        }
+
+        path = new_path;
+        handle = new_handle;
+        tests = std::move(new_tests);
+        return true;
+        #else
+        std::fprintf(stderr, "minitest: Loading the test modules isn't supported on this platform.\n");
+        return false;
+        #endif
+    }
+
+    void TestModule::Unload()
+    {
+        if (!handle)
+            return;
+        #if DETAIL_EM_MINITEST_HAVE_DLOPEN
+        // Unregister first, because the descriptions point into the library.
+        for (const TestDesc &desc : tests)
+            detail::GetTestMap().erase(desc);
+        dlclose(handle);
+        #endif
+        path.clear();
+        handle = nullptr;
+        tests.clear();
+    }
+
+    TraceScope::TraceScope(const char *name)
+        : name(name)
+    {
+        detail::Tracer &tracer = detail::GetTracer();
+        if (tracer.enabled.load(std::memory_order_relaxed))
+            start_ns = tracer.Now();
+    }
+
+    TraceScope::~TraceScope()
+    {
+        if (start_ns < 0)
+            return;
+        detail::Tracer &tracer = detail::GetTracer();
+        // If the tracing got disabled in the meantime, drop this span, because the trace could be already written.
+        if (!tracer.enabled.load(std::memory_order_relaxed))
+            return;
+        tracer.ThisThreadBuffer().events.push_back({.name = name, .category = "scope", .start_ns = start_ns, .duration_ns = tracer.Now() - start_ns});
+    }
+
+    int RunTests(int argc, char **argv)
+    {
+        RunOptions options;
+        bool watch = false;
+
+        // Parse the flags.
+        for (int i = 1; i < argc; i++)
+        {
+            std::string_view arg = argv[i];
+            std::string_view value;
+
+            if (detail::ParseFlagWithValue(arg, "--junit", value))
+                options.junit_path = value;
+            else if (detail::ParseFlagWithValue(arg, "--jsonl", value))
+                options.jsonl_path = value;
+            else if (detail::ParseFlagWithValue(arg, "--binlog", value))
+                options.binlog_path = value;
+            else if (detail::ParseFlagWithValue(arg, "--trace", value))
+                options.trace_path = value;
+            else if (detail::ParseFlagWithValue(arg, "--state", value))
+                options.state_path = value;
+            else if (arg == "--last-failed")
+                options.last_failed = true;
+            else if (arg == "--failed-first")
+                options.failed_first = true;
+            else if (arg == "--watch")
+            {
+                watch = true;
+                options.failed_first = true;
+            }
+            else if (detail::ParseFlagWithValue(arg, "--resume", value))
+                options.resume_path = value;
+            else if (arg == "--cache")
+                options.cache_path = argc > 0 ? std::string(argv[0]) + ".minitest-cache" : "minitest-cache";
+            else if (detail::ParseFlagWithValue(arg, "--cache", value))
+                options.cache_path = value;
+            else if (arg == "--force")
+                options.force = true;
+            else if (arg == "--list")
+                options.list = ListFormat::text;
+            else if (detail::ParseFlagWithValue(arg, "--list", value))
+            {
+                if (value == "text")
+                    options.list = ListFormat::text;
+                else if (value == "json")
+                    options.list = ListFormat::json;
+                else
+                {
+                    std::fprintf(stderr, "minitest: Expected `text` or `json` in `%s`.\n", argv[i]);
+                    return 2;
+                }
+            }
+            else if (detail::ParseFlagWithValue(arg, "--run-exact", value))
+                options.run_exact.emplace_back(value);
+            else if (detail::ParseFlagWithValue(arg, "--tags", value) || detail::ParseFlagWithValue(arg, "--skip-tags", value))
+            {
+                std::vector<std::string> &tags = arg.starts_with("--tags") ? options.include_tags : options.exclude_tags;
+                detail::SplitString(value, ",", [&](std::string_view tag)
+                {
+                    if (!tag.empty())
+                        tags.emplace_back(tag);
+                    return false;
+                });
+            }
+            else if (detail::ParseFlagWithValue(arg, "--impact-map", value))
+                options.impact_map_path = value;
+            else if (arg == "--record-impact")
+                options.record_impact = true;
+            else if (detail::ParseFlagWithValue(arg, "--changed", value))
+            {
+                options.only_impacted = true;
+                std::string contents;
+                if (!detail::ReadFile(std::string(value).c_str(), contents))
+                {
+                    std::fprintf(stderr, "minitest: Unable to read `%.*s`.\n", int(value.size()), value.data());
+                    return 2;
+                }
+                detail::SplitString(contents, "\n", [&](std::string_view line)
+                {
+                    if (line.ends_with('\r'))
+                        line.remove_suffix(1);
+                    if (!line.empty())
+                        options.changed_files.emplace_back(line);
+                    return false;
+                });
+            }
+            else if (detail::ParseFlagWithValue(arg, "--time-budget", value))
+            {
+                if (!detail::ParseDurationMs(value, options.time_budget_ms))
+                {
+                    std::fprintf(stderr, "minitest: Expected a duration like `30s` or `500ms` in `%s`.\n", argv[i]);
+                    return 2;
+                }
+            }
+            else if (detail::ParseFlagWithValue(arg, "--max-time", value))
+            {
+                if (!detail::ParseDurationMs(value, options.max_run_time_ms))
+                {
+                    std::fprintf(stderr, "minitest: Expected a duration like `30s` or `500ms` in `%s`.\n", argv[i]);
+                    return 2;
+                }
+            }
+            else if (arg == "--shuffle")
+            {
+                options.shuffle = true;
+                options.seed = std::random_device{}();
+            }
+            else if (detail::ParseFlagWithValue(arg, "--shuffle", value))
+            {
+                options.shuffle = true;
+                if (!detail::ParseNonNegative(value, options.seed))
+                {
+                    std::fprintf(stderr, "minitest: Expected a number in `%s`.\n", argv[i]);
+                    return 2;
+                }
+            }
+            else if (detail::ParseFlagWithValue(arg, "--repeat", value))
+            {
+                if (!detail::ParseNonNegative(value, options.repeat) || options.repeat == 0)
+                {
+                    std::fprintf(stderr, "minitest: Expected a positive number in `%s`.\n", argv[i]);
+                    return 2;
+                }
+            }
+            else if (arg == "--repeat-until-fail")
+                options.repeat_until_fail = true;
+            else if (detail::ParseFlagWithValue(arg, "--retries", value))
+            {
+                if (!detail::ParseNonNegative(value, options.retries))
+                {
+                    std::fprintf(stderr, "minitest: Expected a number in `%s`.\n", argv[i]);
+                    return 2;
+                }
+            }
+            else if (detail::ParseFlagWithValue(arg, "--jobs", value))
+            {
+                if (!detail::ParseNonNegative(value, options.jobs) || options.jobs == 0)
+                {
+                    std::fprintf(stderr, "minitest: Expected a positive number in `%s`.\n", argv[i]);
+                    return 2;
+                }
+            }
+            else if (detail::ParseFlagWithValue(arg, "--quarantine", value))
+                options.quarantine_path = value;
+            else if (arg == "--virtual-time")
+                options.virtual_time = true;
+            else if (arg == "--backtrace")
+                options.backtrace_on_failure = true;
+            else if (detail::ParseFlagWithValue(arg, "--profile-slow", value))
+            {
+                if (!detail::ParseNonNegative(value, options.profile_slow_ms))
+                {
+                    std::fprintf(stderr, "minitest: Expected a number of milliseconds in `%s`.\n", argv[i]);
+                    return 2;
+                }
+            }
+            else if (detail::ParseFlagWithValue(arg, "--profile-dir", value))
+                options.profile_dir = value;
+            else
+            {
+                std::fprintf(stderr, "minitest: Unknown flag: `%s`.\n", argv[i]);
+                return 2;
+            }
+        }
+
+        if ((options.last_failed || options.failed_first || options.time_budget_ms >= 0 || options.list == ListFormat::json) && options.state_path.empty() && argc > 0)
+            options.state_path = std::string(argv[0]) + ".minitest-state";
+        if ((options.record_impact || options.only_impacted) && options.impact_map_path.empty() && argc > 0)
+            options.impact_map_path = std::string(argv[0]) + ".minitest-impact";
+
+        if (!watch)
+            return RunTests(options);
+
+        #if DETAIL_EM_MINITEST_HAVE_WATCH
+        // Start watching before running, to also notice the rebuilds that finish while the tests run.
+        detail::Watcher watcher;
+        if (!watcher.Start())
+            return 2;
+        if (RunTests(options) == 2)
+            return 2; // An invalid configuration, rerunning won't help.
+        return watcher.WaitAndReexec(argv);
+        #else
+        std::fprintf(stderr, "minitest: `--watch` isn't supported on this platform.\n");
+        return 2;
+        #endif
+    }
+
+    int RunTests(const RunOptions &options, std::span<Listener *const> listeners)
+    {
+        TestRunner runner(options);
+        return runner.Run(listeners);
+    }
+
+    int TestRunner::Run(std::span<Listener *const> listeners)
+    {
+        const auto &test_map = detail::GetTestMap();
+
+        // Reports a problem that stops the run before it starts. Returns the exit code for it.
+        auto Error = [&](const std::string &message)
+        {
+            if (options.console_output)
+                std::fprintf(stderr, "minitest: %s\n", message.c_str());
+            for (Listener *l : listeners)
+                l->OnRunError(message);
+            return 2;
+        };
+
+        if (test_map.empty())
+        {
+            if (options.console_output)
+                std::fprintf(stderr, "minitest: No tests to run.\n");
+            return 1; // For now this is an error. It should probably be allowed if caused by filtering (which we don't have yet).
+        }
+
+        // Select the tests.
+        detail::RunState run_state;
+        if (!options.state_path.empty())
+            run_state = detail::RunState::Load(options.state_path.c_str());
+        // If nothing failed last time, `last_failed` runs everything.
+        bool only_failed = options.last_failed && std::any_of(test_map.begin(), test_map.end(), [&](const auto &elem){return run_state.HasFailed(elem.first);});
+
+        detail::ImpactMap impact_map;
+        if ((options.record_impact || options.only_impacted) && !impact_map.Load(options.impact_map_path.c_str()) && options.only_impacted)
+        {
+            return Error("Unable to read the impact map from `" + options.impact_map_path + "`. Record it with `--record-impact` first.");
+        }
+        std::vector<std::string> changed_files;
+        for (const std::string &file : options.changed_files)
+            changed_files.push_back(std::filesystem::path(file).lexically_normal().generic_string());
+        std::vector<bool> changed_flags = impact_map.FindChangedFiles(changed_files);
+
+        std::unordered_set<std::string_view> run_exact(options.run_exact.begin(), options.run_exact.end());
+        for (std::string_view id : run_exact)
+        {
+            if (std::none_of(test_map.begin(), test_map.end(), [&](const auto &elem){return detail::TestId(elem.first) == id;}))
+            {
+                return Error("No such test: `" + std::string(id) + "`.");
+            }
+        }
+
+        detail::TagMask include_tags = 0;
+        detail::TagMask exclude_tags = 0;
+        std::string tag_error;
+        if (!detail::TagNamesToMask(options.include_tags, include_tags, tag_error) || !detail::TagNamesToMask(options.exclude_tags, exclude_tags, tag_error))
+            return Error(tag_error);
+
+        std::map<const detail::TestMap::value_type *, std::vector<const detail::TestMap::value_type *>> all_dependencies;
+        std::vector<std::string> dependency_errors;
+        if (!detail::ResolveDependencies(test_map, all_dependencies, dependency_errors))
+        {
+            for (const std::string &error : dependency_errors)
+                (void)Error(error);
+            return 2;
+        }
+
+        if (options.jobs > 1 && (options.record_impact || options.profile_slow_ms >= 0))
+            return Error("`--record-impact` and `--profile-slow` don't work with `--jobs`.");
+
+        std::vector<const detail::TestMap::value_type *> selected_tests;
+        for (const auto &elem : test_map)
+        {
+            if (!run_exact.empty() && !run_exact.contains(detail::TestId(elem.first)))
+                continue;
+            if (!options.include_tags.empty() && !(elem.second.tags & include_tags))
+                continue;
+            if (elem.second.tags & exclude_tags)
+                continue;
+            if (only_failed && !run_state.HasFailed(elem.first))
+                continue;
+            if (options.only_impacted && !impact_map.IsAffected(elem.first, changed_files, changed_flags))
+                continue;
+            selected_tests.push_back(&elem);
+        }
+        if (selected_tests.empty() && options.list == ListFormat::none)
+        {
+            // This can only happen because of the filters, so it's not an error.
+            if (options.console_output)
+                std::fprintf(stderr, "minitest: No tests match the filters.\n");
+            return 0;
+        }
+
+        if (options.time_budget_ms >= 0)
+        {
+            std::size_t num_candidates = selected_tests.size();
+            detail::TimeBudgetResult budget = detail::ApplyTimeBudget(selected_tests, std::chrono::milliseconds(options.time_budget_ms), run_state, options.state_path);
+            if (options.console_output && !budget.skipped.empty())
+            {
+                std::fprintf(stderr, "minitest: Running %zu of %zu tests (estimated %.1f s) to fit the time budget of %.1f s. Skipping %zu tests (estimated %.1f s):\n",
+                    selected_tests.size(), num_candidates, double(budget.selected_duration.count()) / 1e6, options.time_budget_ms / 1e3, budget.skipped.size(), double(budget.skipped_duration.count()) / 1e6
+                );
+                constexpr std::size_t max_printed = 20;
+                for (std::size_t i = 0; i < budget.skipped.size() && i < max_printed; i++)
+                    std::fprintf(stderr, "    %s (%.1f ms)\n", detail::TestId(budget.skipped[i].first->first).c_str(), double(budget.skipped[i].second.count()) / 1e3);
+                if (budget.skipped.size() > max_printed)
+                    std::fprintf(stderr, "    ... and %zu more\n", budget.skipped.size() - max_printed);
+                std::fprintf(stderr, "\n");
+            }
+            if (selected_tests.empty() && options.list == ListFormat::none)
+                return 0;
+        }
+
+        if (options.list != ListFormat::none)
+        {
+            detail::PrintTestList(selected_tests, options.list, run_state);
+            return 0;
+        }
+
+        // Claim the process-wide features. This goes before the listeners, so it's released after they're destroyed.
+        struct ExclusiveFeaturesGuard
+        {
+            bool claimed = false;
+
+            ~ExclusiveFeaturesGuard()
+            {
+                if (claimed)
+                    detail::exclusive_features_in_use = false;
+            }
+        };
+        ExclusiveFeaturesGuard exclusive_features_guard;
+        if (!options.trace_path.empty() || options.virtual_time || options.profile_slow_ms >= 0)
+        {
+            if (detail::exclusive_features_in_use.exchange(true))
+            {
+                return Error("Another runner is already using the tracing, the virtual time, or the profiler. Only one runner at a time can use them.");
+            }
+            exclusive_features_guard.claimed = true;
+        }
+
+        std::size_t num_tests_per_repetition = selected_tests.size();
+        std::size_t num_tests_failed = 0;
+
+        // Create the built-in listeners. The console goes first, so that its output isn't delayed by the others.
+        // Except for the repetition statistics, which should be printed before the console summary. They don't do anything slow before the end of the run anyway.
+        std::vector<std::unique_ptr<Listener>> builtin_listeners;
+        if (options.repeat > 1 || options.repeat_until_fail || options.retries > 0 || !options.quarantine_path.empty())
+        {
+            auto stats = detail::RepeatStatsListener::Open(options.console_output, options.quarantine_path.c_str());
+            if (!stats)
+            {
+                return Error("Unable to open `" + options.quarantine_path + "` for writing.");
+            }
+            builtin_listeners.push_back(std::move(stats));
+        }
+        if (options.console_output)
+            builtin_listeners.push_back(std::make_unique<detail::ConsoleListener>(options.shuffle ? &options.seed : nullptr));
+        if (!options.junit_path.empty())
+        {
+            auto reporter = detail::JUnitReporter::Open(options.junit_path.c_str());
+            if (!reporter)
+            {
+                return Error("Unable to open `" + options.junit_path + "` for writing.");
+            }
+            builtin_listeners.push_back(std::move(reporter));
+        }
+        if (!options.jsonl_path.empty())
+        {
+            auto reporter = detail::JsonLinesReporter::Open(options.jsonl_path.c_str());
+            if (!reporter)
+            {
+                return Error("Unable to open `" + options.jsonl_path + "` for writing.");
+            }
+            builtin_listeners.push_back(std::move(reporter));
+        }
+        if (!options.binlog_path.empty())
+        {
+            auto reporter = detail::BinaryLogWriter::Open(options.binlog_path.c_str());
+            if (!reporter)
+            {
+                return Error("Unable to open `" + options.binlog_path + "` for writing.");
+            }
+            builtin_listeners.push_back(std::move(reporter));
+        }
+        if (!options.trace_path.empty())
+        {
+            auto reporter = detail::TraceWriter::Open(options.trace_path.c_str());
+            if (!reporter)
+            {
+                return Error("Unable to open `" + options.trace_path + "` for writing.");
+            }
+            builtin_listeners.push_back(std::move(reporter));
+        }
+        if (!options.state_path.empty())
+            builtin_listeners.push_back(std::make_unique<detail::RunStateWriter>(run_state, options.state_path, options.console_output));
+        detail::RunJournal *journal = nullptr;
+        if (!options.resume_path.empty())
+        {
+            auto new_journal = detail::RunJournal::Open(options.resume_path.c_str());
+            if (!new_journal)
+            {
+                return Error("Unable to open `" + options.resume_path + "` for writing.");
             }
-            else
+            journal = new_journal.get();
+            builtin_listeners.push_back(std::move(new_journal));
+        }
+        #if DETAIL_EM_MINITEST_HAVE_CODE_HASH
+        detail::ResultCache *result_cache = nullptr;
+        #endif
+        if (!options.cache_path.empty())
+        {
+            #if DETAIL_EM_MINITEST_HAVE_CODE_HASH
+            auto cache = std::make_unique<detail::ResultCache>(options.cache_path, options.console_output);
+            result_cache = cache.get();
+            builtin_listeners.push_back(std::move(cache));
+            #else
+            return Error("The result cache isn't supported on this platform.");
+            #endif
+        }
+        // The impact recorder goes near the end, to record as little of the other listeners as possible, in case they're instrumented too.
+        if (options.record_impact)
+        {
+            #if DETAIL_EM_MINITEST_HAVE_IMPACT
+            builtin_listeners.push_back(std::make_unique<detail::ImpactRecorder>(std::move(impact_map), options.impact_map_path, options.console_output));
+            #else
+            return Error("Recording the impact map needs the implementation built with `-DEM_MINITEST_INSTRUMENT_HOOKS=1`, with GCC or Clang on an ELF platform.");
+            #endif
+        }
+        // The profiler goes last, to sample as little of the other listeners as possible.
+        if (options.profile_slow_ms >= 0)
+        {
+            #if DETAIL_EM_MINITEST_HAVE_PROFILER
+            auto profiler = detail::SlowTestProfiler::Open(std::chrono::milliseconds(options.profile_slow_ms), options.profile_dir, options.console_output);
+            if (!profiler)
             {
-                // The full printing format.
+                return Error("Unable to create the directory `" + options.profile_dir + "`.");
+            }
+            builtin_listeners.push_back(std::move(profiler));
+            #else
+            return Error("The profiler isn't supported on this platform.");
+            #endif
+        }
 
-                // The table header
-                std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "        Exception:\n", DETAIL_EM_MINITEST_LOG_PARAMS);
-                std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "            %-*s | %s\n", DETAIL_EM_MINITEST_LOG_PARAMS,
-                    (int)max_string_len,
-                    "Caught",
-                    "Expected"
-                );
+        std::vector<Listener *> all_listeners;
+        for (const auto &l : builtin_listeners)
+            all_listeners.push_back(l.get());
+        all_listeners.insert(all_listeners.end(), listeners.begin(), listeners.end());
 
-                // How many exceptions to print. This is the max between the number of caught and expected exceptions.
-                // Don't want to include `<algorithm>` for `std::max()`.
-                std::size_t n = num_caught_exceptions > num_expected_exceptions ? num_caught_exceptions : num_expected_exceptions;
+        if (options.backtrace_on_failure)
+        {
+            #if DETAIL_EM_MINITEST_HAVE_BACKTRACE
+            // The first `backtrace()` call can allocate when loading the unwinder, so make it in advance.
+            void *dummy[1];
+            (void)backtrace(dummy, 1);
+            #else
+            return Error("The backtraces aren't supported on this platform.");
+            #endif
+        }
 
-                for (std::size_t i = 0; i < n; i++)
-                {
-                    const Arg *caught_ex = nullptr;
-                    if (i < num_caught_exceptions)
-                        caught_ex = &caught_exceptions[i];
+        // Register the listeners into the thread-local singleton.
+        detail::cur_listeners = all_listeners;
+        detail::capture_backtraces = options.backtrace_on_failure;
+        detail::trace_test_spans = !options.trace_path.empty();
+        struct ListenersGuard
+        {
+            ~ListenersGuard()
+            {
+                detail::cur_listeners = {};
+                detail::capture_backtraces = false;
+                detail::trace_test_spans = false;
+            }
+        };
+        ListenersGuard listeners_guard;
 
-                    const Arg *expected_ex = nullptr;
-                    if (i < num_expected_exceptions)
-                        expected_ex = &args.begin()[i];
+        // For the whole run, so that the threads started by the tests follow it too.
+        struct VirtualTimeGuard
+        {
+            bool enabled = false;
 
-                    { // The type.
-                        // Caught.
-                        if (caught_ex && !caught_ex->type.empty())
-                        {
-                            std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "            %-*.*s", DETAIL_EM_MINITEST_LOG_PARAMS,
-                                (int)max_string_len,
-                                (int)caught_ex->type.size(),
-                                caught_ex->type.data()
-                            );
-                        }
-                        else
-                        {
-                            std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "            %-*s", DETAIL_EM_MINITEST_LOG_PARAMS,
-                                (int)max_string_len,
-                                caught_ex ? "(unknown)" : "(none)"
-                            );
-                        }
+            ~VirtualTimeGuard()
+            {
+                if (enabled)
+                    detail::GetVirtualTime().SetEnabled(false);
+            }
+        };
+        VirtualTimeGuard virtual_time_guard{.enabled = options.virtual_time};
+        if (options.virtual_time)
+            detail::GetVirtualTime().SetEnabled(true);
 
-                        // Matches or not?
-                        if (caught_ex && expected_ex && caught_ex->type == expected_ex->type)
-                            std::fprintf(stderr, " | ");
-                        else
-                            std::fprintf(stderr, " # ");
+        // The `TempDir()`s of the tests. The destructor waits for them to be removed, so none are left after the run.
+        detail::TempDirs temp_dirs;
 
-                        // Expected.
-                        if (expected_ex)
-                            std::fprintf(stderr, "%.*s\n", (int)expected_ex->type.size(), expected_ex->type.data());
-                        else
-                            std::fprintf(stderr, "(none)\n");
-                    }
+        for (Listener *l : all_listeners)
+            l->OnRunStart(num_tests_per_repetition);
 
-                    { // The message.
-                        SplitString2(
-                            caught_ex && !caught_ex->type.empty() ? caught_ex->message : std::string_view{}, // Not `""` to force a null `.data()`, which has a special meaning, see below.
-                            expected_ex && !expected_ex->type.empty() ? expected_ex->message : std::string_view{}, // Not `""` to force a null `.data()`, which has a special meaning, see below.
-                            "\n",
-                            [&](std::string_view caught_line, std::string_view expected_line)
-                            {
-                                // Notice that `.data()` of the parameters can be `nullptr`, which has a special effect. It means we ran out of segments in that string.
-
-                                std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "           %*s%c%-*.*s %c    %c%.*s\n", DETAIL_EM_MINITEST_LOG_PARAMS,
-                                    (int)message_indent, "",
-                                    caught_line.data() ? ' ' : '.', // Missing caught line indicator.
-                                    int(max_string_len - message_indent), (int)caught_line.size(), caught_line.data(),
-                                    caught_line.data() && expected_line.data() && caught_line == expected_line ? '|' : '#',
-                                    expected_line.data() ? ' ' : '.', // Missing expected line indicator.
-                                    (int)expected_line.size(), expected_line.data()
-                                );
-                                return false;
-                            }
-                        );
+        // Run the tests.
+        std::chrono::steady_clock::time_point deadline = detail::RealNow() + std::chrono::milliseconds(options.max_run_time_ms);
+        auto IsOutOfTime = [&](std::chrono::nanoseconds expected_duration)
+        {
+            return options.max_run_time_ms >= 0 && detail::RealNow() + expected_duration > deadline;
+        };
+        std::size_t num_runs = 0;
+        std::size_t num_cached = 0;
+        std::size_t num_out_of_time = 0;
+        std::size_t num_skipped = 0;
+        std::size_t num_repetitions = 0;
+        bool repeating = options.repeat > 1 || options.repeat_until_fail;
+        std::size_t max_repetitions = options.repeat_until_fail && options.repeat <= 1 ? std::size_t(-1) : options.repeat;
+        // The dependencies between the selected tests, as indices into `selected_tests`.
+        std::vector<std::vector<std::size_t>> dependencies(selected_tests.size());
+        std::vector<std::vector<std::size_t>> dependents(selected_tests.size());
+        if (!all_dependencies.empty())
+        {
+            std::unordered_map<const detail::TestMap::value_type *, std::size_t> indices;
+            for (std::size_t i = 0; i < selected_tests.size(); i++)
+                indices.try_emplace(selected_tests[i], i);
+            for (std::size_t i = 0; i < selected_tests.size(); i++)
+            {
+                auto iter = all_dependencies.find(selected_tests[i]);
+                if (iter == all_dependencies.end())
+                    continue;
+                for (const detail::TestMap::value_type *dep : iter->second)
+                {
+                    if (auto dep_iter = indices.find(dep); dep_iter != indices.end())
+                    {
+                        dependencies[i].push_back(dep_iter->second);
+                        dependents[dep_iter->second].push_back(i);
                     }
                 }
             }
-
-            #if EM_MINITEST_EXCEPTIONS
-            if (stop_on_failure)
-                throw InterruptTestException{};
-            #endif
         }
-        #endif
-    }
-
-    int RunTests(int argc, char **argv)
-    {
-        (void)argc;
-        (void)argv;
-
-        std::string_view cur_file;
 
-        const auto &test_map = detail::GetTestMap();
-
-        if (test_map.empty())
+        auto ShouldRetry = [&](const TestResult &result, std::size_t attempt)
         {
-            std::fprintf(stderr, "minitest: No tests to run.\n");
-            return 1; // For now this is an error. It should probably be allowed if caused by filtering (which we don't have yet).
-        }
+            return result.failed && attempt < options.retries && !IsOutOfTime(result.duration);
+        };
 
-        std::size_t num_tests_ran = 0; // The loop gradually increments this, so at the end this will match `num_tests_total`.
-        std::size_t num_tests_total = test_map.size();
+        // The tests that finished on the other threads, for us to report them.
+        detail::FinishedJobQueue finished_jobs;
 
-        std::vector<const std::remove_cvref_t<decltype(test_map)>::value_type *> failed_tests;
-        std::size_t failed_tests_max_name_len = 0;
+        std::unique_ptr<detail::TestThreadPool> thread_pool;
+        if (options.jobs > 1)
+            thread_pool = std::make_unique<detail::TestThreadPool>(std::min(options.jobs, selected_tests.size()), options.backtrace_on_failure, !options.trace_path.empty(), temp_dirs, finished_jobs, ShouldRetry);
 
-        // We need this much whitespace: "  0 failed"
-        std::string str_failed_counter = "          ";
+        // The async tests run together on a separate thread. But one at a time (like the normal tests) if something observes the whole process during each test.
+        std::unique_ptr<detail::AsyncTestLoop> async_loop;
+        #if DETAIL_EM_MINITEST_HAVE_EPOLL
+        if (!options.record_impact && options.profile_slow_ms < 0 && std::any_of(selected_tests.begin(), selected_tests.end(), [](const auto *elem){return elem->second.async_func;}))
+            async_loop = std::make_unique<detail::AsyncTestLoop>(&finished_jobs, &temp_dirs, options.backtrace_on_failure, !options.trace_path.empty(), ShouldRetry);
+        #endif
 
-        // Run the tests.
-        for (const auto &elem : test_map)
+        std::vector<std::size_t> order; // Indices into `selected_tests`.
+        std::vector<std::size_t> positions(selected_tests.size()); // Indices into `order`.
+        std::vector<std::size_t> num_pending_dependencies(selected_tests.size());
+        std::vector<detail::TestStatus> statuses(selected_tests.size());
+        for (std::size_t repetition = 0; repetition < max_repetitions; repetition++)
         {
-            num_tests_ran++; // Increment this before logging.
+            if (repeating)
+            {
+                for (Listener *l : all_listeners)
+                    l->OnRepetitionStart(repetition);
+            }
 
-            bool fail_test = false;
+            std::string_view cur_file;
+            bool repetition_failed = false;
 
-            using Clock = std::chrono::steady_clock;
-            Clock::time_point test_start_time; // This gets set later, right before running the test.
-            Clock::time_point test_end_time; // This gets set later, right after running the test.
+            // Decide the test order.
+            order.resize(selected_tests.size());
+            for (std::size_t i = 0; i < order.size(); i++)
+                order[i] = i;
+            if (options.shuffle)
+            {
+                // Fisher-Yates. Not using `std::shuffle()`, because its algorithm differs between the standard libraries, and we want the seeds to be portable.
+                RandomGenerator gen(detail::MixSeed(options.seed, repetition));
+                for (std::size_t i = order.size(); i > 1; i--)
+                    std::swap(order[i - 1], order[gen() % i]);
+            }
+            if (options.failed_first)
+                std::stable_partition(order.begin(), order.end(), [&](std::size_t i){return run_state.HasFailed(selected_tests[i]->first);});
 
-            std::string str_test_counters = std::to_string(num_tests_ran) + "/" + std::to_string(num_tests_total);
+            // The tests start in this order, except that each one waits for its dependencies.
+            // The ones that can start are kept here, by their positions in `order`.
+            std::priority_queue<std::size_t, std::vector<std::size_t>, std::greater<>> ready;
+            for (std::size_t pos = 0; pos < order.size(); pos++)
+            {
+                std::size_t i = order[pos];
+                positions[i] = pos;
+                statuses[i] = detail::TestStatus::pending;
+                num_pending_dependencies[i] = dependencies[i].size();
+                if (dependencies[i].empty())
+                    ready.push(pos);
+            }
+            std::size_t num_running = 0; // On the other threads.
+            std::size_t num_async_running = 0; // In `async_loop`.
 
-            auto LogPrePostRunTest = [&](bool post)
+            auto Finish = [&](std::size_t i, detail::TestStatus status)
             {
-                // This should be first.
-                // After the test, flush all the user streams.
-                // If we don't do this, then the output isn't interleaved correctly when mixing stdout and stderr (even on pure C streams),
-                //   when both streams are redirected to the same file.
-                if (post)
+                statuses[i] = status;
+                for (std::size_t dependent : dependents[i])
                 {
-                    std::fflush(stdout);
-                    std::fflush(stderr);
+                    if (--num_pending_dependencies[dependent] == 0)
+                        ready.push(positions[dependent]);
                 }
-
-                // Update test counters width.
-                detail::test_counters_width = std::max(str_test_counters.size(), str_failed_counter.size());
-
+            };
+            auto FinishWithResult = [&](std::size_t i, bool failed)
+            {
+                num_runs++;
+                if (failed)
+                {
+                    num_tests_failed++;
+                    repetition_failed = true;
+                }
+                Finish(i, failed ? detail::TestStatus::failed : detail::TestStatus::passed);
+            };
+            auto NotifyTestStart = [&](const TestDesc &desc)
+            {
                 // Are we switching to a different file?
-                if (cur_file != elem.first.file)
+                if (cur_file != desc.file)
                 {
-                    cur_file = elem.first.file;
-                    for (std::size_t i = 0; i < detail::test_counters_width; i++)
-                        std::fputc('#', stderr);
-                    std::fprintf(stderr, " [ file   ] --- %s\n", cur_file.data()); // This is guaranteed to be null-terminated.
+                    cur_file = desc.file;
+                    for (Listener *l : all_listeners)
+                        l->OnFileStart(cur_file);
                 }
+                for (Listener *l : all_listeners)
+                    l->OnTestStart(desc);
+            };
+            auto NotifyTestEnd = [&](const TestDesc &desc, const TestResult &result)
+            {
+                for (Listener *l : all_listeners)
+                    l->OnTestEnd(desc, result);
+            };
 
-                // Test counters.
-                std::fprintf(stderr, "%-*s", (int)detail::test_counters_width, post ? str_failed_counter.c_str() : str_test_counters.c_str());
+            while (!ready.empty() || num_running > 0 || num_async_running > 0)
+            {
+                // Report the tests that finished on the other threads or in the event loop.
+                // Wait for them if we can't start more tests right now. The async tests don't take up the threads, so they can start even if all threads are busy.
+                if (num_running > 0 || num_async_running > 0)
+                {
+                    std::optional<detail::TestJob> job;
+                    if (ready.empty() || (num_running >= options.jobs && !(async_loop && selected_tests[order[ready.top()]]->second.async_func)))
+                        job = finished_jobs.Pop();
+                    else
+                        job = finished_jobs.TryPop();
+                    if (job)
+                    {
+                        if (async_loop && job->test->second.async_func)
+                            num_async_running--;
+                        else
+                            num_running--;
 
-                // Explain what we're doing with this test.
-                std::fprintf(stderr, " %s", !post ? "[ run    ]" : fail_test ? "[   FAIL ]" : "[     OK ]");
+                        for (const detail::TestJob::Attempt &attempt : job->attempts)
+                        {
+                            NotifyTestStart(job->test->first);
+                            detail::RunJournal::ReplayFailures(attempt.failures, all_listeners);
+                            known_durations.insert_or_assign(job->test->first, attempt.result.duration);
+                            NotifyTestEnd(job->test->first, attempt.result);
+                        }
+                        FinishWithResult(job->index, job->attempts.back().result.failed);
+                        continue;
+                    }
+                }
 
-                // Test name.
-                std::fprintf(stderr, " %s", elem.first.name.data()); // This is always null-terminated.
+                std::size_t index = order[ready.top()];
+                ready.pop();
+                const detail::TestMap::value_type *elem = selected_tests[index];
 
-                // Print the elapsed time.
-                if (post)
+                bool dependency_failed = false;
+                bool dependency_out_of_time = false;
+                for (std::size_t dep : dependencies[index])
                 {
-                    auto t = std::chrono::duration_cast<std::chrono::microseconds>(test_end_time - test_start_time).count();
-                    std::fprintf(stderr, " (%.1f ms)", t / 1000.0);
+                    dependency_failed |= statuses[dep] == detail::TestStatus::failed || statuses[dep] == detail::TestStatus::skipped;
+                    dependency_out_of_time |= statuses[dep] == detail::TestStatus::out_of_time;
+                }
+                if (dependency_failed)
+                {
+                    NotifyTestStart(elem->first);
+                    NotifyTestEnd(elem->first, TestResult{.skipped = true});
+                    num_skipped++;
+                    Finish(index, detail::TestStatus::skipped);
+                    continue;
                 }
 
-                // Print the source location of failed tests.
-                if (post && fail_test)
-                    std::fprintf(stderr, "   at:  %s:%d", elem.first.file.data(), elem.first.line); // `elem.first.file` is always null-terminated.
+                if (options.max_run_time_ms >= 0)
+                {
+                    std::chrono::nanoseconds expected_duration{};
+                    if (auto iter = known_durations.find(elem->first); iter != known_durations.end())
+                        expected_duration = iter->second;
+                    else if (const detail::RunState::Entry *entry = run_state.Find(elem->first); entry && entry->has_duration)
+                        expected_duration = entry->duration;
+                    if (dependency_out_of_time || IsOutOfTime(expected_duration))
+                    {
+                        num_out_of_time++;
+                        Finish(index, detail::TestStatus::out_of_time);
+                        continue;
+                    }
+                }
 
-                std::fputc('\n', stderr);
+                if (const detail::RunJournal::Record *record = journal ? journal->FindFinished(repetition, elem->first) : nullptr)
+                {
+                    NotifyTestStart(elem->first);
+                    detail::RunJournal::ReplayFailures(record->failures, all_listeners);
+                    NotifyTestEnd(elem->first, TestResult{.failed = record->failed, .duration = record->duration, .resumed = true});
+                    FinishWithResult(index, record->failed);
+                    continue;
+                }
 
-                // This should be last.
-                // Flush stderr before running the user test. Our framework doesn't write to `stdout` (only the user can), so that doesn't need to be flushed.
-                // See the beginning of this function for more details.
-                if (post)
-                    std::fflush(stderr);
-            };
+                #if DETAIL_EM_MINITEST_HAVE_CODE_HASH
+                if (result_cache && !options.force && result_cache->IsCachedPass(elem->first))
+                {
+                    NotifyTestStart(elem->first);
+                    NotifyTestEnd(elem->first, TestResult{.cached = true});
+                    num_cached++;
+                    FinishWithResult(index, false);
+                    continue;
+                }
+                #endif
 
-            // Log pre run test.
-            LogPrePostRunTest(false);
+                if (journal)
+                    journal->OnTestRun(repetition, elem->first);
 
-            { // Run the test. Here we need a scope for RAII purposes.
-                // Register the test pass flag into the thread-local singleton.
-                detail::fail_test_ptr = &fail_test;
-                struct Guard
+                if (async_loop && elem->second.async_func)
                 {
-                    ~Guard()
+                    async_loop->AddJob({.index = index, .test = elem, .seed = detail::TestSeed(options.seed, repetition, elem->first), .attempts = {}});
+                    num_async_running++;
+                    continue;
+                }
+
+                if (thread_pool)
+                {
+                    thread_pool->AddJob({.index = index, .test = elem, .seed = detail::TestSeed(options.seed, repetition, elem->first), .attempts = {}});
+                    num_running++;
+                    continue;
+                }
+
+                for (std::size_t attempt = 0;; attempt++)
+                {
+                    NotifyTestStart(elem->first);
+
+                    TestResult result = detail::RunOneTest(elem->first, elem->second, detail::TestSeed(options.seed, repetition, elem->first), temp_dirs);
+                    result.will_retry = ShouldRetry(result, attempt);
+                    known_durations.insert_or_assign(elem->first, result.duration);
+
+                    NotifyTestEnd(elem->first, result);
+
+                    if (!result.will_retry)
                     {
-                        detail::fail_test_ptr = nullptr;
+                        FinishWithResult(index, result.failed);
+                        break;
                     }
-                };
-                Guard guard;
+                }
+            }
 
-                // Begin measuring time.
-                test_start_time = Clock::now();
+            num_repetitions++;
+            if (options.repeat_until_fail && repetition_failed)
+                break;
+        }
 
-                // Run the test.
-                DETAIL_EM_MINITEST_RUN_WITH_CATCH(
-                    false,
-                    [&]
-                    {
-                        elem.second.func();
-                        return false; // The return value doesn't matter.
-                    },
-                    [&]
-                    {
-                        fail_test = true;
+        RunSummary summary{.num_tests = num_runs, .num_failed = num_tests_failed, .num_repetitions = num_repetitions, .num_cached = num_cached, .num_out_of_time = num_out_of_time, .num_skipped = num_skipped};
+        for (Listener *l : all_listeners)
+            l->OnRunEnd(summary);
 
-                        // Flush the user output.
-                        std::fflush(stdout);
-                        std::fflush(stderr);
+        return num_tests_failed == 0 ? 0 : 1;
+    }
 
-                        std::fprintf(stderr, DETAIL_EM_MINITEST_LOG_STR "    Uncaught exception:\n", DETAIL_EM_MINITEST_LOG_PARAMS);
-                        detail::PrintCurrentException("        ");
-                    }
-                );
+    namespace detail
+    {
+        // Collects the results for `RunSelfTest()`.
+        class SelfTestCollector final : public Listener
+        {
+            SelfTestResult &result;
+            std::map<TestDesc, std::size_t> indices; // Into `result.tests`.
+            SelfTestResult::Test *cur_test = nullptr;
+
+          public:
+            explicit SelfTestCollector(SelfTestResult &result)
+                : result(result)
+            {
+                for (std::size_t i = 0; i < result.tests.size(); i++)
+                    indices.try_emplace(result.tests[i].test, i);
             }
 
-            // Finish measuring time.
-            test_end_time = Clock::now();
+            void OnTestStart(const TestDesc &test) override
+            {
+                auto iter = indices.find(test);
+                cur_test = iter == indices.end() ? nullptr : &result.tests[iter->second];
+                if (cur_test)
+                    cur_test->failures.clear(); // In case of a retry.
+            }
 
-            // Did the test fail? Do this before logging to log the updated count.
-            if (fail_test)
+            void OnFailure(const FailureInfo &info) override
             {
-                failed_tests.push_back(&elem);
+                if (!cur_test)
+                    return;
+                std::string &text = cur_test->failures.emplace_back();
+                AppendFailureText(text, info);
+                if (text.ends_with('\n'))
+                    text.pop_back();
+            }
 
-                str_failed_counter.clear();
-                if (failed_tests.size() < 100)
-                    str_failed_counter += ' ';
-                if (failed_tests.size() < 10)
-                    str_failed_counter += ' ';
-                str_failed_counter += std::to_string(failed_tests.size()) + " failed";
+            void OnTestEnd(const TestDesc &test, const TestResult &test_result) override
+            {
+                (void)test;
+                if (!cur_test)
+                    return;
+                cur_test->out_of_time = false;
+                cur_test->skipped = test_result.skipped;
+                cur_test->failed = test_result.failed;
+                cur_test->duration = test_result.duration;
+            }
 
-                if (elem.first.name.size() > failed_tests_max_name_len)
-                    failed_tests_max_name_len = elem.first.name.size();
+            void OnRunError(std::string_view message) override
+            {
+                result.invalid_options = true;
+                result.errors.emplace_back(message);
             }
+        };
+
+        // Makes the current thread only run when a CPU core is otherwise idle. Does nothing if not supported.
+        static void LowerCurrentThreadPriority()
+        {
+            #if DETAIL_EM_MINITEST_HAVE_THREAD_PRIORITY
+            #ifdef SCHED_IDLE
+            sched_param param{};
+            if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) == 0)
+                return;
+            #endif
+            // On Linux, this only affects the current thread.
+            (void)setpriority(PRIO_PROCESS, 0, 19);
+            #endif
+        }
+    }
 
-            // Log post run test.
-            LogPrePostRunTest(true);
+    SelfTestResult RunSelfTest(const SelfTestOptions &options, TestRunner &runner)
+    {
+        SelfTestResult ret;
+
+        // Validate the tags ourselves, because we need the mask to list the tests in advance.
+        detail::TagMask mask = 0;
+        std::string tag_error;
+        if (!detail::TagNamesToMask(options.tags, mask, tag_error))
+        {
+            ret.invalid_options = true;
+            ret.errors.push_back(std::move(tag_error));
+            return ret;
         }
 
-        { // Log summary.
-            if (failed_tests.empty())
+        for (const auto &elem : detail::GetTestMap())
+        {
+            if (options.tags.empty() || (elem.second.tags & mask))
             {
-                std::fprintf(stderr, "\nAll %zu test%s passed\n", num_tests_total, num_tests_total == 1 ? "" : "s");
+                SelfTestResult::Test &test = ret.tests.emplace_back();
+                test.test = elem.first;
+                test.out_of_time = true;
             }
-            else
-            {
-                std::fprintf(stderr, "\nFailed tests:\n");
-                for (const auto *elem : failed_tests)
-                {
-                    std::fprintf(stderr, "    %-*s   at:  %s:%d\n", (int)failed_tests_max_name_len, elem->first.name.data(), elem->first.file.data(), elem->first.line);
-                }
+        }
+        if (ret.tests.empty())
+            return ret;
+
+        RunOptions &run_options = runner.GetOptions();
+        run_options = {};
+        run_options.console_output = false;
+        run_options.include_tags = options.tags;
+        run_options.max_run_time_ms = int(std::min(options.max_run_time.count(), std::chrono::milliseconds::rep(std::numeric_limits<int>::max())));
+
+        detail::SelfTestCollector collector(ret);
+        Listener *listener = &collector;
+        (void)runner.Run({&listener, 1});
+        if (ret.invalid_options)
+            ret.tests.clear(); // Nothing ran.
+        return ret;
+    }
+
+    SelfTestResult RunSelfTest(const SelfTestOptions &options)
+    {
+        TestRunner runner;
+        return RunSelfTest(options, runner);
+    }
 
-                std::fprintf(stderr, "\nRan %zu test%s, %zu passed, %zu FAILED\n", num_tests_total, num_tests_total == 1 ? "" : "s", num_tests_total - failed_tests.size(), failed_tests.size());
+    struct BackgroundSelfTest::State
+    {
+        std::mutex mutex;
+        std::condition_variable cond_var;
+        bool stop = false;
+        std::thread thread;
+    };
+
+    BackgroundSelfTest::BackgroundSelfTest(SelfTestOptions options, std::chrono::milliseconds period, std::function<void(const SelfTestResult &result)> callback)
+        : state(std::make_unique<State>())
+    {
+        state->thread = std::thread([state = state.get(), options = std::move(options), period, callback = std::move(callback)]
+        {
+            detail::LowerCurrentThreadPriority();
+
+            // Reusing the runner, to skip the tests that don't fit into the time limit in advance.
+            TestRunner runner;
+            std::unique_lock lock(state->mutex);
+            while (!state->stop)
+            {
+                lock.unlock();
+                SelfTestResult result = RunSelfTest(options, runner);
+                if (callback)
+                    callback(result);
+                lock.lock();
+                state->cond_var.wait_for(lock, period, [&]{return state->stop;});
             }
+        });
+    }
+
+    BackgroundSelfTest::~BackgroundSelfTest()
+    {
+        {
+            std::lock_guard lock(state->mutex);
+            state->stop = true;
+        }
+        state->cond_var.notify_all();
+        state->thread.join();
+    }
+}
+
+#if DETAIL_EM_MINITEST_HAVE_TIME_HOOKS
+// The replacements of the libc time functions, for `--virtual-time`. They forward to the real ones when the virtual time is disabled.
+extern "C"
+{
+    EM_MINITEST_API int clock_gettime(clockid_t clock, timespec *time) noexcept
+    {
+        using namespace em::minitest::detail;
+        int ret = GetRealTimeFunctions().clock_gettime(clock, time);
+        if (ret == 0 && IsVirtualClock(clock))
+        {
+            if (std::chrono::nanoseconds offset = GetVirtualTime().Offset(); offset.count() != 0)
+                *time = DurationToTimespec(TimespecToDuration(*time) + offset);
         }
+        return ret;
+    }
+
+    EM_MINITEST_API int nanosleep(const timespec *duration, timespec *remaining)
+    {
+        using namespace em::minitest::detail;
+        VirtualTime &virtual_time = GetVirtualTime();
+        if (!virtual_time.IsEnabled())
+            return GetRealTimeFunctions().nanosleep(duration, remaining);
+        if (duration->tv_sec < 0 || duration->tv_nsec < 0 || duration->tv_nsec >= 1'000'000'000)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        virtual_time.SleepUntil(virtual_time.Now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(TimespecToDuration(*duration)));
+        return 0;
+    }
+
+    EM_MINITEST_API int clock_nanosleep(clockid_t clock, int flags, const timespec *time, timespec *remaining)
+    {
+        using namespace em::minitest::detail;
+        VirtualTime &virtual_time = GetVirtualTime();
+        if (!virtual_time.IsEnabled() || !IsVirtualClock(clock))
+            return GetRealTimeFunctions().clock_nanosleep(clock, flags, time, remaining);
+        if (time->tv_sec < 0 || time->tv_nsec < 0 || time->tv_nsec >= 1'000'000'000)
+            return EINVAL;
+
+        std::chrono::nanoseconds duration = TimespecToDuration(*time);
+        if (flags & TIMER_ABSTIME)
+        {
+            // Relative to the virtual time on that clock.
+            timespec now{};
+            GetRealTimeFunctions().clock_gettime(clock, &now);
+            duration -= TimespecToDuration(now) + virtual_time.Offset();
+        }
+        virtual_time.SleepUntil(virtual_time.Now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(duration));
+        return 0;
+    }
+
+    // Those two call `nanosleep()` in libc directly, so they need their own replacements.
+    EM_MINITEST_API int usleep(useconds_t duration)
+    {
+        using namespace em::minitest::detail;
+        VirtualTime &virtual_time = GetVirtualTime();
+        if (!virtual_time.IsEnabled())
+            return GetRealTimeFunctions().usleep(duration);
+        virtual_time.SleepUntil(virtual_time.Now() + std::chrono::microseconds(duration));
+        return 0;
+    }
+
+    EM_MINITEST_API unsigned int sleep(unsigned int seconds)
+    {
+        using namespace em::minitest::detail;
+        VirtualTime &virtual_time = GetVirtualTime();
+        if (!virtual_time.IsEnabled())
+            return GetRealTimeFunctions().sleep(seconds);
+        virtual_time.SleepUntil(virtual_time.Now() + std::chrono::seconds(seconds));
+        return 0;
+    }
+
+    // The timed waits on the condition variables (e.g. `std::condition_variable::wait_for()`) get the deadlines in the virtual time,
+    //   because they compute them from `clock_gettime()`. We convert them back to the real time. Those waits take as long as usual.
+    EM_MINITEST_API int pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex, const timespec *time)
+    {
+        using namespace em::minitest::detail;
+        std::chrono::nanoseconds offset = GetVirtualTime().Offset();
+        if (offset.count() == 0)
+            return GetRealTimeFunctions().pthread_cond_timedwait(cond, mutex, time);
+        timespec real_time = DurationToTimespec(TimespecToDuration(*time) - offset);
+        return GetRealTimeFunctions().pthread_cond_timedwait(cond, mutex, &real_time);
+    }
+
+    EM_MINITEST_API int pthread_cond_clockwait(pthread_cond_t *cond, pthread_mutex_t *mutex, clockid_t clock, const timespec *time)
+    {
+        using namespace em::minitest::detail;
+        auto real_func = GetRealTimeFunctions().pthread_cond_clockwait;
+        if (!real_func)
+            return EINVAL;
+        std::chrono::nanoseconds offset = GetVirtualTime().Offset();
+        if (offset.count() == 0 || !IsVirtualClock(clock))
+            return real_func(cond, mutex, clock, time);
+        timespec real_time = DurationToTimespec(TimespecToDuration(*time) - offset);
+        return real_func(cond, mutex, clock, &real_time);
+    }
+}
+#endif
+
+#if DETAIL_EM_MINITEST_HAVE_IMPACT
+// The hooks that `-finstrument-functions` inserts calls to, for `--record-impact`. They do nothing when not recording.
+extern "C"
+{
+    [[gnu::no_instrument_function]] EM_MINITEST_API void __cyg_profile_func_enter(void *func, void *call_site)
+    {
+        (void)call_site;
+        auto *functions = em::minitest::detail::impact_functions;
+        if (!functions)
+            return;
+        // Resetting the pointer while inserting, in case the implementation itself is instrumented.
+        em::minitest::detail::impact_functions = nullptr;
+        functions->insert(func);
+        em::minitest::detail::impact_functions = functions;
+    }
 
-        return failed_tests.empty() ? 0 : 1;
+    [[gnu::no_instrument_function]] EM_MINITEST_API void __cyg_profile_func_exit(void *func, void *call_site)
+    {
+        (void)func;
+        (void)call_site;
     }
 }
 #endif
+#endif
 
 // Defines the main function. This is optional, you can call `em::minitest::RunTests()` yourself.
 #define EM_MINITEST_MAIN \
     int main(int argc, char **argv) {return ::em::minitest::RunTests(argc, argv);}
 
 // Declare a test: `EM_TEST(identifier) {body...}`. Only usable in .cpp files. Trying to use those in headers will cause multiple definition errors.
-#define EM_TEST(name) DETAIL_EM_MINITEST_TEST(name, DETAIL_EM_MINITEST_CAT(__test_,name))
+// Optionally with tags, as string literals: `EM_TEST(identifier, "slow", "io") {body...}`. The tags can be used to select the tests, see `RunOptions::include_tags`.
+// A `"depends:other_test"` instead of a tag makes the test depend on `other_test`. It then runs after `other_test`, and is skipped if that fails or is skipped.
+//   The name refers to the test in the same file if there's one, otherwise it must be unique among all tests.
+//   The dependencies that aren't selected to run (e.g. because of `--tags`) don't affect the test.
+#define EM_TEST(name, ...) DETAIL_EM_MINITEST_TEST(name, DETAIL_EM_MINITEST_CAT(__test_,name), void, register_test __VA_OPT__(,) __VA_ARGS__)
+
+// Declare an async test: `EM_TEST_ASYNC(identifier) {body...}`, where the body is a coroutine, e.g. `co_await SleepFor(10ms);`. The tags work the same as in `EM_TEST()`.
+// The async tests run all at once on a thread of their own, alongside the other tests, switching between them whenever they `co_await` a timer or a file descriptor (see `SleepFor()`).
+// The checks work as usual, and report the failures to the test that made them. But `co_await` can't be used inside of them, await into a variable first.
+// Don't block in those tests, use `WaitReadable()` and `WaitWritable()` instead.
+// They run one at a time with `--record-impact` and `--profile-slow`, and on the platforms other than Linux (where they can only await the timers).
+#define EM_TEST_ASYNC(name, ...) DETAIL_EM_MINITEST_TEST(name, DETAIL_EM_MINITEST_CAT(__test_,name), ::em::minitest::Task<>, register_async_test __VA_OPT__(,) __VA_ARGS__)
 
 // Evaluate an assertion: `EM_CHECK(cond)`. The condition doesn't have to be a boolean, anything that `if (...)` accepts is fine.
 // Returns the `bool` value of the condition.
@@ -999,18 +7771,22 @@ namespace em::minitest
 // Like `EM_MUST_THROW()`, but doesn't immediately stop the test on failure. The test will still fail when it finishes executing.
 #define EM_MUST_THROW_SOFT(...) DETAIL_EM_MINITEST_MUST_THROW(false, #__VA_ARGS__, __VA_ARGS__)
 
+// Records the rest of the current scope as a span in the trace, if enabled with `--trace=<file>`: `EM_TRACE_SCOPE("name")`.
+// The name must outlive the test run, normally it's a string literal.
+#define EM_TRACE_SCOPE(name_) ::em::minitest::TraceScope DETAIL_EM_MINITEST_CAT(__em_trace_scope_,__LINE__)(name_)
+
 // Internal macros:
 
-#define DETAIL_EM_MINITEST_TEST(name_, func_name_) \
+#define DETAIL_EM_MINITEST_TEST(name_, func_name_, return_type_, register_, ...) \
     /* Make sure we're at namespace scope. */\
     namespace {} \
-    static void func_name_(); \
+    static return_type_ func_name_(); \
     /* This is non-static to error on test definitions in headers (which aren't useful anyway, because in general a header might be included in no TUs). */\
     /* The different parameter types are used to make the tests with the same name but different locations not collide with each other. */\
     /* Note that the function pointer */\
-    auto __em_register_test(::em::minitest::detail::ConstTestDesc<__FILE__, __LINE__, #name_> __em_desc) {return decltype(__em_desc)::register_test<func_name_>;}\
+    auto __em_register_test(::em::minitest::detail::ConstTestDesc<__FILE__, __LINE__, #name_> __em_desc) {return decltype(__em_desc)::register_<func_name_ __VA_OPT__(,) __VA_ARGS__>;}\
     /* This is static to allow different TUs to use the same test names. */\
-    static void func_name_()
+    static return_type_ func_name_()
 
 #define DETAIL_EM_MINITEST_ASSERT(stop_on_failure_, expr_str_, ...) \
     ::em::minitest::detail::Assert(stop_on_failure_, __FILE__, __LINE__, expr_str_, [&]() -> bool {return (__VA_ARGS__) ? true : false;})
@@ -0,0 +1,679 @@
+// A driver for many test executables: runs them in parallel, and merges their results into one summary and one set of reports.
+// Build it with e.g. `clang++ -std=c++23 -O2 -Iinclude src/minitest_driver.cpp -o minitest_driver`.
+// Only on Linux.
+//
+// Usage:
+//   minitest_driver [options...] <executable>... [-- flags...]
+//       The flags after `--` are passed to every executable.
+//
+// Options:
+//   --jobs=<n>          Run at most this many executables at once. By default, one per core.
+//   --mem-limit=<MB>    The total memory the running executables may use. By default, the available memory at startup.
+//   --history=<file>    Remember the duration and the peak memory usage of each executable in this file (`minitest_driver.history` by default).
+//   --junit=<file>      Write a merged JUnit XML report to this file.
+//   --jsonl=<file>      Write a merged JSON Lines report to this file. Each test gets an extra `"executable"` field.
+//   --verbose           Print the output of the passing executables too, not only of the failing ones.
+//
+// The executables that took the longest last time are started first, so that they don't end up running alone at the end.
+// The ones without history are started before all others, since they could be long too.
+// An executable is only started if its peak memory usage from last time (or 64 MB if unknown) fits into the limit, alongside the ones already running,
+//   and if the system still has that much memory available. At least one executable is always running.
+// The output of each executable is captured in a temporary file, and printed when it finishes, so the outputs don't interleave.
+// The per-test results are collected from the `--jsonl` reports of the executables.
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <map>
+#include <span>
+#include <string_view>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+namespace
+{
+    [[noreturn]] void Fail(const std::string &message)
+    {
+        std::fprintf(stderr, "minitest_driver: %s\n", message.c_str());
+        std::exit(2);
+    }
+
+    // Returns true if `arg` is `name=value`, and writes the value.
+    [[nodiscard]] bool ParseFlagWithValue(std::string_view arg, std::string_view name, std::string_view &value)
+    {
+        if (!arg.starts_with(name) || arg.size() <= name.size() || arg[name.size()] != '=')
+            return false;
+        value = arg.substr(name.size() + 1);
+        return true;
+    }
+
+    template <typename T>
+    [[nodiscard]] bool ParseNumber(std::string_view str, T &value)
+    {
+        auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), value);
+        return ec == std::errc{} && ptr == str.data() + str.size();
+    }
+
+    // Returns false if the file can't be read.
+    [[nodiscard]] bool ReadFile(const std::string &path, std::string &out)
+    {
+        out.clear();
+        std::FILE *file = std::fopen(path.c_str(), "rb");
+        if (!file)
+            return false;
+        char buf[4096];
+        while (std::size_t n = std::fread(buf, 1, sizeof buf, file))
+            out.append(buf, n);
+        std::fclose(file);
+        return true;
+    }
+
+    void AppendJsonString(std::string &out, std::string_view str)
+    {
+        out += '"';
+        for (char ch : str)
+        {
+            switch (ch)
+            {
+                case '"':  out += "\\\""; break;
+                case '\\': out += "\\\\"; break;
+                case '\n': out += "\\n"; break;
+                case '\r': out += "\\r"; break;
+                case '\t': out += "\\t"; break;
+                default:
+                    if ((unsigned char)ch < 0x20)
+                    {
+                        char buf[8];
+                        std::snprintf(buf, sizeof buf, "\\u%04x", (unsigned)(unsigned char)ch);
+                        out += buf;
+                    }
+                    else
+                    {
+                        out += ch;
+                    }
+                    break;
+            }
+        }
+        out += '"';
+    }
+
+    // Reads one value from a line of a `--jsonl` report. This isn't a general JSON parser, it only handles what the reports contain.
+    // On success, advances `pos` past the value. If it's a string, writes it to `str`, otherwise writes the raw text of the value.
+    [[nodiscard]] bool ReadJsonValue(std::string_view line, std::size_t &pos, std::string &str)
+    {
+        str.clear();
+        if (pos >= line.size())
+            return false;
+
+        if (line[pos] == '"')
+        {
+            pos++;
+            while (pos < line.size() && line[pos] != '"')
+            {
+                char ch = line[pos++];
+                if (ch != '\\')
+                {
+                    str += ch;
+                    continue;
+                }
+                if (pos >= line.size())
+                    return false;
+                ch = line[pos++];
+                switch (ch)
+                {
+                    case 'n': str += '\n'; break;
+                    case 'r': str += '\r'; break;
+                    case 't': str += '\t'; break;
+                    case 'u':
+                        {
+                            // We only write these for the control characters.
+                            unsigned code = 0;
+                            if (pos + 4 > line.size() || std::from_chars(line.data() + pos, line.data() + pos + 4, code, 16).ptr != line.data() + pos + 4)
+                                return false;
+                            pos += 4;
+                            str += char(code);
+                        }
+                        break;
+                    default: str += ch; break;
+                }
+            }
+            if (pos >= line.size())
+                return false;
+            pos++;
+            return true;
+        }
+
+        // Something else, skip it, counting the nesting.
+        std::size_t start = pos;
+        int depth = 0;
+        std::string ignored;
+        while (pos < line.size())
+        {
+            char ch = line[pos];
+            if (ch == '"')
+            {
+                if (!ReadJsonValue(line, pos, ignored))
+                    return false;
+                continue;
+            }
+            if (depth == 0 && (ch == ',' || ch == '}' || ch == ']'))
+                break;
+            if (ch == '[' || ch == '{')
+                depth++;
+            else if (ch == ']' || ch == '}')
+                depth--;
+            pos++;
+        }
+        if (depth != 0)
+            return false;
+        str = line.substr(start, pos - start);
+        return true;
+    }
+
+    // Reads the top-level fields of an object on a line of a `--jsonl` report. The nested values are returned as raw text.
+    [[nodiscard]] bool ReadJsonObject(std::string_view line, std::map<std::string, std::string, std::less<>> &fields)
+    {
+        fields.clear();
+        std::size_t pos = 0;
+        if (line.empty() || line[pos++] != '{')
+            return false;
+        if (pos < line.size() && line[pos] == '}')
+            return true;
+        std::string key, value;
+        while (true)
+        {
+            if (!ReadJsonValue(line, pos, key) || pos >= line.size() || line[pos++] != ':' || !ReadJsonValue(line, pos, value) || pos >= line.size())
+                return false;
+            fields[key] = value;
+            char ch = line[pos++];
+            if (ch == '}')
+                return true;
+            if (ch != ',')
+                return false;
+        }
+    }
+
+    // Returns the available memory in kilobytes, or 0 if unknown.
+    [[nodiscard]] std::uint64_t GetAvailableMemoryKb()
+    {
+        std::string meminfo;
+        if (!ReadFile("/proc/meminfo", meminfo))
+            return 0;
+        std::string_view prefix = "MemAvailable:";
+        std::size_t pos = meminfo.find(prefix);
+        if (pos == std::string::npos)
+            return 0;
+        pos += prefix.size();
+        while (pos < meminfo.size() && meminfo[pos] == ' ')
+            pos++;
+        std::uint64_t ret = 0;
+        std::from_chars(meminfo.data() + pos, meminfo.data() + meminfo.size(), ret);
+        return ret;
+    }
+
+    // What we remember about each executable between the runs.
+    struct History
+    {
+        std::uint64_t duration_us = 0;
+        std::uint64_t max_rss_kb = 0;
+    };
+
+    // The file has one `<duration_us> <max_rss_kb> <path>` per line. The paths are absolute.
+    [[nodiscard]] std::map<std::string, History> LoadHistory(const std::string &path)
+    {
+        std::map<std::string, History> ret;
+        std::string contents;
+        if (!ReadFile(path, contents))
+            return ret;
+        std::string_view rest = contents;
+        while (!rest.empty())
+        {
+            std::size_t end = rest.find('\n');
+            std::string_view line = rest.substr(0, end);
+            rest = end == std::string_view::npos ? std::string_view{} : rest.substr(end + 1);
+
+            std::size_t space1 = line.find(' ');
+            std::size_t space2 = space1 == std::string_view::npos ? space1 : line.find(' ', space1 + 1);
+            History entry;
+            if (space2 == std::string_view::npos || !ParseNumber(line.substr(0, space1), entry.duration_us) || !ParseNumber(line.substr(space1 + 1, space2 - space1 - 1), entry.max_rss_kb))
+                continue; // Ignore the garbage.
+            ret.insert_or_assign(std::string(line.substr(space2 + 1)), entry);
+        }
+        return ret;
+    }
+
+    void SaveHistory(const std::string &path, const std::map<std::string, History> &history)
+    {
+        // Write to a temporary file and rename it, to not lose the old history if we crash.
+        std::string temp_path = path + ".tmp";
+        std::FILE *file = std::fopen(temp_path.c_str(), "wb");
+        if (!file)
+        {
+            std::fprintf(stderr, "minitest_driver: Unable to open `%s` for writing.\n", temp_path.c_str());
+            return;
+        }
+        for (const auto &[exe, entry] : history)
+            std::fprintf(file, "%llu %llu %s\n", (unsigned long long)entry.duration_us, (unsigned long long)entry.max_rss_kb, exe.c_str());
+        bool ok = std::fclose(file) == 0;
+        if (!ok || std::rename(temp_path.c_str(), path.c_str()) != 0)
+            std::fprintf(stderr, "minitest_driver: Unable to write `%s`.\n", path.c_str());
+    }
+
+    struct FailedTest
+    {
+        std::string name;
+        std::string file;
+        int line = 0;
+    };
+
+    struct Executable
+    {
+        std::string path; // As given on the command line.
+        std::string key; // The absolute path, for the history.
+
+        bool has_history = false;
+        History history;
+
+        std::string log_path;
+        std::string jsonl_path;
+        std::string junit_path;
+
+        pid_t pid = -1;
+        std::chrono::steady_clock::time_point start_time;
+        std::uint64_t reserved_kb = 0; // What we subtracted from the memory limit when starting this.
+
+        // The results.
+        bool failed = false;
+        std::string failure_reason; // Why the executable itself failed, if it did, as opposed to the tests in it.
+        std::chrono::microseconds duration{};
+        std::uint64_t max_rss_kb = 0;
+        std::size_t num_tests = 0;
+        std::vector<FailedTest> failed_tests;
+        std::string jsonl_lines; // The test records for the merged report, with the `"executable"` field added.
+    };
+
+    // Reads the results from the report and the exit status of a finished executable.
+    void CollectResults(Executable &exe, int status)
+    {
+        std::string contents;
+        bool finished = false;
+        if (ReadFile(exe.jsonl_path, contents))
+        {
+            std::map<std::string, std::string, std::less<>> fields;
+            std::string_view rest = contents;
+            while (!rest.empty())
+            {
+                std::size_t end = rest.find('\n');
+                if (end == std::string_view::npos)
+                    break; // An incomplete line, the executable must've crashed while writing it.
+                std::string_view line = rest.substr(0, end);
+                rest = rest.substr(end + 1);
+
+                if (!ReadJsonObject(line, fields))
+                    continue;
+                auto event = fields.find("event");
+                if (event == fields.end())
+                    continue;
+
+                if (event->second == "run_end")
+                {
+                    finished = true;
+                }
+                else if (event->second == "test")
+                {
+                    // The retried attempts aren't tests of their own, only their last attempt counts.
+                    if (fields["status"] != "retry")
+                        exe.num_tests++;
+                    if (fields["status"] == "fail")
+                    {
+                        FailedTest &test = exe.failed_tests.emplace_back();
+                        test.name = fields["name"];
+                        test.file = fields["file"];
+                        (void)ParseNumber(std::string_view(fields["line"]), test.line);
+                    }
+
+                    exe.jsonl_lines += "{\"executable\":";
+                    AppendJsonString(exe.jsonl_lines, exe.path);
+                    exe.jsonl_lines += ',';
+                    exe.jsonl_lines += line.substr(1);
+                    exe.jsonl_lines += '\n';
+                }
+            }
+        }
+
+        if (WIFSIGNALED(status))
+            exe.failure_reason = "killed by signal " + std::to_string(WTERMSIG(status)) + " (" + strsignal(WTERMSIG(status)) + ")";
+        else if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0 && WEXITSTATUS(status) != 1))
+            exe.failure_reason = "exited with code " + std::to_string(WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+        else if (WEXITSTATUS(status) == 1 && exe.failed_tests.empty())
+            exe.failure_reason = "exited with code 1 without failing tests";
+        else if (!finished)
+            exe.failure_reason = "didn't finish the report";
+
+        exe.failed = !exe.failure_reason.empty() || !exe.failed_tests.empty();
+    }
+
+    // Returns the `--junit` report of an executable without the enclosing `<testsuites>`.
+    [[nodiscard]] std::string ReadJUnitSuites(const std::string &path)
+    {
+        std::string contents;
+        if (!ReadFile(path, contents))
+            return {};
+        std::size_t begin = contents.find("<testsuites");
+        std::size_t end = contents.rfind("</testsuites>");
+        if (begin == std::string::npos || end == std::string::npos)
+            return {};
+        begin = contents.find('\n', begin);
+        if (begin == std::string::npos || begin > end)
+            return {};
+        return contents.substr(begin + 1, end - begin - 1);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    std::span<char *const> args(argv, std::size_t(argc));
+
+    std::size_t max_jobs = std::max(1u, std::thread::hardware_concurrency());
+    std::uint64_t mem_limit_kb = 0;
+    std::string history_path = "minitest_driver.history";
+    std::string junit_path;
+    std::string jsonl_path;
+    bool verbose = false;
+
+    std::vector<Executable> exes;
+    std::vector<std::string> child_flags;
+
+    bool seen_separator = false;
+    for (std::string_view arg : args.subspan(1))
+    {
+        std::string_view value;
+        if (seen_separator)
+            child_flags.emplace_back(arg);
+        else if (arg == "--")
+            seen_separator = true;
+        else if (ParseFlagWithValue(arg, "--jobs", value))
+        {
+            if (!ParseNumber(value, max_jobs) || max_jobs == 0)
+                Fail("Expected a positive number in `" + std::string(arg) + "`.");
+        }
+        else if (ParseFlagWithValue(arg, "--mem-limit", value))
+        {
+            if (!ParseNumber(value, mem_limit_kb) || mem_limit_kb == 0)
+                Fail("Expected a positive number of megabytes in `" + std::string(arg) + "`.");
+            mem_limit_kb *= 1024;
+        }
+        else if (ParseFlagWithValue(arg, "--history", value))
+            history_path = value;
+        else if (ParseFlagWithValue(arg, "--junit", value))
+            junit_path = value;
+        else if (ParseFlagWithValue(arg, "--jsonl", value))
+            jsonl_path = value;
+        else if (arg == "--verbose")
+            verbose = true;
+        else if (arg.starts_with("-"))
+            Fail("Unknown flag `" + std::string(arg) + "`. Use `--` to pass the flags to the executables.");
+        else
+            exes.emplace_back().path = arg;
+    }
+
+    if (exes.empty())
+    {
+        std::fprintf(stderr,
+            "Usage:\n"
+            "  minitest_driver [--jobs=<n>] [--mem-limit=<MB>] [--history=<file>] [--junit=<file>] [--jsonl=<file>] [--verbose] <executable>... [-- flags...]\n"
+        );
+        return 2;
+    }
+
+    if (mem_limit_kb == 0)
+        mem_limit_kb = GetAvailableMemoryKb();
+    constexpr std::uint64_t default_rss_kb = 64 * 1024;
+
+    std::map<std::string, History> history = LoadHistory(history_path);
+
+    std::error_code ec;
+    std::filesystem::path temp_dir = std::filesystem::temp_directory_path(ec) / ("minitest_driver." + std::to_string(getpid()));
+    std::filesystem::create_directories(temp_dir, ec);
+    if (ec)
+        Fail("Unable to create `" + temp_dir.string() + "`: " + ec.message());
+
+    for (std::size_t i = 0; i < exes.size(); i++)
+    {
+        Executable &exe = exes[i];
+        exe.key = std::filesystem::absolute(exe.path, ec).lexically_normal().string();
+        if (auto iter = history.find(exe.key); iter != history.end())
+        {
+            exe.has_history = true;
+            exe.history = iter->second;
+        }
+        std::string prefix = (temp_dir / std::to_string(i)).string();
+        exe.log_path = prefix + ".log";
+        exe.jsonl_path = prefix + ".jsonl";
+        if (!junit_path.empty())
+            exe.junit_path = prefix + ".xml";
+    }
+
+    // The longest first, and the unknown ones before everything else.
+    std::vector<std::size_t> order(exes.size());
+    for (std::size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b)
+    {
+        if (exes[a].has_history != exes[b].has_history)
+            return !exes[a].has_history;
+        return exes[a].history.duration_us > exes[b].history.duration_us;
+    });
+
+    std::map<pid_t, std::size_t> running; // Maps the process IDs to the executable indices.
+    std::uint64_t reserved_kb = 0;
+    std::size_t next = 0;
+    std::size_t num_finished = 0;
+    std::size_t counter_width = std::to_string(exes.size()).size() * 2 + 1;
+
+    auto StartNext = [&]() -> bool
+    {
+        Executable &exe = exes[order[next]];
+        std::uint64_t expected_kb = exe.has_history && exe.history.max_rss_kb > 0 ? exe.history.max_rss_kb : default_rss_kb;
+        if (!running.empty())
+        {
+            if (running.size() >= max_jobs)
+                return false;
+            if (mem_limit_kb > 0 && reserved_kb + expected_kb > mem_limit_kb)
+                return false;
+            std::uint64_t available_kb = GetAvailableMemoryKb();
+            if (available_kb > 0 && available_kb < expected_kb)
+                return false;
+        }
+        next++;
+
+        std::vector<std::string> child_args = {exe.path, "--jsonl=" + exe.jsonl_path};
+        if (!exe.junit_path.empty())
+            child_args.push_back("--junit=" + exe.junit_path);
+        child_args.insert(child_args.end(), child_flags.begin(), child_flags.end());
+        std::vector<char *> child_argv;
+        for (std::string &arg : child_args)
+            child_argv.push_back(arg.data());
+        child_argv.push_back(nullptr);
+
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, exe.log_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+        // `posix_spawn()` doesn't search `PATH`, so the names without slashes are relative to the current directory, as we want.
+        exe.start_time = std::chrono::steady_clock::now();
+        int error = posix_spawn(&exe.pid, exe.path.c_str(), &actions, nullptr, child_argv.data(), environ);
+        posix_spawn_file_actions_destroy(&actions);
+
+        if (error != 0)
+        {
+            exe.pid = -1;
+            exe.failed = true;
+            exe.failure_reason = std::string("unable to start: ") + std::strerror(error);
+            num_finished++;
+            std::fprintf(stderr, "%-*s [   FAIL ] %s: %s\n", (int)counter_width, (std::to_string(num_finished) + "/" + std::to_string(exes.size())).c_str(), exe.path.c_str(), exe.failure_reason.c_str());
+            return true;
+        }
+
+        exe.reserved_kb = expected_kb;
+        reserved_kb += expected_kb;
+        running.emplace(exe.pid, order[next - 1]);
+        return true;
+    };
+
+    while (next < exes.size() || !running.empty())
+    {
+        while (next < exes.size() && StartNext())
+        {}
+
+        if (running.empty())
+            continue;
+
+        int status = 0;
+        rusage usage{};
+        pid_t pid = wait4(-1, &status, 0, &usage);
+        if (pid < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            Fail(std::string("`wait4()` failed: ") + std::strerror(errno));
+        }
+        auto iter = running.find(pid);
+        if (iter == running.end())
+            continue;
+        Executable &exe = exes[iter->second];
+        running.erase(iter);
+        reserved_kb -= exe.reserved_kb;
+
+        exe.duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - exe.start_time);
+        exe.max_rss_kb = std::uint64_t(usage.ru_maxrss); // Kilobytes on Linux.
+        CollectResults(exe, status);
+        history.insert_or_assign(exe.key, History{.duration_us = std::uint64_t(exe.duration.count()), .max_rss_kb = exe.max_rss_kb});
+
+        num_finished++;
+        std::string counter = std::to_string(num_finished) + "/" + std::to_string(exes.size());
+        std::string details = std::to_string(exe.num_tests) + " test" + (exe.num_tests == 1 ? "" : "s");
+        if (!exe.failed_tests.empty())
+            details += ", " + std::to_string(exe.failed_tests.size()) + " failed";
+        if (!exe.failure_reason.empty())
+            details += ", " + exe.failure_reason;
+        std::fprintf(stderr, "%-*s [ %s ] %s (%s, %.1f ms)\n", (int)counter_width, counter.c_str(), exe.failed ? "  FAIL" : "    OK", exe.path.c_str(), details.c_str(), double(exe.duration.count()) / 1000);
+
+        if (exe.failed || verbose)
+        {
+            std::string log;
+            if (ReadFile(exe.log_path, log) && !log.empty())
+            {
+                std::fwrite(log.data(), 1, log.size(), stderr);
+                if (log.back() != '\n')
+                    std::fputc('\n', stderr);
+            }
+        }
+    }
+
+    // Merge the reports, in the order the executables were given.
+    std::size_t num_tests = 0;
+    std::size_t num_failed_tests = 0;
+    std::size_t num_failed_exes = 0;
+    for (const Executable &exe : exes)
+    {
+        num_tests += exe.num_tests;
+        num_failed_tests += exe.failed_tests.size();
+        num_failed_exes += exe.failed;
+    }
+
+    if (!jsonl_path.empty())
+    {
+        std::FILE *file = std::fopen(jsonl_path.c_str(), "wb");
+        if (!file)
+        {
+            std::fprintf(stderr, "minitest_driver: Unable to open `%s` for writing.\n", jsonl_path.c_str());
+        }
+        else
+        {
+            std::fprintf(file, "{\"event\":\"run_start\",\"tests\":%zu}\n", num_tests);
+            for (const Executable &exe : exes)
+                std::fwrite(exe.jsonl_lines.data(), 1, exe.jsonl_lines.size(), file);
+            std::fprintf(file, "{\"event\":\"run_end\",\"tests\":%zu,\"passed\":%zu,\"failed\":%zu}\n", num_tests, num_tests - num_failed_tests, num_failed_tests);
+            std::fclose(file);
+        }
+    }
+
+    if (!junit_path.empty())
+    {
+        std::FILE *file = std::fopen(junit_path.c_str(), "wb");
+        if (!file)
+        {
+            std::fprintf(stderr, "minitest_driver: Unable to open `%s` for writing.\n", junit_path.c_str());
+        }
+        else
+        {
+            std::fprintf(file, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<testsuites name=\"minitest\">\n");
+            for (const Executable &exe : exes)
+            {
+                std::string suites = ReadJUnitSuites(exe.junit_path);
+                std::fwrite(suites.data(), 1, suites.size(), file);
+            }
+            std::fprintf(file, "</testsuites>\n");
+            std::fclose(file);
+        }
+    }
+
+    SaveHistory(history_path, history);
+    std::filesystem::remove_all(temp_dir, ec);
+
+    // The summary, in the same format as a single executable prints.
+    std::string run_details = " in " + std::to_string(exes.size()) + " executable" + (exes.size() == 1 ? "" : "s");
+    if (num_failed_exes == 0)
+    {
+        std::fprintf(stderr, "\nAll %zu test%s passed%s\n", num_tests, num_tests == 1 ? "" : "s", run_details.c_str());
+        return 0;
+    }
+
+    std::size_t max_name_len = 0;
+    for (const Executable &exe : exes)
+    {
+        for (const FailedTest &test : exe.failed_tests)
+            max_name_len = std::max(max_name_len, test.name.size());
+    }
+    if (num_failed_tests > 0)
+    {
+        std::fprintf(stderr, "\nFailed tests:\n");
+        for (const Executable &exe : exes)
+        {
+            for (const FailedTest &test : exe.failed_tests)
+                std::fprintf(stderr, "    %-*s   at:  %s:%d   in:  %s\n", (int)max_name_len, test.name.c_str(), test.file.c_str(), test.line, exe.path.c_str());
+        }
+    }
+    if (std::any_of(exes.begin(), exes.end(), [](const Executable &exe){return !exe.failure_reason.empty();}))
+    {
+        std::fprintf(stderr, "\nFailed executables:\n");
+        for (const Executable &exe : exes)
+        {
+            if (!exe.failure_reason.empty())
+                std::fprintf(stderr, "    %s   %s\n", exe.path.c_str(), exe.failure_reason.c_str());
+        }
+    }
+
+    std::fprintf(stderr, "\nRan %zu test%s%s, %zu passed, %zu FAILED", num_tests, num_tests == 1 ? "" : "s", run_details.c_str(), num_tests - num_failed_tests, num_failed_tests);
+    if (num_failed_exes > 0)
+        std::fprintf(stderr, ", %zu executable%s FAILED", num_failed_exes, num_failed_exes == 1 ? "" : "s");
+    std::fprintf(stderr, "\n");
+    return 1;
+}
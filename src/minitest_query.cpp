@@ -0,0 +1,391 @@
+// A tool to query the binary result logs, produced by running the tests with `--binlog=<file>`.
+// Build it with e.g. `clang++ -std=c++23 -O2 -Iinclude src/minitest_query.cpp -o minitest_query`.
+// It mmaps the logs and doesn't parse any text, so it stays fast even on logs with millions of tests.
+//
+// Usage:
+//   minitest_query summary <log>
+//       Print the test counts, the total duration and the slowest tests.
+// The retried attempts (from `--retries`) are only counted by `summary`. Everything else only sees the final attempt of each test.
+//   minitest_query list <log> [--failed] [--passed] [--file=<substr>] [--name=<substr>] [--min-ms=<ms>]
+//       Print the matching tests.
+//   minitest_query aggregate <log>
+//       Print the per-file totals, slowest files first.
+//   minitest_query diff <old_log> <new_log> [--threshold=<percent>]
+//       Print the tests that changed status, were added or removed, or got slower or faster by more than the threshold (20% by default).
+
+#define EM_ENABLE_TESTS 1 // We only need the format definitions, not the tests.
+#include <em/minitest.hpp>
+
+#include <algorithm>
+#include <charconv>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <span>
+#include <string_view>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#ifdef _WIN32
+#include <fstream>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace binlog = em::minitest::binlog;
+
+namespace
+{
+    [[noreturn]] void Fail(const std::string &message)
+    {
+        std::fprintf(stderr, "minitest_query: %s\n", message.c_str());
+        std::exit(2);
+    }
+
+    // A read-only view of a log file.
+    class Log
+    {
+        const char *data = nullptr;
+        std::size_t size = 0;
+
+        #ifdef _WIN32
+        std::string storage;
+        #endif
+
+      public:
+        std::vector<std::string_view> strings;
+        std::vector<const binlog::ResultEntry *> results; // Without the retried attempts, only the final result of each test.
+        std::size_t num_retries = 0; // The retried attempts, see `binlog::Status::retry`.
+
+        explicit Log(const char *path)
+        {
+            #ifdef _WIN32
+            std::ifstream input(path, std::ios::binary);
+            if (!input)
+                Fail("Unable to open `" + std::string(path) + "`.");
+            storage.assign(std::istreambuf_iterator<char>(input), {});
+            data = storage.data();
+            size = storage.size();
+            #else
+            int fd = open(path, O_RDONLY);
+            if (fd == -1)
+                Fail("Unable to open `" + std::string(path) + "`.");
+            struct stat st{};
+            if (fstat(fd, &st) != 0)
+                Fail("Unable to get the size of `" + std::string(path) + "`.");
+            size = std::size_t(st.st_size);
+            if (size > 0)
+            {
+                void *ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (ptr == MAP_FAILED)
+                    Fail("Unable to map `" + std::string(path) + "`.");
+                data = static_cast<const char *>(ptr);
+            }
+            close(fd);
+            #endif
+
+            // The header.
+            if (size < sizeof(binlog::FileHeader))
+                Fail("`" + std::string(path) + "` is too short to be a binary log.");
+            const auto &header = *reinterpret_cast<const binlog::FileHeader *>(data);
+            if (std::memcmp(header.magic, binlog::magic, sizeof binlog::magic) != 0)
+                Fail("`" + std::string(path) + "` is not a binary log.");
+            if (header.byte_order != binlog::byte_order_mark)
+                Fail("`" + std::string(path) + "` was written on a machine with a different byte order.");
+            if (header.version != binlog::current_version)
+                Fail("`" + std::string(path) + "` has unsupported version " + std::to_string(header.version) + ".");
+
+            // The entries. We silently stop at an incomplete entry, which can be left by a crash.
+            std::size_t pos = sizeof(binlog::FileHeader);
+            while (size - pos >= sizeof(binlog::EntryKind))
+            {
+                binlog::EntryKind kind = *reinterpret_cast<const binlog::EntryKind *>(data + pos);
+                if (kind == binlog::EntryKind::string)
+                {
+                    if (size - pos < sizeof(binlog::StringEntry))
+                        break;
+                    const auto &entry = *reinterpret_cast<const binlog::StringEntry *>(data + pos);
+                    std::size_t padded_size = (entry.size + 7) / 8 * 8;
+                    if (size - pos - sizeof(binlog::StringEntry) < padded_size)
+                        break;
+                    strings.emplace_back(data + pos + sizeof(binlog::StringEntry), entry.size);
+                    pos += sizeof(binlog::StringEntry) + padded_size;
+                }
+                else if (kind == binlog::EntryKind::result)
+                {
+                    if (size - pos < sizeof(binlog::ResultEntry))
+                        break;
+                    const auto *entry = reinterpret_cast<const binlog::ResultEntry *>(data + pos);
+                    if (entry->status == binlog::Status::retry)
+                        num_retries++;
+                    else
+                        results.push_back(entry);
+                    pos += sizeof(binlog::ResultEntry);
+                }
+                else
+                {
+                    Fail("`" + std::string(path) + "` has an unknown entry kind at offset " + std::to_string(pos) + ".");
+                }
+            }
+        }
+
+        Log(const Log &) = delete;
+        Log &operator=(const Log &) = delete;
+
+        ~Log()
+        {
+            #ifndef _WIN32
+            if (data)
+                munmap(const_cast<char *>(data), size);
+            #endif
+        }
+
+        [[nodiscard]] std::string_view String(std::uint32_t index) const
+        {
+            if (index >= strings.size())
+                return "?";
+            return strings[index];
+        }
+    };
+
+    [[nodiscard]] double Ms(std::uint64_t ns)
+    {
+        return double(ns) / 1'000'000;
+    }
+
+    void PrintResult(const Log &log, const binlog::ResultEntry &r)
+    {
+        std::string_view file = log.String(r.file);
+        std::string_view name = log.String(r.name);
+        std::printf("%s %10.3f ms  %.*s:%u  %.*s",
+            r.status == binlog::Status::pass ? "PASS" : r.status == binlog::Status::skip ? "SKIP" : "FAIL",
+            Ms(r.duration_ns),
+            (int)file.size(), file.data(), r.line,
+            (int)name.size(), name.data()
+        );
+        if (r.first_failure_file != binlog::no_string)
+        {
+            std::string_view failure_file = log.String(r.first_failure_file);
+            std::printf("  (%u failure%s, first at %.*s:%u)", r.num_failures, r.num_failures == 1 ? "" : "s", (int)failure_file.size(), failure_file.data(), r.first_failure_line);
+        }
+        std::printf("\n");
+    }
+
+    // Parses the `--flag=value` syntax, see `ParseFlagWithValue()` in `minitest.hpp`.
+    [[nodiscard]] bool ParseFlagWithValue(std::string_view arg, std::string_view name, std::string_view &value)
+    {
+        if (!arg.starts_with(name) || arg.size() <= name.size() || arg[name.size()] != '=')
+            return false;
+        value = arg.substr(name.size() + 1);
+        return true;
+    }
+
+    [[nodiscard]] double ParseNumber(std::string_view str)
+    {
+        double ret = 0;
+        auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), ret);
+        if (ec != std::errc{} || ptr != str.data() + str.size())
+            Fail("Expected a number, got `" + std::string(str) + "`.");
+        return ret;
+    }
+
+    int Summary(const Log &log)
+    {
+        std::size_t num_failed = 0;
+        std::size_t num_skipped = 0;
+        std::uint64_t total_ns = 0;
+        for (const auto *r : log.results)
+        {
+            if (r->status == binlog::Status::skip)
+                num_skipped++;
+            else if (r->status != binlog::Status::pass)
+                num_failed++;
+            total_ns += r->duration_ns;
+        }
+
+        std::printf("%zu tests, %zu passed, %zu failed", log.results.size(), log.results.size() - num_failed - num_skipped, num_failed);
+        if (num_skipped > 0)
+            std::printf(", %zu skipped", num_skipped);
+        if (log.num_retries > 0)
+            std::printf(", %zu retried attempt%s", log.num_retries, log.num_retries == 1 ? "" : "s");
+        std::printf(", %.3f ms total\n", Ms(total_ns));
+
+        std::vector<const binlog::ResultEntry *> slowest = log.results;
+        std::size_t n = std::min<std::size_t>(slowest.size(), 10);
+        std::partial_sort(slowest.begin(), slowest.begin() + std::ptrdiff_t(n), slowest.end(), [](const auto *a, const auto *b){return a->duration_ns > b->duration_ns;});
+        if (n > 0)
+        {
+            std::printf("\nSlowest tests:\n");
+            for (std::size_t i = 0; i < n; i++)
+                PrintResult(log, *slowest[i]);
+        }
+        return 0;
+    }
+
+    int List(const Log &log, std::span<char *const> args)
+    {
+        bool only_failed = false;
+        bool only_passed = false;
+        std::string_view file_substr;
+        std::string_view name_substr;
+        double min_ms = 0;
+
+        for (std::string_view arg : args)
+        {
+            std::string_view value;
+            if (arg == "--failed")
+                only_failed = true;
+            else if (arg == "--passed")
+                only_passed = true;
+            else if (ParseFlagWithValue(arg, "--file", value))
+                file_substr = value;
+            else if (ParseFlagWithValue(arg, "--name", value))
+                name_substr = value;
+            else if (ParseFlagWithValue(arg, "--min-ms", value))
+                min_ms = ParseNumber(value);
+            else
+                Fail("Unknown flag: `" + std::string(arg) + "`.");
+        }
+
+        for (const auto *r : log.results)
+        {
+            if ((only_failed && r->status != binlog::Status::fail) || (only_passed && r->status != binlog::Status::pass))
+                continue;
+            if (Ms(r->duration_ns) < min_ms)
+                continue;
+            // Comparing the string indices first would be faster, but this is fast enough.
+            if (!file_substr.empty() && log.String(r->file).find(file_substr) == std::string_view::npos)
+                continue;
+            if (!name_substr.empty() && log.String(r->name).find(name_substr) == std::string_view::npos)
+                continue;
+            PrintResult(log, *r);
+        }
+        return 0;
+    }
+
+    int Aggregate(const Log &log)
+    {
+        struct FileStats
+        {
+            std::size_t num_tests = 0;
+            std::size_t num_failed = 0;
+            std::uint64_t duration_ns = 0;
+        };
+
+        // The file names are interned, so we can aggregate by their indices.
+        std::map<std::uint32_t, FileStats> stats;
+        for (const auto *r : log.results)
+        {
+            FileStats &s = stats[r->file];
+            s.num_tests++;
+            if (r->status == binlog::Status::fail)
+                s.num_failed++;
+            s.duration_ns += r->duration_ns;
+        }
+
+        std::vector<std::pair<std::uint32_t, FileStats>> sorted(stats.begin(), stats.end());
+        std::sort(sorted.begin(), sorted.end(), [](const auto &a, const auto &b){return a.second.duration_ns > b.second.duration_ns;});
+
+        for (const auto &[file_index, s] : sorted)
+        {
+            std::string_view file = log.String(file_index);
+            std::printf("%12.3f ms  %6zu tests  %6zu failed  %.*s\n", Ms(s.duration_ns), s.num_tests, s.num_failed, (int)file.size(), file.data());
+        }
+        return 0;
+    }
+
+    int Diff(const Log &old_log, const Log &new_log, std::span<char *const> args)
+    {
+        double threshold_percent = 20;
+
+        for (std::string_view arg : args)
+        {
+            std::string_view value;
+            if (ParseFlagWithValue(arg, "--threshold", value))
+                threshold_percent = ParseNumber(value);
+            else
+                Fail("Unknown flag: `" + std::string(arg) + "`.");
+        }
+
+        // The string indices differ between the logs, so we have to match the tests by their strings.
+        using Key = std::tuple<std::string_view, std::uint32_t, std::string_view>;
+        std::map<Key, const binlog::ResultEntry *> old_results;
+        for (const auto *r : old_log.results)
+            old_results[Key(old_log.String(r->file), r->line, old_log.String(r->name))] = r; // If the test ran several times, keep the last result.
+
+        int ret = 0;
+
+        for (const auto *r : new_log.results)
+        {
+            auto iter = old_results.find(Key(new_log.String(r->file), r->line, new_log.String(r->name)));
+            if (iter == old_results.end())
+            {
+                std::printf("added:     ");
+                PrintResult(new_log, *r);
+                continue;
+            }
+
+            const binlog::ResultEntry *old_r = iter->second;
+            old_results.erase(iter);
+
+            if (old_r->status != r->status)
+            {
+                std::printf("%s ", r->status == binlog::Status::pass ? "fixed:    " : r->status == binlog::Status::skip ? "skipped:  " : "broken:   ");
+                PrintResult(new_log, *r);
+                if (r->status == binlog::Status::fail)
+                    ret = 1;
+                continue;
+            }
+
+            // Ignore tiny durations, they are mostly noise.
+            double old_ms = Ms(old_r->duration_ns);
+            double new_ms = Ms(r->duration_ns);
+            if (std::max(old_ms, new_ms) >= 1 && old_ms > 0)
+            {
+                double change_percent = (new_ms - old_ms) / old_ms * 100;
+                if (change_percent > threshold_percent || change_percent < -threshold_percent)
+                {
+                    std::printf("%s %+7.1f%% (%.3f ms -> %.3f ms)  ", change_percent > 0 ? "slower:   " : "faster:   ", change_percent, old_ms, new_ms);
+                    PrintResult(new_log, *r);
+                }
+            }
+        }
+
+        for (const auto &[key, r] : old_results)
+        {
+            std::printf("removed:   ");
+            PrintResult(old_log, *r);
+        }
+
+        return ret;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    std::span<char *const> args(argv, std::size_t(argc));
+
+    if (args.size() < 3)
+    {
+        std::fprintf(stderr, "Usage: %s summary|list|aggregate <log> [flags...]\n       %s diff <old_log> <new_log> [flags...]\n", argv[0], argv[0]);
+        return 2;
+    }
+
+    std::string_view command = args[1];
+
+    if (command == "summary" && args.size() == 3)
+        return Summary(Log(args[2]));
+    if (command == "list")
+        return List(Log(args[2]), args.subspan(3));
+    if (command == "aggregate" && args.size() == 3)
+        return Aggregate(Log(args[2]));
+    if (command == "diff" && args.size() >= 4)
+        return Diff(Log(args[2]), Log(args[3]), args.subspan(4));
+
+    Fail("Unknown command or wrong number of arguments. Run without arguments for usage.");
+}
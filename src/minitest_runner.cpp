@@ -0,0 +1,131 @@
+// A generic test runner: loads the tests from several shared libraries, and runs them all at once, as if they were linked into one executable.
+// This replaces a separate test executable per library, along with its startup and link time.
+// The test modules are shared libraries with tests (see `em::minitest::TestModule`). They must link to the same `libminitest.so` as the runner.
+// Build it with e.g. `clang++ -std=c++23 -O2 -Iinclude src/minitest_runner.cpp -Ltest/build -lminitest -Wl,-rpath=test/build -o minitest_runner`.
+// Only on POSIX systems.
+//
+// Usage:
+//   minitest_runner <module>... [flags...]
+//       Each module is a path to a shared library, a directory (to load every `*.so` in it), or a glob pattern (quote it to stop the shell from expanding it).
+//       The arguments starting with `-` are the flags for the test runner, the same as the test executables accept (see `em::minitest::RunTests()`).
+//       If some tests are defined in more than one module, or some module can't be loaded, nothing is run.
+
+#define EM_ENABLE_TESTS 1 // We don't have tests, but we need the test runner.
+#include <em/minitest.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <set>
+#include <span>
+#include <string_view>
+#include <string>
+#include <vector>
+
+#include <glob.h>
+
+namespace
+{
+    // Expands one module argument into the library paths, appending them to `paths`. Returns false and prints the reason on failure.
+    [[nodiscard]] bool ExpandModuleArg(const char *arg, std::vector<std::string> &paths)
+    {
+        std::error_code ec;
+        if (std::filesystem::is_directory(arg, ec))
+        {
+            std::vector<std::string> dir_paths;
+            for (const auto &entry : std::filesystem::directory_iterator(arg, ec))
+            {
+                if (entry.path().extension() == ".so" && entry.is_regular_file(ec))
+                    dir_paths.push_back(entry.path().string());
+            }
+            if (ec)
+            {
+                std::fprintf(stderr, "minitest_runner: Unable to read the directory `%s`: %s\n", arg, ec.message().c_str());
+                return false;
+            }
+            std::sort(dir_paths.begin(), dir_paths.end());
+            paths.insert(paths.end(), dir_paths.begin(), dir_paths.end());
+            return true;
+        }
+
+        glob_t result{};
+        int status = glob(arg, 0, nullptr, &result);
+        if (status == GLOB_NOMATCH)
+        {
+            std::fprintf(stderr, "minitest_runner: No files match `%s`.\n", arg);
+            return false;
+        }
+        if (status != 0)
+        {
+            std::fprintf(stderr, "minitest_runner: Unable to expand `%s`.\n", arg);
+            return false;
+        }
+        for (std::size_t i = 0; i < result.gl_pathc; i++)
+            paths.push_back(result.gl_pathv[i]); // Already sorted by `glob()`.
+        globfree(&result);
+        return true;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    std::span<char *const> args(argv, std::size_t(argc));
+
+    std::vector<std::string> paths;
+    std::vector<char *> runner_argv = {args[0]};
+    bool ok = true;
+    for (char *arg : args.subspan(1))
+    {
+        if (arg[0] == '-')
+        {
+            if (std::string_view(arg) == "--watch")
+            {
+                // The watcher only knows about the executable and `libminitest.so`, not the modules.
+                std::fprintf(stderr, "minitest_runner: `--watch` doesn't work with the modules.\n");
+                ok = false;
+            }
+            runner_argv.push_back(arg);
+        }
+        else if (!ExpandModuleArg(arg, paths))
+        {
+            ok = false;
+        }
+    }
+    runner_argv.push_back(nullptr);
+
+    if (ok && paths.empty())
+    {
+        std::fprintf(stderr,
+            "Usage:\n"
+            "  minitest_runner <module.so|directory|glob>... [flags...]\n"
+        );
+        return 2;
+    }
+
+    // Load everything, even after a failure, to report all problems at once.
+    std::vector<em::minitest::TestModule> modules;
+    std::set<std::filesystem::path> seen_paths; // Loading the same file twice would only bump its reference count.
+    modules.reserve(paths.size());
+    for (const std::string &path : paths)
+    {
+        std::error_code ec;
+        std::filesystem::path canonical = std::filesystem::weakly_canonical(path, ec);
+        if (!seen_paths.insert(ec ? std::filesystem::path(path) : canonical).second)
+            continue;
+
+        // `dlopen()` searches the system paths for the names without slashes, which is not what we want.
+        em::minitest::TestModule &module = modules.emplace_back();
+        if (!module.Load(path.find('/') == std::string::npos ? "./" + path : path))
+            ok = false;
+    }
+
+    int exit_code = 2;
+    if (ok)
+        exit_code = em::minitest::RunTests(int(runner_argv.size() - 1), runner_argv.data());
+
+    // Unload in the reverse order, in case the later modules depend on the earlier ones.
+    while (!modules.empty())
+        modules.pop_back();
+
+    return exit_code;
+}
@@ -0,0 +1,377 @@
+// A test server: a long-lived process that loads the test modules once, and then runs their tests on request.
+// This saves the process startup and the static initialization on every run, and keeps the global state of the server warm between the runs.
+// The test modules are shared libraries with tests (see `em::minitest::TestModule`). They must link to the same `libminitest.so` as the server.
+// Build it with e.g. `clang++ -std=c++23 -O2 -Iinclude src/minitest_server.cpp -Ltest/build -lminitest -Wl,-rpath=test/build -o minitest_server`.
+// Only on POSIX systems.
+//
+// Usage:
+//   minitest_server serve <socket> <module.so>...
+//       Load the modules and serve the requests on this Unix socket, one at a time.
+//       Before each request, the modules whose files changed are reloaded.
+//   minitest_server run <socket> [flags...]
+//       Run the tests in the server, with the same flags as the test executables accept (see `em::minitest::RunTests()`).
+//       The output goes to our stdout and stderr, and we exit with the same code as a test executable would.
+//
+// The protocol: the client sends its stdout and stderr with `SCM_RIGHTS` (along with one dummy byte), so the server writes to them directly.
+// Then it sends a 32-bit size, followed by that many bytes: its current directory and the flags, each null-terminated.
+// The server replies with a single byte, the exit code.
+
+#define EM_ENABLE_TESTS 1 // We don't have tests, but we need the test runner.
+#include <em/minitest.hpp>
+
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <span>
+#include <string_view>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace
+{
+    [[noreturn]] void Fail(const std::string &message)
+    {
+        std::fprintf(stderr, "minitest_server: %s\n", message.c_str());
+        std::exit(2);
+    }
+
+    [[nodiscard]] sockaddr_un MakeAddress(const std::string &path)
+    {
+        sockaddr_un ret{};
+        ret.sun_family = AF_UNIX;
+        if (path.size() >= sizeof ret.sun_path)
+            Fail("The socket path is too long: `" + path + "`.");
+        std::memcpy(ret.sun_path, path.c_str(), path.size() + 1);
+        return ret;
+    }
+
+    // Returns false on failure.
+    [[nodiscard]] bool WriteAll(int fd, const void *data, std::size_t size)
+    {
+        const char *ptr = static_cast<const char *>(data);
+        while (size > 0)
+        {
+            ssize_t n = send(fd, ptr, size, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            ptr += n;
+            size -= std::size_t(n);
+        }
+        return true;
+    }
+
+    // Returns false on failure, or if the other side closes the connection early.
+    [[nodiscard]] bool ReadAll(int fd, void *data, std::size_t size)
+    {
+        char *ptr = static_cast<char *>(data);
+        while (size > 0)
+        {
+            ssize_t n = read(fd, ptr, size);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            ptr += n;
+            size -= std::size_t(n);
+        }
+        return true;
+    }
+
+    // Set by `SIGINT` and `SIGTERM`, to clean up before exiting.
+    volatile std::sig_atomic_t stop_requested = false;
+
+    // A test module, and what we need to notice when its file changes.
+    struct Module
+    {
+        std::string path; // As given on the command line.
+        // We load a private copy of the file, so the linker can overwrite the original, and so that a reload loads a fresh library
+        //   even if the old one stays in memory (see `TestModule::Unload()`).
+        std::string copy_path;
+        struct stat loaded_stat{};
+        em::minitest::TestModule module;
+
+        [[nodiscard]] bool Changed() const
+        {
+            struct stat st{};
+            if (stat(path.c_str(), &st) != 0)
+                return false; // Probably being rebuilt right now. Keep the old version.
+            return st.st_ino != loaded_stat.st_ino || st.st_size != loaded_stat.st_size || st.st_mtim.tv_sec != loaded_stat.st_mtim.tv_sec || st.st_mtim.tv_nsec != loaded_stat.st_mtim.tv_nsec;
+        }
+
+        // Loads or reloads the module. Returns false and prints the reason on failure.
+        [[nodiscard]] bool Load(const std::filesystem::path &copies_dir, std::size_t &num_copies)
+        {
+            module.Unload();
+            std::error_code ec;
+            if (!copy_path.empty())
+                std::filesystem::remove(copy_path, ec);
+
+            if (stat(path.c_str(), &loaded_stat) != 0)
+            {
+                std::fprintf(stderr, "minitest_server: Unable to access `%s`: %s\n", path.c_str(), std::strerror(errno));
+                return false;
+            }
+            copy_path = (copies_dir / (std::to_string(num_copies++) + "-" + std::filesystem::path(path).filename().string())).string();
+            if (!std::filesystem::copy_file(path, copy_path, std::filesystem::copy_options::overwrite_existing, ec))
+            {
+                std::fprintf(stderr, "minitest_server: Unable to copy `%s` to `%s`: %s\n", path.c_str(), copy_path.c_str(), ec.message().c_str());
+                return false;
+            }
+            if (!module.Load(copy_path))
+                return false;
+            if (module.GetTests().empty())
+                std::fprintf(stderr, "minitest_server: `%s` has no tests.\n", path.c_str());
+            return true;
+        }
+    };
+
+    // Handles one request. Errors are reported to the client if possible.
+    void HandleRequest(int client, std::span<Module> modules, const std::filesystem::path &copies_dir, std::size_t &num_copies, const std::string &socket_path)
+    {
+        // Receive the output descriptors.
+        char dummy = 0;
+        iovec iov{.iov_base = &dummy, .iov_len = 1};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * 2)]{};
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+        if (recvmsg(client, &msg, MSG_CMSG_CLOEXEC) != 1)
+            return;
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * 2))
+            return;
+        int fds[2];
+        std::memcpy(fds, CMSG_DATA(cmsg), sizeof fds);
+
+        // Receive the directory and the flags.
+        std::uint32_t size = 0;
+        std::string payload;
+        std::vector<std::string_view> strings;
+        if (ReadAll(client, &size, sizeof size))
+        {
+            payload.resize(size);
+            if (ReadAll(client, payload.data(), payload.size()))
+            {
+                for (std::size_t pos = 0; pos < payload.size();)
+                {
+                    std::size_t end = payload.find('\0', pos);
+                    if (end == std::string::npos)
+                        break;
+                    strings.push_back(std::string_view(payload).substr(pos, end - pos));
+                    pos = end + 1;
+                }
+            }
+        }
+        if (strings.empty())
+        {
+            close(fds[0]);
+            close(fds[1]);
+            return;
+        }
+
+        // Redirect our output to the client.
+        std::fflush(stdout);
+        std::fflush(stderr);
+        int saved_stdout = dup(STDOUT_FILENO);
+        int saved_stderr = dup(STDERR_FILENO);
+        dup2(fds[0], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        int saved_dir = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+        int exit_code = 2;
+        if (chdir(std::string(strings[0]).c_str()) != 0)
+        {
+            std::fprintf(stderr, "minitest_server: Unable to enter `%.*s`: %s\n", int(strings[0].size()), strings[0].data(), std::strerror(errno));
+        }
+        else
+        {
+            bool ok = true;
+            for (Module &m : modules)
+            {
+                if (!m.Changed())
+                    continue;
+                std::fprintf(stderr, "minitest_server: Reloading `%s`.\n", m.path.c_str());
+                if (!m.Load(copies_dir, num_copies))
+                    ok = false;
+            }
+
+            // The socket path plays the role of the executable name, which is used for the default paths of the state files.
+            std::vector<std::string> args = {socket_path};
+            for (std::size_t i = 1; i < strings.size(); i++)
+            {
+                args.emplace_back(strings[i]);
+                if (args.back() == "--watch")
+                {
+                    std::fprintf(stderr, "minitest_server: `--watch` doesn't work in the server.\n");
+                    ok = false;
+                }
+            }
+
+            if (ok)
+            {
+                std::vector<char *> argv;
+                for (std::string &arg : args)
+                    argv.push_back(arg.data());
+                argv.push_back(nullptr);
+                exit_code = em::minitest::RunTests(int(args.size()), argv.data());
+            }
+        }
+
+        // Restore everything.
+        std::fflush(stdout);
+        std::fflush(stderr);
+        if (saved_dir >= 0)
+        {
+            (void)fchdir(saved_dir);
+            close(saved_dir);
+        }
+        dup2(saved_stdout, STDOUT_FILENO);
+        dup2(saved_stderr, STDERR_FILENO);
+        close(saved_stdout);
+        close(saved_stderr);
+
+        unsigned char code_byte = (unsigned char)exit_code;
+        (void)WriteAll(client, &code_byte, 1);
+    }
+
+    int Serve(const std::string &socket_path, std::span<char *const> module_paths)
+    {
+        // The clients can disappear at any moment, don't die because of that.
+        std::signal(SIGPIPE, SIG_IGN);
+
+        struct sigaction action{};
+        action.sa_handler = [](int){stop_requested = true;};
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = 0; // No `SA_RESTART`, to interrupt `accept()`.
+        sigaction(SIGINT, &action, nullptr);
+        sigaction(SIGTERM, &action, nullptr);
+
+        std::error_code ec;
+        std::filesystem::path copies_dir = std::filesystem::temp_directory_path(ec) / ("minitest_server." + std::to_string(getpid()));
+        std::filesystem::create_directories(copies_dir, ec);
+        if (ec)
+            Fail("Unable to create `" + copies_dir.string() + "`: " + ec.message());
+
+        std::size_t num_copies = 0;
+        std::vector<Module> modules(module_paths.size());
+        std::size_t num_tests = 0;
+        for (std::size_t i = 0; i < module_paths.size(); i++)
+        {
+            modules[i].path = module_paths[i];
+            if (!modules[i].Load(copies_dir, num_copies))
+            {
+                std::filesystem::remove_all(copies_dir, ec);
+                return 2;
+            }
+            num_tests += modules[i].module.GetTests().size();
+        }
+
+        int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listener < 0)
+            Fail(std::string("Unable to create a socket: ") + std::strerror(errno));
+        sockaddr_un address = MakeAddress(socket_path);
+        unlink(socket_path.c_str()); // Remove the stale socket from a previous server.
+        if (bind(listener, reinterpret_cast<const sockaddr *>(&address), sizeof address) != 0 || listen(listener, 16) != 0)
+            Fail("Unable to listen on `" + socket_path + "`: " + std::strerror(errno));
+
+        std::fprintf(stderr, "minitest_server: Serving %zu tests from %zu modules on `%s`.\n", num_tests, modules.size(), socket_path.c_str());
+
+        while (!stop_requested)
+        {
+            int client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client < 0)
+            {
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                Fail(std::string("`accept()` failed: ") + std::strerror(errno));
+            }
+            HandleRequest(client, modules, copies_dir, num_copies, socket_path);
+            close(client);
+        }
+
+        close(listener);
+        unlink(socket_path.c_str());
+        modules.clear();
+        std::filesystem::remove_all(copies_dir, ec);
+        return 0;
+    }
+
+    int Run(const std::string &socket_path, std::span<char *const> flags)
+    {
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            Fail(std::string("Unable to create a socket: ") + std::strerror(errno));
+        sockaddr_un address = MakeAddress(socket_path);
+        if (connect(fd, reinterpret_cast<const sockaddr *>(&address), sizeof address) != 0)
+            Fail("Unable to connect to `" + socket_path + "`: " + std::strerror(errno) + ". Start the server with `minitest_server serve`.");
+
+        // Send our stdout and stderr.
+        char dummy = 0;
+        iovec iov{.iov_base = &dummy, .iov_len = 1};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * 2)]{};
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * 2);
+        int fds[2] = {STDOUT_FILENO, STDERR_FILENO};
+        std::memcpy(CMSG_DATA(cmsg), fds, sizeof fds);
+        if (sendmsg(fd, &msg, MSG_NOSIGNAL) != 1)
+            Fail(std::string("Unable to send the request: ") + std::strerror(errno));
+
+        // Send the directory and the flags.
+        std::error_code ec;
+        std::string payload = std::filesystem::current_path(ec).string();
+        payload += '\0';
+        for (const char *flag : flags)
+        {
+            payload += flag;
+            payload += '\0';
+        }
+        std::uint32_t size = std::uint32_t(payload.size());
+        if (!WriteAll(fd, &size, sizeof size) || !WriteAll(fd, payload.data(), payload.size()))
+            Fail(std::string("Unable to send the request: ") + std::strerror(errno));
+
+        unsigned char exit_code = 0;
+        if (!ReadAll(fd, &exit_code, 1))
+            Fail("The server closed the connection without finishing the run.");
+        close(fd);
+        return exit_code;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    std::span<char *const> args(argv, std::size_t(argc));
+    if (args.size() >= 3 && std::string_view(args[1]) == "serve")
+        return Serve(std::filesystem::absolute(args[2]).string(), args.subspan(3));
+    if (args.size() >= 3 && std::string_view(args[1]) == "run")
+        return Run(args[2], args.subspan(3));
+
+    std::fprintf(stderr,
+        "Usage:\n"
+        "  minitest_server serve <socket> <module.so>...\n"
+        "  minitest_server run <socket> [flags...]\n"
+    );
+    return 2;
+}
@@ -0,0 +1,82 @@
+#define EM_ENABLE_TESTS
+#include <em/minitest.hpp>
+
+#include "helpers.hpp"
+
+#include <chrono>
+#include <unistd.h>
+
+using namespace std::chrono_literals;
+
+static int pipe_fds[2] = {-1, -1};
+
+static em::minitest::Task<int> Helper()
+{
+    co_await em::minitest::SleepFor(10ms);
+    co_return 42;
+}
+
+// Finishes last, even though it starts first.
+EM_TEST_ASYNC( sleep_long )
+{
+    co_await em::minitest::SleepFor(200ms);
+}
+
+EM_TEST_ASYNC( sleep_short )
+{
+    int value = co_await Helper();
+    EM_CHECK(value == 42);
+}
+
+// Waits for `write_pipe` to write.
+EM_TEST_ASYNC( read_pipe )
+{
+    bool ready = co_await em::minitest::WaitReadable(pipe_fds[0], 1s);
+    EM_CHECK(ready);
+    char ch = 0;
+    EM_CHECK(read(pipe_fds[0], &ch, 1) == 1);
+    EM_CHECK(ch == 'x');
+}
+
+EM_TEST_ASYNC( write_pipe )
+{
+    co_await em::minitest::SleepFor(50ms);
+    bool ready = co_await em::minitest::WaitWritable(pipe_fds[1]);
+    EM_CHECK(ready);
+    EM_CHECK(write(pipe_fds[1], "x", 1) == 1);
+}
+
+EM_TEST_ASYNC( read_timeout )
+{
+    int fds[2];
+    EM_CHECK(pipe(fds) == 0);
+    bool ready = co_await em::minitest::WaitReadable(fds[0], 100ms);
+    close(fds[0]);
+    close(fds[1]);
+    EM_CHECK(ready);
+}
+
+EM_TEST_ASYNC( fail_after_sleep )
+{
+    co_await em::minitest::SleepFor(150ms);
+    EM_CHECK(1 + 1 == 3);
+}
+
+static int num_flaky_attempts = 0;
+
+EM_TEST_ASYNC( flaky )
+{
+    co_await em::minitest::SleepFor(10ms);
+    EM_CHECK(++num_flaky_attempts > 1);
+}
+
+EM_TEST( sync ) {}
+
+int main()
+{
+    if (pipe(pipe_fds) != 0)
+        return 1;
+    (void)RunWithFlags({"--retries=1"});
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+}
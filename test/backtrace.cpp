@@ -0,0 +1,28 @@
+#define EM_ENABLE_TESTS
+#include <em/minitest.hpp>
+
+#include "helpers.hpp"
+
+// The stacks show which call of the helper failed.
+[[gnu::noinline]] static void CheckIsTwo(int x)
+{
+    EM_CHECK_SOFT(x == 2);
+}
+
+[[gnu::noinline]] static void CheckIsTwoTwice(int x)
+{
+    CheckIsTwo(x);
+    CheckIsTwo(x + 1);
+}
+
+EM_TEST( helpers )
+{
+    CheckIsTwo(1);
+    CheckIsTwoTwice(0);
+}
+
+int main()
+{
+    (void)RunWithFlags({"--backtrace"});
+    (void)RunWithFlags({});
+}
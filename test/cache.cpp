@@ -0,0 +1,32 @@
+#define EM_ENABLE_TESTS
+#include <em/minitest.hpp>
+
+#include "helpers.hpp"
+
+static int Helper(int x)
+{
+    return x * 2;
+}
+
+// A call chain that's too deep to hash, so the test calling it is never cached.
+template <int N>
+static int DeepHelper(int x)
+{
+    if constexpr (N == 0)
+        return x;
+    else
+        return DeepHelper<N - 1>(x) + 1;
+}
+
+EM_TEST( pass ) {}
+EM_TEST( pass_with_helper ) {EM_CHECK(Helper(2) == 4);}
+EM_TEST( fail ) {EM_CHECK(Helper(2) == 5);}
+EM_TEST( pass_with_deep_helper ) {EM_CHECK(DeepHelper<300>(0) == 300);}
+
+int main()
+{
+    std::remove("test/build/cache.txt");
+    (void)RunWithFlags({"--cache=test/build/cache.txt"});
+    (void)RunWithFlags({"--cache=test/build/cache.txt"}); // The passed tests are skipped now.
+    (void)RunWithFlags({"--cache=test/build/cache.txt", "--force"});
+}
@@ -0,0 +1,12 @@
+// An executable with a failing test, for `minitest_driver`.
+#define EM_ENABLE_TESTS
+#include <em/minitest.hpp>
+
+EM_MINITEST_MAIN
+
+EM_TEST( driver_pass ) {}
+
+EM_TEST( driver_fail )
+{
+    EM_CHECK(1 + 1 == 3);
+}
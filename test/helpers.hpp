@@ -0,0 +1,77 @@
+#pragma once
+
+// The helpers for the tests that check the runner itself, by running their own tests several times with different flags.
+
+#include <em/minitest.hpp>
+
+#include <cstdio>
+#include <initializer_list>
+#include <string_view>
+#include <string>
+#include <vector>
+
+// Runs the tests with those command line flags, like `EM_MINITEST_MAIN` would. Prints the flags and the exit code.
+inline int RunWithFlags(std::initializer_list<std::string_view> flags)
+{
+    std::vector<std::string> args = {"test"};
+    std::fprintf(stderr, "--- RUN");
+    for (std::string_view flag : flags)
+    {
+        args.emplace_back(flag);
+        std::fprintf(stderr, " %.*s", int(flag.size()), flag.data());
+    }
+    std::fprintf(stderr, "\n");
+
+    std::vector<char *> argv;
+    for (std::string &arg : args)
+        argv.push_back(arg.data());
+    argv.push_back(nullptr);
+
+    int ret = em::minitest::RunTests(int(args.size()), argv.data());
+    std::fflush(stdout); // `--list` prints there, and the rest goes to stderr.
+    std::fprintf(stderr, "--- RUN EXIT CODE %d\n", ret);
+    return ret;
+}
+
+// Prints a text file that a run has written.
+// The numbers after any of the `masked` strings are replaced with `#`, because those are the timings that differ between the runs.
+inline void PrintFile(const char *path, std::initializer_list<std::string_view> masked = {})
+{
+    std::fprintf(stderr, "--- FILE %s\n", path);
+    std::FILE *file = std::fopen(path, "rb");
+    if (!file)
+    {
+        std::fprintf(stderr, "Unable to open the file.\n");
+        return;
+    }
+    std::string contents;
+    char buffer[4096];
+    while (std::size_t size = std::fread(buffer, 1, sizeof buffer, file))
+        contents.append(buffer, size);
+    std::fclose(file);
+
+    std::string out;
+    for (std::size_t i = 0; i < contents.size();)
+    {
+        bool found = false;
+        for (std::string_view prefix : masked)
+        {
+            if (std::string_view(contents).substr(i).starts_with(prefix))
+            {
+                out += prefix;
+                i += prefix.size();
+                std::size_t end = i;
+                while (end < contents.size() && ((contents[end] >= '0' && contents[end] <= '9') || contents[end] == '.'))
+                    end++;
+                if (end > i)
+                    out += '#';
+                i = end;
+                found = true;
+                break;
+            }
+        }
+        if (!found)
+            out += contents[i++];
+    }
+    std::fwrite(out.data(), 1, out.size(), stderr);
+}
@@ -0,0 +1,29 @@
+#define EM_ENABLE_TESTS
+#include <em/minitest.hpp>
+
+#include "helpers.hpp"
+#include "impact_helper.hpp"
+
+EM_TEST( uses_helper ) {EM_CHECK(ImpactHelper(2) == 4);}
+EM_TEST( doesnt_use_helper ) {}
+
+// Writes the list of the changed files for `--changed`.
+static void SetChangedFile(const char *changed_file)
+{
+    std::fprintf(stderr, "--- Changed: %s\n", changed_file);
+    std::FILE *file = std::fopen("test/build/impact_changed.txt", "w");
+    std::fprintf(file, "%s\n", changed_file);
+    std::fclose(file);
+}
+
+int main()
+{
+    std::remove("test/build/impact_map.txt");
+    (void)RunWithFlags({"--impact-map=test/build/impact_map.txt", "--record-impact"});
+    SetChangedFile("impact_helper.hpp");
+    (void)RunWithFlags({"--impact-map=test/build/impact_map.txt", "--changed=test/build/impact_changed.txt"});
+    SetChangedFile("test/impact.cpp");
+    (void)RunWithFlags({"--impact-map=test/build/impact_map.txt", "--changed=test/build/impact_changed.txt"});
+    SetChangedFile("unrelated.cpp");
+    (void)RunWithFlags({"--impact-map=test/build/impact_map.txt", "--changed=test/build/impact_changed.txt"});
+}
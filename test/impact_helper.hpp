@@ -0,0 +1,7 @@
+#pragma once
+
+// A function in a separate file, for `impact.cpp`.
+[[gnu::noinline]] inline int ImpactHelper(int x)
+{
+    return x * 2;
+}
@@ -0,0 +1,65 @@
+#define EM_ENABLE_TESTS
+#include <em/minitest.hpp>
+
+#include "helpers.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <string>
+#include <thread>
+
+static std::atomic<bool> first_done = false;
+
+EM_TEST( second, "depends:first" ) {EM_CHECK(first_done);}
+EM_TEST( first )
+{
+    first_done = false;
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    first_done = true;
+}
+EM_TEST( third, "depends:second" ) {}
+EM_TEST( independent ) {}
+EM_TEST( fail ) {EM_CHECK(1 + 1 == 3);}
+EM_TEST( after_fail, "depends:fail" ) {}
+EM_TEST( after_after_fail, "depends:after_fail" ) {}
+
+// The tests finish in a different order every time, so this prints them sorted.
+class SortedResults : public em::minitest::Listener
+{
+    std::map<std::string, std::string> results;
+
+  public:
+    void OnTestEnd(const em::minitest::TestDesc &test, const em::minitest::TestResult &result) override
+    {
+        results[std::string(test.name)] += result.skipped ? " skipped" : result.failed ? " failed" : " passed";
+    }
+
+    void OnRunEnd(const em::minitest::RunSummary &summary) override
+    {
+        for (const auto &[name, statuses] : results)
+            std::fprintf(stderr, "%s:%s\n", name.c_str(), statuses.c_str());
+        std::fprintf(stderr, "%zu tests, %zu failed, %zu skipped\n", summary.num_tests, summary.num_failed, summary.num_skipped);
+        results.clear();
+    }
+};
+
+int main()
+{
+    // Without `--jobs`, the dependencies change the order.
+    (void)RunWithFlags({});
+
+    SortedResults listener;
+    em::minitest::Listener *const listeners[] = {&listener};
+    em::minitest::RunOptions options;
+    options.console_output = false;
+    options.jobs = 4;
+    options.repeat = 3;
+    std::fprintf(stderr, "--- With 4 jobs, 3 times:\n");
+    std::fprintf(stderr, "--- Exit code %d\n", em::minitest::RunTests(options, listeners));
+
+    options.repeat = 1;
+    options.run_exact = {"test/jobs.cpp:21:third"};
+    std::fprintf(stderr, "--- The dependencies that aren't selected are ignored:\n");
+    std::fprintf(stderr, "--- Exit code %d\n", em::minitest::RunTests(options, listeners));
+}
@@ -0,0 +1,33 @@
+#define EM_ENABLE_TESTS
+#include <em/minitest.hpp>
+
+#include "helpers.hpp"
+
+#include <cstdlib>
+
+EM_TEST( passed_before ) {}
+EM_TEST( failed_before ) {}
+EM_TEST( crashed_before ) {std::abort();}
+EM_TEST( not_started ) {}
+EM_TEST( not_started_fail ) {EM_CHECK(1 + 1 == 3);}
+
+int main()
+{
+    // Pretend that the previous run crashed in `crashed_before`.
+    std::FILE *file = std::fopen("test/build/journal.txt", "wb");
+    std::fputs(
+        "minitest-journal 1\n"
+        "S\t0\ttest/journal.cpp\t8\ttest/journal.cpp:8:passed_before\n"
+        "T\t0\tpass\t1000\ttest/journal.cpp:8:passed_before\n"
+        "S\t0\ttest/journal.cpp\t9\ttest/journal.cpp:9:failed_before\n"
+        "F\t0\ttest/journal.cpp\t42\t1 == 2\t0\t0\n"
+        "T\t0\tfail\t2000\ttest/journal.cpp:9:failed_before\n"
+        "S\t0\ttest/journal.cpp\t10\ttest/journal.cpp:10:crashed_before\n"
+        "T\t0\tpa", // The last line is incomplete.
+        file
+    );
+    std::fclose(file);
+
+    (void)RunWithFlags({"--resume=test/build/journal.txt"});
+    PrintFile("test/build/journal.txt", {"pass\t", "fail\t"});
+}
@@ -0,0 +1,18 @@
+#define EM_ENABLE_TESTS
+#include <em/minitest.hpp>
+
+#include "helpers.hpp"
+
+EM_TEST( a ) {}
+EM_TEST( b, "slow" ) {}
+EM_TEST( c, "slow", "io" ) {}
+EM_TEST( d, "depends:a" ) {}
+
+int main()
+{
+    (void)RunWithFlags({"--list"});
+    (void)RunWithFlags({"--list=json"});
+    (void)RunWithFlags({"--list", "--tags=slow", "--skip-tags=io"});
+    (void)RunWithFlags({"--run-exact=test/list.cpp:8:c", "--run-exact=test/list.cpp:6:a"});
+    (void)RunWithFlags({"--run-exact=test/list.cpp:1:no_such_test"});
+}
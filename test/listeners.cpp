@@ -0,0 +1,78 @@
+#define EM_ENABLE_TESTS
+#include <em/minitest.hpp>
+
+#include <cstdio>
+
+EM_TEST( pass ) {}
+
+EM_TEST( fail )
+{
+    EM_CHECK_SOFT(1 + 1 == 3);
+    EM_CHECK(2 + 2 == 5);
+}
+
+EM_TEST( skipped, "depends:fail" ) {}
+
+// Prints every event it gets.
+class PrintingListener : public em::minitest::Listener
+{
+  public:
+    void OnRunStart(std::size_t num_tests) override
+    {
+        std::fprintf(stderr, "OnRunStart(%zu)\n", num_tests);
+    }
+    void OnRepetitionStart(std::size_t repetition) override
+    {
+        std::fprintf(stderr, "OnRepetitionStart(%zu)\n", repetition);
+    }
+    void OnFileStart(std::string_view file) override
+    {
+        std::fprintf(stderr, "OnFileStart(%.*s)\n", int(file.size()), file.data());
+    }
+    void OnTestStart(const em::minitest::TestDesc &test) override
+    {
+        std::fprintf(stderr, "OnTestStart(%.*s)\n", int(test.name.size()), test.name.data());
+    }
+    void OnFailure(const em::minitest::FailureInfo &info) override
+    {
+        std::fprintf(stderr, "OnFailure(%s:%d: %s)\n", info.file, info.line, info.expr);
+    }
+    void OnTestEnd(const em::minitest::TestDesc &test, const em::minitest::TestResult &result) override
+    {
+        std::fprintf(stderr, "OnTestEnd(%.*s, failed=%d, skipped=%d)\n", int(test.name.size()), test.name.data(), result.failed, result.skipped);
+    }
+    void OnRunEnd(const em::minitest::RunSummary &summary) override
+    {
+        std::fprintf(stderr, "OnRunEnd(tests=%zu, failed=%zu, skipped=%zu, repetitions=%zu)\n", summary.num_tests, summary.num_failed, summary.num_skipped, summary.num_repetitions);
+    }
+    void OnRunError(std::string_view message) override
+    {
+        std::fprintf(stderr, "OnRunError(%.*s)\n", int(message.size()), message.data());
+    }
+};
+
+int main()
+{
+    PrintingListener listener;
+    em::minitest::Listener *const listeners[] = {&listener};
+
+    em::minitest::RunOptions options;
+    options.console_output = false;
+    std::fprintf(stderr, "--- Without the console output:\n");
+    std::fprintf(stderr, "--- Exit code %d\n", em::minitest::RunTests(options, listeners));
+
+    options.repeat = 2;
+    std::fprintf(stderr, "--- Repeating:\n");
+    std::fprintf(stderr, "--- Exit code %d\n", em::minitest::RunTests(options, listeners));
+
+    options.repeat = 1;
+    options.include_tags = {"no_such_tag"};
+    std::fprintf(stderr, "--- With an error:\n");
+    std::fprintf(stderr, "--- Exit code %d\n", em::minitest::RunTests(options, listeners));
+
+    options.include_tags = {};
+    options.console_output = true;
+    options.run_exact = {"test/listeners.cpp:6:pass"};
+    std::fprintf(stderr, "--- Along with the console output:\n");
+    std::fprintf(stderr, "--- Exit code %d\n", em::minitest::RunTests(options, listeners));
+}
@@ -0,0 +1,10 @@
+// A test module for `minitest_runner` and `minitest_server`, built as a shared library.
+#define EM_ENABLE_TESTS
+#include <em/minitest.hpp>
+
+EM_TEST( a_pass ) {}
+
+EM_TEST( a_fail )
+{
+    EM_CHECK(1 + 1 == 3);
+}
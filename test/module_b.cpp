@@ -0,0 +1,7 @@
+// A test module for `minitest_runner` and `minitest_server`, built as a shared library.
+#define EM_ENABLE_TESTS
+#include <em/minitest.hpp>
+
+EM_TEST( b_pass ) {}
+
+EM_TEST( b_slow, "slow" ) {}
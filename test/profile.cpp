@@ -0,0 +1,54 @@
+#define EM_ENABLE_TESTS
+#include <em/minitest.hpp>
+
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+// Keeps the CPU busy, so the profiler has something to sample.
+[[gnu::noinline]] static double BusyLoop()
+{
+    double ret = 0;
+    auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(200);
+    while (std::chrono::steady_clock::now() < end)
+        ret += 1;
+    return ret;
+}
+
+EM_TEST( slow )
+{
+    volatile double result = BusyLoop();
+    (void)result;
+}
+
+EM_TEST( fast ) {}
+
+int main()
+{
+    // The sample counts differ between the runs, so this only checks that the folded stacks were written, and that they are what we expect.
+    std::filesystem::remove_all("test/build/profile_stacks");
+    em::minitest::RunOptions options;
+    options.console_output = false;
+    options.profile_slow_ms = 100;
+    options.profile_dir = "test/build/profile_stacks";
+    std::fprintf(stderr, "--- Exit code %d\n", em::minitest::RunTests(options));
+
+    for (const auto &entry : std::filesystem::directory_iterator(options.profile_dir))
+    {
+        std::size_t num_lines = 0, num_samples = 0, num_busy_samples = 0;
+        std::ifstream file(entry.path());
+        std::string line;
+        while (std::getline(file, line))
+        {
+            // Each line is `frame;frame;... count`, from the outermost frame.
+            std::size_t count = std::stoul(line.substr(line.rfind(' ') + 1));
+            num_lines++;
+            num_samples += count;
+            if (line.starts_with("__test_slow();BusyLoop()"))
+                num_busy_samples += count;
+        }
+        std::fprintf(stderr, "%s: has samples: %d, all in BusyLoop(): %d\n", entry.path().filename().c_str(), num_lines > 0, num_busy_samples == num_samples);
+    }
+}
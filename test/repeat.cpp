@@ -0,0 +1,28 @@
+#define EM_ENABLE_TESTS
+#include <em/minitest.hpp>
+
+#include "helpers.hpp"
+
+EM_TEST( pass ) {}
+
+// Fails every other time.
+EM_TEST( flaky )
+{
+    static int counter = 0;
+    EM_CHECK(counter++ % 2 == 1);
+}
+
+// Fails every third time.
+EM_TEST( rarely_fails )
+{
+    static int counter = 0;
+    EM_CHECK(++counter % 3 != 0);
+}
+
+int main()
+{
+    (void)RunWithFlags({"--retries=2"});
+    (void)RunWithFlags({"--repeat=3", "--quarantine=test/build/repeat_quarantine.txt"});
+    PrintFile("test/build/repeat_quarantine.txt");
+    (void)RunWithFlags({"--repeat-until-fail"});
+}
@@ -0,0 +1,38 @@
+#define EM_ENABLE_TESTS
+#include <em/minitest.hpp>
+
+#include "helpers.hpp"
+
+EM_TEST( pass ) {}
+
+EM_TEST( fail )
+{
+    EM_CHECK(1 + 1 == 3);
+}
+
+EM_TEST( escaping )
+{
+    // The reports must escape this.
+    EM_CHECK("<a & \"b\">\n\t\\"[0] == '?');
+}
+
+EM_TEST( skipped, "depends:fail" ) {}
+
+// Fails every other attempt, so it passes when retried.
+EM_TEST( flaky, "flaky" )
+{
+    static int num_attempts = 0;
+    EM_CHECK(++num_attempts % 2 == 0);
+}
+
+int main()
+{
+    (void)RunWithFlags({"--junit=test/build/reports.xml", "--jsonl=test/build/reports.jsonl", "--skip-tags=flaky"});
+    PrintFile("test/build/reports.xml", {"time=\""});
+    PrintFile("test/build/reports.jsonl", {"\"duration_ms\":"});
+
+    // The retried attempts don't count as failures. The binary log is checked by `minitest_query` in the makefile.
+    (void)RunWithFlags({"--junit=test/build/reports_retries.xml", "--jsonl=test/build/reports_retries.jsonl", "--binlog=test/build/reports_retries.binlog", "--retries=1"});
+    PrintFile("test/build/reports_retries.xml", {"time=\""});
+    PrintFile("test/build/reports_retries.jsonl", {"\"duration_ms\":"});
+}
@@ -0,0 +1,80 @@
+#define EM_ENABLE_TESTS
+#include <em/minitest.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+
+EM_TEST( not_in_self_test ) {}
+
+EM_TEST( self_pass, "selftest" ) {}
+
+EM_TEST( self_fail, "selftest" )
+{
+    EM_CHECK(1 + 1 == 3);
+}
+
+EM_TEST( self_skipped, "selftest", "depends:self_fail" ) {}
+
+EM_TEST( self_slow, "selftest" )
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+}
+
+EM_TEST( self_after_slow, "selftest" ) {}
+
+static void PrintResult(const em::minitest::SelfTestResult &result)
+{
+    for (const std::string &error : result.errors)
+        std::fprintf(stderr, "error: %s\n", error.c_str());
+    for (const em::minitest::SelfTestResult::Test &test : result.tests)
+    {
+        std::fprintf(stderr, "%.*s: %s\n", int(test.test.name.size()), test.test.name.data(),
+            test.out_of_time ? "out of time" : test.skipped ? "skipped" : test.failed ? "failed" : "passed");
+        for (const std::string &failure : test.failures)
+            std::fprintf(stderr, "    %s\n", failure.c_str());
+    }
+    std::fprintf(stderr, "passed: %d\n", result.Passed());
+}
+
+int main()
+{
+    em::minitest::SelfTestOptions options;
+    options.tags = {"selftest"};
+    options.max_run_time = std::chrono::milliseconds(30);
+
+    // The first run doesn't know the durations yet, so it only stops after the slow test.
+    // The second run knows that the slow test doesn't fit, and skips it in advance.
+    em::minitest::TestRunner runner;
+    std::fprintf(stderr, "--- First run:\n");
+    PrintResult(em::minitest::RunSelfTest(options, runner));
+    std::fprintf(stderr, "--- Second run:\n");
+    PrintResult(em::minitest::RunSelfTest(options, runner));
+
+    options.tags = {"no_such_tag"};
+    std::fprintf(stderr, "--- Unknown tag:\n");
+    PrintResult(em::minitest::RunSelfTest(options));
+
+    // Waits for a few background runs. The destructor stops the thread.
+    options.tags = {"selftest"};
+    options.max_run_time = std::chrono::milliseconds(1000);
+    std::mutex mutex;
+    std::condition_variable cv;
+    int num_runs = 0;
+    bool all_failed = true;
+    {
+        em::minitest::BackgroundSelfTest background(options, std::chrono::milliseconds(10), [&](const em::minitest::SelfTestResult &result)
+        {
+            std::lock_guard lock(mutex);
+            num_runs++;
+            all_failed = all_failed && !result.Passed();
+            cv.notify_all();
+        });
+        std::unique_lock lock(mutex);
+        cv.wait(lock, [&]{return num_runs >= 3;});
+    }
+    std::fprintf(stderr, "--- Background runs: at least 3: %d, all failed: %d\n", num_runs >= 3, all_failed);
+}
@@ -0,0 +1,27 @@
+#define EM_ENABLE_TESTS
+#include <em/minitest.hpp>
+
+#include "helpers.hpp"
+
+#include <cinttypes>
+
+// Prints a random number, which depends on the seed and the test, but not on the order.
+static void PrintRandom()
+{
+    std::fprintf(stderr, "Rng() = %" PRIu64 "\n", em::minitest::Rng()());
+}
+
+EM_TEST( a ) {PrintRandom();}
+EM_TEST( b ) {PrintRandom();}
+EM_TEST( c ) {PrintRandom();}
+EM_TEST( d ) {PrintRandom();}
+EM_TEST( e ) {PrintRandom();}
+EM_TEST( after_a, "depends:a" ) {PrintRandom();}
+
+int main()
+{
+    (void)RunWithFlags({});
+    (void)RunWithFlags({"--shuffle=42"});
+    (void)RunWithFlags({"--shuffle=42"});
+    (void)RunWithFlags({"--shuffle=43", "--repeat=2"});
+}
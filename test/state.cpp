@@ -0,0 +1,23 @@
+#define EM_ENABLE_TESTS
+#include <em/minitest.hpp>
+
+#include "helpers.hpp"
+
+static bool fixed = false;
+
+EM_TEST( pass ) {}
+EM_TEST( fail1 ) {EM_CHECK(fixed);}
+EM_TEST( pass2 ) {}
+EM_TEST( fail2 ) {EM_CHECK(fixed);}
+
+int main()
+{
+    std::remove("test/build/state.txt");
+    (void)RunWithFlags({"--state=test/build/state.txt", "--last-failed"}); // Nothing failed yet, so this runs everything.
+    (void)RunWithFlags({"--state=test/build/state.txt", "--last-failed"});
+    (void)RunWithFlags({"--state=test/build/state.txt", "--failed-first"});
+    fixed = true;
+    std::fprintf(stderr, "--- Fixed the tests.\n");
+    (void)RunWithFlags({"--state=test/build/state.txt", "--last-failed"});
+    (void)RunWithFlags({"--state=test/build/state.txt", "--last-failed"});
+}
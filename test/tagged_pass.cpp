@@ -0,0 +1,9 @@
+#define EM_ENABLE_TESTS
+#include <em/minitest.hpp>
+
+EM_MINITEST_MAIN
+
+// Used by the tools' tests, to check the tag filters passed through them.
+EM_TEST( foo ) {}
+EM_TEST( bar ) { EM_CHECK(true); }
+EM_TEST( tagged, "slow", "io" ) { EM_CHECK(true); }
@@ -0,0 +1,32 @@
+#define EM_ENABLE_TESTS
+#include <em/minitest.hpp>
+
+#include "helpers.hpp"
+
+#include <cstdio>
+
+EM_TEST( untagged ) {}
+EM_TEST( fast, "fast" ) {}
+EM_TEST( slow_io, "slow", "io" ) {}
+EM_TEST( io_after_fast, "io", "depends:fast" ) {}
+
+int main()
+{
+    for (const em::minitest::TestDesc &test : {
+        em::minitest::TestDesc{.file = "test/tags.cpp", .line = 10, .name = "slow_io"},
+        em::minitest::TestDesc{.file = "test/tags.cpp", .line = 11, .name = "io_after_fast"},
+        em::minitest::TestDesc{.file = "test/tags.cpp", .line = 8, .name = "untagged"},
+        em::minitest::TestDesc{.file = "test/tags.cpp", .line = 1, .name = "no_such_test"},
+    })
+    {
+        std::fprintf(stderr, "--- Tags of %.*s:", int(test.name.size()), test.name.data());
+        for (std::string_view tag : em::minitest::GetTestTags(test))
+            std::fprintf(stderr, " %.*s", int(tag.size()), tag.data());
+        std::fprintf(stderr, "\n");
+    }
+
+    (void)RunWithFlags({"--tags=io"});
+    (void)RunWithFlags({"--tags=io,fast", "--skip-tags=slow"});
+    (void)RunWithFlags({"--skip-tags=io,fast,slow"});
+    (void)RunWithFlags({"--tags=no_such_tag"});
+}
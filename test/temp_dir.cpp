@@ -0,0 +1,70 @@
+#define EM_ENABLE_TESTS
+#include <em/minitest.hpp>
+
+#include "helpers.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <set>
+#include <string>
+#include <utility>
+#include <unistd.h>
+
+// The directories that the tests got. The paths themselves differ between the runs, so they aren't printed.
+static std::set<std::string> temp_dirs;
+
+static void UseTempDir()
+{
+    const std::string &dir = em::minitest::TempDir();
+    EM_CHECK(&em::minitest::TempDir() == &dir); // The same directory for the whole test.
+    EM_CHECK(std::filesystem::is_directory(dir));
+    EM_CHECK(std::filesystem::is_empty(dir));
+    EM_CHECK(temp_dirs.insert(dir).second);
+
+    // The nested files and directories are removed too.
+    std::filesystem::create_directories(dir + "/a/b");
+    std::ofstream(dir + "/a/b/file.txt") << "hello";
+    EM_CHECK(std::filesystem::file_size(dir + "/a/b/file.txt") == 5);
+}
+
+EM_TEST( first ) {UseTempDir();}
+EM_TEST( second ) {UseTempDir();}
+// Sleeps to finish after the other tests, to keep the output stable.
+EM_TEST_ASYNC( async )
+{
+    UseTempDir();
+    co_await em::minitest::SleepFor(std::chrono::milliseconds(50));
+}
+
+// Fails once, and gets a new directory on retry.
+EM_TEST( retried )
+{
+    UseTempDir();
+    static bool failed = false;
+    EM_CHECK(std::exchange(failed, true));
+}
+
+EM_TEST( temp_file )
+{
+    int fd = em::minitest::OpenTempFile();
+    EM_CHECK(fd >= 0);
+    EM_CHECK(write(fd, "hello", 5) == 5);
+    EM_CHECK(lseek(fd, 0, SEEK_SET) == 0);
+    char buffer[8] = {};
+    EM_CHECK(read(fd, buffer, sizeof buffer) == 5);
+    EM_CHECK(std::string(buffer) == "hello");
+    close(fd);
+}
+
+int main()
+{
+    (void)RunWithFlags({"--retries=1", "--repeat=2"});
+
+    // Every test, repetition and retry got its own directory, and they were all removed by the end of the run.
+    std::size_t num_left = 0;
+    for (const std::string &dir : temp_dirs)
+        num_left += std::filesystem::exists(dir);
+    std::fprintf(stderr, "--- %zu directories, %zu left after the run\n", temp_dirs.size(), num_left);
+}
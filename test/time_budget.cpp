@@ -0,0 +1,20 @@
+#define EM_ENABLE_TESTS
+#include <em/minitest.hpp>
+
+#include "helpers.hpp"
+
+#include <chrono>
+#include <thread>
+
+EM_TEST( slow ) {std::this_thread::sleep_for(std::chrono::milliseconds(200));}
+EM_TEST( fast ) {}
+EM_TEST( fail ) {EM_CHECK(1 + 1 == 3);}
+EM_TEST( fast2 ) {}
+
+int main()
+{
+    std::remove("test/build/time_budget_state.txt");
+    (void)RunWithFlags({"--state=test/build/time_budget_state.txt"});
+    (void)RunWithFlags({"--state=test/build/time_budget_state.txt", "--time-budget=100ms"});
+    (void)RunWithFlags({"--max-time=100ms"});
+}
@@ -0,0 +1,54 @@
+#define EM_ENABLE_TESTS
+#include <em/minitest.hpp>
+
+#include "helpers.hpp"
+
+#include <thread>
+
+EM_TEST( pass )
+{
+    EM_TRACE_SCOPE("outer");
+    {
+        EM_TRACE_SCOPE("inner");
+    }
+}
+
+EM_TEST( fail )
+{
+    EM_TRACE_SCOPE("scope");
+    EM_CHECK(1 + 1 == 3);
+}
+
+EM_TEST( skipped, "depends:fail" ) {}
+
+// Only runs in the other runner below.
+EM_TEST( other_runner_test, "other" ) {}
+
+EM_TEST( other_runner )
+{
+    int untraced_exit_code = -1;
+    int traced_exit_code = -1;
+    std::thread([&]
+    {
+        em::minitest::RunOptions options;
+        options.console_output = false;
+        options.include_tags = {"other"};
+        // The tests of this runner don't appear in our trace.
+        untraced_exit_code = em::minitest::TestRunner(options).Run();
+        // Only one runner at a time can trace.
+        options.trace_path = "test/build/trace_other.json";
+        traced_exit_code = em::minitest::TestRunner(options).Run();
+    }).join();
+    EM_CHECK(untraced_exit_code == 0);
+    EM_CHECK(traced_exit_code == 2);
+}
+
+int main()
+{
+    // The scopes outside of the run aren't recorded.
+    {
+        EM_TRACE_SCOPE("not_recorded");
+    }
+    (void)RunWithFlags({"--trace=test/build/trace.json", "--skip-tags=other"});
+    PrintFile("test/build/trace.json", {"\"ts\":", "\"dur\":"});
+}
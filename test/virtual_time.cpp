@@ -0,0 +1,84 @@
+#define EM_ENABLE_TESTS
+#include <em/minitest.hpp>
+
+#include "helpers.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+// The sleeps take no real time with `--virtual-time`. Without the time hooks, only `Clock` and the async tests would do that.
+
+EM_TEST( std_sleep )
+{
+    auto start = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(1h);
+    EM_CHECK(std::chrono::steady_clock::now() - start >= 1h);
+}
+
+EM_TEST( minitest_clock )
+{
+    auto start = em::minitest::Clock::now();
+    em::minitest::Clock::SleepFor(10min);
+    auto duration = em::minitest::Clock::now() - start;
+    EM_CHECK(duration >= 10min && duration < 11min);
+}
+
+// The timed waits take the real time, but must convert their deadlines from the virtual time, which is ahead by now.
+EM_TEST( condition_variable_timeout )
+{
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::unique_lock lock(mutex);
+    auto start = std::chrono::steady_clock::now();
+    bool woken = cv.wait_for(lock, 50ms, []{return false;});
+    EM_CHECK(!woken);
+    auto duration = std::chrono::steady_clock::now() - start;
+    EM_CHECK(duration >= 50ms && duration < 10s);
+}
+
+// The threads still wake up in the order of their deadlines.
+EM_TEST( threads_order )
+{
+    std::mutex mutex;
+    std::vector<int> order;
+    std::vector<std::thread> threads;
+    for (int i : {3, 1, 2})
+    {
+        threads.emplace_back([&, i]
+        {
+            std::this_thread::sleep_for(std::chrono::hours(i));
+            std::lock_guard lock(mutex);
+            order.push_back(i);
+        });
+    }
+    for (std::thread &thread : threads)
+        thread.join();
+    EM_CHECK(order == std::vector<int>{1, 2, 3});
+}
+
+EM_TEST_ASYNC( async_sleep )
+{
+    auto start = em::minitest::Clock::now();
+    co_await em::minitest::SleepFor(1h);
+    EM_CHECK(em::minitest::Clock::now() - start >= 1h);
+}
+
+// Without `--virtual-time`, the hooks only forward to the real functions.
+EM_TEST( real_sleep, "real" )
+{
+    auto start = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(50ms);
+    auto duration = std::chrono::steady_clock::now() - start;
+    EM_CHECK(duration >= 50ms && duration < 10s);
+}
+
+int main()
+{
+    (void)RunWithFlags({"--virtual-time", "--skip-tags=real"});
+    (void)RunWithFlags({"--tags=real"});
+}